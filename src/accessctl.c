@@ -23,8 +23,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include <osipparser2/osip_parser.h>
 
@@ -34,6 +37,83 @@
 /* configuration storage */
 extern struct siproxd_config configuration;
 
+/*
+ * Compiled access lists
+ *
+ * The textual access lists are compiled once into a binary prefix
+ * trie (one bit per level), a lookup walks at most 32 nodes and does
+ * not depend on the number of entries. Entries given as hostname are
+ * kept aside and resolved (DNS cache) at check time, as before.
+ *
+ * An entry of the form "@/path/file" reads further entries from a
+ * file, one per line ('#' starts a comment, mask defaults to /32).
+ */
+#define ACL_MAX_HOSTNAMES	32	/* max hostname entries per list */
+
+typedef struct {
+   int child[2];		/* index of child node, 0 = none */
+   int match;			/* a prefix ends here */
+} acl_node_t;
+
+struct acl_s {
+   acl_node_t *nodes;		/* nodes[0] is the root */
+   int num_nodes;
+   int max_nodes;
+   int num_entries;
+   int num_hostnames;
+   struct {
+      char host[HOSTNAME_SIZE+1];
+      unsigned int bitmask;
+   } hostnames[ACL_MAX_HOSTNAMES];
+};
+
+/* the compiled lists of the configuration */
+static acl_t *acl_deny_sip=NULL;
+static acl_t *acl_allow_sip=NULL;
+static acl_t *acl_allow_reg=NULL;
+
+/* local prototypes */
+static int acl_add_entry(acl_t *acl, char *address, char *mask, int deflen,
+                         char *aclist);
+static int acl_add_file(acl_t *acl, char *filename);
+static int acl_insert(acl_t *acl, unsigned int addr, int masklen);
+
+
+/*
+ * compile the access lists of the configuration (at startup)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error in the access lists
+ */
+int accesslist_init(void) {
+   int sts=STS_SUCCESS;
+
+   if (acl_deny_sip)  acl_free(acl_deny_sip);
+   if (acl_allow_sip) acl_free(acl_allow_sip);
+   if (acl_allow_reg) acl_free(acl_allow_reg);
+   acl_deny_sip = acl_allow_sip = acl_allow_reg = NULL;
+
+   if ((configuration.hosts_deny_sip != NULL) &&
+       (strcmp(configuration.hosts_deny_sip,"") != 0)) {
+      acl_deny_sip = acl_compile(configuration.hosts_deny_sip);
+      if (acl_deny_sip == NULL) sts = STS_FAILURE;
+   }
+   if ((configuration.hosts_allow_sip != NULL) &&
+       (strcmp(configuration.hosts_allow_sip,"") != 0)) {
+      acl_allow_sip = acl_compile(configuration.hosts_allow_sip);
+      if (acl_allow_sip == NULL) sts = STS_FAILURE;
+   }
+   if ((configuration.hosts_allow_reg != NULL) &&
+       (strcmp(configuration.hosts_allow_reg,"") != 0)) {
+      acl_allow_reg = acl_compile(configuration.hosts_allow_reg);
+      if (acl_allow_reg == NULL) sts = STS_FAILURE;
+   }
+
+   return sts;
+}
+
+
 
 /*
  * verifies the from address agains the access lists
@@ -44,20 +124,13 @@ extern struct siproxd_config configuration;
 int accesslist_check (struct sockaddr_in from) {
    int access = 0;
 
-   DEBUGC(DBCLASS_ACCESS,"deny  list (SIP):%s",
-      configuration.hosts_deny_sip? configuration.hosts_deny_sip : "*NULL*");
-   DEBUGC(DBCLASS_ACCESS,"allow list (SIP):%s",
-      configuration.hosts_allow_sip? configuration.hosts_allow_sip : "*NULL*");
-   DEBUGC(DBCLASS_ACCESS,"allow list (REG):%s",
-      configuration.hosts_allow_reg? configuration.hosts_allow_reg : "*NULL*");
-
 /*
  * check DENY list
  */
    if ( (configuration.hosts_deny_sip !=NULL) &&
         (strcmp(configuration.hosts_deny_sip,"")!=0) ) {
       /* non-empty list -> check agains it */
-      if (process_aclist(configuration.hosts_deny_sip, from)== STS_SUCCESS) {
+      if (acl_match(acl_deny_sip, from.sin_addr) == STS_SUCCESS) {
          /* yup - this one is blacklisted */
          DEBUGC(DBCLASS_ACCESS,"caught by deny list");
          return 0;
@@ -70,7 +143,7 @@ int accesslist_check (struct sockaddr_in from) {
    if ( (configuration.hosts_allow_sip !=NULL) &&
         (strcmp(configuration.hosts_allow_sip,"")!=0) ) {
       /* non-empty list -> check agains it */
-      if (process_aclist(configuration.hosts_allow_sip, from)==STS_SUCCESS) {
+      if (acl_match(acl_allow_sip, from.sin_addr) == STS_SUCCESS) {
          /* SIP access granted */
          DEBUGC(DBCLASS_ACCESS,"granted SIP access");
          access |= ACCESSCTL_SIP;
@@ -85,7 +158,7 @@ int accesslist_check (struct sockaddr_in from) {
    if ( (configuration.hosts_allow_reg !=NULL) &&
         (strcmp(configuration.hosts_allow_reg,"")!=0) ) {
       /* non-empty list -> check against it */
-      if (process_aclist(configuration.hosts_allow_reg, from)==STS_SUCCESS) {
+      if (acl_match(acl_allow_reg, from.sin_addr) == STS_SUCCESS) {
          /* SIP registration access granted */
          DEBUGC(DBCLASS_ACCESS,"granted REG/SIP access");
          access |= ACCESSCTL_REG | ACCESSCTL_SIP;
@@ -101,26 +174,83 @@ int accesslist_check (struct sockaddr_in from) {
 
 /*
  * checks for a match of the 'from' address with the supplied
- * access list.
+ * (textual) access list. The list is compiled on each call -
+ * for lists that are checked repeatedly use acl_compile() once
+ * and acl_match().
  *
  * RETURNS
  *	STS_SUCCESS for a match
  *	STS_FAILURE for no match
  */
 int process_aclist (char *aclist, struct sockaddr_in from) {
-   int i, sts;
-   int lastentry;
+   acl_t *acl;
+   int sts;
+
+   acl = acl_compile(aclist);
+   if (acl == NULL) return STS_FAILURE;
+
+   sts = acl_match(acl, from.sin_addr);
+   acl_free(acl);
+   return sts;
+}
+
+
+/*
+ * compile a textual access list
+ * ("addr/mask,addr/mask,...", addr may be a hostname)
+ *
+ * RETURNS
+ *	the compiled list (to be released with acl_free)
+ *	NULL on syntax error
+ */
+acl_t *acl_compile(char *aclist) {
+   acl_t *acl;
+   int i, lastentry;
    char *p1, *p2;
-   char address[HOSTNAME_SIZE+1]; /* dotted decimal IP - max 15 chars */
-                                  /* or hostname*/
-   char mask[8];                  /* mask - max 2 digits */
-   int  mask_int;
-   struct in_addr inaddr;
-   unsigned int bitmask;
+   char address[PATH_STRING_SIZE+1]; /* dotted decimal IP, hostname */
+                                     /* or @filename */
+   char mask[8];                     /* mask - max 2 digits */
 
+   if (aclist == NULL) return NULL;
+
+   acl = malloc(sizeof(acl_t));
+   if (acl == NULL) {
+      ERROR("acl_compile: out of memory");
+      return NULL;
+   }
+   memset(acl, 0, sizeof(acl_t));
+
+   /* root node */
+   if (acl_insert(acl, 0, -1) != STS_SUCCESS) {
+      acl_free(acl);
+      return NULL;
+   }
 
    for (i=0, p1=aclist, lastentry=0; !lastentry && p1-aclist<strlen(aclist); i++) {
 
+      /* file include */
+      if (*p1 == '@') {
+         p2=strchr(p1,',');
+         if (!p2) { /* then this must be the last entry in the list */
+            p2=strchr(p1,'\0');
+            lastentry=1;
+         }
+         if (p2-p1-1 >= sizeof(address)) {
+            ERROR("CONFIG: accesslist [%s]- file name too long", aclist);
+            acl_free(acl);
+            return NULL;
+         }
+         memset(address,0,sizeof(address));
+         memcpy(address,p1+1,p2-p1-1);
+         p1=p2+1;
+
+         if (acl_add_file(acl, address) != STS_SUCCESS) {
+            acl_free(acl);
+            return NULL;
+         }
+         continue;
+      }
+
 /*
  * extract one entry from the access list
  */
@@ -128,12 +258,14 @@ int process_aclist (char *aclist, struct sockaddr_in from) {
       p2=strchr(p1,'/');
       if (!p2) {
          ERROR("CONFIG: accesslist [%s]- no mask separator found", aclist);
-         return STS_FAILURE;
+         acl_free(acl);
+         return NULL;
       }
 
-      if (p2-p1 >= sizeof(address)) {
+      if (p2-p1 > HOSTNAME_SIZE) {
          ERROR("CONFIG: accesslist [%s]- illegal ip address format or netmask separator", aclist);
-         return STS_FAILURE;
+         acl_free(acl);
+         return NULL;
       }
       memset(address,0,sizeof(address));
       memcpy(address,p1,p2-p1);
@@ -148,7 +280,8 @@ int process_aclist (char *aclist, struct sockaddr_in from) {
 
       if (p2-p1 >= sizeof(mask)) {
          ERROR("CONFIG: accesslist [%s]- illegal netmask format or IP separator", aclist);
-         return STS_FAILURE;
+         acl_free(acl);
+         return NULL;
       }
       memset(mask,0,sizeof(mask));
       memcpy(mask,p1,p2-p1);
@@ -157,31 +290,214 @@ int process_aclist (char *aclist, struct sockaddr_in from) {
       DEBUGC(DBCLASS_ACCESS,"[%i] extracted address=%s", i, address);
       DEBUGC(DBCLASS_ACCESS,"[%i] extracted mask   =%s", i, mask);
 
+      if (acl_add_entry(acl, address, mask, 32, aclist) != STS_SUCCESS) {
+         acl_free(acl);
+         return NULL;
+      }
+   }
+
+   DEBUGC(DBCLASS_ACCESS, "acl_compile: %i entries (%i nodes), %i hostnames",
+          acl->num_entries, acl->num_nodes, acl->num_hostnames);
+   return acl;
+}
+
+
 /*
- * check for a match
+ * checks for a match of an address with a compiled access list
+ *
+ * RETURNS
+ *	STS_SUCCESS for a match
+ *	STS_FAILURE for no match
  */
-      sts=get_ip_by_host(address, &inaddr);
-      if (sts == STS_FAILURE) {
-         DEBUGC(DBCLASS_ACCESS, "process_aclist: cannot resolve address [%s]",
-                address);
-         return STS_FAILURE;
-      }
+int acl_match(acl_t *acl, struct in_addr from) {
+   unsigned int addr;
+   int node, bit, i;
+   struct in_addr inaddr;
 
-      mask_int=atoi(mask);
-      if ((mask_int < 0) || (mask_int > 32)) mask_int=32;
-      bitmask= (mask_int)? (0xffffffff<<(32-mask_int)) : 0;
+   if (acl == NULL) return STS_FAILURE;
 
-      DEBUGC(DBCLASS_ACCESS,"check match: entry=%i, filter=%lx, from=%lx", i,
-                            (long)ntohl(inaddr.s_addr) & bitmask,
-			    (long)ntohl(from.sin_addr.s_addr) & bitmask);
+   /* walk down the trie along the bits of the address */
+   addr = ntohl(from.s_addr);
+   node = 0;
+   for (bit=31; ; bit--) {
+      if (acl->nodes[node].match) {
+         DEBUGC(DBCLASS_ACCESS, "acl_match: MATCH (prefix length %i)",
+                31-bit);
+         return STS_SUCCESS;
+      }
+      if (bit < 0) break;
+      node = acl->nodes[node].child[(addr >> bit) & 1];
+      if (node == 0) break;
+   }
 
-      if ( (ntohl(inaddr.s_addr) & bitmask) == 
-           (ntohl(from.sin_addr.s_addr) & bitmask) ) {
-         DEBUGC(DBCLASS_ACCESS, "process_aclist: MATCH");
+   /* entries given as hostname */
+   for (i=0; i<acl->num_hostnames; i++) {
+      if (get_ip_by_host(acl->hostnames[i].host, &inaddr) == STS_FAILURE) {
+         DEBUGC(DBCLASS_ACCESS, "acl_match: cannot resolve address [%s]",
+                acl->hostnames[i].host);
+         continue;
+      }
+      if ((ntohl(inaddr.s_addr) & acl->hostnames[i].bitmask) ==
+          (addr & acl->hostnames[i].bitmask)) {
+         DEBUGC(DBCLASS_ACCESS, "acl_match: MATCH [%s]",
+                acl->hostnames[i].host);
          return STS_SUCCESS;
       }
    }
 
-   DEBUGC(DBCLASS_ACCESS, "process_aclist: no match");
+   DEBUGC(DBCLASS_ACCESS, "acl_match: no match");
    return STS_FAILURE;
 }
+
+
+/*
+ * release a compiled access list
+ */
+void acl_free(acl_t *acl) {
+   if (acl == NULL) return;
+   if (acl->nodes) free(acl->nodes);
+   free(acl);
+}
+
+
+/*
+ * add one "address/mask" entry to a compiled list
+ * (an empty mask uses deflen - /32 for config lists. Formerly
+ * atoi("") = 0 was used, which matched every address)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on failure
+ */
+static int acl_add_entry(acl_t *acl, char *address, char *mask, int deflen,
+                         char *aclist) {
+   int  mask_int;
+   struct in_addr inaddr;
+
+   mask_int=(mask[0])? atoi(mask) : deflen;
+   if ((mask_int < 0) || (mask_int > 32)) mask_int=32;
+
+   /* numeric address -> trie */
+   if (utils_inet_aton(address, &inaddr) > 0) {
+      return acl_insert(acl, ntohl(inaddr.s_addr), mask_int);
+   }
+
+   /* hostname: resolved when checking */
+   if (acl->num_hostnames >= ACL_MAX_HOSTNAMES) {
+      ERROR("CONFIG: accesslist [%s]- too many hostnames (max %i)",
+            aclist, ACL_MAX_HOSTNAMES);
+      return STS_FAILURE;
+   }
+   strncpy(acl->hostnames[acl->num_hostnames].host, address, HOSTNAME_SIZE);
+   acl->hostnames[acl->num_hostnames].host[HOSTNAME_SIZE]='\0';
+   acl->hostnames[acl->num_hostnames].bitmask=
+      (mask_int)? (0xffffffff<<(32-mask_int)) : 0;
+   acl->num_hostnames++;
+   acl->num_entries++;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * read access list entries from a file
+ * (one "address[/mask]" per line, '#' starts a comment)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on failure
+ */
+static int acl_add_file(acl_t *acl, char *filename) {
+   FILE *stream;
+   char buff[HOSTNAME_SIZE+16];
+   char *p, *address, *mask;
+   int line=0;
+
+   stream = fopen(filename, "r");
+   if (stream == NULL) {
+      ERROR("CONFIG: cannot open accesslist file [%s]: %s", filename,
+            strerror(errno));
+      return STS_FAILURE;
+   }
+
+   while (fgets(buff, sizeof(buff), stream) != NULL) {
+      line++;
+      buff[sizeof(buff)-1]='\0';
+
+      /* strip comments and whitespace */
+      p=strchr(buff, '#');
+      if (p) *p='\0';
+      for (address=buff; isspace((int)*address); address++) {};
+      for (p=address; *p && !isspace((int)*p); p++) {};
+      *p='\0';
+      if (*address == '\0') continue;
+
+      mask=strchr(address, '/');
+      if (mask) {
+         *mask='\0';
+         mask++;
+      } else {
+         mask=p; /* empty string */
+      }
+
+      if (acl_add_entry(acl, address, mask, 32, filename) != STS_SUCCESS) {
+         ERROR("CONFIG: accesslist file [%s], line %i", filename, line);
+         fclose(stream);
+         return STS_FAILURE;
+      }
+   }
+
+   fclose(stream);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * insert a prefix into the trie (masklen -1 only creates the root)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on failure
+ */
+static int acl_insert(acl_t *acl, unsigned int addr, int masklen) {
+   int node=0, bit, b, depth;
+   acl_node_t *tmp;
+
+   for (depth=-1; depth < masklen; depth++) {
+      /* make room for one more node */
+      if (acl->num_nodes >= acl->max_nodes) {
+         acl->max_nodes = (acl->max_nodes)? 2*acl->max_nodes : 64;
+         tmp = realloc(acl->nodes, acl->max_nodes * sizeof(acl_node_t));
+         if (tmp == NULL) {
+            ERROR("acl_insert: out of memory");
+            return STS_FAILURE;
+         }
+         acl->nodes = tmp;
+      }
+
+      if (depth < 0) {
+         /* root */
+         if (acl->num_nodes == 0) {
+            memset(&acl->nodes[0], 0, sizeof(acl_node_t));
+            acl->num_nodes = 1;
+         }
+         continue;
+      }
+
+      /* a shorter prefix already covers this one */
+      if (acl->nodes[node].match) return STS_SUCCESS;
+
+      bit = 31-depth;
+      b = (addr >> bit) & 1;
+      if (acl->nodes[node].child[b] == 0) {
+         memset(&acl->nodes[acl->num_nodes], 0, sizeof(acl_node_t));
+         acl->nodes[node].child[b] = acl->num_nodes++;
+      }
+      node = acl->nodes[node].child[b];
+   }
+
+   if (masklen >= 0) {
+      acl->nodes[node].match = 1;
+      acl->num_entries++;
+   }
+   return STS_SUCCESS;
+}
@@ -24,8 +24,15 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <pthread.h>
 
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include <netinet/in.h>
 
@@ -43,10 +50,176 @@ extern struct siproxd_config configuration;
 /* Global File instance on pw file */
 extern FILE *siproxd_passwordfile;
 
+/*
+ * Credential store
+ *
+ * The password file is loaded into a hash table keyed by username.
+ * H(A1) for the configured realm is calculated once when loading.
+ * The file is checked for changes (mtime) every AUTH_PWFILE_CHECK
+ * seconds, a changed file is loaded into a new store which then
+ * replaces the current one (pointer swap). Lookups never take a lock,
+ * a replaced store is freed after AUTH_GRACE seconds.
+ */
+#define AUTH_PWFILE_CHECK	2	/* check password file every (sec) */
+#define AUTH_GRACE		5	/* free replaced stores after (sec) */
+#define AUTH_RETIRED		4	/* max replaced stores waiting */
+
+typedef struct {
+   int     hnext;			/* next entry in hash chain, -1 = end */
+   char    username[USERNAME_SIZE];
+   char    password[PASSWORD_SIZE];
+   HASHHEX ha1;				/* H(A1) for proxy_auth_realm */
+} auth_user_t;
+
+typedef struct {
+   int          count;
+   auth_user_t  *user;
+   unsigned int hash_mask;
+   int          *hash;			/* buckets -> index into user */
+} auth_store_t;
+
+/* the current store, NULL if not loaded */
+static auth_store_t *auth_store=NULL;
+
+/* reload state (only touched by the thread holding auth_reloading) */
+static int auth_reloading=0;
+static time_t auth_next_check=0;
+static struct stat auth_pwfile_stat;
+static struct {
+   auth_store_t *store;
+   time_t retired;
+} auth_retired[AUTH_RETIRED];
+
+/*
+ * Stateless nonces
+ *
+ * nonce = <timestamp><salt><mac>, all hex, mac is the first half of
+ * HMAC-MD5(secret, timestamp|salt). A nonce can be verified without
+ * remembering it and is accepted until proxy_auth_nonce_lifetime has
+ * passed, so clients can reuse it for many requests. The secret is
+ * random and changes with every restart.
+ *
+ * Replay protection: for nonces used with qop the nonce-counts seen
+ * are tracked in a small table (slot selected by the nonce's mac) as
+ * a sliding window bitmap. A nonce-count seen before, older than the
+ * window, or a nonce not (or no longer) tracked with nc>1 makes the
+ * client authenticate again with a fresh nonce. The challenge is only
+ * flagged stale=true if the digest was correct (RFC2617 3.2.1), this
+ * also applies to expired nonces.
+ */
+#define AUTH_NONCE_LEN		32	/* 8 timestamp + 8 salt + 16 mac */
+#define AUTH_NC_SLOTS		1024	/* nonces tracked for replay */
+#define AUTH_NC_WINDOW		64	/* nonce-counts per window */
+
+static unsigned char auth_secret[16];
+static unsigned int auth_salt;
+
+static struct {
+   char mac[16+1];		/* nonce owning this slot */
+   unsigned long max_nc;	/* highest nonce-count seen */
+   unsigned long long window;	/* bit n: max_nc-n has been seen */
+} auth_nc[AUTH_NC_SLOTS];
+
+/*
+ * Authentication result cache
+ *
+ * Clients that do not use qop send the same Authorization header with
+ * every refresh. Verified credentials (the complete tuple, including
+ * the response) are remembered for proxy_auth_cache_ttl seconds, an
+ * identical tuple is then accepted without calculating the digest.
+ * Entries verified with qop remember this, a hit on them still runs
+ * the nonce-count check.
+ * The cache is 4-way set associative, a set is selected by a hash
+ * of the tuple, the least recently used way is replaced. Entries
+ * are bound to the credential store they were verified against, a
+ * reloaded password file invalidates them. One mutex protects the
+ * cache and the counters.
+ */
+#define AUTH_CACHE_SETS		256	/* must be power of 2 */
+#define AUTH_CACHE_WAYS		4
+#define AUTH_CACHE_KEYLEN	512	/* longer tuples are not cached */
+
+typedef struct {
+   time_t       expires;		/* 0 = unused */
+   time_t       used;			/* last hit, for replacement */
+   unsigned int generation;		/* credential store generation */
+   unsigned int hash;
+   int          needs_nc;		/* verified with qop, check nc on hit */
+   int          keylen;
+   char         key[AUTH_CACHE_KEYLEN];
+} auth_cache_t;
+
+static auth_cache_t *auth_cache=NULL;
+static auth_stats_t auth_stats;
+static pthread_mutex_t auth_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* incremented whenever the credential store is replaced */
+static unsigned int auth_generation=0;
+
 /* local protorypes */
 static char *auth_generate_nonce(void);
+static void auth_nonce_mac(char *stamp_salt, char *mac);
+static int auth_nonce_valid(char *nonce);
+static int auth_nonce_count(char *nonce, char *nonce_count);
 static int auth_check(osip_proxy_authorization_t *proxy_auth);
-static char *auth_getpwd(char *username);
+static auth_user_t *auth_getuser(char *username);
+static int auth_pwfile_reload(time_t now);
+static auth_store_t *auth_store_load(FILE *pwfile);
+static void auth_store_free(auth_store_t *store);
+static unsigned int auth_hashfunc(char *username);
+static int auth_cache_key(char *key, char **field, int nfields);
+static unsigned int auth_cache_hash(char *key, int keylen);
+static int auth_cache_lookup(char *key, int keylen, unsigned int generation,
+                             int *needs_nc);
+static void auth_cache_insert(char *key, int keylen, unsigned int generation,
+                              int needs_nc);
+
+
+/*
+ * initialize the nonce secret and load the password file (if configured)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if the password file could not be loaded
+ */
+int auth_init(void) {
+   struct timeval tv;
+   int fd, i;
+   int got=0;
+
+   /* secret for signing nonces */
+   fd=open("/dev/urandom", O_RDONLY);
+   if (fd >= 0) {
+      got=(read(fd, auth_secret, sizeof(auth_secret)) ==
+           sizeof(auth_secret));
+      close(fd);
+   }
+   if (!got) {
+      WARN("auth_init: /dev/urandom not available, weak nonce secret");
+      gettimeofday(&tv, NULL);
+      srand(tv.tv_sec ^ tv.tv_usec ^ getpid());
+      for (i=0; i<sizeof(auth_secret); i++) auth_secret[i]=rand();
+   }
+   memcpy(&auth_salt, auth_secret, sizeof(auth_salt));
+   memset(auth_nc, 0, sizeof(auth_nc));
+
+   /* result cache */
+   memset(&auth_stats, 0, sizeof(auth_stats));
+   if (configuration.proxy_auth_cache_ttl > 0) {
+      auth_cache=calloc(AUTH_CACHE_SETS*AUTH_CACHE_WAYS, sizeof(auth_cache_t));
+      if (auth_cache == NULL) {
+         WARN("auth_init: out of memory, authentication cache disabled");
+      }
+   }
+
+   if (configuration.proxy_auth_pwfile == NULL) return STS_SUCCESS;
+
+   memset(&auth_pwfile_stat, 0, sizeof(auth_pwfile_stat));
+   memset(auth_retired, 0, sizeof(auth_retired));
+   auth_next_check=time(NULL)+AUTH_PWFILE_CHECK;
+
+   return auth_pwfile_reload(0);
+}
 
 /*
  * perform proxy authentication
@@ -55,9 +228,11 @@ static char *auth_getpwd(char *username);
  *	STS_SUCCESS : authentication ok / not needed
  *	STS_FAILURE : authentication failed
  *	STS_NEEDAUTH: authentication needed
+ *	STS_AUTH_STALE: authentication needed, nonce stale
  */
 int authenticate_proxy(osip_message_t *sipmsg) {
    osip_proxy_authorization_t *proxy_auth=NULL;
+   int sts;
    
    /* required by config? */
    if (configuration.proxy_auth_realm == NULL) {
@@ -72,9 +247,16 @@ int authenticate_proxy(osip_message_t *sipmsg) {
    }
 
    /* verify supplied authentication */
-   if (auth_check(proxy_auth) == STS_SUCCESS) {
+   sts=auth_check(proxy_auth);
+   if (sts == STS_SUCCESS) {
       DEBUGC(DBCLASS_AUTH,"proxy-auth succeeded");
       return STS_SUCCESS;
+   } else if (sts == STS_NEED_AUTH) {
+      DEBUGC(DBCLASS_AUTH,"proxy-auth nonce unknown, new challenge");
+      return STS_NEED_AUTH;
+   } else if (sts == STS_AUTH_STALE) {
+      DEBUGC(DBCLASS_AUTH,"proxy-auth nonce stale, new challenge");
+      return STS_AUTH_STALE;
    }
 
    /* authentication failed */
@@ -83,13 +265,16 @@ int authenticate_proxy(osip_message_t *sipmsg) {
 }
 
 /*
- * includes proxy authentication header in SIP message
+ * includes proxy authentication header in SIP message. stale is set
+ * if the request had a correct digest with a nonce that is not usable
+ * any more (auth_check() returned STS_AUTH_STALE), the client then
+ * retries with the new nonce without asking the user for the password.
  *
  * RETURNS
  *	STS_SUCCESS
  *	STS_FAILURE
  */
-int auth_include_authrq(osip_message_t *sipmsg) {
+int auth_include_authrq(osip_message_t *sipmsg, int stale) {
    osip_proxy_authenticate_t *p_auth;
    char *realm=NULL;
 
@@ -110,6 +295,12 @@ int auth_include_authrq(osip_message_t *sipmsg) {
       return STS_FAILURE;
    }
 
+   osip_proxy_authenticate_set_qop_options(p_auth, osip_strdup("\"auth\""));
+
+   if (stale) {
+      osip_proxy_authenticate_set_stale(p_auth, osip_strdup("true"));
+   }
+
    osip_list_add (&(sipmsg->proxy_authenticates), p_auth, -1);
 
    DEBUGC(DBCLASS_AUTH,"added authentication header");
@@ -123,30 +314,170 @@ int auth_include_authrq(osip_message_t *sipmsg) {
  * RETURNS nonce string
  */
 static char *auth_generate_nonce() {
-   static char nonce[40];
-   struct timeval tv;
-   
-   gettimeofday (&tv, NULL);
+   static char nonce[AUTH_NONCE_LEN+3];
+   char stamp_salt[16+1];
+
+   /* the salt makes nonces handed out within the same second differ */
+   auth_salt = auth_salt * 1103515245U + 12345U;
+   sprintf(stamp_salt, "%8.8lx%8.8x", (unsigned long)time(NULL) & 0xffffffffUL,
+           auth_salt);
 
-/* yeah, I know... should be a better algorithm */
 /* enclose it in double quotes, as libosip does *not* do it (2.0.6) */
-   sprintf(nonce, "\"%8.8lx%8.8lx%8.8x%8.8x\"",
-           (long)tv.tv_sec, (long)tv.tv_usec, rand(), rand() );
+   nonce[0]='"';
+   memcpy(&nonce[1], stamp_salt, 16);
+   auth_nonce_mac(stamp_salt, &nonce[1+16]);
+   nonce[AUTH_NONCE_LEN+1]='"';
+   nonce[AUTH_NONCE_LEN+2]='\0';
 
-   DEBUGC(DBCLASS_AUTH,"created nonce=\"%s\"",nonce);
+   DEBUGC(DBCLASS_AUTH,"created nonce=%s",nonce);
    return nonce;
 }
 
 
+/*
+ * calculate the mac of a nonce: first 8 bytes of
+ * HMAC-MD5(secret, timestamp|salt) as 16 hex digits
+ */
+static void auth_nonce_mac(char *stamp_salt, char *mac) {
+   osip_MD5_CTX Md5Ctx;
+   unsigned char pad[64];
+   HASH inner, outer;
+   HASHHEX hex;
+   int i;
+
+   /* H(K ^ ipad, text) */
+   memset(pad, 0, sizeof(pad));
+   memcpy(pad, auth_secret, sizeof(auth_secret));
+   for (i=0; i<sizeof(pad); i++) pad[i] ^= 0x36;
+   osip_MD5Init(&Md5Ctx);
+   osip_MD5Update(&Md5Ctx, pad, sizeof(pad));
+   osip_MD5Update(&Md5Ctx, (unsigned char*)stamp_salt, 16);
+   osip_MD5Final(inner, &Md5Ctx);
+
+   /* H(K ^ opad, inner) */
+   memset(pad, 0, sizeof(pad));
+   memcpy(pad, auth_secret, sizeof(auth_secret));
+   for (i=0; i<sizeof(pad); i++) pad[i] ^= 0x5c;
+   osip_MD5Init(&Md5Ctx);
+   osip_MD5Update(&Md5Ctx, pad, sizeof(pad));
+   osip_MD5Update(&Md5Ctx, inner, HASHLEN);
+   osip_MD5Final(outer, &Md5Ctx);
+
+   CvtHex(outer, hex);
+   memcpy(mac, hex, 16);
+}
+
+
+/*
+ * check that a nonce has been created by us and is not too old
+ *
+ * RETURNS
+ *	STS_SUCCESS if valid
+ *	STS_FAILURE if it is ours but has expired
+ *	-1 if it is not one of our nonces
+ */
+static int auth_nonce_valid(char *nonce) {
+   char stamp_salt[16+1];
+   char mac[16];
+   unsigned long stamp;
+   long age;
+   int i;
+
+   if (strlen(nonce) != AUTH_NONCE_LEN) return -1;
+   for (i=0; i<AUTH_NONCE_LEN; i++) {
+      if (!isxdigit((unsigned char)nonce[i])) return -1;
+   }
+
+   memcpy(stamp_salt, nonce, 16);
+   stamp_salt[16]='\0';
+   auth_nonce_mac(stamp_salt, mac);
+   if (memcmp(mac, &nonce[16], 16) != 0) return -1;
+
+   stamp_salt[8]='\0';
+   stamp=strtoul(stamp_salt, NULL, 16);
+   age=(long)(((unsigned long)time(NULL) - stamp) & 0xffffffffUL);
+   if (age > configuration.proxy_auth_nonce_lifetime) {
+      DEBUGC(DBCLASS_AUTH,"nonce expired (age %lis)", age);
+      return STS_FAILURE;
+   }
+
+   return STS_SUCCESS;
+}
+
+
+/*
+ * replay check: has this nonce-count been used with this nonce?
+ * (call only for requests that did pass the digest check)
+ *
+ * RETURNS
+ *	STS_SUCCESS if the nonce-count is fresh
+ *	STS_FAILURE if it is a replay or can't be checked
+ */
+static int auth_nonce_count(char *nonce, char *nonce_count) {
+   unsigned long nc;
+   unsigned long diff;
+   unsigned int slot=0;
+   char *end;
+   int i;
+
+   nc=strtoul(nonce_count, &end, 16);
+   if ((nc == 0) || (*end != '\0')) return STS_FAILURE;
+
+   /* slot selected by the mac part of the nonce */
+   for (i=16; i<AUTH_NONCE_LEN; i++) slot = slot*31 + (unsigned char)nonce[i];
+   slot %= AUTH_NC_SLOTS;
+
+   if (memcmp(auth_nc[slot].mac, &nonce[16], 16) != 0) {
+      /* not tracked (yet or any more) */
+      if (nc != 1) {
+         DEBUGC(DBCLASS_AUTH,"nonce not tracked, nc=%lu", nc);
+         return STS_FAILURE;
+      }
+      memcpy(auth_nc[slot].mac, &nonce[16], 16);
+      auth_nc[slot].mac[16]='\0';
+      auth_nc[slot].max_nc=1;
+      auth_nc[slot].window=1;
+      return STS_SUCCESS;
+   }
+
+   if (nc > auth_nc[slot].max_nc) {
+      diff=nc - auth_nc[slot].max_nc;
+      auth_nc[slot].window = (diff >= AUTH_NC_WINDOW) ? 0 :
+                             auth_nc[slot].window << diff;
+      auth_nc[slot].window |= 1;
+      auth_nc[slot].max_nc=nc;
+      return STS_SUCCESS;
+   }
+
+   diff=auth_nc[slot].max_nc - nc;
+   if ((diff >= AUTH_NC_WINDOW) ||
+       (auth_nc[slot].window & (1ULL << diff))) {
+      DEBUGC(DBCLASS_AUTH,"nonce-count %lu replayed or too old", nc);
+      return STS_FAILURE;
+   }
+   auth_nc[slot].window |= (1ULL << diff);
+   return STS_SUCCESS;
+}
+
+
 /*
  * verify the supplied authentication information from UA
  *
  * RETURNS
  *	STS_SUCCESS if succeeded
  *	STS_FAILURE if failed
+ *	STS_NEED_AUTH if the nonce is not ours (new challenge needed)
+ *	STS_AUTH_STALE if the digest is correct but the nonce is expired
+ *	               or the nonce-count is not usable (stale challenge)
  */
 static int auth_check(osip_proxy_authorization_t *proxy_auth) {
+   auth_user_t *user=NULL;
    char *password=NULL;
+   unsigned int generation;
+   char key[AUTH_CACHE_KEYLEN];
+   int keylen=0;
+   int needs_nc=0;
+   int nonce_sts=-1;
    int sts;
 
    HASHHEX HA1;
@@ -187,10 +518,22 @@ static int auth_check(osip_proxy_authorization_t *proxy_auth) {
    if (proxy_auth->response)
       Response=osip_strdup_without_quote(proxy_auth->response);
 
+   /* the nonce must be one of ours, an expired one is only reported
+    * stale if the digest turns out to be correct */
+   if (Nonce) nonce_sts=auth_nonce_valid(Nonce);
+   if (nonce_sts == -1) {
+      DEBUGC(DBCLASS_AUTH,"nonce [%s] unknown",
+             (Nonce)?Nonce:"*NULL*");
+      sts = STS_NEED_AUTH;
+      goto end;
+   }
+
    /* get password */
+   generation=__atomic_load_n(&auth_generation, __ATOMIC_ACQUIRE);
    if (configuration.proxy_auth_pwfile) {
       /* check in passwd file */
-      password=auth_getpwd(Username);
+      user=auth_getuser(Username);
+      if (user) password=user->password;
    } else if (configuration.proxy_auth_passwd) {
       /* get password from configuration */
       password=configuration.proxy_auth_passwd;
@@ -199,7 +542,8 @@ static int auth_check(osip_proxy_authorization_t *proxy_auth) {
    if (password == NULL) {
       DEBUGC(DBCLASS_AUTH,"user [%s] not in password file!",
              (Username)?Username:"*NULL*");
-      return STS_FAILURE;
+      sts = STS_FAILURE;
+      goto end;
    }
 
    DEBUGC(DBCLASS_BABBLE," username=\"%s\"",Username  );
@@ -211,21 +555,61 @@ static int auth_check(osip_proxy_authorization_t *proxy_auth) {
    DEBUGC(DBCLASS_BABBLE," uri     =\"%s\"",Uri	    );
    DEBUGC(DBCLASS_BABBLE," response=\"%s\"",Response  );
 
+   /* identical credentials verified before? */
+   if (auth_cache) {
+      char *field[8];
+      field[0]=Username; field[1]=Realm; field[2]=Nonce; field[3]=NonceCount;
+      field[4]=CNonce; field[5]=Qpop; field[6]=Uri; field[7]=Response;
+      keylen=auth_cache_key(key, field, 8);
+      if ((keylen > 0) &&
+          (auth_cache_lookup(key, keylen, generation,
+                             &needs_nc) == STS_SUCCESS)) {
+         DEBUGC(DBCLASS_AUTH,"Authentication succeeded (cached)");
+         sts = STS_SUCCESS;
+         goto replay;
+      }
+   }
+
    /* calculate the MD5 digest (heavily inspired from linphone code) */
-   DigestCalcHA1("MD5", Username, Realm, password, Nonce, CNonce, HA1);
+   if (user && Realm && (strcmp(Realm, configuration.proxy_auth_realm)==0)) {
+      /* precalculated when loading the password file */
+      memcpy(HA1, user->ha1, sizeof(HASHHEX));
+   } else {
+      DigestCalcHA1("MD5", Username, Realm, password, Nonce, CNonce, HA1);
+   }
    DigestCalcResponse(HA1, Nonce, NonceCount, CNonce, Qpop,
 		      "REGISTER", Uri, HA2, Lcl_Response);
 
    DEBUGC(DBCLASS_BABBLE,"calculated Response=\"%s\"", Lcl_Response);
 
-   if (strcmp((char*)Lcl_Response, Response)==0) {
+   if (Response && (strcmp((char*)Lcl_Response, Response)==0)) {
       DEBUGC(DBCLASS_AUTH,"Authentication succeeded");
       sts = STS_SUCCESS;
+      needs_nc=(Qpop && NonceCount);
+      if ((keylen > 0) && (nonce_sts == STS_SUCCESS)) {
+         auth_cache_insert(key, keylen, generation, needs_nc);
+      }
    } else {
       DEBUGC(DBCLASS_AUTH,"Authentication failed");
       sts = STS_FAILURE;
    }
 
+   /* expired nonce or replayed nonce-count: the digest is correct,
+    * authenticate again with a new nonce (stale). A cached hit that was
+    * verified with qop/nc must pass the nonce-count check too */
+ replay:
+   if ((sts == STS_SUCCESS) && (nonce_sts != STS_SUCCESS)) {
+      DEBUGC(DBCLASS_AUTH,"nonce expired, correct digest");
+      sts = STS_AUTH_STALE;
+   }
+   if ((sts == STS_SUCCESS) && (needs_nc || (Qpop && NonceCount))) {
+      if ((Qpop == NULL) || (NonceCount == NULL) ||
+          (auth_nonce_count(Nonce, NonceCount) != STS_SUCCESS)) {
+         sts = STS_AUTH_STALE;
+      }
+   }
+
+ end:
    /* free allocated memory from above */
    if (Username)   free(Username);
    if (Realm)      free(Realm);
@@ -241,81 +625,41 @@ static int auth_check(osip_proxy_authorization_t *proxy_auth) {
 
 
 /*
- * lookup in the password file and return
- * the user specific password for 'username'
+ * lookup a user in the credential store, reloads the
+ * password file if it has been changed
  *
  * RETURNS
- *	password for user or NULL if not found
+ *	user entry or NULL if not found
  */
-static char *auth_getpwd(char *username) {
-   typedef struct {
-      char username[USERNAME_SIZE];
-      char password[PASSWORD_SIZE];
-   } auth_cache_t;
-
-   char buff[128];
+static auth_user_t *auth_getuser(char *username) {
+   auth_store_t *store;
+   time_t now;
    int i;
-   static auth_cache_t *auth_cache=NULL;
-   void *tmpptr;
-   static int auth_cache_size=0;
-   static int auth_cache_count=0;
 
-   if (auth_cache==NULL) {
-      DEBUGC(DBCLASS_AUTH,"initialize password cache");
+   if (username == NULL) return NULL;
 
-      /* config file not found or unable to open for read */
-      if (siproxd_passwordfile==NULL) {
-         ERROR ("could not open password file: %s", strerror(errno));
-         return NULL;
-      }
-      
-      rewind(siproxd_passwordfile);
-
-      while (fgets(buff,sizeof(buff),siproxd_passwordfile) != NULL) {
-         /* life insurance */
-         buff[sizeof(buff)-1]='\0';
-
-	 /* strip newline if present */
-	 if (buff[strlen(buff)-1]=='\n') buff[strlen(buff)-1]='\0';
-
-	 /* strip emty lines */
-	 if (strlen(buff) == 0) continue;
-
-	 /* strip comments and line with only whitespaces */
-	 for (i=0;i<strlen(buff);i++) {
-            if ((buff[i] == ' ') || (buff[i] == '\t')) continue;
-            if (buff[i] =='#') i=strlen(buff);
-            break;
-	 }
-	 if (i == strlen(buff)) continue;
-
-         /* allocate space whenever needed */
-	 if (auth_cache_count >= auth_cache_size) {
-	    auth_cache_size+=10;
-	    tmpptr=realloc(auth_cache, auth_cache_size*sizeof(auth_cache_t));
-            if (tmpptr != NULL) {
-               auth_cache= (auth_cache_t *)tmpptr;
-	    } else {
-               ERROR("realloc failed! this is not good");
-	       auth_cache_size-=10;
-	       return NULL;
-	    }
-         } /* cnt > size */
-
-         i=sscanf(buff,"%s %s",auth_cache[auth_cache_count].username,
-	                       auth_cache[auth_cache_count].password);
-         /* if I got username & passwd, make it valid and increment counter */
-         if (i == 2) auth_cache_count++;
-      }
+   /* password file changed? (one thread checks, others go on) */
+   now=time(NULL);
+   if ((now >= auth_next_check) &&
+       (__atomic_exchange_n(&auth_reloading, 1, __ATOMIC_ACQUIRE) == 0)) {
+      auth_next_check=now+AUTH_PWFILE_CHECK;
+      auth_pwfile_reload(now);
+      __atomic_store_n(&auth_reloading, 0, __ATOMIC_RELEASE);
+   }
 
-   } /* initialize cache */
+   store=__atomic_load_n(&auth_store, __ATOMIC_ACQUIRE);
+   if (store == NULL) {
+      ERROR("password file %s not loaded", configuration.proxy_auth_pwfile);
+      return NULL;
+   }
 
-   /* search cache for user */
+   /* search store for user */
    DEBUGC(DBCLASS_AUTH,"searching password entry for user %s",username);
-   for (i=0; i< auth_cache_count;i++) {
-      if (strcmp(username, auth_cache[i].username)==0) {
+   for (i=store->hash[auth_hashfunc(username) & store->hash_mask]; i >= 0;
+        i=store->user[i].hnext) {
+      if (strcmp(username, store->user[i].username)==0) {
          DEBUGC(DBCLASS_AUTH,"found password entry for user %s",username);
-         return auth_cache[i].password;
+         return &store->user[i];
       }
    }
 
@@ -324,6 +668,337 @@ static char *auth_getpwd(char *username) {
 }
 
 
+/*
+ * (re)load the password file if it has been changed since the
+ * last load and make it the current credential store.
+ *
+ * The file is reopened by name if it has been replaced. If it can't
+ * be reached by name (chroot jail), the file opened at startup is
+ * read again.
+ *
+ * RETURNS
+ *	STS_SUCCESS if loaded or not changed
+ *	STS_FAILURE on error (the current store is kept)
+ */
+static int auth_pwfile_reload(time_t now) {
+   struct stat st;
+   auth_store_t *store, *old;
+   FILE *pwfile;
+   int i, slot;
+
+   if (stat(configuration.proxy_auth_pwfile, &st) == 0) {
+      /* replaced (e.g. by an editor) - open the new file */
+      if ((siproxd_passwordfile == NULL) ||
+          ((auth_pwfile_stat.st_ino != 0) &&
+           ((st.st_ino != auth_pwfile_stat.st_ino) ||
+            (st.st_dev != auth_pwfile_stat.st_dev)))) {
+         pwfile=fopen(configuration.proxy_auth_pwfile, "r");
+         if (pwfile) {
+            if (siproxd_passwordfile) fclose(siproxd_passwordfile);
+            siproxd_passwordfile=pwfile;
+            if (fstat(fileno(pwfile), &st) != 0) return STS_FAILURE;
+         }
+      }
+   } else if ((siproxd_passwordfile == NULL) ||
+              (fstat(fileno(siproxd_passwordfile), &st) != 0)) {
+      ERROR("could not open password file %s: %s",
+            configuration.proxy_auth_pwfile, strerror(errno));
+      return STS_FAILURE;
+   }
+
+   if (siproxd_passwordfile == NULL) {
+      ERROR("could not open password file %s", configuration.proxy_auth_pwfile);
+      return STS_FAILURE;
+   }
+
+   /* unchanged? */
+   if ((st.st_ino   == auth_pwfile_stat.st_ino) &&
+       (st.st_dev   == auth_pwfile_stat.st_dev) &&
+       (st.st_mtime == auth_pwfile_stat.st_mtime) &&
+       (st.st_size  == auth_pwfile_stat.st_size)) {
+      return STS_SUCCESS;
+   }
+
+   /* still being written? try again with the next check */
+   if (now && (st.st_mtime >= now)) return STS_SUCCESS;
+
+   /* need a free slot to retire the current store */
+   slot=-1;
+   for (i=0; i<AUTH_RETIRED; i++) {
+      if (auth_retired[i].store &&
+          (auth_retired[i].retired + AUTH_GRACE < now)) {
+         auth_store_free(auth_retired[i].store);
+         auth_retired[i].store=NULL;
+      }
+      if ((slot < 0) && (auth_retired[i].store == NULL)) slot=i;
+   }
+   if (slot < 0) return STS_SUCCESS;
+
+   store=auth_store_load(siproxd_passwordfile);
+   if (store == NULL) return STS_FAILURE;
+
+   old=__atomic_exchange_n(&auth_store, store, __ATOMIC_ACQ_REL);
+   __atomic_add_fetch(&auth_generation, 1, __ATOMIC_RELEASE);
+   if (old) {
+      auth_retired[slot].store=old;
+      auth_retired[slot].retired=now;
+   }
+   memcpy(&auth_pwfile_stat, &st, sizeof(st));
+
+   INFO("loaded %i users from password file %s", store->count,
+        configuration.proxy_auth_pwfile);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * read the password file into a new credential store
+ *
+ * RETURNS
+ *	new store (malloc'ed) or NULL on error
+ */
+static auth_store_t *auth_store_load(FILE *pwfile) {
+   char buff[USERNAME_SIZE+PASSWORD_SIZE+16];
+   auth_store_t *store;
+   auth_user_t *user;
+   void *tmpptr;
+   int size=0;
+   unsigned int h;
+   int i;
+
+   store=malloc(sizeof(auth_store_t));
+   if (store == NULL) {
+      ERROR("auth_store_load: out of memory");
+      return NULL;
+   }
+   memset(store, 0, sizeof(auth_store_t));
+
+   rewind(pwfile);
+
+   while (fgets(buff,sizeof(buff),pwfile) != NULL) {
+      /* life insurance */
+      buff[sizeof(buff)-1]='\0';
+
+      /* strip newline if present */
+      if (buff[strlen(buff)-1]=='\n') buff[strlen(buff)-1]='\0';
+
+      /* strip emty lines */
+      if (strlen(buff) == 0) continue;
+
+      /* strip comments and line with only whitespaces */
+      for (i=0;i<strlen(buff);i++) {
+         if ((buff[i] == ' ') || (buff[i] == '\t')) continue;
+         if (buff[i] =='#') i=strlen(buff);
+         break;
+      }
+      if (i == strlen(buff)) continue;
+
+      /* allocate space whenever needed */
+      if (store->count >= size) {
+         size=(size)? size*2 : 64;
+         tmpptr=realloc(store->user, size*sizeof(auth_user_t));
+         if (tmpptr == NULL) {
+            ERROR("realloc failed! this is not good");
+            auth_store_free(store);
+            return NULL;
+         }
+         store->user=(auth_user_t *)tmpptr;
+      }
+
+      user=&store->user[store->count];
+      /* field widths: USERNAME_SIZE-1, PASSWORD_SIZE-1 */
+      i=sscanf(buff,"%127s %127s",user->username, user->password);
+      /* if I got username & passwd, make it valid and increment counter */
+      if (i == 2) store->count++;
+   }
+
+   /* hash size: power of 2, at least the number of users */
+   for (h=16; h < (unsigned int)store->count; h<<=1) {};
+   store->hash_mask=h-1;
+   store->hash=malloc(h*sizeof(int));
+   if (store->hash == NULL) {
+      ERROR("auth_store_load: out of memory");
+      auth_store_free(store);
+      return NULL;
+   }
+   for (h=0; h <= store->hash_mask; h++) store->hash[h]=-1;
+
+   for (i=0; i < store->count; i++) {
+      user=&store->user[i];
+      /* H(A1) = MD5(username:realm:password) */
+      DigestCalcHA1("MD5", user->username, configuration.proxy_auth_realm,
+                    user->password, NULL, NULL, user->ha1);
+      /* first entry of a username wins (as before) - append to chain */
+      h=auth_hashfunc(user->username) & store->hash_mask;
+      user->hnext=-1;
+      if (store->hash[h] < 0) {
+         store->hash[h]=i;
+      } else {
+         int j;
+         for (j=store->hash[h]; store->user[j].hnext >= 0;
+              j=store->user[j].hnext) {};
+         store->user[j].hnext=i;
+      }
+   }
+
+   return store;
+}
+
+
+/*
+ * free a credential store
+ */
+static void auth_store_free(auth_store_t *store) {
+   if (store == NULL) return;
+   if (store->user) free(store->user);
+   if (store->hash) free(store->hash);
+   free(store);
+}
+
+
+/*
+ * hash of a username (FNV-1a)
+ */
+static unsigned int auth_hashfunc(char *username) {
+   unsigned int hash=2166136261U;
+   unsigned char *p;
+
+   for (p=(unsigned char*)username; *p; p++) {
+      hash ^= (unsigned int)*p;
+      hash *= 16777619U;
+   }
+   return hash;
+}
+
+
+/*
+ * get a copy of the authentication cache counters
+ */
+void auth_get_stats(auth_stats_t *stats) {
+   pthread_mutex_lock(&auth_cache_mutex);
+   memcpy(stats, &auth_stats, sizeof(auth_stats_t));
+   pthread_mutex_unlock(&auth_cache_mutex);
+}
+
+
+/*
+ * build the cache key from the credential fields ('\0' separated,
+ * a missing field is marked by a single '\1')
+ *
+ * RETURNS
+ *	length of the key, 0 if it does not fit (don't cache)
+ */
+static int auth_cache_key(char *key, char **field, int nfields) {
+   int len=0;
+   int i, n;
+
+   for (i=0; i<nfields; i++) {
+      n=(field[i])? strlen(field[i]) : 1;
+      if (len+n+1 > AUTH_CACHE_KEYLEN) return 0;
+      if (field[i]) memcpy(&key[len], field[i], n);
+      else key[len]='\1';
+      len+=n;
+      key[len++]='\0';
+   }
+   return len;
+}
+
+
+/*
+ * hash function for cache keys (FNV-1a over the whole key)
+ *
+ * RETURNS
+ *	hash value
+ */
+static unsigned int auth_cache_hash(char *key, int keylen) {
+   unsigned int hash=2166136261U;
+   int i;
+
+   for (i=0; i<keylen; i++) {
+      hash ^= (unsigned char)key[i];
+      hash *= 16777619U;
+   }
+   return hash;
+}
+
+
+/*
+ * look up a credential tuple in the result cache, needs_nc is set
+ * if the tuple was verified with qop (nonce-count must be checked)
+ *
+ * RETURNS
+ *	STS_SUCCESS if the tuple has been verified before
+ *	STS_FAILURE if not cached
+ */
+static int auth_cache_lookup(char *key, int keylen, unsigned int generation,
+                             int *needs_nc) {
+   auth_cache_t *set;
+   unsigned int h;
+   time_t now;
+   int i;
+   int sts=STS_FAILURE;
+
+   h=auth_cache_hash(key, keylen);
+   set=&auth_cache[(h & (AUTH_CACHE_SETS-1)) * AUTH_CACHE_WAYS];
+   time(&now);
+
+   pthread_mutex_lock(&auth_cache_mutex);
+   for (i=0; i<AUTH_CACHE_WAYS; i++) {
+      if ((set[i].expires > now) && (set[i].hash == h) &&
+          (set[i].keylen == keylen) && (set[i].generation == generation) &&
+          (memcmp(set[i].key, key, keylen) == 0)) {
+         set[i].used=now;
+         *needs_nc=set[i].needs_nc;
+         sts=STS_SUCCESS;
+         break;
+      }
+   }
+   if (sts == STS_SUCCESS) auth_stats.hits++;
+   else auth_stats.misses++;
+   pthread_mutex_unlock(&auth_cache_mutex);
+
+   return sts;
+}
+
+
+/*
+ * remember a verified credential tuple
+ */
+static void auth_cache_insert(char *key, int keylen, unsigned int generation,
+                              int needs_nc) {
+   auth_cache_t *set, *e;
+   unsigned int h;
+   time_t now;
+   int i;
+
+   h=auth_cache_hash(key, keylen);
+   set=&auth_cache[(h & (AUTH_CACHE_SETS-1)) * AUTH_CACHE_WAYS];
+   time(&now);
+
+   pthread_mutex_lock(&auth_cache_mutex);
+   /* a free or expired way, else the least recently used one */
+   e=&set[0];
+   for (i=0; i<AUTH_CACHE_WAYS; i++) {
+      if (set[i].expires <= now) {
+         e=&set[i];
+         break;
+      }
+      if (set[i].used < e->used) e=&set[i];
+   }
+   if (e->expires > now) auth_stats.evictions++;
+
+   e->expires=now+configuration.proxy_auth_cache_ttl;
+   e->used=now;
+   e->generation=generation;
+   e->hash=h;
+   e->needs_nc=needs_nc;
+   e->keylen=keylen;
+   memcpy(e->key, key, keylen);
+   auth_stats.inserts++;
+   pthread_mutex_unlock(&auth_cache_mutex);
+}
+
+
 /*-------------------------------------------------------------------------
   -------------------------------------------------------------------------
   The routines below have been taken from linphone
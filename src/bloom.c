@@ -0,0 +1,183 @@
+/*
+    Copyright (C) 2002-2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/*
+ * Counting Bloom filter
+ *
+ * A set that answers "definitely not contained" or "maybe contained"
+ * with BLOOM_HASHES memory probes, elements can be removed again.
+ * The key is hashed by the caller (16 bytes, e.g. siphash_final()),
+ * the probe positions are derived from it by double hashing.
+ *
+ * The counters are 8 bit and stick at 255 once reached. Removing
+ * elements then leaves some counters too high (more false positives,
+ * never false negatives), bloom_saturated() tells when the filter
+ * should be rebuilt.
+ *
+ * Not thread safe, the caller must serialize the access.
+ */
+#define BLOOM_HASHES		4	/* probes per element */
+#define BLOOM_COUNTERS		10	/* counters per expected element */
+#define BLOOM_MAX		255	/* counter value that sticks */
+
+/* local prototypes */
+static void bloom_pos(bloom_t *bloom, const unsigned char *hash,
+                      unsigned int *pos);
+
+
+/*
+ * create a filter sized for the expected number of elements
+ * (about 1% false positives at that number)
+ *
+ * RETURNS
+ *	pointer to the filter, NULL if out of memory
+ */
+bloom_t *bloom_new(unsigned int entries) {
+   bloom_t *bloom;
+   unsigned int size;
+
+   if (entries < 64) entries=64;
+   for (size=64; size < entries*BLOOM_COUNTERS; size <<= 1);
+
+   bloom=calloc(1, sizeof(bloom_t));
+   if (bloom == NULL) return NULL;
+   bloom->counter=calloc(size, 1);
+   if (bloom->counter == NULL) {
+      free(bloom);
+      return NULL;
+   }
+   bloom->size=size;
+   bloom->capacity=entries;
+   return bloom;
+}
+
+
+void bloom_free(bloom_t *bloom) {
+   if (bloom == NULL) return;
+   free(bloom->counter);
+   free(bloom);
+}
+
+
+/*
+ * remove all elements
+ */
+void bloom_clear(bloom_t *bloom) {
+   memset(bloom->counter, 0, bloom->size);
+   bloom->entries=0;
+   bloom->saturated=0;
+}
+
+
+void bloom_add(bloom_t *bloom, const unsigned char *hash) {
+   unsigned int pos[BLOOM_HASHES];
+   int i;
+
+   bloom_pos(bloom, hash, pos);
+   for (i=0; i < BLOOM_HASHES; i++) {
+      if (bloom->counter[pos[i]] < BLOOM_MAX) {
+         bloom->counter[pos[i]]++;
+      } else {
+         bloom->saturated=1;
+      }
+   }
+   bloom->entries++;
+}
+
+
+/*
+ * remove an element (must have been added before)
+ */
+void bloom_del(bloom_t *bloom, const unsigned char *hash) {
+   unsigned int pos[BLOOM_HASHES];
+   int i;
+
+   bloom_pos(bloom, hash, pos);
+   for (i=0; i < BLOOM_HASHES; i++) {
+      if ((bloom->counter[pos[i]] > 0) &&
+          (bloom->counter[pos[i]] < BLOOM_MAX)) {
+         bloom->counter[pos[i]]--;
+      }
+   }
+   if (bloom->entries > 0) bloom->entries--;
+}
+
+
+/*
+ * RETURNS
+ *	STS_TRUE if the element may be contained
+ *	STS_FALSE if the element is not contained
+ */
+int bloom_check(bloom_t *bloom, const unsigned char *hash) {
+   unsigned int pos[BLOOM_HASHES];
+   int i;
+
+   bloom_pos(bloom, hash, pos);
+   for (i=0; i < BLOOM_HASHES; i++) {
+      if (bloom->counter[pos[i]] == 0) return STS_FALSE;
+   }
+   return STS_TRUE;
+}
+
+
+/*
+ * should the filter be rebuilt (saturated counters or more elements
+ * than it was sized for)?
+ *
+ * RETURNS
+ *	STS_TRUE if a rebuild is recommended
+ *	STS_FALSE if not
+ */
+int bloom_saturated(bloom_t *bloom) {
+   if (bloom->saturated || (bloom->entries > bloom->capacity)) {
+      return STS_TRUE;
+   }
+   return STS_FALSE;
+}
+
+
+/*
+ * probe positions: h1 + i*h2 (size is a power of 2, h2 is odd)
+ */
+static void bloom_pos(bloom_t *bloom, const unsigned char *hash,
+                      unsigned int *pos) {
+   unsigned int h1, h2;
+   int i;
+
+   memcpy(&h1, &hash[4], sizeof(h1));
+   memcpy(&h2, &hash[8], sizeof(h2));
+   h2 |= 1;
+   for (i=0; i < BLOOM_HASHES; i++) {
+      pos[i]=(h1 + i*h2) & (bloom->size-1);
+   }
+}
@@ -0,0 +1,1226 @@
+/*
+    Copyright (C) 2002-2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include <arpa/nameser.h>
+#ifdef __APPLE__
+#include <arpa/nameser_compat.h>
+#endif
+#include <resolv.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+extern int h_errno;
+
+/*
+ * Asynchronous DNS resolver with a hashed, TTL honoring cache.
+ *
+ * Lookups are done by a small pool of resolver threads. The SIP
+ * thread never waits for the DNS server while processing a message:
+ * if a hostname is not in the cache, the lookup is queued and the
+ * message is "parked". The SIP processing checks dnscache_is_parked()
+ * after each step that may resolve a name and stops there, so that
+ * registrations, RTP streams and plugin state are not touched by the
+ * parked pass (SIP output is suppressed as well). The raw message is
+ * stored away and is processed again from scratch once all the
+ * answers it was waiting for have arrived.
+ *
+ * Outside of message processing (startup, timer plugins) a lookup
+ * that misses the cache waits for the resolver thread to complete.
+ *
+ * Positive answers are cached for the TTL of the DNS records,
+ * negative answers (NXDOMAIN / NODATA) for the TTL given by the
+ * SOA record of the authority section (RFC2308). Multiple requests
+ * for a hostname that is currently being resolved only cause one
+ * single DNS query (in-flight deduplication).
+ *
+ * Besides A records, the cache holds the SIP server sets of a domain
+ * (RFC3263 NAPTR/SRV, see resolve.c) - one entry per transport.
+ *
+ * Entries that are in use are refreshed in the background shortly
+ * before they expire (prefetch). An expired entry is still served for
+ * up to dns_serve_stale seconds while it is being refreshed, and is
+ * kept if the refresh fails (serve-stale) - so in steady state a
+ * lookup never has to wait for the DNS server.
+ */
+
+/* cache entry states */
+#define DNS_ENTRY_FREE		0	/* unused */
+#define DNS_ENTRY_PENDING	1	/* queued/being resolved, no result yet */
+#define DNS_ENTRY_GOOD		2	/* resolved */
+#define DNS_ENTRY_BAD		3	/* resolving failed (negative entry) */
+
+/* cache entry types */
+#define DNS_TYPE_A		0	/* A record */
+#define DNS_TYPE_SRV_UDP	1	/* SIP server set, UDP transport */
+#define DNS_TYPE_SRV_TCP	2	/* SIP server set, TCP transport */
+
+/* results of a resolver run */
+#define DNS_RES_GOOD		0	/* got an address */
+#define DNS_RES_NEGATIVE	1	/* authoritative: no such name/no data */
+#define DNS_RES_FAILURE		2	/* server failure, timeout, ... */
+
+/* prefetch: refresh entries that have been used at least
+ * DNS_PREFETCH_HITS times when less than 1/DNS_PREFETCH_DIV
+ * of their TTL is left */
+#define DNS_PREFETCH_HITS	2
+#define DNS_PREFETCH_DIV	10
+
+typedef struct {
+   int    state;		/* DNS_ENTRY_* */
+   int    type;			/* DNS_TYPE_* */
+   time_t expires_timestamp;	/* time of expiration */
+   struct in_addr addr;		/* IP address or 0.0.0.0 if a bad entry */
+   dns_srvset_t *srv;		/* server set (DNS_TYPE_SRV_*) */
+   int    error_count;		/* counts failed resolution attempts */
+   int    ttl;			/* cache lifetime the entry was stored with */
+   int    hits;			/* lookups since last (re)fresh */
+   int    refreshing;		/* queued for a background refresh */
+   time_t retry_timestamp;	/* no refresh attempt before this time */
+   int    hnext;		/* next entry in hash chain, -1 = end */
+   int    lru_prev;		/* LRU list, -1 = end */
+   int    lru_next;
+   unsigned int hash;
+   char   hostname[HOSTNAME_SIZE+1];
+} dns_entry_t;
+
+/* the cache */
+static dns_entry_t *dns_table=NULL;
+static int dns_table_size=0;
+static int *dns_hash=NULL;		/* hash buckets -> index into table */
+static unsigned int dns_hash_mask=0;
+static int dns_lru_head=-1;		/* most recently used */
+static int dns_lru_tail=-1;		/* least recently used */
+
+/* queue of pending lookups (indexes into dns_table) */
+static int *dns_queue=NULL;
+static int dns_queue_head=0;
+static int dns_queue_count=0;
+
+/* number of running resolver threads, 0 = resolve synchronously */
+static int dns_threads=0;
+
+/* statistics */
+static dnscache_stats_t dns_stats;
+
+/* locking: one mutex protects the cache and the queue */
+static pthread_mutex_t dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  dns_job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  dns_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* resolver threads signal completed lookups to the SIP thread */
+static int dns_notify_pipe[2]={-1, -1};
+
+/*
+ * parked SIP messages, waiting for DNS answers
+ */
+#define DNS_PARK_SIZE		64	/* max number of parked messages */
+#define DNS_PARK_HOSTS		8	/* max hostnames a message waits for */
+#define DNS_PARK_MAXCOUNT	3	/* max times a message is parked */
+#define DNS_PARK_TIMEOUT	32	/* drop parked messages after (sec) */
+
+typedef struct {
+   char   *raw_buffer;		/* copy of the raw SIP message, NULL=free */
+   size_t raw_buffer_len;
+   struct sockaddr_in from;
+   int    protocol;
+   time_t timestamp;		/* time parked */
+   int    parkcount;		/* number of times this message was parked */
+   int    num_hosts;
+   int    types[DNS_PARK_HOSTS];
+   char   hosts[DNS_PARK_HOSTS][HOSTNAME_SIZE+1];
+} dns_parked_t;
+
+static dns_parked_t dns_parked[DNS_PARK_SIZE];
+static int dns_parked_count=0;
+
+/* state of the message that is currently processed by the SIP thread */
+static int  park_enabled=0;	/* parking allowed */
+static int  park_active=0;	/* message is parked (had a cache miss) */
+static int  park_parkcount=0;	/* times the current message was parked */
+static int  park_num_hosts=0;
+static int  park_types[DNS_PARK_HOSTS];
+static char park_hosts[DNS_PARK_HOSTS][HOSTNAME_SIZE+1];
+
+/* local prototypes */
+static void *dns_resolver_main(void *arg);
+static int  dns_cache_get(char *hostname, int type, struct in_addr *addr,
+                          dns_srvset_t *srvset);
+static int  dns_resolve_entry(char *hostname, int type, struct in_addr *addr,
+                              dns_srvset_t *srvset, int *ttl);
+static int  dns_resolve(char *hostname, struct in_addr *addr, int *ttl);
+static int  dns_query_a(char *hostname, struct in_addr *addr, int *ttl);
+static int  dns_gethostbyname(char *hostname, struct in_addr *addr);
+static void dns_store_result(int idx, int result, struct in_addr addr,
+                             dns_srvset_t *srvset, int ttl);
+static int  dns_find(char *hostname, int type, unsigned int hash);
+static int  dns_alloc(char *hostname, int type, unsigned int hash);
+static void dns_unlink(int idx);
+static void dns_lru_touch(int idx);
+static void dns_lru_retire(int idx);
+static void dns_refresh(int idx, time_t now);
+static unsigned int dns_hashfunc(char *hostname, int type);
+static void dns_park_add_host(char *hostname, int type);
+
+
+/*
+ * initialize the DNS cache and start the resolver threads
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on failure
+ */
+int dnscache_init(void) {
+   int i, sts;
+   pthread_attr_t attr;
+   pthread_t tid;
+   sigset_t sigset, oldset;
+
+   dns_table_size = configuration.dns_cache_size;
+   if (dns_table_size <= 0) dns_table_size = DNS_CACHE_SIZE;
+
+   /* hash size: power of 2, at least the number of entries */
+   for (i=1; i < dns_table_size; i <<= 1) {};
+   dns_hash_mask = i-1;
+
+   DEBUGC(DBCLASS_DNS, "initializing DNS cache (%i entries, %i buckets)",
+          dns_table_size, i);
+
+   dns_table = malloc(dns_table_size * sizeof(dns_entry_t));
+   dns_hash  = malloc((dns_hash_mask+1) * sizeof(int));
+   dns_queue = malloc(dns_table_size * sizeof(int));
+   if ((dns_table == NULL) || (dns_hash == NULL) || (dns_queue == NULL)) {
+      ERROR("dnscache_init: out of memory");
+      return STS_FAILURE;
+   }
+
+   memset(dns_table, 0, dns_table_size * sizeof(dns_entry_t));
+   for (i=0; i <= dns_hash_mask; i++) dns_hash[i]=-1;
+
+   /* all entries start free in the LRU list */
+   for (i=0; i < dns_table_size; i++) {
+      dns_table[i].hnext = -1;
+      dns_table[i].lru_prev = i-1;
+      dns_table[i].lru_next = (i+1 < dns_table_size) ? i+1 : -1;
+   }
+   dns_lru_head = 0;
+   dns_lru_tail = dns_table_size-1;
+
+   memset(dns_parked, 0, sizeof(dns_parked));
+   dns_parked_count = 0;
+
+   /* no resolver threads configured -> resolve synchronously */
+   if (configuration.dns_resolver_threads <= 0) {
+      INFO("DNS resolver threads disabled, using synchronous lookups");
+      return STS_SUCCESS;
+   }
+
+   if (pipe(dns_notify_pipe) != 0) {
+      ERROR("dnscache_init: pipe() failed: %s", strerror(errno));
+      return STS_FAILURE;
+   }
+   fcntl(dns_notify_pipe[0], F_SETFL, O_NONBLOCK);
+   fcntl(dns_notify_pipe[1], F_SETFL, O_NONBLOCK);
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   if (configuration.thread_stack_size > 0) {
+      pthread_attr_setstacksize(&attr, configuration.thread_stack_size*1024);
+   }
+
+   /* the resolver threads must not catch any signals */
+   sigfillset(&sigset);
+   pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+   for (i=0; i < configuration.dns_resolver_threads; i++) {
+      sts=pthread_create(&tid, &attr, dns_resolver_main, NULL);
+      if (sts != 0) {
+         ERROR("dnscache_init: pthread_create() failed: %s", strerror(sts));
+         break;
+      }
+      dns_threads++;
+   }
+   pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+   pthread_attr_destroy(&attr);
+
+   INFO("started %i DNS resolver threads", dns_threads);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * resolve a hostname and return in_addr - cached
+ * (called by get_ip_by_host)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on failure (or if the current message got parked)
+ */
+int dnscache_lookup(char *hostname, struct in_addr *addr) {
+   return dns_cache_get(hostname, DNS_TYPE_A, addr, NULL);
+}
+
+
+/*
+ * get the SIP server set of a domain (RFC3263 NAPTR/SRV) - cached
+ *
+ * proto	PROTO_UDP / PROTO_TCP
+ * srvset	returned server set, sorted by priority.
+ *		srvset->count=0 if the domain has no SRV records
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on failure (or if the current message got parked)
+ */
+int dnscache_lookup_srv(char *domain, int proto, dns_srvset_t *srvset) {
+   return dns_cache_get(domain,
+                        (proto == PROTO_TCP) ? DNS_TYPE_SRV_TCP :
+                                               DNS_TYPE_SRV_UDP,
+                        NULL, srvset);
+}
+
+
+/*
+ * look up the A record of a hostname in the cache only - never
+ * queues a lookup nor parks the current message.
+ *
+ * RETURNS
+ *	STS_SUCCESS if a valid positive entry exists
+ *	STS_FAILURE if not
+ */
+int dnscache_peek(char *hostname, struct in_addr *addr) {
+   int idx;
+   int sts=STS_FAILURE;
+   time_t now;
+
+   if (dns_table == NULL) return STS_FAILURE;
+
+   time(&now);
+   pthread_mutex_lock(&dns_mutex);
+   idx = dns_find(hostname, DNS_TYPE_A, dns_hashfunc(hostname, DNS_TYPE_A));
+   if ((idx >= 0) && (dns_table[idx].state == DNS_ENTRY_GOOD) &&
+       (dns_table[idx].expires_timestamp >= now)) {
+      memcpy(addr, &dns_table[idx].addr, sizeof(struct in_addr));
+      sts = STS_SUCCESS;
+   }
+   pthread_mutex_unlock(&dns_mutex);
+   return sts;
+}
+
+
+/*
+ * cached lookup of an entry of any type. Depending on the type,
+ * either addr or srvset is returned.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on failure (or if the current message got parked)
+ */
+static int dns_cache_get(char *hostname, int type, struct in_addr *addr,
+                         dns_srvset_t *srvset) {
+   int idx;
+   unsigned int hash;
+   time_t now;
+   int sts=STS_FAILURE;
+   int stale=0;
+   dns_entry_t *e;
+
+   if (dns_table == NULL) {
+      ERROR("dnscache_lookup: DNS cache not initialized");
+      return STS_FAILURE;
+   }
+
+   hash = dns_hashfunc(hostname, type);
+   time(&now);
+
+   pthread_mutex_lock(&dns_mutex);
+
+   idx = dns_find(hostname, type, hash);
+
+   /* prefetch and serve-stale (need resolver threads) */
+   if ((idx >= 0) && (dns_table[idx].state == DNS_ENTRY_GOOD) &&
+       (dns_threads > 0)) {
+      e = &dns_table[idx];
+      if (e->expires_timestamp < now) {
+         if (e->expires_timestamp + configuration.dns_serve_stale >= now) {
+            /* expired, but still usable while being refreshed */
+            DEBUGC(DBCLASS_DNS, "DNS lookup - serving stale entry: %s",
+                   hostname);
+            dns_stats.stale++;
+            dns_refresh(idx, now);
+            stale = 1;
+         } else if (e->refreshing) {
+            /* too old to be served, wait for the running refresh */
+            e->state = DNS_ENTRY_PENDING;
+         }
+      } else if (configuration.dns_prefetch &&
+                 (e->hits >= DNS_PREFETCH_HITS) &&
+                 ((e->expires_timestamp - now) <=
+                  (e->ttl / DNS_PREFETCH_DIV))) {
+         dns_refresh(idx, now);
+      }
+   }
+
+   /* expired entries are treated as not existing */
+   if ((idx >= 0) && (dns_table[idx].state != DNS_ENTRY_PENDING) &&
+       (!stale) && (dns_table[idx].expires_timestamp < now)) {
+      DEBUGC(DBCLASS_DNS, "DNS lookup - cache entry expired: %s", hostname);
+      if (dns_table[idx].state == DNS_ENTRY_BAD) {
+         /* keep error count, resolve again */
+         dns_table[idx].state = DNS_ENTRY_PENDING;
+         dns_queue[(dns_queue_head+dns_queue_count) % dns_table_size] = idx;
+         dns_queue_count++;
+         pthread_cond_signal(&dns_job_cond);
+      } else {
+         dns_unlink(idx);
+         idx = -1;
+      }
+   }
+
+   /* not in cache: queue the lookup */
+   if (idx < 0) {
+      idx = dns_alloc(hostname, type, hash);
+      if (idx < 0) {
+         pthread_mutex_unlock(&dns_mutex);
+         ERROR("DNS lookup - cache full of pending lookups, %s", hostname);
+         return STS_FAILURE;
+      }
+      DEBUGC(DBCLASS_DNS, "DNS lookup - queued: %s", hostname);
+      dns_queue[(dns_queue_head+dns_queue_count) % dns_table_size] = idx;
+      dns_queue_count++;
+      pthread_cond_signal(&dns_job_cond);
+   }
+
+   dns_lru_touch(idx);
+
+   if (dns_table[idx].state == DNS_ENTRY_PENDING) {
+      dns_stats.misses++;
+   } else {
+      dns_stats.hits++;
+      dns_table[idx].hits++;
+   }
+
+   if (dns_table[idx].state == DNS_ENTRY_PENDING) {
+      if (dns_threads == 0) {
+         /* no resolver threads, do it myself (blocking) */
+         struct in_addr tmpaddr;
+         dns_srvset_t tmpsrv;
+         int result, ttl;
+         char tmphost[HOSTNAME_SIZE+1];
+
+         /* dequeue (it is the one just queued) */
+         dns_queue_count--;
+         strcpy(tmphost, dns_table[idx].hostname);
+         pthread_mutex_unlock(&dns_mutex);
+         result = dns_resolve_entry(tmphost, type, &tmpaddr, &tmpsrv, &ttl);
+         pthread_mutex_lock(&dns_mutex);
+         dns_store_result(idx, result, tmpaddr, &tmpsrv, ttl);
+
+      } else if (park_enabled) {
+         /* park the message until the answer has arrived */
+         DEBUGC(DBCLASS_DNS, "DNS lookup - pending, parking message: %s",
+                hostname);
+         dns_park_add_host(hostname, type);
+         pthread_mutex_unlock(&dns_mutex);
+         return STS_FAILURE;
+
+      } else {
+         /* wait for the resolver thread */
+         DEBUGC(DBCLASS_DNS, "DNS lookup - pending, waiting: %s", hostname);
+         while (dns_table[idx].state == DNS_ENTRY_PENDING) {
+            pthread_cond_wait(&dns_done_cond, &dns_mutex);
+         }
+      }
+   }
+
+   if (dns_table[idx].state == DNS_ENTRY_GOOD) {
+      if (addr) memcpy(addr, &dns_table[idx].addr, sizeof(struct in_addr));
+      if (srvset) {
+         if (dns_table[idx].srv) {
+            memcpy(srvset, dns_table[idx].srv, sizeof(dns_srvset_t));
+         } else {
+            srvset->count = 0;
+         }
+      }
+      sts = STS_SUCCESS;
+   } else {
+      DEBUGC(DBCLASS_DNS, "DNS lookup - negative from cache: %s", hostname);
+      sts = STS_FAILURE;
+   }
+
+   pthread_mutex_unlock(&dns_mutex);
+   return sts;
+}
+
+
+/*
+ * get a copy of the DNS cache statistics counters
+ */
+void dnscache_get_stats(dnscache_stats_t *stats) {
+   pthread_mutex_lock(&dns_mutex);
+   memcpy(stats, &dns_stats, sizeof(dnscache_stats_t));
+   pthread_mutex_unlock(&dns_mutex);
+}
+
+
+/*
+ * returns the file descriptor the SIP thread has to wait on
+ * (readable = a lookup has completed), -1 if none
+ */
+int dnscache_notify_fd(void) {
+   return dns_notify_pipe[0];
+}
+
+
+/*
+ * drain the notification pipe
+ */
+void dnscache_notify_clear(void) {
+   char dummy[64];
+   if (dns_notify_pipe[0] < 0) return;
+   while (read(dns_notify_pipe[0], dummy, sizeof(dummy)) > 0) {};
+}
+
+
+/*
+ * Start processing of a SIP message: from now on, DNS cache misses
+ * will park the message. (Unless it has been parked too often yet,
+ * then lookups are done blocking)
+ */
+void dnscache_park_begin(void) {
+   park_active = 0;
+   park_num_hosts = 0;
+   park_enabled = (dns_threads > 0) && (park_parkcount < DNS_PARK_MAXCOUNT);
+}
+
+
+/*
+ * is the current message parked? (no SIP output must be sent then)
+ *
+ * RETURNS
+ *	STS_TRUE if parked
+ *	STS_FALSE if not
+ */
+int dnscache_is_parked(void) {
+   return (park_active) ? STS_TRUE : STS_FALSE;
+}
+
+
+/*
+ * End of processing of a SIP message. If the message has been parked,
+ * a copy of the raw message is stored away to be processed again
+ * once the DNS lookups it waits for are done.
+ *
+ * RETURNS
+ *	STS_TRUE if the message has been parked
+ *	STS_FALSE if not
+ */
+int dnscache_park_end(sip_ticket_t *ticket) {
+   int i, j;
+
+   park_enabled = 0;
+   if (!park_active) return STS_FALSE;
+   park_active = 0;
+
+   /* find a free slot */
+   for (i=0; i<DNS_PARK_SIZE; i++) {
+      if (dns_parked[i].raw_buffer == NULL) break;
+   }
+   if (i >= DNS_PARK_SIZE) {
+      LIMIT_LOG_RATE(30) {
+         WARN("DNS park table full - dropping SIP message from %s",
+              utils_inet_ntoa(ticket->from.sin_addr));
+      }
+      return STS_TRUE;
+   }
+
+   dns_parked[i].raw_buffer = malloc(ticket->raw_buffer_len);
+   if (dns_parked[i].raw_buffer == NULL) {
+      ERROR("dnscache_park_end: out of memory");
+      return STS_TRUE;
+   }
+   memcpy(dns_parked[i].raw_buffer, ticket->raw_buffer,
+          ticket->raw_buffer_len);
+   dns_parked[i].raw_buffer_len = ticket->raw_buffer_len;
+   memcpy(&dns_parked[i].from, &ticket->from, sizeof(struct sockaddr_in));
+   dns_parked[i].protocol = ticket->protocol;
+   dns_parked[i].timestamp = ticket->timestamp;
+   dns_parked[i].parkcount = park_parkcount+1;
+   dns_parked[i].num_hosts = park_num_hosts;
+   for (j=0; j<park_num_hosts; j++) {
+      strcpy(dns_parked[i].hosts[j], park_hosts[j]);
+      dns_parked[i].types[j] = park_types[j];
+   }
+   dns_parked_count++;
+
+   DEBUGC(DBCLASS_DNS, "parked SIP message from %s in slot %i, "
+          "waiting for %i lookups", utils_inet_ntoa(ticket->from.sin_addr),
+          i, park_num_hosts);
+   return STS_TRUE;
+}
+
+
+/*
+ * fetch a parked SIP message that is ready to be processed again
+ * (all DNS lookups it was waiting for have completed)
+ *
+ * RETURNS number of bytes (0 if no parked message is ready)
+ *         buf, from and protocol are set like sipsock_waitfordata() does
+ */
+int dnscache_resume(char *buf, size_t bufsize,
+                    struct sockaddr_in *from, int *protocol) {
+   int i, j, idx;
+   int ready;
+   int length;
+   time_t now;
+
+   /* a message read from the network has never been parked */
+   park_parkcount = 0;
+   if (dns_parked_count == 0) return 0;
+
+   time(&now);
+   pthread_mutex_lock(&dns_mutex);
+   for (i=0; i<DNS_PARK_SIZE; i++) {
+      if (dns_parked[i].raw_buffer == NULL) continue;
+
+      /* waited too long, the UA has given up by now anyway */
+      if ((dns_parked[i].timestamp + DNS_PARK_TIMEOUT) < now) {
+         DEBUGC(DBCLASS_DNS, "parked SIP message in slot %i timed out", i);
+         free(dns_parked[i].raw_buffer);
+         dns_parked[i].raw_buffer = NULL;
+         dns_parked_count--;
+         continue;
+      }
+
+      ready=1;
+      for (j=0; j<dns_parked[i].num_hosts; j++) {
+         idx = dns_find(dns_parked[i].hosts[j], dns_parked[i].types[j],
+                        dns_hashfunc(dns_parked[i].hosts[j],
+                                     dns_parked[i].types[j]));
+         if ((idx >= 0) && (dns_table[idx].state == DNS_ENTRY_PENDING)) {
+            ready=0;
+            break;
+         }
+      }
+      if (!ready) continue;
+
+      /* hand it back to the SIP thread */
+      length = dns_parked[i].raw_buffer_len;
+      if (length > bufsize) length = bufsize;
+      memcpy(buf, dns_parked[i].raw_buffer, length);
+      memcpy(from, &dns_parked[i].from, sizeof(struct sockaddr_in));
+      *protocol = dns_parked[i].protocol;
+      park_parkcount = dns_parked[i].parkcount;
+
+      free(dns_parked[i].raw_buffer);
+      dns_parked[i].raw_buffer = NULL;
+      dns_parked_count--;
+      pthread_mutex_unlock(&dns_mutex);
+
+      DEBUGC(DBCLASS_DNS, "resuming parked SIP message from %s (slot %i)",
+             utils_inet_ntoa(from->sin_addr), i);
+      return length;
+   }
+   pthread_mutex_unlock(&dns_mutex);
+
+   return 0;
+}
+
+
+/*
+ * remember a hostname the current message is waiting for
+ * (called with dns_mutex held)
+ */
+static void dns_park_add_host(char *hostname, int type) {
+   int i;
+
+   park_active = 1;
+   for (i=0; i<park_num_hosts; i++) {
+      if ((park_types[i] == type) &&
+          (strcasecmp(park_hosts[i], hostname) == 0)) return;
+   }
+   /* if the list is full, the message will simply be parked again */
+   if (park_num_hosts >= DNS_PARK_HOSTS) return;
+   strncpy(park_hosts[park_num_hosts], hostname, HOSTNAME_SIZE);
+   park_hosts[park_num_hosts][HOSTNAME_SIZE]='\0';
+   park_types[park_num_hosts] = type;
+   park_num_hosts++;
+}
+
+
+/*
+ * main() of the resolver threads
+ */
+static void *dns_resolver_main(void *arg) {
+   int idx, type;
+   int result, ttl;
+   struct in_addr addr;
+   dns_srvset_t srvset;
+   char hostname[HOSTNAME_SIZE+1];
+
+   for (;;) {
+      pthread_mutex_lock(&dns_mutex);
+      while (dns_queue_count == 0) {
+         pthread_cond_wait(&dns_job_cond, &dns_mutex);
+      }
+      idx = dns_queue[dns_queue_head];
+      dns_queue_head = (dns_queue_head+1) % dns_table_size;
+      dns_queue_count--;
+      /* a PENDING or refreshing entry is never reused, so the hostname stays valid */
+      strcpy(hostname, dns_table[idx].hostname);
+      type = dns_table[idx].type;
+      pthread_mutex_unlock(&dns_mutex);
+
+      result = dns_resolve_entry(hostname, type, &addr, &srvset, &ttl);
+
+      pthread_mutex_lock(&dns_mutex);
+      dns_store_result(idx, result, addr, &srvset, ttl);
+      pthread_cond_broadcast(&dns_done_cond);
+      pthread_mutex_unlock(&dns_mutex);
+
+      /* wake up the SIP thread */
+      if (write(dns_notify_pipe[1], "", 1) < 0) {
+         /* pipe full - SIP thread will wake up anyway */
+      }
+   }
+
+   return NULL;
+}
+
+
+/*
+ * store the result of a lookup into the cache entry
+ * (called with dns_mutex held)
+ */
+static void dns_store_result(int idx, int result, struct in_addr addr,
+                             dns_srvset_t *srvset, int ttl) {
+   dns_entry_t *e = &dns_table[idx];
+   time_t now;
+
+   time(&now);
+
+   if (e->refreshing) {
+      e->refreshing = 0;
+      if ((e->state == DNS_ENTRY_GOOD) && (result == DNS_RES_FAILURE)) {
+         /* keep serving the old data, retry a bit later */
+         DEBUGC(DBCLASS_DNS, "DNS lookup - refresh of %s failed, "
+                "keeping old entry", e->hostname);
+         dns_stats.refresh_failures++;
+         e->retry_timestamp = now + DNS_MIN_TTL;
+         return;
+      }
+   }
+
+   if ((result == DNS_RES_GOOD) && (e->type != DNS_TYPE_A) &&
+       (srvset->count > 0)) {
+      if (e->srv == NULL) e->srv = malloc(sizeof(dns_srvset_t));
+      if (e->srv == NULL) {
+         ERROR("dns_store_result: out of memory");
+         result = DNS_RES_FAILURE;
+      } else {
+         memcpy(e->srv, srvset, sizeof(dns_srvset_t));
+      }
+   } else if (e->srv) {
+      free(e->srv);
+      e->srv = NULL;
+   }
+
+   e->ttl = ttl;
+   e->hits = 0;
+   e->retry_timestamp = 0;
+   if (result == DNS_RES_GOOD) {
+      e->state = DNS_ENTRY_GOOD;
+      e->addr = addr;
+      e->error_count = 0;
+      e->expires_timestamp = now + ttl;
+   } else {
+      e->state = DNS_ENTRY_BAD;
+      memset(&e->addr, 0, sizeof(e->addr));
+      if (result == DNS_RES_NEGATIVE) {
+         /* authoritative negative answer - cache for the SOA TTL */
+         e->expires_timestamp = now + ttl;
+      } else {
+         /* server failure: retry soon, blacklist after DNS_ATTEMPTS */
+         e->error_count++;
+         DEBUGC(DBCLASS_DNS, "DNS lookup - %s errcnt=%i", e->hostname,
+                e->error_count);
+         if (e->error_count >= DNS_ATTEMPTS) {
+            DEBUGC(DBCLASS_DNS, "DNS lookup - blacklisting entry %s",
+                   e->hostname);
+            e->expires_timestamp = now + configuration.dns_max_negative_ttl;
+         } else {
+            e->expires_timestamp = now + DNS_MIN_TTL;
+         }
+      }
+   }
+}
+
+
+/*
+ * resolve a cache entry of any type (blocking)
+ *
+ * RETURNS
+ *	DNS_RES_GOOD, DNS_RES_NEGATIVE or DNS_RES_FAILURE
+ */
+static int dns_resolve_entry(char *hostname, int type, struct in_addr *addr,
+                             dns_srvset_t *srvset, int *ttl) {
+   memset(addr, 0, sizeof(struct in_addr));
+   srvset->count = 0;
+
+   if (type == DNS_TYPE_A) {
+      return dns_resolve(hostname, addr, ttl);
+   }
+
+   if (resolve_SRV(hostname,
+                   (type == DNS_TYPE_SRV_TCP) ? PROTO_TCP : PROTO_UDP,
+                   srvset, ttl) != STS_SUCCESS) {
+      return DNS_RES_FAILURE;
+   }
+
+   /* no SRV is a valid answer, too (use the A record then) */
+   if (*ttl > configuration.dns_max_ttl) *ttl = configuration.dns_max_ttl;
+   if (*ttl < DNS_MIN_TTL) *ttl = DNS_MIN_TTL;
+   DEBUGC(DBCLASS_DNS, "DNS lookup - %i SIP servers for %s, ttl=%i",
+          srvset->count, hostname, *ttl);
+   return DNS_RES_GOOD;
+}
+
+
+/*
+ * resolve a hostname (blocking, called by the resolver threads)
+ *
+ * Uses a direct DNS query to learn the TTL of the records. Names
+ * that are not known to the DNS (e.g. from /etc/hosts) are resolved
+ * via gethostbyname() and cached for DNS_GOOD_AGE seconds.
+ *
+ * RETURNS
+ *	DNS_RES_GOOD, DNS_RES_NEGATIVE or DNS_RES_FAILURE
+ *	addr and ttl (cache lifetime of the result) are set
+ */
+static int dns_resolve(char *hostname, struct in_addr *addr, int *ttl) {
+   int sts=DNS_RES_FAILURE;
+   int negttl;
+   char tmp[INET_ADDRSTRLEN];
+
+   memset(addr, 0, sizeof(struct in_addr));
+   *ttl = DNS_GOOD_AGE;
+
+   /* single label names go straight to the system resolver */
+   if (strchr(hostname, '.') != NULL) {
+      sts = dns_query_a(hostname, addr, ttl);
+   }
+
+   if (sts != DNS_RES_GOOD) {
+      negttl = *ttl;
+      if (dns_gethostbyname(hostname, addr) == STS_SUCCESS) {
+         sts = DNS_RES_GOOD;
+         *ttl = DNS_GOOD_AGE;
+      } else if (sts == DNS_RES_NEGATIVE) {
+         *ttl = negttl;
+      }
+   }
+
+   /* limit the cache lifetime */
+   if (sts == DNS_RES_GOOD) {
+      if (*ttl > configuration.dns_max_ttl) *ttl = configuration.dns_max_ttl;
+      inet_ntop(AF_INET, addr, tmp, sizeof(tmp));
+      DEBUGC(DBCLASS_DNS, "DNS lookup - resolved: %s -> %s, ttl=%i",
+             hostname, tmp, *ttl);
+   } else if (sts == DNS_RES_NEGATIVE) {
+      if (*ttl > configuration.dns_max_negative_ttl) {
+         *ttl = configuration.dns_max_negative_ttl;
+      }
+      DEBUGC(DBCLASS_DNS, "DNS lookup - does not exist: %s, ttl=%i",
+             hostname, *ttl);
+   }
+   if (*ttl < DNS_MIN_TTL) *ttl = DNS_MIN_TTL;
+
+   return sts;
+}
+
+
+/*
+ * query the DNS for the A record of a hostname
+ *
+ * RETURNS
+ *	DNS_RES_GOOD:     addr is set, ttl is the lowest TTL of the answer
+ *	DNS_RES_NEGATIVE: ttl is the negative caching TTL (RFC2308, 5)
+ *	DNS_RES_FAILURE:  anything else
+ */
+static int dns_query_a(char *hostname, struct in_addr *addr, int *ttl) {
+   unsigned char query[NS_PACKETSZ];
+   unsigned char answer[4*NS_PACKETSZ];
+   int qlen, alen;
+   int i, count;
+   int found=0;
+   unsigned int minttl=UINT_MAX;
+   ns_msg msg;
+   ns_rr rr;
+
+   qlen = res_mkquery(ns_o_query, hostname, ns_c_in, ns_t_a, NULL, 0,
+                      NULL, query, sizeof(query));
+   if (qlen < 0) {
+      DEBUGC(DBCLASS_DNS, "res_mkquery(%s) failed", hostname);
+      return DNS_RES_FAILURE;
+   }
+
+   alen = res_send(query, qlen, answer, sizeof(answer));
+   if (alen < 0) {
+      DEBUGC(DBCLASS_DNS, "res_send(%s) failed", hostname);
+      return DNS_RES_FAILURE;
+   }
+
+   if (ns_initparse(answer, alen, &msg) < 0) {
+      DEBUGC(DBCLASS_DNS, "DNS answer for %s unparseable", hostname);
+      return DNS_RES_FAILURE;
+   }
+
+   switch (ns_msg_getflag(msg, ns_f_rcode)) {
+   case ns_r_noerror:
+      /* walk the answer section (CNAME chain and A records) */
+      count = ns_msg_count(msg, ns_s_an);
+      for (i=0; i<count; i++) {
+         if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) break;
+         if (ns_rr_ttl(rr) < minttl) minttl = ns_rr_ttl(rr);
+         if ((ns_rr_type(rr) == ns_t_a) && (ns_rr_rdlen(rr) == 4) &&
+             (found == 0)) {
+            memcpy(addr, ns_rr_rdata(rr), sizeof(struct in_addr));
+            found = 1;
+         }
+      }
+      if (found) {
+         *ttl = (minttl > INT_MAX) ? INT_MAX : (int)minttl;
+         return DNS_RES_GOOD;
+      }
+      /* no A record (NODATA) - is a negative answer, too */
+      /* fall through */
+   case ns_r_nxdomain:
+      /* RFC2308, 5: TTL of negative answer = min(SOA TTL, SOA MINIMUM) */
+      *ttl = DNS_BAD_AGE;
+      count = ns_msg_count(msg, ns_s_ns);
+      for (i=0; i<count; i++) {
+         if (ns_parserr(&msg, ns_s_ns, i, &rr) < 0) break;
+         if ((ns_rr_type(rr) == ns_t_soa) && (ns_rr_rdlen(rr) >= 20)) {
+            /* SOA MINIMUM is the last 32 bit of the RDATA */
+            unsigned int soamin = ns_get32(ns_rr_rdata(rr) +
+                                           ns_rr_rdlen(rr) - 4);
+            minttl = ns_rr_ttl(rr);
+            if (soamin < minttl) minttl = soamin;
+            *ttl = (minttl > INT_MAX) ? INT_MAX : (int)minttl;
+            break;
+         }
+      }
+      return DNS_RES_NEGATIVE;
+   default:
+      DEBUGC(DBCLASS_DNS, "DNS query for %s failed, rcode=%i", hostname,
+             ns_msg_getflag(msg, ns_f_rcode));
+      break;
+   }
+
+   return DNS_RES_FAILURE;
+}
+
+
+/*
+ * resolve via the system resolver (hosts file, NSS, ...)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on failure
+ */
+static int dns_gethostbyname(char *hostname, struct in_addr *addr) {
+   struct hostent *hostentry;
+#if defined(HAVE_GETHOSTBYNAME_R)
+   struct hostent result_buffer;
+   char tmp[GETHOSTBYNAME_BUFLEN];
+#endif
+   int error;
+
+   error = 0;
+
+   /* need to deal with reentrant versions of gethostbyname_r()
+    * as we may use threads... */
+#if defined(HAVE_GETHOSTBYNAME_R)
+
+   /* gethostbyname_r() with 3 arguments (e.g. osf/1) */
+   #if defined(HAVE_FUNC_GETHOSTBYNAME_R_3)
+   gethostbyname_r(hostname,		/* the FQDN */
+		   &result_buffer,	/* the result buffer */
+		   &hostentry
+		   );
+   if (hostentry == NULL) error = h_errno;
+
+   /* gethostbyname_r() with 5 arguments (e.g. solaris, linux libc5) */
+   #elif defined(HAVE_FUNC_GETHOSTBYNAME_R_5)
+   hostentry = gethostbyname_r(hostname,        /* the FQDN */
+			       &result_buffer,  /* the result buffer */
+			       tmp,
+			       GETHOSTBYNAME_BUFLEN,
+			       &error);
+
+   /* gethostbyname_r() with 6 arguments (e.g. linux glibc) */
+   #elif defined(HAVE_FUNC_GETHOSTBYNAME_R_6)
+   gethostbyname_r(hostname,        /* the FQDN */
+		   &result_buffer,  /* the result buffer */
+		   tmp,
+		   GETHOSTBYNAME_BUFLEN,
+		   &hostentry,
+		   &error);
+   #else
+      #error "gethostbyname_r() with 3, 5 or 6 arguments supported only"
+   #endif
+#elif defined(HAVE_GETHOSTBYNAME)
+   /* no reentrant version - only safe with a single resolver thread */
+   hostentry=gethostbyname(hostname);
+   if (hostentry == NULL) error = h_errno;
+#else
+   #error "need gethostbyname() or gethostbyname_r()"
+#endif
+   /* Here I have 'hostentry' and 'error' */
+
+   if (hostentry==NULL) {
+      /*
+       * Some errors just tell us that there was no IP resolvable.
+       * From the manpage:
+       *   HOST_NOT_FOUND
+       *      The specified host is unknown.
+       *   NO_ADDRESS or NO_DATA
+       *      The requested name is valid but does not have an IP
+       *      address.
+       */
+      if ((error == HOST_NOT_FOUND) ||
+          (error == NO_ADDRESS) ||
+          (error == NO_DATA)) {
+#ifdef HAVE_HSTRERROR
+         DEBUGC(DBCLASS_DNS, "gethostbyname(%s) failed: h_errno=%i [%s]",
+                hostname, error, hstrerror(error));
+#else
+         DEBUGC(DBCLASS_DNS, "gethostbyname(%s) failed: h_errno=%i",
+                hostname, error);
+#endif
+      } else {
+#ifdef HAVE_HSTRERROR
+         ERROR("gethostbyname(%s) failed: h_errno=%i [%s]",
+               hostname, error, hstrerror(error));
+#else
+         ERROR("gethostbyname(%s) failed: h_errno=%i",hostname, error);
+#endif
+      }
+      return STS_FAILURE;
+   }
+
+   memcpy(addr, hostentry->h_addr, sizeof(struct in_addr));
+   return STS_SUCCESS;
+}
+
+
+/*
+ * case insensitive hash of a hostname and entry type (FNV-1a)
+ */
+static unsigned int dns_hashfunc(char *hostname, int type) {
+   unsigned int hash=2166136261U;
+   unsigned char *p;
+
+   hash ^= (unsigned int)type;
+   hash *= 16777619U;
+
+   for (p=(unsigned char*)hostname; *p; p++) {
+      hash ^= (unsigned int)tolower(*p);
+      hash *= 16777619U;
+   }
+   return hash;
+}
+
+
+/*
+ * find a hostname in the cache
+ * (called with dns_mutex held)
+ *
+ * RETURNS index into dns_table, -1 if not found
+ */
+static int dns_find(char *hostname, int type, unsigned int hash) {
+   int idx;
+
+   for (idx=dns_hash[hash & dns_hash_mask]; idx >= 0;
+        idx=dns_table[idx].hnext) {
+      if ((dns_table[idx].hash == hash) && (dns_table[idx].type == type) &&
+          (strcasecmp(dns_table[idx].hostname, hostname) == 0)) {
+         return idx;
+      }
+   }
+   return -1;
+}
+
+
+/*
+ * allocate a new (PENDING) cache entry for hostname, victimizes the
+ * least recently used entry that is not PENDING if the cache is full.
+ * (called with dns_mutex held)
+ *
+ * RETURNS index into dns_table, -1 if no entry can be allocated
+ */
+static int dns_alloc(char *hostname, int type, unsigned int hash) {
+   int idx;
+   unsigned int bucket;
+
+   for (idx=dns_lru_tail; idx >= 0; idx=dns_table[idx].lru_prev) {
+      if ((dns_table[idx].state != DNS_ENTRY_PENDING) &&
+          (dns_table[idx].refreshing == 0)) break;
+   }
+   if (idx < 0) return -1;
+
+   if (dns_table[idx].state != DNS_ENTRY_FREE) {
+      DEBUGC(DBCLASS_DNS, "DNS cache - victimizing entry %i [%s]", idx,
+             dns_table[idx].hostname);
+      dns_unlink(idx);
+   }
+
+   strncpy(dns_table[idx].hostname, hostname, HOSTNAME_SIZE);
+   dns_table[idx].hostname[HOSTNAME_SIZE]='\0';
+   dns_table[idx].hash = hash;
+   dns_table[idx].type = type;
+   dns_table[idx].state = DNS_ENTRY_PENDING;
+   dns_table[idx].error_count = 0;
+   dns_table[idx].expires_timestamp = 0;
+   dns_table[idx].ttl = 0;
+   dns_table[idx].hits = 0;
+   dns_table[idx].refreshing = 0;
+   dns_table[idx].retry_timestamp = 0;
+
+   bucket = hash & dns_hash_mask;
+   dns_table[idx].hnext = dns_hash[bucket];
+   dns_hash[bucket] = idx;
+
+   return idx;
+}
+
+
+/*
+ * remove an entry from its hash chain and mark it free. Free entries
+ * are kept at the tail of the LRU list, so dns_alloc() takes them
+ * before it victimizes a live entry.
+ * (called with dns_mutex held)
+ */
+static void dns_unlink(int idx) {
+   int *pp;
+
+   for (pp=&dns_hash[dns_table[idx].hash & dns_hash_mask]; *pp >= 0;
+        pp=&dns_table[*pp].hnext) {
+      if (*pp == idx) {
+         *pp = dns_table[idx].hnext;
+         break;
+      }
+   }
+   dns_table[idx].hnext = -1;
+   dns_table[idx].state = DNS_ENTRY_FREE;
+   dns_table[idx].hostname[0] = '\0';
+   if (dns_table[idx].srv) {
+      free(dns_table[idx].srv);
+      dns_table[idx].srv = NULL;
+   }
+   dns_lru_retire(idx);
+}
+
+
+/*
+ * move an entry to the head of the LRU list
+ * (called with dns_mutex held)
+ */
+static void dns_lru_touch(int idx) {
+   dns_entry_t *e = &dns_table[idx];
+
+   if (dns_lru_head == idx) return;
+
+   /* unlink */
+   if (e->lru_prev >= 0) dns_table[e->lru_prev].lru_next = e->lru_next;
+   if (e->lru_next >= 0) dns_table[e->lru_next].lru_prev = e->lru_prev;
+   if (dns_lru_tail == idx) dns_lru_tail = e->lru_prev;
+
+   /* insert at head */
+   e->lru_prev = -1;
+   e->lru_next = dns_lru_head;
+   if (dns_lru_head >= 0) dns_table[dns_lru_head].lru_prev = idx;
+   dns_lru_head = idx;
+   if (dns_lru_tail < 0) dns_lru_tail = idx;
+}
+
+
+/*
+ * move an entry to the tail of the LRU list (next to be reused)
+ * (called with dns_mutex held)
+ */
+static void dns_lru_retire(int idx) {
+   dns_entry_t *e = &dns_table[idx];
+
+   if (dns_lru_tail == idx) return;
+
+   /* unlink */
+   if (e->lru_prev >= 0) dns_table[e->lru_prev].lru_next = e->lru_next;
+   if (e->lru_next >= 0) dns_table[e->lru_next].lru_prev = e->lru_prev;
+   if (dns_lru_head == idx) dns_lru_head = e->lru_next;
+
+   /* insert at tail */
+   e->lru_next = -1;
+   e->lru_prev = dns_lru_tail;
+   if (dns_lru_tail >= 0) dns_table[dns_lru_tail].lru_next = idx;
+   dns_lru_tail = idx;
+   if (dns_lru_head < 0) dns_lru_head = idx;
+}
+
+
+/*
+ * queue a background refresh of a (still valid) entry
+ * (called with dns_mutex held)
+ */
+static void dns_refresh(int idx, time_t now) {
+   dns_entry_t *e = &dns_table[idx];
+
+   if (e->refreshing || (e->retry_timestamp > now)) return;
+
+   DEBUGC(DBCLASS_DNS, "DNS lookup - refreshing: %s", e->hostname);
+   e->refreshing = 1;
+   dns_stats.refreshes++;
+   dns_queue[(dns_queue_head+dns_queue_count) % dns_table_size] = idx;
+   dns_queue_count++;
+   pthread_cond_signal(&dns_job_cond);
+}
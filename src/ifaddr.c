@@ -0,0 +1,347 @@
+/*
+    Copyright (C) 2002-2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#if defined(HAVE_LINUX_RTNETLINK_H) && defined(HAVE_GETIFADDRS)
+# include <ifaddrs.h>
+# include <linux/netlink.h>
+# include <linux/rtnetlink.h>
+# define USE_NETLINK 1
+#endif
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/*
+ * Interface address table, kept up to date by rtnetlink events.
+ *
+ * A watcher thread subscribes to address and link changes and
+ * rebuilds the table whenever the kernel reports a change. The
+ * table is published by swapping a pointer, readers (SIP thread,
+ * RTP thread) never take a lock. A replaced table is freed only
+ * after IFADDR_GRACE seconds - no reader holds on to it that long.
+ *
+ * Without rtnetlink (non-Linux), get_ip_by_ifname() keeps using its
+ * own polling cache.
+ */
+
+#define IFADDR_GRACE		5	/* free replaced tables after (sec) */
+#define IFADDR_RETIRED		16	/* max replaced tables waiting */
+
+typedef struct {
+   int count;
+   struct {
+      char ifname[IFNAME_SIZE+1];
+      struct in_addr ifaddr;		/* first IPv4 address */
+      int isup;				/* interface is UP */
+   } entry[IFADR_CACHE_SIZE];
+} ifaddr_table_t;
+
+/* the current table, NULL if netlink is not in use */
+static ifaddr_table_t *ifaddr_current=NULL;
+
+#ifdef USE_NETLINK
+/* replaced tables, waiting to be freed (watcher thread only) */
+static struct {
+   ifaddr_table_t *table;
+   time_t retired;
+} ifaddr_retired[IFADDR_RETIRED];
+
+static int ifaddr_nlsock=-1;
+
+/* local prototypes */
+static void *ifaddr_watcher_main(void *arg);
+static ifaddr_table_t *ifaddr_build(void);
+static void ifaddr_publish(ifaddr_table_t *table);
+#endif
+
+
+/*
+ * open the rtnetlink socket, read the initial interface addresses
+ * and start the watcher thread.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if not available (polling will be used)
+ */
+int ifaddr_init(void) {
+#ifdef USE_NETLINK
+   struct sockaddr_nl sa;
+   ifaddr_table_t *table;
+   pthread_attr_t attr;
+   pthread_t tid;
+   sigset_t sigset, oldset;
+   int sts;
+
+   ifaddr_nlsock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+   if (ifaddr_nlsock < 0) {
+      WARN("ifaddr_init: netlink socket failed: %s - polling interface "
+           "addresses", strerror(errno));
+      return STS_FAILURE;
+   }
+
+   memset(&sa, 0, sizeof(sa));
+   sa.nl_family = AF_NETLINK;
+   sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+   if (bind(ifaddr_nlsock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+      WARN("ifaddr_init: netlink bind failed: %s - polling interface "
+           "addresses", strerror(errno));
+      close(ifaddr_nlsock);
+      ifaddr_nlsock = -1;
+      return STS_FAILURE;
+   }
+
+   /* initial table (subscribed first - no change is lost) */
+   table = ifaddr_build();
+   if (table == NULL) {
+      close(ifaddr_nlsock);
+      ifaddr_nlsock = -1;
+      return STS_FAILURE;
+   }
+   memset(ifaddr_retired, 0, sizeof(ifaddr_retired));
+   __atomic_store_n(&ifaddr_current, table, __ATOMIC_RELEASE);
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   if (configuration.thread_stack_size > 0) {
+      pthread_attr_setstacksize(&attr, configuration.thread_stack_size*1024);
+   }
+
+   /* the watcher thread must not catch any signals */
+   sigfillset(&sigset);
+   pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+   sts = pthread_create(&tid, &attr, ifaddr_watcher_main, NULL);
+   pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+   pthread_attr_destroy(&attr);
+
+   if (sts != 0) {
+      ERROR("ifaddr_init: pthread_create() failed: %s", strerror(sts));
+      /* no readers yet (startup), fall back to polling */
+      __atomic_store_n(&ifaddr_current, NULL, __ATOMIC_RELEASE);
+      free(table);
+      close(ifaddr_nlsock);
+      ifaddr_nlsock = -1;
+      return STS_FAILURE;
+   }
+
+   INFO("watching interface addresses via netlink (%i interfaces)",
+        table->count);
+   return STS_SUCCESS;
+#else
+   DEBUGC(DBCLASS_DNS, "no netlink support - polling interface addresses");
+   return STS_FAILURE;
+#endif
+}
+
+
+/*
+ * look up an interface in the netlink maintained table (lock free)
+ *
+ * RETURNS
+ *	STS_SUCCESS on returning a valid IP and interface is UP
+ *	STS_FAILURE if interface is DOWN or unknown
+ *	-1 if no table is maintained (use polling)
+ */
+int ifaddr_lookup(char *ifname, struct in_addr *retaddr) {
+   ifaddr_table_t *table;
+   int i;
+
+   table = __atomic_load_n(&ifaddr_current, __ATOMIC_ACQUIRE);
+   if (table == NULL) return -1;
+
+   for (i=0; i<table->count; i++) {
+      if (strcmp(ifname, table->entry[i].ifname) == 0) {
+         if (retaddr) memcpy(retaddr, &table->entry[i].ifaddr,
+                             sizeof(struct in_addr));
+         DEBUGC(DBCLASS_BABBLE, "ifaddr lookup: %s -> %s %s", ifname,
+                utils_inet_ntoa(table->entry[i].ifaddr),
+                (table->entry[i].isup)? "UP":"DOWN");
+         return (table->entry[i].isup)? STS_SUCCESS: STS_FAILURE;
+      }
+   }
+
+   DEBUGC(DBCLASS_DNS, "Interface %s not found.", ifname);
+   return STS_FAILURE;
+}
+
+
+#ifdef USE_NETLINK
+/*
+ * main() of the watcher thread: wait for netlink messages and
+ * rebuild the table on any address or link change
+ */
+static void *ifaddr_watcher_main(void *arg) {
+   char buf[8192];
+   struct nlmsghdr *nh;
+   int len;
+   int changed;
+   ifaddr_table_t *table;
+
+   for (;;) {
+      len = recv(ifaddr_nlsock, buf, sizeof(buf), 0);
+      if (len < 0) {
+         if (errno == EINTR) continue;
+         if (errno != ENOBUFS) {
+            ERROR("ifaddr watcher: recv failed: %s", strerror(errno));
+            sleep(1);
+            continue;
+         }
+         /* overrun - events lost, just rebuild */
+         changed = 1;
+      } else {
+         changed = 0;
+         for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+              nh = NLMSG_NEXT(nh, len)) {
+            switch (nh->nlmsg_type) {
+            case RTM_NEWADDR:
+            case RTM_DELADDR:
+            case RTM_NEWLINK:
+            case RTM_DELLINK:
+               changed = 1;
+               break;
+            default:
+               break;
+            }
+         }
+      }
+      if (!changed) continue;
+
+      /* a change usually comes as a burst of events, swallow them */
+      while (recv(ifaddr_nlsock, buf, sizeof(buf), MSG_DONTWAIT) > 0) {};
+
+      table = ifaddr_build();
+      if (table) ifaddr_publish(table);
+   }
+
+   return NULL;
+}
+
+
+/*
+ * read all IPv4 interface addresses
+ *
+ * RETURNS a new table (malloc'ed), NULL on error
+ */
+static ifaddr_table_t *ifaddr_build(void) {
+   struct ifaddrs *ifa;
+   struct ifaddrs *ifa_list;
+   ifaddr_table_t *table;
+   int i;
+
+   table = malloc(sizeof(ifaddr_table_t));
+   if (table == NULL) {
+      ERROR("ifaddr_build: out of memory");
+      return NULL;
+   }
+   memset(table, 0, sizeof(ifaddr_table_t));
+
+   if (getifaddrs(&ifa_list)) {
+      ERROR("Error in getifaddrs: %s",strerror(errno));
+      free(table);
+      return NULL;
+   }
+
+   for (ifa = ifa_list; ifa != NULL; ifa = ifa->ifa_next) {
+      if ((ifa->ifa_name == NULL) || (ifa->ifa_addr == NULL) ||
+          (ifa->ifa_addr->sa_family != AF_INET)) continue;
+
+      /* first address of an interface only */
+      for (i=0; i<table->count; i++) {
+         if (strcmp(table->entry[i].ifname, ifa->ifa_name) == 0) break;
+      }
+      if (i < table->count) continue;
+
+      if (table->count >= IFADR_CACHE_SIZE) {
+         WARN("ifaddr_build: more than %i interfaces, ignoring %s",
+              IFADR_CACHE_SIZE, ifa->ifa_name);
+         continue;
+      }
+
+      i = table->count++;
+      strncpy(table->entry[i].ifname, ifa->ifa_name, IFNAME_SIZE);
+      table->entry[i].ifname[IFNAME_SIZE]='\0';
+      memcpy(&table->entry[i].ifaddr,
+             &((struct sockaddr_in*)ifa->ifa_addr)->sin_addr,
+             sizeof(struct in_addr));
+      table->entry[i].isup = (ifa->ifa_flags & IFF_UP)? 1 : 0;
+
+      DEBUGC(DBCLASS_DNS, "ifaddr: if %s has IP:%s (flags=%x) %s",
+             table->entry[i].ifname, utils_inet_ntoa(table->entry[i].ifaddr),
+             ifa->ifa_flags, (table->entry[i].isup)? "UP":"DOWN");
+   }
+   freeifaddrs(ifa_list);
+
+   return table;
+}
+
+
+/*
+ * make a new table the current one, retire the old one
+ * (watcher thread only)
+ */
+static void ifaddr_publish(ifaddr_table_t *table) {
+   ifaddr_table_t *old;
+   time_t now;
+   int i, slot;
+
+   old = __atomic_exchange_n(&ifaddr_current, table, __ATOMIC_ACQ_REL);
+   if (old == NULL) return;
+
+   for (;;) {
+      time(&now);
+      slot = -1;
+      for (i=0; i<IFADDR_RETIRED; i++) {
+         /* free tables nobody can be using any more */
+         if (ifaddr_retired[i].table &&
+             (ifaddr_retired[i].retired + IFADDR_GRACE < now)) {
+            free(ifaddr_retired[i].table);
+            ifaddr_retired[i].table = NULL;
+         }
+         if ((slot < 0) && (ifaddr_retired[i].table == NULL)) slot = i;
+      }
+      if (slot >= 0) break;
+      /* interface storm - wait for the grace period to pass */
+      sleep(1);
+   }
+
+   ifaddr_retired[slot].table = old;
+   ifaddr_retired[slot].retired = now;
+}
+#endif
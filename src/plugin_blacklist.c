@@ -25,6 +25,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sqlite3.h>
 
 #include <sys/types.h>
@@ -61,6 +64,9 @@ static struct plugin_config {
    int  duration;	/* in seconds, 0: forever, dont' expire */ 
    int  hitcount;	/* required attempts until blocked */ 
    int  register_window;/* time window for REGISTER reesponse to arrive */ 
+   int  flush_interval;	/* write changes to the DB every n seconds */
+   int  expire_interval;/* run the expiry every n seconds */
+   int  expire_batch;	/* records checked per step of the expiry */
 } plugin_cfg;
 
 /* Instructions for config parser */
@@ -72,6 +78,9 @@ static cfgopts_t plugin_cfg_opts[] = {
    { "plugin_blacklist_duration",	TYP_INT4,   &plugin_cfg.duration,	{3600, NULL} },
    { "plugin_blacklist_hitcount",	TYP_INT4,   &plugin_cfg.hitcount,	{10, NULL} },
    { "plugin_blacklist_register_window", TYP_INT4,  &plugin_cfg.register_window, {30, NULL} },
+   { "plugin_blacklist_flush_interval",	TYP_INT4,   &plugin_cfg.flush_interval,	{5, NULL} },
+   { "plugin_blacklist_expire_interval", TYP_INT4,  &plugin_cfg.expire_interval, {60, NULL} },
+   { "plugin_blacklist_expire_batch",	TYP_INT4,   &plugin_cfg.expire_batch,	{500, NULL} },
    {0, 0, 0}
 };
 
@@ -86,36 +95,33 @@ typedef struct {
 } sql_statement_t;
 
 static sql_statement_t sql_statement[] = {
-   /* blacklist_check() */
-   {  0, NULL, "SELECT count(*) from blacklist WHERE ip=?001 and sipuri=?002 AND (type=1 or failcount>?003);" },
-   {  1, NULL, "UPDATE OR IGNORE blacklist SET lastseen=?003 WHERE ip=?001 and sipuri=?002;" },
-   {  2, NULL, "UPDATE OR IGNORE requests SET timestamp=?001, callid=?004 WHERE ip=?002 AND sipuri=?003;" },
-   {  3, NULL, "INSERT OR IGNORE INTO requests (timestamp, ip, sipuri, callid) VALUES (?001, ?002, ?003, ?004);" },
-   /* blacklist_update() */
-   {  4, NULL, "DELETE FROM requests WHERE timestamp<?001;" },
-   {  5, NULL, "SELECT count(*) from requests WHERE ip=?001 and sipuri=?002 AND callid=?003;" },
-   {  6, NULL, "INSERT OR IGNORE INTO blacklist (ip, sipuri) VALUES (?001, ?002);" },
-   {  7, NULL, "UPDATE OR IGNORE blacklist SET failcount=failcount+1, lastseen=?003, lastfail=?003 WHERE type=0 and ip=?001 and sipuri=?002;" },
-   {  8, NULL, "UPDATE OR IGNORE blacklist SET lastseen=?003 WHERE ip=?001 and sipuri=?002;" },
-   {  9, NULL, "UPDATE OR IGNORE blacklist SET failcount=0, lastseen=?003 WHERE type=0 and ip=?001 and sipuri=?002;" },
-   /* blacklist_expire() */
-   { 10, NULL, "UPDATE OR IGNORE blacklist SET failcount=0 WHERE type=0 and failcount>?001 and lastseen<?002;" },
-   { 11, NULL, "DELETE FROM blacklist WHERE type=0 AND failcount=0 AND lastseen<?001;" },
+   /* bl_load() */
+   {  0, NULL, "SELECT rowid, type, ip, sipuri, failcount, lastfail, lastseen FROM blacklist WHERE rowid>?001 ORDER BY rowid;" },
+   /* bl_flush() */
+   {  1, NULL, "INSERT OR IGNORE INTO blacklist (ip, sipuri) VALUES (?001, ?002);" },
+   {  2, NULL, "UPDATE OR IGNORE blacklist SET failcount=?003, lastfail=?004, lastseen=?005 WHERE ip=?001 and sipuri=?002;" },
+   {  3, NULL, "DELETE FROM blacklist WHERE type=0 AND ip=?001 AND sipuri=?002;" },
+   /* bl_expire_query(), ?002/?003: continue after (lastseen, rowid) */
+   {  4, NULL, "SELECT rowid, ip, sipuri, failcount, lastfail, lastseen FROM blacklist WHERE lastseen>=?002 AND lastseen<?001 AND NOT (lastseen=?002 AND rowid<=?003) AND type=0 AND failcount>?005 ORDER BY lastseen, rowid LIMIT ?004;" },
+   {  5, NULL, "SELECT rowid, ip, sipuri, failcount, lastfail, lastseen FROM blacklist WHERE lastseen>=?002 AND lastseen<?001 AND NOT (lastseen=?002 AND rowid<=?003) AND type=0 AND failcount=0 ORDER BY lastseen, rowid LIMIT ?004;" },
+   /* outstanding REGISTER requests */
+   {  6, NULL, "SELECT ip, sipuri, callid, timestamp FROM requests WHERE timestamp>=?001 ORDER BY timestamp;" },
+   {  7, NULL, "UPDATE OR IGNORE requests SET timestamp=?001, callid=?004 WHERE ip=?002 AND sipuri=?003;" },
+   {  8, NULL, "INSERT OR IGNORE INTO requests (timestamp, ip, sipuri, callid) VALUES (?001, ?002, ?003, ?004);" },
+   {  9, NULL, "DELETE FROM requests WHERE timestamp<?001;" },
 };
-#define SQL_CHECK_1	0
-#define SQL_CHECK_2	1
-#define SQL_CHECK_3	2
-#define SQL_CHECK_4	3
+#define SQL_LOAD	0	/* read records (all at startup, later new ones) */
+#define SQL_WRITE_1	1	/* insert new blacklist record to DB */
+#define SQL_WRITE_2	2	/* write counters and timestamps */
+#define SQL_WRITE_3	3	/* remove expired record */
 
-#define SQL_UPDATE_1	4	/* expire old request records */
-#define SQL_UPDATE_2	5	/* check if REGISTER response matches a know record */
-#define SQL_UPDATE_3	6	/* insert new blacklist record to DB */
-#define SQL_UPDATE_4	7	/* increment failcount */
-#define SQL_UPDATE_5	8	/* just update lastseen */
-#define SQL_UPDATE_6	9	/* reset failcount upon successful registration */
+#define SQL_EXPIRE_1	4	/* candidates for failcount reset (duration) */
+#define SQL_EXPIRE_2	5	/* candidates for removal */
 
-#define SQL_EXPIRE_1	10	/* reset failcount upon duration timeout */
-#define SQL_EXPIRE_2	11	/* cleanup blacklist table */
+#define SQL_REQ_LOAD	6	/* read outstanding REGISTERs (startup) */
+#define SQL_REQ_WRITE_1	7	/* update outstanding REGISTER */
+#define SQL_REQ_WRITE_2	8	/* insert outstanding REGISTER */
+#define SQL_REQ_EXPIRE	9	/* forget REGISTERs without response */
 
 /* string magic in C preprocessor */
 #define xstr(s) str(s)
@@ -140,6 +146,8 @@ static sql_statement_t sql_statement[] = {
 		"lastseen INTEGER DEFAULT 0, "\
 		"CONSTRAINT unique_src UNIQUE (ip, sipuri) " \
 	    ");" \
+	"CREATE INDEX IF NOT EXISTS "\
+	    "blacklist_lastseen ON blacklist (lastseen);" \
 	"CREATE TABLE IF NOT EXISTS "\
 	    "requests ( "\
 		"timestamp INTEGER DEFAULT 0, "\
@@ -158,23 +166,116 @@ blacklist
     - failcount	count of failed attempts
     - lastfail	UNIX timestamp of last failure activity (last failed auth)
     - lastseen	UNIX timestamp of last activity
-requests
-    - timestamp	timestamp of outgoing REGISTER request
+requests	outstanding REGISTER requests (one per ip, sipuri)
+    - timestamp	UNIX timestamp of the request
     - ip	IP address of source (xxx.xxx.xxx.xxx)
     - sipuri	SIP authentication username
-    - callid	SIP CallID of REGISTER request
+    - callid	Call-Id of the request (empty if it had no Authorization)
 */
 
+/*
+ * In-memory blacklist
+ *
+ * All records of the blacklist table are held in a hash table
+ * (ip, sipuri) and the SIP thread does only work on this table.
+ * Changed records are put on a dirty list and written to the DB
+ * by a background thread every flush_interval seconds, so the DB
+ * is the persistent storage only. Records that are inserted into
+ * the DB manually (type=1) while siproxd is running are picked up
+ * by the background thread as well.
+ *
+ * Outstanding REGISTER requests (to match the responses) are kept
+ * in the same table and on a list in the order they were received.
+ * They are written to the requests table by the background thread
+ * as well (batched like the blacklist records) and read back at
+ * startup, so responses still match after a restart.
+ *
+ * The expiry runs in the background thread too, every expire_interval
+ * seconds. The candidates are read from the DB ordered by lastseen
+ * (index blacklist_lastseen), expire_batch records at a time, and
+ * checked against the in-memory state one batch at a time.
+ *
+ * Two counting Bloom filters hold the IPs and the (ip, sipuri) pairs
+ * of all records in the blacklist. Requests from an IP without any
+ * record (by far the most) are passed after a probe of the IP filter,
+ * without building the From URI string.
+ */
+#define BL_HASH_SIZE	65536	/* hash buckets, power of 2 */
+#define BL_BLOOM_MIN	16384	/* initial Bloom filter capacity */
+
+typedef struct bl_entry_s {
+   struct bl_entry_s *next;		/* hash chain */
+   struct bl_entry_s *dirty_next;	/* list of records to write */
+   struct bl_entry_s *req_prev;		/* list of outstanding REGISTERs */
+   struct bl_entry_s *req_next;
+   unsigned int hash;
+   struct in_addr ip;
+   char *sipuri;
+   int listed;		/* has a record in the blacklist table */
+   int dirty;		/* BL_DIRTY_*, != 0: is on the dirty list */
+   int type;		/* fields of the blacklist table */
+   int failcount;
+   time_t lastfail;
+   time_t lastseen;
+   time_t req_timestamp;	/* outstanding REGISTER, 0: none */
+   char *req_callid;		/* != NULL: is on the REGISTER list */
+} bl_entry_t;
+
+#define BL_DIRTY_RECORD		1	/* blacklist record changed */
+#define BL_DIRTY_REQUEST	2	/* outstanding REGISTER changed */
+
+/* copy of a dirty record, written outside of the lock */
+typedef struct {
+   struct in_addr ip;
+   char *sipuri;
+   int dirty;
+   int listed;
+   int failcount;
+   time_t lastfail;
+   time_t lastseen;
+   time_t req_timestamp;
+   char *req_callid;		/* NULL: no REGISTER to write */
+} bl_record_t;
+
+static bl_entry_t **bl_table=NULL;
+static bl_entry_t *bl_dirty_list=NULL;
+static bl_entry_t *bl_req_head=NULL;	/* oldest outstanding REGISTER */
+static bl_entry_t *bl_req_tail=NULL;
+static bloom_t *bl_bloom_ip=NULL;	/* IPs with a blacklist record */
+static bloom_t *bl_bloom_pair=NULL;	/* (ip, sipuri) with a record */
+static sqlite_int64 bl_maxrowid=0;	/* highest rowid loaded from DB */
+
+/* protects the hash table and the dirty list */
+static pthread_mutex_t bl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  bl_writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t bl_writer_tid;
+static int bl_writer_stop=0;
+
 
 /* local prototypes */
 static int blacklist_check(sip_ticket_t *ticket);
 static int blacklist_update(sip_ticket_t *ticket);
-static int blacklist_expire(sip_ticket_t *ticket);
+static int blacklist_expire(void);
+static int bl_expire_query(int query, time_t before);
+static void bl_expire_requests(time_t now);
+static void bl_hash(struct in_addr ip, char *sipuri, unsigned char *hash);
+static bl_entry_t *bl_lookup(struct in_addr ip, char *sipuri,
+                             unsigned char *hash, int create);
+static void bl_set_dirty(bl_entry_t *entry, int what);
+static void bl_set_listed(bl_entry_t *entry, int listed);
+static int bl_bloom_rebuild(void);
+static void bl_unlink(bl_entry_t *entry);
+static void bl_req_append(bl_entry_t *entry);
+static void bl_req_remove(bl_entry_t *entry);
+static void bl_free_entry(bl_entry_t *entry);
+static int bl_load(int manual_only);
+static int bl_load_requests(time_t since);
+static int bl_flush(void);
+static void *bl_writer_main(void *arg);
 /* helpers */
 static int sqlite_begin(void);
 static int sqlite_end(void);
 static int sqlite_exec_stmt_none(sql_statement_t *sql_statement);
-static int sqlite_exec_stmt_int(sql_statement_t *sql_statement, int *retval);
 static int sqlite_begin_transaction(void);
 static int sqlite_end_transaction(void);
 
@@ -184,6 +285,9 @@ static int sqlite_end_transaction(void);
  * Called once suring siproxd startup.
  */
 int  PLUGIN_INIT(plugin_def_t *plugin_def) {
+   sigset_t sigset, oldset;
+   int sts;
+
    /* API version number of siproxd that this plugin is built against.
     * This constant will change whenever changes to the API are made
     * that require adaptions in the plugin. */
@@ -195,7 +299,9 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
 
    /* Execution mask - during what stages of SIP processing shall
     * the plugin be called. */
-   plugin_def->exe_mask=PLUGIN_VALIDATE | PLUGIN_POST_PROXY | PLUGIN_TIMER;
+   plugin_def->exe_mask=PLUGIN_VALIDATE | PLUGIN_POST_PROXY;
+   /* shared tables are protected by bl_mutex */
+   plugin_def->mt_level=PLUGIN_MT_SAFE;
 
    /* read the config file */
    if (read_config(configuration.configfile,
@@ -205,10 +311,48 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
       return STS_FAILURE;
    }
 
+   if (plugin_cfg.flush_interval < 1) plugin_cfg.flush_interval=1;
+   if (plugin_cfg.expire_interval < 1) plugin_cfg.expire_interval=1;
+   if (plugin_cfg.expire_batch < 1) plugin_cfg.expire_batch=1;
+
+   bl_table=calloc(BL_HASH_SIZE, sizeof(bl_entry_t *));
+   bl_bloom_ip=bloom_new(BL_BLOOM_MIN);
+   bl_bloom_pair=bloom_new(BL_BLOOM_MIN);
+   if ((bl_table == NULL) || (bl_bloom_ip == NULL) || (bl_bloom_pair == NULL)) {
+      ERROR("Plugin '%s': out of memory", name);
+      return STS_FAILURE;
+   }
+
    if (sqlite_begin() != STS_SUCCESS) {
       return STS_FAILURE;
    }
 
+   /* read the blacklist table into memory */
+   if ((bl_load(0) != STS_SUCCESS) ||
+       (bl_load_requests(time(NULL)-plugin_cfg.register_window) != STS_SUCCESS)) {
+      sqlite_end();
+      return STS_FAILURE;
+   }
+   if ((bloom_saturated(bl_bloom_ip) == STS_TRUE) ||
+       (bloom_saturated(bl_bloom_pair) == STS_TRUE)) {
+      bl_bloom_rebuild();
+   }
+
+   /* background thread writing the changes to the DB, must not
+      catch any signals */
+   sigfillset(&sigset);
+   pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+   sts=pthread_create(&bl_writer_tid, NULL, bl_writer_main, NULL);
+   pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+   if (sts != 0) {
+      ERROR("Plugin '%s': pthread_create() failed: %s", name, strerror(sts));
+      sqlite_end();
+      return STS_FAILURE;
+   }
+
+   /* the Authorization header is evaluated (lazy parsing) */
+   sip_want_header("Authorization");
+
    INFO("plugin_blacklist is initialized (sqlite version %s)", sqlite3_libversion());
    return STS_SUCCESS;
 }
@@ -241,13 +385,6 @@ int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
               && MSG_IS_RESPONSE(ticket->sipmsg)
               && MSG_IS_RESPONSE_FOR(ticket->sipmsg, "REGISTER")) {
       sts = blacklist_update(ticket);
-   } else if ((stage == PLUGIN_TIMER)) {
-      static int count=0;
-      /*&&&TODO: hmmm, still hardcoded... will be executed once per minute */
-      if (++count >= 12) {
-         count=0;
-         sts = blacklist_expire(ticket);
-      }
    }
 
    return STS_SUCCESS;
@@ -261,9 +398,30 @@ int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
  */
 int  PLUGIN_END(plugin_def_t *plugin_def){
    int sts;
+   int i;
+   bl_entry_t *entry;
+
+   /* stop the background thread, it writes the pending changes */
+   pthread_mutex_lock(&bl_mutex);
+   bl_writer_stop=1;
+   pthread_cond_signal(&bl_writer_cond);
+   pthread_mutex_unlock(&bl_mutex);
+   pthread_join(bl_writer_tid, NULL);
 
    sts = sqlite_end();
 
+   for (i=0; i < BL_HASH_SIZE; i++) {
+      while ((entry=bl_table[i]) != NULL) {
+         bl_table[i]=entry->next;
+         bl_free_entry(entry);
+      }
+   }
+   free(bl_table);
+   bl_table=NULL;
+   bloom_free(bl_bloom_ip);
+   bloom_free(bl_bloom_pair);
+   bl_bloom_ip=bl_bloom_pair=NULL;
+
    INFO("plugin_blacklist ends here, sts=%i", sts);
    return STS_SUCCESS;
 }
@@ -271,18 +429,32 @@ int  PLUGIN_END(plugin_def_t *plugin_def){
 /*--------------------------------------------------------------------*/
 /* private plugin code */
 static int blacklist_check(sip_ticket_t *ticket) {
-   int sts;
    int retval=0;
-   sql_statement_t *sql_stmt = NULL;
    char *srcip=NULL;	/* IP address from UAC issuing the REGSITER */
    osip_uri_t *from_url = NULL;
    char *from=NULL;
    char *call_id=ticket->sipmsg->call_id->number;
    osip_authorization_t *auth=NULL;
+   bl_entry_t *entry=NULL;
+   unsigned char hash[16];
+   int sts;
 
 
    DEBUGC(DBCLASS_BABBLE, "entering blacklist_check");
 
+   /* fast path: no record for this IP (REGISTER requests are tracked
+      and need the full processing) */
+   if (!MSG_IS_REGISTER(ticket->sipmsg)) {
+      bl_hash(ticket->from.sin_addr, NULL, hash);
+      pthread_mutex_lock(&bl_mutex);
+      sts=bloom_check(bl_bloom_ip, hash);
+      pthread_mutex_unlock(&bl_mutex);
+      if (sts != STS_TRUE) {
+         DEBUGC(DBCLASS_BABBLE, "leaving blacklist_check, IP has no record");
+         return STS_SUCCESS;
+      }
+   }
+
    /* get source IP address as string */
    srcip=utils_inet_ntoa(ticket->from.sin_addr);
 
@@ -294,39 +466,25 @@ static int blacklist_check(sip_ticket_t *ticket) {
       return STS_SUCCESS;
    }
    osip_uri_to_str(from_url, &from);
+   if (from == NULL) return STS_SUCCESS;
 
    DEBUGC(DBCLASS_BABBLE,"checking user %s from IP %s (Call-Id=[%s])",from, srcip, call_id);
 
-   sqlite_begin_transaction();
+   bl_hash(ticket->from.sin_addr, from, hash);
 
-   /* Query 1: SELECT for blacklisted entries */
-   /* bind */
-   sql_stmt = &sql_statement[SQL_CHECK_1];
-   sts = sqlite3_bind_text(sql_stmt->stmt, 001, srcip, -1, SQLITE_TRANSIENT);
-   if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-   sts = sqlite3_bind_text(sql_stmt->stmt, 002, from, -1, SQLITE_TRANSIENT);
-   if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-   sts = sqlite3_bind_int(sql_stmt->stmt,  003, plugin_cfg.hitcount);
-   if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
-   /* execute & eval result */
-   sts = sqlite_exec_stmt_int(sql_stmt, &retval); /* retval: nunber of records found that */
-                                                  /* the blocked query */
-   if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_int failed with %i", sts); }
-   sql_stmt = NULL;
-
-   /* Query 2: UPDATE  (last seen TS) */
-   /* bind */
-   sql_stmt = &sql_statement[SQL_CHECK_2];
-   sts = sqlite3_bind_text(sql_stmt->stmt, 001, srcip, -1, SQLITE_TRANSIENT);
-   if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-   sts = sqlite3_bind_text(sql_stmt->stmt, 002, from, -1, SQLITE_TRANSIENT);
-   if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-   sts = sqlite3_bind_int(sql_stmt->stmt,  003, ticket->timestamp);
-   if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
-   /* execute & eval result */
-   sts = sqlite_exec_stmt_none(sql_stmt);
-   if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_none failed with %i", sts); }
-   sql_stmt = NULL;
+   pthread_mutex_lock(&bl_mutex);
+
+   /* blacklisted? then update last seen TS */
+   if (bloom_check(bl_bloom_pair, hash) == STS_TRUE) {
+      entry=bl_lookup(ticket->from.sin_addr, from, hash, 0);
+   }
+   if (entry && entry->listed) {
+      if ((entry->type == 1) || (entry->failcount > plugin_cfg.hitcount)) {
+         retval=1;
+      }
+      entry->lastseen=ticket->timestamp;
+      bl_set_dirty(entry, BL_DIRTY_RECORD);
+   }
 
    if (MSG_IS_REGISTER(ticket->sipmsg)) {
       /* Disarm initial REGISTER requests that carry no Authentication header data. */
@@ -336,42 +494,25 @@ static int blacklist_check(sip_ticket_t *ticket) {
          call_id="";
       }
 
-      /* Query 3: UPDATE OR IGNORE REGISTER request into requests DB */
-      /* bind */
-      sql_stmt = &sql_statement[SQL_CHECK_3];
-      sts = sqlite3_bind_int(sql_stmt->stmt,  001, ticket->timestamp);
-      if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
-      sts = sqlite3_bind_text(sql_stmt->stmt, 002, srcip, -1, SQLITE_TRANSIENT);
-      if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-      sts = sqlite3_bind_text(sql_stmt->stmt, 003, from, -1, SQLITE_TRANSIENT);
-      if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-      sts = sqlite3_bind_text(sql_stmt->stmt, 004, call_id,-1, SQLITE_TRANSIENT);
-      if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-      /* execute & eval result */
-      sts = sqlite_exec_stmt_none(sql_stmt);
-      if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_none failed with %i", sts); }
-      sql_stmt = NULL;
-
-      /* Query 4: INSERT OR IGNORE REGISTER request into requests DB */
-      /* bind */
-      sql_stmt = &sql_statement[SQL_CHECK_4];
-      sts = sqlite3_bind_int(sql_stmt->stmt,  001, ticket->timestamp);
-      if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
-      sts = sqlite3_bind_text(sql_stmt->stmt, 002, srcip, -1, SQLITE_TRANSIENT);
-      if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-      sts = sqlite3_bind_text(sql_stmt->stmt, 003, from, -1, SQLITE_TRANSIENT);
-      if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-      sts = sqlite3_bind_text(sql_stmt->stmt, 004, call_id,-1, SQLITE_TRANSIENT);
-      if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-      /* execute & eval result */
-      sts = sqlite_exec_stmt_none(sql_stmt);
-      if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_none failed with %i", sts); }
-      sql_stmt = NULL;
+      /* remember the REGISTER request */
+      if (entry == NULL) {
+         entry=bl_lookup(ticket->from.sin_addr, from, hash, 1);
+      }
+      if (entry) {
+         if (entry->req_callid) {
+            bl_req_remove(entry);
+            free(entry->req_callid);
+         }
+         entry->req_callid=strdup(call_id ? call_id : "");
+         entry->req_timestamp=ticket->timestamp;
+         if (entry->req_callid) {
+            bl_req_append(entry);
+            bl_set_dirty(entry, BL_DIRTY_REQUEST);
+         }
+      }
    }
 
-   sqlite_end_transaction();
-
-   // not present in sqlite 3.3.6   sts = sqlite3_clear_bindings(stmt1);
+   pthread_mutex_unlock(&bl_mutex);
 
    if ((retval > 0) && (plugin_cfg.simulate==0)) {
       DEBUGC(DBCLASS_BABBLE, "leaving blacklist_check, UAC is blocked");
@@ -392,13 +533,12 @@ static int blacklist_check(sip_ticket_t *ticket) {
 
 
 static int blacklist_update(sip_ticket_t *ticket) {
-   int sts;
-   int retval=0;
-   sql_statement_t *sql_stmt = NULL;
    char *dstip=NULL;	/* IP address from UAC issuing the REGSITER */
    osip_uri_t *from_url = NULL;
    char *from=NULL;
    char *call_id=ticket->sipmsg->call_id->number;
+   bl_entry_t *entry;
+   unsigned char hash[16];
 
    DEBUGC(DBCLASS_BABBLE, "entering blacklist_update");
 
@@ -413,87 +553,61 @@ static int blacklist_update(sip_ticket_t *ticket) {
       return STS_SUCCESS;
    }
    osip_uri_to_str(from_url, &from);
+   if (from == NULL) return STS_SUCCESS;
 
 
    DEBUGC(DBCLASS_BABBLE,"checking user %s at IP %s (Call-Id=[%s])",from, dstip, call_id);
 
-   sqlite_begin_transaction();
+   bl_hash(ticket->next_hop.sin_addr, from, hash);
 
-   /* Query 1: remove old records (> register_window seconds) */
-   /* bind */
-   sql_stmt = &sql_statement[SQL_UPDATE_1];
-   sts = sqlite3_bind_int(sql_stmt->stmt,  001, ticket->timestamp - plugin_cfg.register_window);
-   if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
-   /* execute & eval result */
-   sts = sqlite_exec_stmt_none(sql_stmt);
-   if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_none failed with %i", sts); }
-   sql_stmt = NULL;
-
-   /* Query 2: check if this REGISTER response has a known record in the requests table */
-   /* bind */
-   sql_stmt = &sql_statement[SQL_UPDATE_2];
-   sts = sqlite3_bind_text(sql_stmt->stmt, 001, dstip, -1, SQLITE_TRANSIENT);
-   if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-   sts = sqlite3_bind_text(sql_stmt->stmt, 002, from, -1, SQLITE_TRANSIENT);
-   if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-   sts = sqlite3_bind_text(sql_stmt->stmt, 003, call_id, -1, SQLITE_TRANSIENT);
-   if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-   /* execute & eval result */
-   sts = sqlite_exec_stmt_int(sql_stmt, &retval);
-   if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_int failed with %i", sts); }
-   sql_stmt = NULL;
+   pthread_mutex_lock(&bl_mutex);
 
-   if (retval > 0) {
+   /* check if this REGISTER response has a known request
+      (not older than register_window seconds) */
+   entry=bl_lookup(ticket->next_hop.sin_addr, from, hash, 0);
+   if (entry && entry->req_callid &&
+       (entry->req_timestamp >= ticket->timestamp - plugin_cfg.register_window) &&
+       (strcmp(entry->req_callid, call_id ? call_id : "") == 0)) {
       DEBUGC(DBCLASS_BABBLE, "response to existing query, continue processing");
 
-      /* a failed request? then instert resp. update DB blacklist record */
-      if (MSG_IS_STATUS_4XX(ticket->sipmsg)) {
+      /* a failed request? then instert resp. update blacklist record */
+      if (MSG_IS_STATUS_4XX(ticket->sipmsg) && !entry->listed) {
          DEBUGC(DBCLASS_BABBLE, "inserting blacklist record for user %s at IP %s ", from, dstip);
-         /* Query 3: failed REGISTER, add new record in blacklist in not yet existing */
-         /* bind */
-         sql_stmt = &sql_statement[SQL_UPDATE_3];
-         sts = sqlite3_bind_text(sql_stmt->stmt, 001, dstip, -1, SQLITE_TRANSIENT);
-         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-         sts = sqlite3_bind_text(sql_stmt->stmt, 002, from, -1, SQLITE_TRANSIENT);
-         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-         /* execute & eval result */
-         sts = sqlite_exec_stmt_int(sql_stmt, &retval);
-         if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_int failed with %i", sts); }
-         sql_stmt = NULL;
-      }
-
-
-      if (MSG_IS_STATUS_4XX(ticket->sipmsg)) {
-         /* REGISTER 4xx failure: increment error counter */
-         DEBUGC(DBCLASS_BABBLE, "4XX: incrementing error counter for user %s at IP %s ", from, dstip);
-         sql_stmt = &sql_statement[SQL_UPDATE_4];
-      } else if (MSG_IS_STATUS_2XX(ticket->sipmsg)) {
-         /* REGISTER 2xx success: set error counter to 0 */
-         DEBUGC(DBCLASS_BABBLE, "2XX: setting error counter=0 for user %s at IP %s ", from, dstip);
-         sql_stmt = &sql_statement[SQL_UPDATE_6];
-      } else {
-         /* update last-seen */
-         DEBUGC(DBCLASS_BABBLE, "update last seen for user %s at IP %s ", from, dstip);
-         sql_stmt = &sql_statement[SQL_UPDATE_5];
-      }
-      if (sql_stmt) {
-         /* Query 4/5/6 */
-         /* bind */
-         sts = sqlite3_bind_text(sql_stmt->stmt, 001, dstip, -1, SQLITE_TRANSIENT);
-         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-         sts = sqlite3_bind_text(sql_stmt->stmt, 002, from, -1, SQLITE_TRANSIENT);
-         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
-         sts = sqlite3_bind_int(sql_stmt->stmt,  003, ticket->timestamp);
-         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
-         /* execute query */
-         sts = sqlite_exec_stmt_none(sql_stmt);
-         if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_int failed with %i", sts); }
-         sql_stmt = NULL;
+         bl_set_listed(entry, 1);
+         entry->type=0;
+         entry->failcount=0;
+         entry->lastfail=0;
+         entry->lastseen=0;
+         bl_set_dirty(entry, BL_DIRTY_RECORD);
+      }
+
+      if (entry->listed) {
+         if (MSG_IS_STATUS_4XX(ticket->sipmsg)) {
+            /* REGISTER 4xx failure: increment error counter */
+            DEBUGC(DBCLASS_BABBLE, "4XX: incrementing error counter for user %s at IP %s ", from, dstip);
+            if (entry->type == 0) {
+               entry->failcount++;
+               entry->lastseen=ticket->timestamp;
+               entry->lastfail=ticket->timestamp;
+            }
+         } else if (MSG_IS_STATUS_2XX(ticket->sipmsg)) {
+            /* REGISTER 2xx success: set error counter to 0 */
+            DEBUGC(DBCLASS_BABBLE, "2XX: setting error counter=0 for user %s at IP %s ", from, dstip);
+            if (entry->type == 0) {
+               entry->failcount=0;
+               entry->lastseen=ticket->timestamp;
+            }
+         } else {
+            /* update last-seen */
+            DEBUGC(DBCLASS_BABBLE, "update last seen for user %s at IP %s ", from, dstip);
+            entry->lastseen=ticket->timestamp;
+         }
+         bl_set_dirty(entry, BL_DIRTY_RECORD);
       }
 
-   } /* if Q2 true */
+   } /* if known request */
 
-   sqlite_end_transaction();
+   pthread_mutex_unlock(&bl_mutex);
 
    /* free resources */
    osip_free(from);
@@ -503,54 +617,670 @@ static int blacklist_update(sip_ticket_t *ticket) {
 }
 
 
-static int blacklist_expire(sip_ticket_t *ticket) {
-   int sts;
-   sql_statement_t *sql_stmt = NULL;
+/*
+ * expiry of blacklist records (background thread)
+ */
+static int blacklist_expire(void) {
    time_t now;
 
    DEBUGC(DBCLASS_BABBLE, "entering blacklist_expire");
 
    time(&now);
 
-   /* set failcount=0 for all records where last_seen is older than block_period */
-   /* or remove records */
+   /* set failcount=0 for records where last_seen is older than
+      block_period (if config.duration > 0) */
+   if (plugin_cfg.duration > 0) {
+      bl_expire_query(SQL_EXPIRE_1, now-plugin_cfg.duration);
+      bl_flush();
+   }
 
-   sqlite_begin_transaction();
+   /* remove old records (failcount=0, lastseen older than one day) */
+   bl_expire_query(SQL_EXPIRE_2, now-86400);
+   bl_flush();
 
-   /* expire old blacklist records (if config.duration > 0)*/
-   if (plugin_cfg.duration > 0) {
-      /* Query7 */
-      /* bind */
-      sql_stmt = &sql_statement[SQL_EXPIRE_1];
-      sts = sqlite3_bind_int(sql_stmt->stmt,  001, plugin_cfg.hitcount);
+   /* counters of the Bloom filters did stick or they are too small */
+   pthread_mutex_lock(&bl_mutex);
+   if ((bloom_saturated(bl_bloom_ip) == STS_TRUE) ||
+       (bloom_saturated(bl_bloom_pair) == STS_TRUE)) {
+      bl_bloom_rebuild();
+   }
+   pthread_mutex_unlock(&bl_mutex);
+
+   DEBUGC(DBCLASS_BABBLE, "leaving blacklist_expire");
+   return STS_SUCCESS;
+}
+
+
+/*
+ * read the candidates of one expiry rule from the DB in batches
+ * ordered by lastseen and apply the rule to the in-memory records
+ * (the DB may lag behind by one flush_interval). Records that exist
+ * in the DB only (added by hand) are taken over.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+static int bl_expire_query(int query, time_t before) {
+   int sts;
+   int i, rows, count;
+   int expired=0;
+   int stop=0;
+   sql_statement_t *sql_stmt = &sql_statement[query];
+   bl_record_t *cand;
+   sqlite_int64 rowid=0;
+   time_t lastseen=0;
+   const char *ip, *sipuri;
+   struct in_addr addr;
+   bl_entry_t *entry;
+   unsigned char hash[16];
+
+   cand=malloc(plugin_cfg.expire_batch * sizeof(bl_record_t));
+   if (cand == NULL) return STS_FAILURE;
+
+   do {
+      /* next batch of candidates */
+      sts = sqlite3_bind_int(sql_stmt->stmt,  001, before);
       if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
-      sts = sqlite3_bind_int(sql_stmt->stmt,  002, now-plugin_cfg.duration);
+      sts = sqlite3_bind_int(sql_stmt->stmt,  002, lastseen);
       if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
-      /* execute query */
-      sts = sqlite_exec_stmt_none(sql_stmt);
-      if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_int failed with %i", sts); }
-      sql_stmt = NULL;
-   }
-
-   /* delete old records (failcount=0, lastseen older than one day) */
-/*&&&TODO: I should do this once a day/hour/whatever */
-   /* Query8 */
-   /* bind */
-   sql_stmt = &sql_statement[SQL_EXPIRE_2];
-   sts = sqlite3_bind_int(sql_stmt->stmt,  001, now-86400);
+      sts = sqlite3_bind_int64(sql_stmt->stmt, 003, rowid);
+      if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int64 failed with %i", sts); }
+      sts = sqlite3_bind_int(sql_stmt->stmt,  004, plugin_cfg.expire_batch);
+      if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
+      if (query == SQL_EXPIRE_1) {
+         sts = sqlite3_bind_int(sql_stmt->stmt,  005, plugin_cfg.hitcount);
+         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
+      }
+
+      rows=0;
+      count=0;
+      while ((sts = sqlite3_step(sql_stmt->stmt)) == SQLITE_ROW) {
+         rows++;
+         rowid = sqlite3_column_int64(sql_stmt->stmt, 0);
+         lastseen = sqlite3_column_int(sql_stmt->stmt, 5);
+         ip = (const char *)sqlite3_column_text(sql_stmt->stmt, 1);
+         sipuri = (const char *)sqlite3_column_text(sql_stmt->stmt, 2);
+         if ((ip == NULL) || (sipuri == NULL) || (inet_aton(ip, &addr) == 0)) {
+            continue;
+         }
+         cand[count].sipuri=strdup(sipuri);
+         if (cand[count].sipuri == NULL) continue;
+         cand[count].ip=addr;
+         cand[count].failcount=sqlite3_column_int(sql_stmt->stmt, 3);
+         cand[count].lastfail=sqlite3_column_int(sql_stmt->stmt, 4);
+         cand[count].lastseen=lastseen;
+         count++;
+      }
+      if (sts != SQLITE_DONE) {
+         ERROR("SQL step error [%i]: %s\n", sts, sqlite3_errmsg(db));
+         rows=0;
+      }
+      sqlite3_reset(sql_stmt->stmt);
+
+      /* apply the rule, one batch with the lock held */
+      pthread_mutex_lock(&bl_mutex);
+      for (i=0; i < count; i++) {
+         bl_hash(cand[i].ip, cand[i].sipuri, hash);
+         entry=bl_lookup(cand[i].ip, cand[i].sipuri, hash, 0);
+         if (entry == NULL) {
+            entry=bl_lookup(cand[i].ip, cand[i].sipuri, hash, 1);
+            if (entry == NULL) continue;
+            bl_set_listed(entry, 1);
+            entry->type=0;
+            entry->failcount=cand[i].failcount;
+            entry->lastfail=cand[i].lastfail;
+            entry->lastseen=cand[i].lastseen;
+         }
+         if (!entry->listed || (entry->type != 0) ||
+             (entry->lastseen >= before)) {
+            continue;
+         }
+         if ((query == SQL_EXPIRE_1) &&
+             (entry->failcount > plugin_cfg.hitcount)) {
+            entry->failcount=0;
+            bl_set_dirty(entry, BL_DIRTY_RECORD);
+            expired++;
+         } else if ((query == SQL_EXPIRE_2) && (entry->failcount == 0)) {
+            bl_set_listed(entry, 0);
+            bl_set_dirty(entry, BL_DIRTY_RECORD);
+            expired++;
+         }
+      }
+      stop=bl_writer_stop;
+      pthread_mutex_unlock(&bl_mutex);
+
+      for (i=0; i < count; i++) free(cand[i].sipuri);
+   } while ((rows == plugin_cfg.expire_batch) && !stop);
+
+   free(cand);
+
+   if (expired > 0) {
+      DEBUGC(DBCLASS_BABBLE, "bl_expire_query: %i records expired (query %i)",
+             expired, query);
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * forget REGISTER requests that did not get a response within
+ * register_window seconds, in memory and in the DB (background thread)
+ */
+static void bl_expire_requests(time_t now) {
+   bl_entry_t *entry;
+   sql_statement_t *sql_stmt;
+   int count;
+   int sts;
+
+   do {
+      pthread_mutex_lock(&bl_mutex);
+      for (count=0; count < plugin_cfg.expire_batch; count++) {
+         entry=bl_req_head;
+         if ((entry == NULL) ||
+             (entry->req_timestamp >= now-plugin_cfg.register_window)) {
+            break;
+         }
+         bl_req_remove(entry);
+         free(entry->req_callid);
+         entry->req_callid=NULL;
+         entry->req_timestamp=0;
+
+         /* entry is not needed any more */
+         if (!entry->listed && !entry->dirty) {
+            bl_unlink(entry);
+            bl_free_entry(entry);
+         }
+      }
+      pthread_mutex_unlock(&bl_mutex);
+   } while (count == plugin_cfg.expire_batch);
+
+   /* and from the requests table */
+   sql_stmt = &sql_statement[SQL_REQ_EXPIRE];
+   sts = sqlite3_bind_int(sql_stmt->stmt, 001, now-plugin_cfg.register_window);
    if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
-   /* execute query */
    sts = sqlite_exec_stmt_none(sql_stmt);
-   if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_int failed with %i", sts); }
-   sql_stmt = NULL;
+   if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_none failed with %i", sts); }
+}
+
+
+/*--------------------------------------------------------------------*/
+/* in-memory blacklist */
+
+/*
+ * hash of (ip, sipuri), or of the ip only if sipuri is NULL
+ * (keyed, the sipuri is chosen by the UAC)
+ */
+static void bl_hash(struct in_addr ip, char *sipuri, unsigned char *hash) {
+   siphash_ctx_t ctx;
+
+   siphash_begin(&ctx);
+   siphash_update(&ctx, &ip, sizeof(ip));
+   if (sipuri) siphash_update(&ctx, sipuri, strlen(sipuri));
+   siphash_final(&ctx, hash);
+}
+
+
+/*
+ * find the entry of (ip, sipuri), optionally create it
+ * (hash from bl_hash(), bl_mutex must be held)
+ *
+ * RETURNS
+ *	pointer to the entry, NULL if not found (or out of memory)
+ */
+static bl_entry_t *bl_lookup(struct in_addr ip, char *sipuri,
+                             unsigned char *hash, int create) {
+   unsigned int h;
+   bl_entry_t *entry;
+
+   memcpy(&h, hash, sizeof(h));
+
+   for (entry=bl_table[h & (BL_HASH_SIZE-1)]; entry; entry=entry->next) {
+      if ((entry->hash == h) && (entry->ip.s_addr == ip.s_addr) &&
+          (strcmp(entry->sipuri, sipuri) == 0)) {
+         return entry;
+      }
+   }
+   if (!create) return NULL;
+
+   entry=calloc(1, sizeof(bl_entry_t));
+   if (entry == NULL) return NULL;
+   entry->sipuri=strdup(sipuri);
+   if (entry->sipuri == NULL) {
+      free(entry);
+      return NULL;
+   }
+   entry->hash=h;
+   entry->ip=ip;
+   entry->next=bl_table[h & (BL_HASH_SIZE-1)];
+   bl_table[h & (BL_HASH_SIZE-1)]=entry;
+   return entry;
+}
+
+
+/*
+ * put an entry on the list of records to be written to the DB
+ * (bl_mutex must be held)
+ */
+static void bl_set_dirty(bl_entry_t *entry, int what) {
+   if (entry->dirty == 0) {
+      entry->dirty_next=bl_dirty_list;
+      bl_dirty_list=entry;
+   }
+   entry->dirty |= what;
+}
+
+
+/*
+ * an entry gets / loses its blacklist record, maintain the Bloom
+ * filters (bl_mutex must be held)
+ */
+static void bl_set_listed(bl_entry_t *entry, int listed) {
+   unsigned char hash[16];
+
+   if (entry->listed == listed) return;
+   entry->listed=listed;
+
+   bl_hash(entry->ip, NULL, hash);
+   if (listed) {
+      bloom_add(bl_bloom_ip, hash);
+   } else {
+      bloom_del(bl_bloom_ip, hash);
+   }
+   bl_hash(entry->ip, entry->sipuri, hash);
+   if (listed) {
+      bloom_add(bl_bloom_pair, hash);
+   } else {
+      bloom_del(bl_bloom_pair, hash);
+   }
+}
+
+
+/*
+ * build new Bloom filters from the listed entries, sized for twice
+ * their number (bl_mutex must be held)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if out of memory (old filters are kept)
+ */
+static int bl_bloom_rebuild(void) {
+   bloom_t *bloom_ip, *bloom_pair;
+   bl_entry_t *entry;
+   unsigned char hash[16];
+   unsigned int count=0;
+   int i;
+
+   for (i=0; i < BL_HASH_SIZE; i++) {
+      for (entry=bl_table[i]; entry; entry=entry->next) {
+         if (entry->listed) count++;
+      }
+   }
+   if (count*2 < BL_BLOOM_MIN) count=BL_BLOOM_MIN/2;
+
+   bloom_ip=bloom_new(count*2);
+   bloom_pair=bloom_new(count*2);
+   if ((bloom_ip == NULL) || (bloom_pair == NULL)) {
+      WARN("plugin_blacklist: out of memory, Bloom filters not rebuilt");
+      bloom_free(bloom_ip);
+      bloom_free(bloom_pair);
+      return STS_FAILURE;
+   }
+
+   for (i=0; i < BL_HASH_SIZE; i++) {
+      for (entry=bl_table[i]; entry; entry=entry->next) {
+         if (!entry->listed) continue;
+         bl_hash(entry->ip, NULL, hash);
+         bloom_add(bloom_ip, hash);
+         bl_hash(entry->ip, entry->sipuri, hash);
+         bloom_add(bloom_pair, hash);
+      }
+   }
+
+   bloom_free(bl_bloom_ip);
+   bloom_free(bl_bloom_pair);
+   bl_bloom_ip=bloom_ip;
+   bl_bloom_pair=bloom_pair;
+   DEBUGC(DBCLASS_BABBLE, "Bloom filters rebuilt for %u records", count);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * remove an entry from the hash table (bl_mutex must be held)
+ */
+static void bl_unlink(bl_entry_t *entry) {
+   bl_entry_t **prev;
+
+   for (prev=&bl_table[entry->hash & (BL_HASH_SIZE-1)]; *prev;
+        prev=&(*prev)->next) {
+      if (*prev == entry) {
+         *prev=entry->next;
+         break;
+      }
+   }
+}
+
+
+/*
+ * list of outstanding REGISTER requests (bl_mutex must be held)
+ */
+static void bl_req_append(bl_entry_t *entry) {
+   entry->req_next=NULL;
+   entry->req_prev=bl_req_tail;
+   if (bl_req_tail) {
+      bl_req_tail->req_next=entry;
+   } else {
+      bl_req_head=entry;
+   }
+   bl_req_tail=entry;
+}
+
+static void bl_req_remove(bl_entry_t *entry) {
+   if (entry->req_prev) {
+      entry->req_prev->req_next=entry->req_next;
+   } else {
+      bl_req_head=entry->req_next;
+   }
+   if (entry->req_next) {
+      entry->req_next->req_prev=entry->req_prev;
+   } else {
+      bl_req_tail=entry->req_prev;
+   }
+   entry->req_prev=entry->req_next=NULL;
+}
+
+
+static void bl_free_entry(bl_entry_t *entry) {
+   if (entry->req_callid) free(entry->req_callid);
+   free(entry->sipuri);
+   free(entry);
+}
+
+
+/*
+ * read records from the blacklist table into memory
+ * manual_only=0: all records (startup)
+ * manual_only=1: manual records (type=1) added since the last call
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on DB error
+ */
+static int bl_load(int manual_only) {
+   int sts;
+   int count=0;
+   sql_statement_t *sql_stmt = &sql_statement[SQL_LOAD];
+   sqlite_int64 rowid;
+   const char *ip, *sipuri;
+   struct in_addr addr;
+   bl_entry_t *entry;
+   unsigned char hash[16];
+
+   sts = sqlite3_bind_int64(sql_stmt->stmt, 001, bl_maxrowid);
+   if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int64 failed with %i", sts); }
+
+   pthread_mutex_lock(&bl_mutex);
+   while ((sts = sqlite3_step(sql_stmt->stmt)) == SQLITE_ROW) {
+      rowid = sqlite3_column_int64(sql_stmt->stmt, 0);
+      if (rowid > bl_maxrowid) bl_maxrowid=rowid;
+
+      if (manual_only && (sqlite3_column_int(sql_stmt->stmt, 1) != 1)) continue;
+
+      ip = (const char *)sqlite3_column_text(sql_stmt->stmt, 2);
+      sipuri = (const char *)sqlite3_column_text(sql_stmt->stmt, 3);
+      if ((ip == NULL) || (sipuri == NULL) || (inet_aton(ip, &addr) == 0)) {
+         continue;
+      }
+      bl_hash(addr, (char *)sipuri, hash);
+      entry=bl_lookup(addr, (char *)sipuri, hash, 1);
+      if (entry == NULL) {
+         ERROR("plugin_blacklist: out of memory loading the blacklist");
+         break;
+      }
+      bl_set_listed(entry, 1);
+      entry->type=sqlite3_column_int(sql_stmt->stmt, 1);
+      entry->failcount=sqlite3_column_int(sql_stmt->stmt, 4);
+      entry->lastfail=sqlite3_column_int(sql_stmt->stmt, 5);
+      entry->lastseen=sqlite3_column_int(sql_stmt->stmt, 6);
+      count++;
+   }
+   pthread_mutex_unlock(&bl_mutex);
+
+   if ((sts != SQLITE_DONE) && (sts != SQLITE_ROW)) {
+      ERROR("SQL step error [%i]: %s\n", sts, sqlite3_errmsg(db));
+      sqlite3_reset(sql_stmt->stmt);
+      return STS_FAILURE;
+   }
+   sqlite3_reset(sql_stmt->stmt);
+
+   if (count > 0) {
+      DEBUGC(DBCLASS_BABBLE, "bl_load: %i records loaded", count);
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * read the outstanding REGISTER requests since 'since' (startup)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on DB error
+ */
+static int bl_load_requests(time_t since) {
+   int sts;
+   int count=0;
+   sql_statement_t *sql_stmt = &sql_statement[SQL_REQ_LOAD];
+   const char *ip, *sipuri, *callid;
+   struct in_addr addr;
+   bl_entry_t *entry;
+   unsigned char hash[16];
+
+   sts = sqlite3_bind_int(sql_stmt->stmt, 001, since);
+   if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
+
+   pthread_mutex_lock(&bl_mutex);
+   while ((sts = sqlite3_step(sql_stmt->stmt)) == SQLITE_ROW) {
+      ip = (const char *)sqlite3_column_text(sql_stmt->stmt, 0);
+      sipuri = (const char *)sqlite3_column_text(sql_stmt->stmt, 1);
+      callid = (const char *)sqlite3_column_text(sql_stmt->stmt, 2);
+      if ((ip == NULL) || (sipuri == NULL) || (inet_aton(ip, &addr) == 0)) {
+         continue;
+      }
+      bl_hash(addr, (char *)sipuri, hash);
+      entry=bl_lookup(addr, (char *)sipuri, hash, 1);
+      if ((entry == NULL) || (entry->req_callid != NULL)) continue;
+      entry->req_callid=strdup(callid ? callid : "");
+      if (entry->req_callid == NULL) {
+         ERROR("plugin_blacklist: out of memory loading the requests");
+         break;
+      }
+      entry->req_timestamp=sqlite3_column_int(sql_stmt->stmt, 3);
+      bl_req_append(entry);
+      count++;
+   }
+   pthread_mutex_unlock(&bl_mutex);
+
+   if ((sts != SQLITE_DONE) && (sts != SQLITE_ROW)) {
+      ERROR("SQL step error [%i]: %s\n", sts, sqlite3_errmsg(db));
+      sqlite3_reset(sql_stmt->stmt);
+      return STS_FAILURE;
+   }
+   sqlite3_reset(sql_stmt->stmt);
+
+   DEBUGC(DBCLASS_BABBLE, "bl_load_requests: %i requests loaded", count);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * write all dirty records to the DB (background thread)
+ *
+ * RETURNS
+ *	STS_SUCCESS
+ */
+static int bl_flush(void) {
+   int sts;
+   int i, j, count=0;
+   sql_statement_t *sql_stmt = NULL;
+   bl_record_t *rec=NULL;
+   bl_entry_t *entry, *next;
+   char ip[IPSTRING_SIZE];
+
+   /* take a copy of the dirty records, the DB is written unlocked */
+   pthread_mutex_lock(&bl_mutex);
+   for (entry=bl_dirty_list; entry; entry=entry->dirty_next) count++;
+   if (count > 0) rec=malloc(count * sizeof(bl_record_t));
+   if (rec == NULL) {
+      /* nothing to do (or retry next time) */
+      pthread_mutex_unlock(&bl_mutex);
+      return STS_SUCCESS;
+   }
+   for (i=0, entry=bl_dirty_list, bl_dirty_list=NULL; entry; entry=next) {
+      next=entry->dirty_next;
+      rec[i].dirty=entry->dirty;
+      entry->dirty=0;
+      rec[i].sipuri=strdup(entry->sipuri);
+      rec[i].req_callid=NULL;
+      /* an expired REGISTER is removed from the DB by the expiry */
+      if (rec[i].sipuri && (rec[i].dirty & BL_DIRTY_REQUEST) &&
+          entry->req_callid) {
+         rec[i].req_callid=strdup(entry->req_callid);
+         rec[i].req_timestamp=entry->req_timestamp;
+         if (rec[i].req_callid == NULL) {
+            free(rec[i].sipuri);
+            rec[i].sipuri=NULL;
+         }
+      }
+      if (rec[i].sipuri == NULL) {
+         /* stays dirty, next time */
+         bl_set_dirty(entry, rec[i].dirty);
+         continue;
+      }
+      rec[i].ip=entry->ip;
+      rec[i].listed=entry->listed;
+      rec[i].failcount=entry->failcount;
+      rec[i].lastfail=entry->lastfail;
+      rec[i].lastseen=entry->lastseen;
+      i++;
+
+      /* record removed and no REGISTER outstanding: not needed any more */
+      if (!entry->listed && (entry->req_callid == NULL)) {
+         bl_unlink(entry);
+         bl_free_entry(entry);
+      }
+   }
+   count=i;
+   pthread_mutex_unlock(&bl_mutex);
+
+   DEBUGC(DBCLASS_BABBLE, "bl_flush: writing %i records", count);
+   sqlite_begin_transaction();
+
+   for (i=0; i < count; i++) {
+      inet_ntop(AF_INET, &rec[i].ip, ip, sizeof(ip));
+
+      if (rec[i].req_callid) {
+         /* Query 1+2: outstanding REGISTER, update or insert */
+         sql_stmt = &sql_statement[SQL_REQ_WRITE_1];
+         for (j=0; j < 2; j++) {
+            sts = sqlite3_bind_int(sql_stmt->stmt,  001, rec[i].req_timestamp);
+            if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
+            sts = sqlite3_bind_text(sql_stmt->stmt, 002, ip, -1, SQLITE_TRANSIENT);
+            if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
+            sts = sqlite3_bind_text(sql_stmt->stmt, 003, rec[i].sipuri, -1, SQLITE_TRANSIENT);
+            if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
+            sts = sqlite3_bind_text(sql_stmt->stmt, 004, rec[i].req_callid, -1, SQLITE_TRANSIENT);
+            if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
+            sts = sqlite_exec_stmt_none(sql_stmt);
+            if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_none failed with %i", sts); }
+            sql_stmt = &sql_statement[SQL_REQ_WRITE_2];
+         }
+         free(rec[i].req_callid);
+      }
+
+      if ((rec[i].dirty & BL_DIRTY_RECORD) && rec[i].listed) {
+         /* Query 1: add new record in blacklist in not yet existing */
+         sql_stmt = &sql_statement[SQL_WRITE_1];
+         sts = sqlite3_bind_text(sql_stmt->stmt, 001, ip, -1, SQLITE_TRANSIENT);
+         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
+         sts = sqlite3_bind_text(sql_stmt->stmt, 002, rec[i].sipuri, -1, SQLITE_TRANSIENT);
+         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
+         sts = sqlite_exec_stmt_none(sql_stmt);
+         if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_none failed with %i", sts); }
+
+         /* Query 2: counters and timestamps */
+         sql_stmt = &sql_statement[SQL_WRITE_2];
+         sts = sqlite3_bind_text(sql_stmt->stmt, 001, ip, -1, SQLITE_TRANSIENT);
+         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
+         sts = sqlite3_bind_text(sql_stmt->stmt, 002, rec[i].sipuri, -1, SQLITE_TRANSIENT);
+         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
+         sts = sqlite3_bind_int(sql_stmt->stmt,  003, rec[i].failcount);
+         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
+         sts = sqlite3_bind_int(sql_stmt->stmt,  004, rec[i].lastfail);
+         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
+         sts = sqlite3_bind_int(sql_stmt->stmt,  005, rec[i].lastseen);
+         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_int failed with %i", sts); }
+         sts = sqlite_exec_stmt_none(sql_stmt);
+         if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_none failed with %i", sts); }
+      } else if (rec[i].dirty & BL_DIRTY_RECORD) {
+         /* Query 3: expired, remove record */
+         sql_stmt = &sql_statement[SQL_WRITE_3];
+         sts = sqlite3_bind_text(sql_stmt->stmt, 001, ip, -1, SQLITE_TRANSIENT);
+         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
+         sts = sqlite3_bind_text(sql_stmt->stmt, 002, rec[i].sipuri, -1, SQLITE_TRANSIENT);
+         if( sts != SQLITE_OK ){ WARN("sqlite3_bind_text failed with %i", sts); }
+         sts = sqlite_exec_stmt_none(sql_stmt);
+         if( sts != STS_SUCCESS ){ WARN("sqlite_exec_stmt_none failed with %i", sts); }
+      }
+      free(rec[i].sipuri);
+   }
 
    sqlite_end_transaction();
+   free(rec);
 
-   DEBUGC(DBCLASS_BABBLE, "leaving blacklist_expire");
    return STS_SUCCESS;
 }
 
 
+/*
+ * background thread: write the changes every flush_interval seconds,
+ * pick up manually added records, forget outstanding REGISTERs and
+ * run the expiry every expire_interval seconds
+ */
+static void *bl_writer_main(void *arg) {
+   struct timespec ts;
+   time_t next_expire;
+   int stop=0;
+
+   next_expire=time(NULL) + plugin_cfg.expire_interval;
+   while (!stop) {
+      pthread_mutex_lock(&bl_mutex);
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += plugin_cfg.flush_interval;
+      while (!bl_writer_stop) {
+         if (pthread_cond_timedwait(&bl_writer_cond, &bl_mutex, &ts) == ETIMEDOUT) {
+            break;
+         }
+      }
+      stop=bl_writer_stop;
+      pthread_mutex_unlock(&bl_mutex);
+
+      bl_flush();
+      if (stop) break;
+
+      bl_load(1);
+      bl_expire_requests(time(NULL));
+      if (time(NULL) >= next_expire) {
+         blacklist_expire();
+         next_expire=time(NULL) + plugin_cfg.expire_interval;
+      }
+   }
+
+   return NULL;
+}
+
+
 /*--------------------------------------------------------------------*/
 /* helper functions */
 static int sqlite_begin(void){
@@ -588,6 +1318,18 @@ static int sqlite_begin(void){
       return STS_FAILURE;
    }
 
+   /* tools writing to the DB (manual records) may hold the lock for
+      a moment, the background writer waits for it */
+   sqlite3_busy_timeout(db, 2000);
+
+   /* write ahead log: fewer syncs, and tools reading the DB do not
+      block the background writer (SQLite >= 3.7.0, ignored otherwise) */
+   sts = sqlite3_exec(db, "PRAGMA journal_mode = WAL", NULL, 0, &zErrMsg);
+   if( sts != SQLITE_OK ){
+      WARN( "SQL exec error: %s\n", zErrMsg);
+      sqlite3_free(zErrMsg);
+   }
+
    /* perform write check (DB update) */
 #define DB_SQL_STARTUP \
 	"INSERT OR IGNORE INTO control (action, count) VALUES ('bl_started', 0); "\
@@ -700,28 +1442,3 @@ static int sqlite_exec_stmt_none(sql_statement_t *sql_statement){
    return STS_SUCCESS;
 }
 
-static int sqlite_exec_stmt_int(sql_statement_t *sql_statement, int *retval){
-   int sts;
-
-   /* execute & eval result */
-   DEBUGC(DBCLASS_BABBLE, "executing query [%s]", sql_statement->sql_query);
-   do {
-      sts = sqlite3_step(sql_statement->stmt);
-      if (sts == SQLITE_ROW) {
-         if (retval != NULL) {
-            *retval = sqlite3_column_int(sql_statement->stmt, 0);
-            DEBUGC(DBCLASS_BABBLE, "sqlite_exec_stmt_int: query returned INT %i", *retval);
-         }
-      }
-   } while (sts == SQLITE_ROW);
-   if ( sts == SQLITE_ERROR) {
-      sts = sqlite3_reset(sql_statement->stmt);
-      ERROR("SQL step error [%i]: %s\n", sts, sqlite3_errmsg(db));
-   } else if ( sts != SQLITE_DONE ) {
-      ERROR("SQL step error [%i]: %s\n", sts, sqlite3_errmsg(db));
-   }
-   /* cleanup */
-   sts = sqlite3_reset(sql_statement->stmt);
-
-   return STS_SUCCESS;
-}
@@ -76,6 +76,7 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
    /* Execution mask - during what stages of SIP processing shall
     * the plugin be called. */
    plugin_def->exe_mask=PLUGIN_PRE_PROXY;
+   plugin_def->mt_level=PLUGIN_MT_SAFE;
 
    /* read the config file */
    if (read_config(configuration.configfile,
@@ -96,13 +97,9 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
 int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
    /* stage contains the PLUGIN_* value - the stage of SIP processing. */
    int sts;
-   char *buff;
-   size_t buflen;
-   osip_body_t *body;
    sdp_message_t  *sdp;
    int content_length;
    osip_content_type_t *content_type;
-   char clen[8]; /* content length: probably never more than 7 digits !*/
 
    //
    // check that we have the expected payload "application/sdp"
@@ -135,78 +132,26 @@ int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
           content_type->type, content_type->subtype, content_length);
 
    //
-   // parse the payload
+   // get the parsed payload (shared with siproxd core, owned by the ticket)
    //
-
-   // get a pointer to the payload of the SIP packet
-   sts = osip_message_get_body(ticket->sipmsg, 0, &body);
-   if (sts != 0) {
-      DEBUGC(DBCLASS_PLUGIN, "%s: no body found in message", name);
-      return STS_SUCCESS;
-   }
-   // dump it into a buffer
-   sts = sip_body_to_str(body, &buff, &buflen);
-   if (sts != 0) {
-      WARN("%s: unable to sip_body_to_str", name);
+   sts = sip_get_sdp(ticket, &sdp);
+   if (sts != STS_SUCCESS) {
+      WARN("%s: unable to parse SDP body", name);
       return STS_SUCCESS;
    }
-   // and parse it into an SDP structure
-   sts = sdp_message_init(&sdp);
-   sts = sdp_message_parse (sdp, buff);
-   if (sts != 0) {
-      WARN("%s: unable to sdp_message_parse() body", name);
-      DUMP_BUFFER(-1, buff, buflen);
-      osip_free(buff);
-      buff=NULL;
-      sdp_message_free(sdp);
+   if (sdp == NULL) {
+      DEBUGC(DBCLASS_PLUGIN, "%s: no body found in message", name);
       return STS_SUCCESS;
    }
-   osip_free(buff);
-   buff=NULL;
 
    //
    // now do the codec filtering magic...
    sdp_filter_codec(sdp);
 
    //
-   // replace the original payload with the new modified payload
+   // the modified payload is put into the SIP message before sending
    //
-   
-   // remove old body from SIP packet
-   sts = osip_list_remove(&(ticket->sipmsg->bodies), 0);
-   osip_body_free(body);
-   body=NULL;
-
-   // dump new body to buffer
-   sdp_message_to_str(sdp, &buff);
-   buflen=strlen(buff);
-
-   // free sdp structure (no longer needed)
-   sdp_message_free(sdp);
-   sdp=NULL;
-
-   // put new body into SIP message
-   sts=sip_message_set_body(ticket->sipmsg, buff, buflen);
-   if (sts != 0) {
-      ERROR("%s: unable to sip_message_set_body body", name);
-      DUMP_BUFFER(-1, buff, buflen);
-      buflen=0;
-   }
-   // free buffer
-   osip_free(buff);
-   buff=NULL;
-
-   //
-   // set new content length
-   //
-
-   // remove old content leght field
-   osip_content_length_free(ticket->sipmsg->content_length);
-   ticket->sipmsg->content_length=NULL;
-
-   // set new content length
-   sprintf(clen,"%ld",(long)buflen);
-   sts = osip_message_set_content_length(ticket->sipmsg, clen);
+   sip_sdp_modified(ticket);
 
    return STS_SUCCESS;
 }
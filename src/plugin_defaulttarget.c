@@ -80,6 +80,13 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
    /* Execution mask - during what stages of SIP processing shall
     * the plugin be called. */
    plugin_def->exe_mask=PLUGIN_DETERMINE_TARGET;
+   /* sip_gen_response() is not reentrant */
+   plugin_def->mt_level=PLUGIN_MT_SERIAL;
+
+   /* Message filter - only INVITE and ACK requests with unknown
+    * direction are of interest */
+   plugin_def->filter=PLUGIN_FLT_REQUEST|PLUGIN_FLT_INVITE|PLUGIN_FLT_ACK|
+                      PLUGIN_FLT_UNKNOWN;
 
    /* read the config file */
    if (read_config(configuration.configfile,
@@ -111,12 +118,10 @@ int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
    int sts;
 
    sts = STS_SUCCESS;
-   sip_find_direction(ticket, NULL);
 
-   /* direction is unknown and SIP message is a REQUEST */
-   if ((ticket->direction == DIRTYP_UNKNOWN) &&
-       (MSG_IS_REQUEST(ticket->sipmsg)) &&
-       (MSG_IS_INVITE(ticket->sipmsg))) {
+   /* direction is unknown and SIP message is a REQUEST
+    * (siproxd filters them for us, plugin_def->filter) */
+   if (MSG_IS_INVITE(ticket->sipmsg)) {
 
       /* LOG if master wishes so */
       if (plugin_cfg.log) {
@@ -140,9 +145,7 @@ int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
    }
 
    /* Catch the ACK following the redirect */
-   if ((ticket->direction == DIRTYP_UNKNOWN) &&
-       (MSG_IS_REQUEST(ticket->sipmsg)) &&
-       (MSG_IS_ACK(ticket->sipmsg))) {
+   if (MSG_IS_ACK(ticket->sipmsg)) {
       /* eat it up and don't react */
       return STS_SIP_SENT;
    }
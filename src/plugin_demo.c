@@ -53,6 +53,10 @@ static cfgopts_t plugin_cfg_opts[] = {
    {0, 0, 0}
 };
 
+/* state shared by all SIP workers, protected by plugin_lock() */
+static plugin_def_t *demo_plugin=NULL;
+static int demo_calls=0;
+
 
 /* 
  * Initialization.
@@ -72,6 +76,16 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
     * the plugin be called. */
    plugin_def->exe_mask=PLUGIN_DETERMINE_TARGET|PLUGIN_PRE_PROXY;
 
+   /* Message filter (optional) - only call the plugin for SIP messages
+    * matching these PLUGIN_FLT_* bits. 0 means all messages. */
+   plugin_def->filter=0;
+
+   /* Thread safety - PLUGIN_MT_SAFE: may be called by several SIP
+    * workers at once. Optionally worker_init/worker_end provide a
+    * context per worker (passed in ticket->plugin_ctx). */
+   plugin_def->mt_level=PLUGIN_MT_SAFE;
+   demo_plugin=plugin_def;
+
    /* read the config file */
    if (read_config(configuration.configfile,
                    configuration.config_search,
@@ -89,8 +103,13 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
  * 
  */
 int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
+   int calls;
+
    /* stage contains the PLUGIN_* value - the stage of SIP processing. */
-   INFO("plugin_demo: processing - stage %i",stage);
+   plugin_lock(demo_plugin);
+   calls=++demo_calls;
+   plugin_unlock(demo_plugin);
+   INFO("plugin_demo: processing - stage %i, call %i",stage, calls);
    return STS_SUCCESS;
 }
 
@@ -53,6 +53,9 @@ static cfgopts_t plugin_cfg_opts[] = {
    {0, 0, 0}
 };
 
+/* compiled list of networks */
+static acl_t *networks_acl=NULL;
+
 /* Prototypes */
 static int sip_fix_topvia(sip_ticket_t *ticket);
 
@@ -74,6 +77,9 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
    /* Execution mask - during what stages of SIP processing shall
     * the plugin be called. */
    plugin_def->exe_mask=PLUGIN_PRE_PROXY;
+   plugin_def->filter=PLUGIN_FLT_RESPONSE|PLUGIN_FLT_INCOMING;
+   /* get_ip_by_host() uses the DNS park state of the SIP thread */
+   plugin_def->mt_level=PLUGIN_MT_SERIAL;
 
    /* read the config file */
    if (read_config(configuration.configfile,
@@ -83,6 +89,16 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
       return STS_FAILURE;
    }
 
+   /* compile the list of networks */
+   if ((plugin_cfg.networks != NULL) &&
+       (strcmp(plugin_cfg.networks, "") !=0)) {
+      networks_acl = acl_compile(plugin_cfg.networks);
+      if (networks_acl == NULL) {
+         ERROR("Plugin '%s': invalid list of networks", name);
+         return STS_FAILURE;
+      }
+   }
+
    INFO("plugin_fix_DTAG is initialized");
    return STS_SUCCESS;
 }
@@ -113,10 +129,8 @@ DEBUGC(DBCLASS_PLUGIN, "plugin_fix_DTAG: type=%i", type);
       DEBUGC(DBCLASS_PLUGIN, "plugin_fix_DTAG: processing VIA host [%s]",
              via->host);
       get_ip_by_host(via->host, &(from.sin_addr));
-      if ((plugin_cfg.networks != NULL) &&
-          (strcmp(plugin_cfg.networks, "") !=0) &&
-          (process_aclist(plugin_cfg.networks, ticket->from) == STS_SUCCESS) &&
-          (process_aclist(plugin_cfg.networks, from) == STS_SUCCESS)) {
+      if ((acl_match(networks_acl, ticket->from.sin_addr) == STS_SUCCESS) &&
+          (acl_match(networks_acl, from.sin_addr) == STS_SUCCESS)) {
 
          /* VIA & Sender IP are in list, fix Via header */
          DEBUGC(DBCLASS_PLUGIN, "plugin_fix_DTAG: replacing a bogus via");
@@ -140,6 +154,8 @@ DEBUGC(DBCLASS_PLUGIN, "plugin_fix_DTAG: type=%i", type);
  */
 int  PLUGIN_END(plugin_def_t *plugin_def){
    INFO("plugin_fix_DTAG ends here");
+   acl_free(networks_acl);
+   networks_acl=NULL;
    return STS_SUCCESS;
 }
 
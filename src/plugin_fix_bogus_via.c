@@ -54,6 +54,9 @@ static cfgopts_t plugin_cfg_opts[] = {
    {0, 0, 0}
 };
 
+/* compiled list of networks */
+static acl_t *networks_acl=NULL;
+
 /* Prototypes */
 static int sip_patch_topvia(sip_ticket_t *ticket);
 
@@ -75,6 +78,9 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
    /* Execution mask - during what stages of SIP processing shall
     * the plugin be called. */
    plugin_def->exe_mask=PLUGIN_PRE_PROXY;
+   plugin_def->filter=PLUGIN_FLT_REQUEST|PLUGIN_FLT_INCOMING;
+   /* get_ip_by_host() uses the DNS park state of the SIP thread */
+   plugin_def->mt_level=PLUGIN_MT_SERIAL;
 
    /* read the config file */
    if (read_config(configuration.configfile,
@@ -84,6 +90,16 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
       return STS_FAILURE;
    }
 
+   /* compile the list of networks */
+   if ((plugin_cfg.networks != NULL) &&
+       (strcmp(plugin_cfg.networks, "") !=0)) {
+      networks_acl = acl_compile(plugin_cfg.networks);
+      if (networks_acl == NULL) {
+         ERROR("Plugin '%s': invalid list of networks", name);
+         return STS_FAILURE;
+      }
+   }
+
    INFO("plugin_fix_bogus_via is initialized");
    return STS_SUCCESS;
 }
@@ -112,9 +128,7 @@ DEBUGC(DBCLASS_PLUGIN, "plugin_fix_bogus_via: type=%i", type);
       get_ip_by_host(via->host, &(from.sin_addr));
 
       /* check for Via IP in configured range */
-      if ((plugin_cfg.networks != NULL) &&
-          (strcmp(plugin_cfg.networks, "") !=0) &&
-          (process_aclist(plugin_cfg.networks, from) == STS_SUCCESS)) {
+      if (acl_match(networks_acl, from.sin_addr) == STS_SUCCESS) {
          /* is in list, patch Via header with received from IP */
          DEBUGC(DBCLASS_PLUGIN, "plugin_fix_bogus_via: replacing a bogus via");
          if (sip_patch_topvia(ticket) == STS_FAILURE) {
@@ -133,6 +147,8 @@ DEBUGC(DBCLASS_PLUGIN, "plugin_fix_bogus_via: type=%i", type);
  */
 int  PLUGIN_END(plugin_def_t *plugin_def){
    INFO("plugin_fix_bogus_via ends here");
+   acl_free(networks_acl);
+   networks_acl=NULL;
    return STS_SUCCESS;
 }
 
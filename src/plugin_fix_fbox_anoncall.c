@@ -57,6 +57,9 @@ static cfgopts_t plugin_cfg_opts[] = {
    {0, 0, 0}
 };
 
+/* compiled list of networks */
+static acl_t *networks_acl=NULL;
+
 /* Prototypes */
 //static int sip_fix_topvia(sip_ticket_t *ticket);
 
@@ -78,6 +81,9 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
    /* Execution mask - during what stages of SIP processing shall
     * the plugin be called. */
    plugin_def->exe_mask=PLUGIN_PRE_PROXY;
+   plugin_def->filter=PLUGIN_FLT_OUTGOING;
+   /* reads the urlmap, which is changed by register_client() */
+   plugin_def->mt_level=PLUGIN_MT_SERIAL;
 
    /* read the config file */
    if (read_config(configuration.configfile,
@@ -87,6 +93,16 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
       return STS_FAILURE;
    }
 
+   /* compile the list of networks */
+   if ((plugin_cfg.networks != NULL) &&
+       (strcmp(plugin_cfg.networks, "") !=0)) {
+      networks_acl = acl_compile(plugin_cfg.networks);
+      if (networks_acl == NULL) {
+         ERROR("Plugin '%s': invalid list of networks", name);
+         return STS_FAILURE;
+      }
+   }
+
    INFO("plugin_fix_fbox_anoncall is initialized");
    return STS_SUCCESS;
 }
@@ -164,9 +180,7 @@ find some additional markers that allow nailing the actual phone number
       /* check for sender IP is in configured range */
       DEBUGC(DBCLASS_PLUGIN, "processing from host [%s]",
              utils_inet_ntoa(ticket->from.sin_addr));
-      if ((plugin_cfg.networks != NULL) &&
-          (strcmp(plugin_cfg.networks, "") !=0) &&
-          (process_aclist(plugin_cfg.networks, ticket->from) == STS_SUCCESS)) {
+      if (acl_match(networks_acl, ticket->from.sin_addr) == STS_SUCCESS) {
          /* Sender IP is in list, fix check and fix Contact header */
          DEBUGC(DBCLASS_PLUGIN, "checking for bogus Contact header");
 
@@ -326,6 +340,8 @@ find some additional markers that allow nailing the actual phone number
  */
 int  PLUGIN_END(plugin_def_t *plugin_def){
    INFO("plugin_fix_fbox_anoncall ends here");
+   acl_free(networks_acl);
+   networks_acl=NULL;
    return STS_SUCCESS;
 }
 
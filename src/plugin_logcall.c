@@ -60,6 +60,9 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
    /* Execution mask - during what stages of SIP processing shall
     * the plugin be called. */
    plugin_def->exe_mask=PLUGIN_PRE_PROXY;
+   plugin_def->filter=PLUGIN_FLT_REQUEST|PLUGIN_FLT_INVITE|PLUGIN_FLT_ACK|
+                      PLUGIN_FLT_BYE|PLUGIN_FLT_CANCEL;
+   plugin_def->mt_level=PLUGIN_MT_SAFE;
 
    return STS_SUCCESS;
 }
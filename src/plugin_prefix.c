@@ -90,6 +90,10 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
    plugin_def->name=name;
    plugin_def->desc=desc;
    plugin_def->exe_mask=PLUGIN_DETERMINE_TARGET;
+   plugin_def->filter=PLUGIN_FLT_REQUEST|PLUGIN_FLT_INVITE|PLUGIN_FLT_ACK|
+                      PLUGIN_FLT_OUTGOING;
+   /* sip_gen_response() is not reentrant */
+   plugin_def->mt_level=PLUGIN_MT_SERIAL;
 
    /* read the config file */
    if (read_config(configuration.configfile,
@@ -135,14 +139,8 @@ static int plugin_prefix(sip_ticket_t *ticket) {
    req_url=osip_message_get_uri(ticket->sipmsg);
    to_url=osip_to_get_url(ticket->sipmsg);
 
-   /* only outgoing direction is handled */
-   sip_find_direction(ticket, NULL);
-   if (ticket->direction != DIR_OUTGOING)
-      return STS_SUCCESS;
-
-   /* only INVITE and ACK are handled */
-   if (!MSG_IS_INVITE(ticket->sipmsg) && !MSG_IS_ACK(ticket->sipmsg))
-      return STS_SUCCESS;
+   /* only outgoing INVITE and ACK requests are handled,
+    * siproxd filters them for us (plugin_def->filter) */
 
    /* expire old cache entries */
    expire_redirected_cache(&redirected_cache);
@@ -43,6 +43,7 @@
 #include "siproxd.h"
 #include "plugins.h"
 #include "redirect_cache.h"
+#include "rulematch.h"
 #include "log.h"
 
 /* Plug-in identification */
@@ -61,6 +62,7 @@ static struct plugin_config {
    stringa_t regex_desc;
    stringa_t regex_pattern;
    stringa_t regex_replace;
+   int  cache_size;
 } plugin_cfg;
 
 /* Instructions for config parser */
@@ -68,21 +70,32 @@ static cfgopts_t plugin_cfg_opts[] = {
    { "plugin_regex_desc",     TYP_STRINGA,&plugin_cfg.regex_desc,	{0, NULL} },
    { "plugin_regex_pattern",  TYP_STRINGA,&plugin_cfg.regex_pattern,	{0, NULL} },
    { "plugin_regex_replace",  TYP_STRINGA,&plugin_cfg.regex_replace,	{0, NULL} },
+   { "plugin_regex_cache_size", TYP_INT4, &plugin_cfg.cache_size,	{256, NULL} },
    {0, 0, 0}
 };
 
 /* local storage needed for regular expression handling */
-static regex_t *re;
+static rulematch_t *rules;
 /* Redirect Cache: Queue Head is static */
 static redirected_cache_element_t redirected_cache;
 
+/* character workspaces for regex, one set per SIP worker */
+#define WORKSPACE_SIZE 128
+#define NMATCHES 10
+typedef struct {
+   char in[WORKSPACE_SIZE+1];
+   char rp[WORKSPACE_SIZE+1];
+} regex_worker_t;
+
 
 /* local prototypes */
 static int plugin_regex_init(void);
 static int plugin_regex_process(sip_ticket_t *ticket);
 static int plugin_regex_redirect(sip_ticket_t *ticket);
-static regmatch_t * rmatch (char *buf, int size, regex_t *re);
-static int rreplace (char *buf, int size, regex_t *re, regmatch_t pmatch[], char *rp);
+static void *plugin_regex_worker_init(int worker);
+static void plugin_regex_worker_end(int worker, void *ctx);
+static int rreplace (char *buf, int size, regex_t *re, regmatch_t pmatch[],
+                     char *rp, int matched);
 
 
 /* 
@@ -94,6 +107,13 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
    plugin_def->name=name;
    plugin_def->desc=desc;
    plugin_def->exe_mask=PLUGIN_DETERMINE_TARGET;
+   plugin_def->filter=PLUGIN_FLT_REQUEST|PLUGIN_FLT_INVITE|PLUGIN_FLT_ACK|
+                      PLUGIN_FLT_OUTGOING;
+   /* rule set and caches are thread safe, workspaces are per worker -
+    * but sip_gen_response() is not reentrant */
+   plugin_def->mt_level=PLUGIN_MT_SERIAL;
+   plugin_def->worker_init=plugin_regex_worker_init;
+   plugin_def->worker_end=plugin_regex_worker_end;
 
    /* read the config file */
    if (read_config(configuration.configfile,
@@ -115,15 +135,9 @@ int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
 
 /* De-Initialization */
 int  PLUGIN_END(plugin_def_t *plugin_def){
-   int i;
-   int num_entries;
-
    /* free space for regexes */
-   num_entries = plugin_cfg.regex_pattern.used;
-   for (i=0; i < num_entries; i++) {
-      regfree(&re[i]);
-   }
-   free(re);
+   rulematch_free(rules);
+   rules=NULL;
    return STS_SUCCESS;
 }
 
@@ -132,12 +146,7 @@ int  PLUGIN_END(plugin_def_t *plugin_def){
  * Workload code
  */
 static int plugin_regex_init(void) {
-   int i;
-   int sts, retsts;
-   int num_entries;
-   char errbuf[256];
-
-   retsts = STS_SUCCESS;
+   int sts;
 
    /* check for equal entries of patterns and replacements */
    if (plugin_cfg.regex_pattern.used != plugin_cfg.regex_replace.used) {
@@ -154,22 +163,28 @@ static int plugin_regex_init(void) {
       return STS_FAILURE;
    }
 
-   /* allocate space for regexes and compile them */
-   num_entries = plugin_cfg.regex_pattern.used;
-   re = malloc(num_entries*sizeof(re[0]));
-   for (i=0; i < num_entries; i++) {
-      sts = regcomp (&re[i], plugin_cfg.regex_pattern.string[i],
-                     REG_ICASE|REG_EXTENDED);
-      if (sts != 0) {
-         regerror(sts, &re[i], errbuf, sizeof(errbuf));
-         ERROR("Regular expression [%s] failed to compile: %s", 
-               plugin_cfg.regex_pattern.string[i], errbuf);
-         retsts = STS_FAILURE;
-      }
-   }
-   
-   return retsts;
+   /* compile the regexes into one rule set */
+   sts = rulematch_compile(&rules, plugin_cfg.regex_pattern.used,
+                           plugin_cfg.regex_pattern.string,
+                           REG_ICASE|REG_EXTENDED);
+
+   /* cache of rewrite results, dropped with the compiled rules */
+   rulematch_cache_init(rules, plugin_cfg.cache_size);
+   return sts;
 }
+
+static void *plugin_regex_worker_init(int worker) {
+   regex_worker_t *ctx;
+
+   ctx=malloc(sizeof(regex_worker_t));
+   if (ctx == NULL) ERROR("Plugin '%s': out of memory", name);
+   return ctx;
+}
+
+static void plugin_regex_worker_end(int worker, void *ctx) {
+   free(ctx);
+}
+
 /* returns STS_SIP_SENT if processing is to be terminated,
  * otherwise STS_SUCCESS (go on with processing) */
 /* code (entry point) */
@@ -187,14 +202,8 @@ static int plugin_regex_process(sip_ticket_t *ticket) {
    req_url=osip_message_get_uri(ticket->sipmsg);
    to_url=osip_to_get_url(ticket->sipmsg);
 
-   /* only outgoing direction is handled */
-   sip_find_direction(ticket, NULL);
-   if (ticket->direction != DIR_OUTGOING)
-      return STS_SUCCESS;
-
-   /* only INVITE and ACK are handled */
-   if (!MSG_IS_INVITE(ticket->sipmsg) && !MSG_IS_ACK(ticket->sipmsg))
-      return STS_SUCCESS;
+   /* only outgoing INVITE and ACK requests are handled,
+    * siproxd filters them for us (plugin_def->filter) */
 
    /* expire old cache entries */
    expire_redirected_cache(&redirected_cache);
@@ -261,9 +270,18 @@ static int plugin_regex_redirect(sip_ticket_t *ticket) {
    osip_uri_t *new_to_url;
    int  i, sts;
    osip_contact_t *contact = NULL;
-   /* character workspaces for regex */
-   #define WORKSPACE_SIZE 128
-   static char in[WORKSPACE_SIZE+1], rp[WORKSPACE_SIZE+1];
+   regex_worker_t *ctx = ticket->plugin_ctx;
+   char *in;
+   char *rp;
+   regmatch_t pmatch[NMATCHES];
+
+   /* no workspace - plugin_workers_init() has not been called */
+   if (ctx == NULL) {
+      ERROR("plugin_regex: no worker context, not redirecting");
+      return STS_SUCCESS;
+   }
+   in = ctx->in;
+   rp = ctx->rp;
 
    /* do apply to full To URI... */
    sts = osip_uri_to_str(to_url, &url_string);
@@ -273,11 +291,25 @@ static int plugin_regex_redirect(sip_ticket_t *ticket) {
    }
    DEBUGC(DBCLASS_BABBLE, "To URI string: [%s]", url_string);
 
-   /* perform search and replace of the regexes, first match hits */
-   for (i = 0; i < plugin_cfg.regex_pattern.used; i++) {
-      regmatch_t *pmatch = NULL;
-      pmatch = rmatch(url_string, WORKSPACE_SIZE, &re[i]);
-      if (pmatch == NULL) continue; /* no match, next */
+   /* same To URI seen before? */
+   if (rulematch_cache_get(rules, url_string, &i, in,
+                           WORKSPACE_SIZE+1) == STS_SUCCESS) {
+      DEBUGC(DBCLASS_PLUGIN, "rewrite result from cache, rule %i", i);
+      if ((i < 0) || (in[0] == '\0')) {
+         /* no match */
+         osip_free(url_string);
+         return STS_SUCCESS;
+      }
+      INFO("Matched rexec rule: %s",plugin_cfg.regex_desc.string[i] );
+   } else {
+      /* search the first matching regex */
+      i = rulematch_exec(rules, url_string, NMATCHES, pmatch);
+      if (i < 0) {
+         /* no match */
+         rulematch_cache_put(rules, url_string, -1, NULL);
+         osip_free(url_string);
+         return STS_SUCCESS;
+      }
 
       /* have a match, do the replacement */
       INFO("Matched rexec rule: %s",plugin_cfg.regex_desc.string[i] );
@@ -286,7 +318,9 @@ static int plugin_regex_redirect(sip_ticket_t *ticket) {
       strncpy (rp, plugin_cfg.regex_replace.string[i], WORKSPACE_SIZE);
       rp[WORKSPACE_SIZE]='\0';
 
-      sts = rreplace(in, WORKSPACE_SIZE, &re[i], pmatch, rp);
+      /* the match can be reused unless the URI did not fit into 'in' */
+      sts = rreplace(in, WORKSPACE_SIZE, &rules->re[i], pmatch, rp,
+                     (strlen(url_string) <= WORKSPACE_SIZE));
       if (sts != STS_SUCCESS) {
          ERROR("regex replace failed: pattern:[%s] replace:[%s]",
                plugin_cfg.regex_pattern.string[i],
@@ -294,13 +328,7 @@ static int plugin_regex_redirect(sip_ticket_t *ticket) {
          osip_free(url_string);
          return STS_FAILURE;
       }
-      /* only do first match */
-      break;
-   }
-   if (i >= plugin_cfg.regex_pattern.used) {
-      /* no match */
-      osip_free(url_string);
-      return STS_SUCCESS;
+      rulematch_cache_put(rules, url_string, i, in);
    }
    /* in: contains the new string */
 
@@ -368,26 +396,18 @@ static int plugin_regex_redirect(sip_ticket_t *ticket) {
  * size: size of buf and rp
  * re: regex to process
  *
- * rmatch() performs the initial regexec match, and if a match is found
- * it returns a pointer to the regmatch array which contains the result
- * of the match.
- * Afterwards rreplace() is to be called, providing this regmatch array.
+ * matched: pmatch[] holds the result of regexec() on 'buf'
+ *
+ * The initial match is done by rulematch_exec(), which returns the
+ * regmatch array of the matching rule. Afterwards rreplace() is to be
+ * called, providing this regmatch array.
  *
  * This eliminates the need to copy the 'rp' string before knowing
- * if a match is actually there.
+ * if a match is actually there. If 'matched' is set, the first
+ * replacement uses pmatch[0] instead of running regexec() again.
  */
-#define NMATCHES 10
-static regmatch_t * rmatch (char *buf, int size, regex_t *re) {
-   static regmatch_t pm[NMATCHES]; /* regoff_t is int so size is int */
-
-   /* perform the match */
-   if (regexec (re, buf, NMATCHES, pm, 0)) {
-      return NULL;
-   }
-   return &pm[0];
-}
-
-static int rreplace (char *buf, int size, regex_t *re, regmatch_t pmatch[], char *rp) {
+static int rreplace (char *buf, int size, regex_t *re, regmatch_t pmatch[],
+                     char *rp, int matched) {
    char *pos;
    int sub, so, n;
 
@@ -406,7 +426,7 @@ static int rreplace (char *buf, int size, regex_t *re, regmatch_t pmatch[], char
 
    sub = pmatch[1].rm_so; /* no repeated replace when sub >= 0 */
    /* and replace rp in the input buffer */
-   for (pos = buf; !regexec (re, pos, 1, pmatch, 0); ) {
+   for (pos = buf; matched || !regexec (re, pos, 1, pmatch, 0); matched=0) {
       n = pmatch[0].rm_eo - pmatch[0].rm_so;
       pos += pmatch[0].rm_so;
       if (strlen (buf) - n + strlen (rp) > size) {
@@ -35,6 +35,7 @@
 
 #include "siproxd.h"
 #include "plugins.h"
+#include "rulematch.h"
 #include "log.h"
 
 /* Plug-in identification */
@@ -50,6 +51,7 @@ static struct plugin_config {
    stringa_t trunk_name;
    stringa_t trunk_account;
    stringa_t trunk_numbers_regex;
+   int  cache_size;
 } plugin_cfg;
 
 /* Instructions for config parser */
@@ -57,16 +59,17 @@ static cfgopts_t plugin_cfg_opts[] = {
    { "plugin_siptrunk_name",          TYP_STRINGA,&plugin_cfg.trunk_name,	{0, NULL} },
    { "plugin_siptrunk_account",       TYP_STRINGA,&plugin_cfg.trunk_account,	{0, NULL} },
    { "plugin_siptrunk_numbers_regex", TYP_STRINGA,&plugin_cfg.trunk_numbers_regex,	{0, NULL} },
+   { "plugin_siptrunk_cache_size",    TYP_INT4,   &plugin_cfg.cache_size,	{256, NULL} },
    {0, 0, 0}
 };
 
 /* local storage needed for regular expression handling */
-static regex_t *re;
+static rulematch_t *rules;
 
 /* Prototypes */
 static int plugin_siptrunk_init(void);
 static int plugin_siptrunk_process(sip_ticket_t *ticket);
-static regmatch_t * rmatch (char *buf, regex_t *re);
+static int rmatch (char *buf);
 
 
 /* 
@@ -86,6 +89,13 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
    /* Execution mask - during what stages of SIP processing shall
     * the plugin be called. */
    plugin_def->exe_mask=PLUGIN_PRE_PROXY;
+   /* reads the urlmap (changed by register_client()) and calls
+    * get_ip_by_host(), which uses the DNS park state of the SIP thread */
+   plugin_def->mt_level=PLUGIN_MT_SERIAL;
+
+   /* Message filter - only requests with a direction that siproxd
+    * could not determine are of interest */
+   plugin_def->filter=PLUGIN_FLT_REQUEST|PLUGIN_FLT_UNKNOWN;
 
    /* read the config file */
    if (read_config(configuration.configfile,
@@ -114,15 +124,9 @@ int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
  * connections, whatever the plugin messes around with)
  */
 int  PLUGIN_END(plugin_def_t *plugin_def){
-   int i;
-   int num_entries;
-
    /* free space for regexes */
-   num_entries = plugin_cfg.trunk_numbers_regex.used;
-   for (i=0; i < num_entries; i++) {
-      regfree(&re[i]);
-   }
-   free(re);
+   rulematch_free(rules);
+   rules=NULL;
 
    return STS_SUCCESS;
 }
@@ -132,12 +136,9 @@ int  PLUGIN_END(plugin_def_t *plugin_def){
  * Workload code
  */
 static int plugin_siptrunk_init(void) {
+   int sts;
    int i;
-   int sts, retsts;
-   int num_entries;
-   char errbuf[256];
-
-   retsts = STS_SUCCESS;
+   osip_uri_t *url = NULL;
 
    /* check for equal entries of trunk_name and trunk_account */
    if (plugin_cfg.trunk_name.used != plugin_cfg.trunk_account.used) {
@@ -154,26 +155,34 @@ static int plugin_siptrunk_init(void) {
       return STS_FAILURE;
    }
 
-   /* allocate space for regexes and compile them */
-   num_entries = plugin_cfg.trunk_numbers_regex.used;
-   re = malloc(num_entries*sizeof(re[0]));
-   for (i=0; i < num_entries; i++) {
-      sts = regcomp (&re[i], plugin_cfg.trunk_numbers_regex.string[i],
-                     REG_ICASE|REG_EXTENDED);
-      if (sts != 0) {
-         regerror(sts, &re[i], errbuf, sizeof(errbuf));
-         ERROR("Regular expression [%s] failed to compile: %s", 
-               plugin_cfg.trunk_numbers_regex.string[i], errbuf);
-         retsts = STS_FAILURE;
+   /* compile the regexes into one rule set */
+   sts = rulematch_compile(&rules, plugin_cfg.trunk_numbers_regex.used,
+                           plugin_cfg.trunk_numbers_regex.string,
+                           REG_ICASE|REG_EXTENDED);
+   DEBUGC(DBCLASS_PLUGIN, "plugin_siptrunk: %i regular expressions compiled",
+          plugin_cfg.trunk_numbers_regex.used);
+
+   /* a trunk whose account does not parse is skipped, the next
+    * matching rule is used instead */
+   for (i=0; i < plugin_cfg.trunk_account.used; i++) {
+      osip_uri_init(&url);
+      if (osip_uri_parse(url, plugin_cfg.trunk_account.string[i]) != 0) {
+         WARN("parsing plugin_siptrunk_account [%s] failed.",
+              plugin_cfg.trunk_account.string[i]);
+         rulematch_disable(rules, i);
       }
+      osip_uri_free(url);
+      url=NULL;
    }
-   DEBUGC(DBCLASS_PLUGIN, "plugin_siptrunk: %i regular expressions compiled", i);
-   return retsts;
+
+   /* cache of match results, dropped with the compiled rules */
+   rulematch_cache_init(rules, plugin_cfg.cache_size);
+   return sts;
 }
 
 static int plugin_siptrunk_process(sip_ticket_t *ticket) {
    int sts=STS_SUCCESS;
-   int i, j;
+   int i, j, k;
    osip_uri_t *req_url = NULL;
    osip_uri_t *to_url = NULL;
    osip_uri_t *url = NULL;
@@ -207,23 +216,17 @@ static int plugin_siptrunk_process(sip_ticket_t *ticket) {
          DEBUGC(DBCLASS_BABBLE, "To: header: [%s]", to_url->username);
       }
 
-      /* Loop through config array */
-      for (i = 0; i < plugin_cfg.trunk_numbers_regex.used; i++) {
-         regmatch_t *pmatch_uri = NULL;
-         regmatch_t *pmatch_to  = NULL;
-
-         /* check SIP URI */
-         if (req_url && req_url->username) {
-            pmatch_uri = rmatch(req_url->username, &re[i]);
-         }
-
-         /* check To: URI */
-         if (to_url && to_url->username) {
-            pmatch_to = rmatch(to_url->username, &re[i]);
-         }
-
-         if ((pmatch_uri == NULL) && (pmatch_to == NULL)) continue;
+      /* first rule matching the SIP URI or the To: URI */
+      i = -1;
+      if (req_url && req_url->username) {
+         i = rmatch(req_url->username);
+      }
+      if (to_url && to_url->username) {
+         k = rmatch(to_url->username);
+         if ((k >= 0) && ((i < 0) || (k < i))) i = k;
+      }
 
+      if (i >= 0) {
          /* have a match */
          DEBUGC(DBCLASS_PLUGIN, "plugin_siptrunk: matched trunk on rule %i [%s]",
                 i, plugin_cfg.trunk_numbers_regex.string[i] );
@@ -238,50 +241,43 @@ static int plugin_siptrunk_process(sip_ticket_t *ticket) {
          if (sts != 0) {
             WARN("parsing plugin_siptrunk_account [%s] failed.", 
                  plugin_cfg.trunk_account.string[i]);
-            continue;
-         }
-
-         /* search for an Account entry in registration DB */
-         for (j=0; j<URLMAP_SIZE; j++){
-            if (urlmap[j].active == 0) continue;
-            if (urlmap[j].expires < ticket->timestamp) continue;
-
-            if (compare_url(url, urlmap[j].reg_url) == STS_SUCCESS) {
-               DEBUGC(DBCLASS_PLUGIN, "plugin_siptrunk: found registered client, idx=%i",j);
-
-               /* set ticket->direction == REQTYP_INCOMING */
-               ticket->direction = REQTYP_INCOMING;
-
-               /* set next jop host & port */
-               sts = get_ip_by_host(osip_uri_get_host(urlmap[j].true_url), 
-                                    &ticket->next_hop.sin_addr);
-               if (sts == STS_FAILURE) {
-                  DEBUGC(DBCLASS_PROXY, "plugin_siptrunk: cannot resolve URI [%s]",
-                         osip_uri_get_host(urlmap[j].true_url));
-                  return STS_FAILURE;
-               }
+         } else {
+            /* search for an Account entry in registration DB */
+            for (j=0; j<URLMAP_SIZE; j++){
+               if (urlmap[j].active == 0) continue;
+               if (urlmap[j].expires < ticket->timestamp) continue;
+
+               if (compare_url(url, urlmap[j].reg_url) == STS_SUCCESS) {
+                  DEBUGC(DBCLASS_PLUGIN, "plugin_siptrunk: found registered client, idx=%i",j);
+
+                  /* set ticket->direction == REQTYP_INCOMING */
+                  ticket->direction = REQTYP_INCOMING;
+
+                  /* set next jop host & port */
+                  sts = get_ip_by_host(osip_uri_get_host(urlmap[j].true_url), 
+                                       &ticket->next_hop.sin_addr);
+                  if (sts == STS_FAILURE) {
+                     DEBUGC(DBCLASS_PROXY, "plugin_siptrunk: cannot resolve URI [%s]",
+                            osip_uri_get_host(urlmap[j].true_url));
+                     osip_uri_free(url);
+                     return STS_FAILURE;
+                  }
 
-               ticket->next_hop.sin_port=SIP_PORT;
-               if (osip_uri_get_port(urlmap[j].true_url)) {
-                  ticket->next_hop.sin_port=atoi(osip_uri_get_port(urlmap[j].true_url));
-                  if (ticket->next_hop.sin_port == 0) {
-                     ticket->next_hop.sin_port=SIP_PORT;
+                  ticket->next_hop.sin_port=SIP_PORT;
+                  if (osip_uri_get_port(urlmap[j].true_url)) {
+                     ticket->next_hop.sin_port=atoi(osip_uri_get_port(urlmap[j].true_url));
+                     if (ticket->next_hop.sin_port == 0) {
+                        ticket->next_hop.sin_port=SIP_PORT;
+                     }
                   }
-               }
 
-               break;
-            }
+                  break;
+               }
          
+            }
          }
          if (url) {osip_uri_free(url);}
-
-
-         /* only do first match, then break */
-         break;
-      } /* end for i */
-
-
-      if (i >= plugin_cfg.trunk_numbers_regex.used) {
+      } else {
          DEBUGC(DBCLASS_PLUGIN, "plugin_siptrunk: no match");
       }
 
@@ -297,28 +293,23 @@ static int plugin_siptrunk_process(sip_ticket_t *ticket) {
 }
 
 /*
- * This regex replacement code has been proudly borrowed from
- * http://www.daniweb.com/software-development/c/code/216955#
- *
- * buf: input string + output result
- * rp: replacement string, will be destroyed during processing!
- * size: size of buf and rp
- * re: regex to process
+ * rmatch() finds the first configured trunk whose number regex
+ * matches 'buf'. All rules are looked up at once in the compiled
+ * rule set (see rulematch.c), only the submatches are not needed.
+ * Numbers seen before are answered from the result cache.
  *
- * rmatch() performs the initial regexec match, and if a match is found
- * it returns a pointer to the regmatch array which contains the result
- * of the match.
- *
- * This eliminates the need to copy the 'rp' string before knowing
- * if a match is actually there.
+ * RETURNS
+ *	index of the matching rule
+ *	-1 if no rule matches
  */
-#define NMATCHES 10
-static regmatch_t * rmatch (char *buf, regex_t *re) {
-   static regmatch_t pm[NMATCHES]; /* regoff_t is int so size is int */
+static int rmatch (char *buf) {
+   regmatch_t pm[1];
+   int i;
 
-   /* perform the match */
-   if (regexec (re, buf, NMATCHES, pm, 0)) {
-      return NULL;
+   if (rulematch_cache_get(rules, buf, &i, NULL, 0) == STS_SUCCESS) {
+      return i;
    }
-   return &pm[0];
+   i = rulematch_exec(rules, buf, 1, pm);
+   rulematch_cache_put(rules, buf, i, NULL);
+   return i;
 }
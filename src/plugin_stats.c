@@ -90,6 +90,7 @@ static void stats_sighandler(int sig);
 static void stats_prepare(void);
 static void stats_to_syslog(void);
 static void stats_to_file(void);
+static unsigned long stats_prof_avg(plugin_profile_t *prof);
 
 /* 
  * Initialization.
@@ -110,6 +111,8 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
    /* Execution mask - during what stages of SIP processing shall
     * the plugin be called. */
    plugin_def->exe_mask=PLUGIN_TIMER;
+   /* PLUGIN_TIMER only, always called by the main thread */
+   plugin_def->mt_level=PLUGIN_MT_SAFE;
 
    /* read the config file */
    if (read_config(configuration.configfile,
@@ -404,8 +407,46 @@ static void stats_prepare(void) {
 }
 
 static void stats_to_syslog(void) {
+   dnscache_stats_t dns;
+   auth_stats_t auth;
+   prefilter_stats_t pf;
+   ratelimit_stats_t rl;
+   rulematch_stats_t rm;
+   plugin_profile_t prof;
+   int i;
+
    INFO("STATS: %i active Streams, %i active Calls, %i active Clients, %i registered Clients", 
         stats_num_streams, stats_num_calls, stats_num_act_clients, stats_num_reg_clients);
+
+   dnscache_get_stats(&dns);
+   INFO("STATS: DNS cache %lu hits, %lu misses, %lu refreshes, %lu stale, %lu refresh failures",
+        dns.hits, dns.misses, dns.refreshes, dns.stale, dns.refresh_failures);
+
+   auth_get_stats(&auth);
+   INFO("STATS: auth cache %lu hits, %lu misses, %lu inserts, %lu evictions",
+        auth.hits, auth.misses, auth.inserts, auth.evictions);
+
+   prefilter_get_stats(&pf);
+   INFO("STATS: prefilter %lu rate limited, %lu malformed, %lu UA blocked",
+        pf.rate_limited, pf.malformed, pf.ua_blocked);
+
+   ratelimit_get_stats(&rl);
+   INFO("STATS: rate limits %lu source, %lu AOR exceeded, %lu 503 sent, "
+        "%lu dropped, %lu evictions", rl.limited_source, rl.limited_aor,
+        rl.replied, rl.dropped, rl.evictions);
+
+   rulematch_get_stats(&rm);
+   INFO("STATS: rewrite cache %lu hits, %lu misses, %lu inserts, %lu evictions",
+        rm.hits, rm.misses, rm.inserts, rm.evictions);
+
+   for (i=0; plugin_get_profile(i, &prof) == STS_SUCCESS; i++) {
+      if ((prof.calls == 0) && (prof.filtered == 0)) continue;
+      INFO("STATS: plugin %s stage 0x%X: %lu calls, %lu filtered, "
+           "avg %lu us, max %lu us, %lu success, %lu failure, %lu sent, "
+           "%lu other", prof.name, prof.stage, prof.calls, prof.filtered,
+           stats_prof_avg(&prof)/1000, prof.max_ns/1000, prof.sts_success,
+           prof.sts_failure, prof.sts_sip_sent, prof.sts_other);
+   }
 }
 
 static void stats_to_file(void) {
@@ -415,6 +456,12 @@ static void stats_to_file(void) {
    char remip[IPSTRING_SIZE];
    char lclip[IPSTRING_SIZE];
    time_t now;
+   dnscache_stats_t dns;
+   auth_stats_t auth;
+   prefilter_stats_t pf;
+   ratelimit_stats_t rl;
+   rulematch_stats_t rm;
+   plugin_profile_t prof;
 
    if (plugin_cfg.filename) {
       DEBUGC(DBCLASS_PLUGIN,"opening stats file for write");
@@ -444,6 +491,53 @@ static void stats_to_file(void) {
       fprintf(stream, "active Calls:       %6i\n", stats_num_calls);
       fprintf(stream, "active Streams:     %6i\n", stats_num_streams);
 
+      dnscache_get_stats(&dns);
+      fprintf(stream, "\nDNS cache\n---------\n");
+      fprintf(stream, "hits:               %6lu\n", dns.hits);
+      fprintf(stream, "misses:             %6lu\n", dns.misses);
+      fprintf(stream, "refreshes:          %6lu\n", dns.refreshes);
+      fprintf(stream, "stale answers:      %6lu\n", dns.stale);
+      fprintf(stream, "refresh failures:   %6lu\n", dns.refresh_failures);
+
+      auth_get_stats(&auth);
+      fprintf(stream, "\nAuthentication cache\n--------------------\n");
+      fprintf(stream, "hits:               %6lu\n", auth.hits);
+      fprintf(stream, "misses:             %6lu\n", auth.misses);
+      fprintf(stream, "inserts:            %6lu\n", auth.inserts);
+      fprintf(stream, "evictions:          %6lu\n", auth.evictions);
+
+      prefilter_get_stats(&pf);
+      fprintf(stream, "\nPrefilter\n---------\n");
+      fprintf(stream, "rate limited:       %6lu\n", pf.rate_limited);
+      fprintf(stream, "malformed:          %6lu\n", pf.malformed);
+      fprintf(stream, "UA blocked:         %6lu\n", pf.ua_blocked);
+
+      ratelimit_get_stats(&rl);
+      fprintf(stream, "\nRate limits\n-----------\n");
+      fprintf(stream, "source exceeded:    %6lu\n", rl.limited_source);
+      fprintf(stream, "AOR exceeded:       %6lu\n", rl.limited_aor);
+      fprintf(stream, "503 sent:           %6lu\n", rl.replied);
+      fprintf(stream, "dropped:            %6lu\n", rl.dropped);
+      fprintf(stream, "evictions:          %6lu\n", rl.evictions);
+
+      rulematch_get_stats(&rm);
+      fprintf(stream, "\nRewrite cache (plugin_regex, plugin_siptrunk)\n"
+                      "---------------------------------------------\n");
+      fprintf(stream, "hits:               %6lu\n", rm.hits);
+      fprintf(stream, "misses:             %6lu\n", rm.misses);
+      fprintf(stream, "inserts:            %6lu\n", rm.inserts);
+      fprintf(stream, "evictions:          %6lu\n", rm.evictions);
+
+      fprintf(stream, "\nPlugin profile (times in ns)\n----------------------------\n");
+      fprintf(stream, "Header; Plugin; Stage; Calls; Filtered; Timed; Avg; Max; "
+                      "Success; Failure; SIP sent; Other\n");
+      for (i=0; plugin_get_profile(i, &prof) == STS_SUCCESS; i++) {
+         fprintf(stream, "Data;%s;0x%X;%lu;%lu;%lu;%lu;%lu;%lu;%lu;%lu;%lu\n",
+                 prof.name, prof.stage, prof.calls, prof.filtered, prof.timed,
+                 stats_prof_avg(&prof), prof.max_ns, prof.sts_success,
+                 prof.sts_failure, prof.sts_sip_sent, prof.sts_other);
+      }
+
 #if 0
 //&&& future feature:
       fprintf(stream, "\nRegistered Clients\n------------------\n");
@@ -483,3 +577,14 @@ static void stats_to_file(void) {
    }
    return;
 }
+
+/*
+ * average time of the timed invocations
+ *
+ * RETURNS
+ *	average in ns, 0 if nothing has been timed
+ */
+static unsigned long stats_prof_avg(plugin_profile_t *prof) {
+   if (prof->timed == 0) return 0;
+   return (unsigned long)(prof->total_ns / prof->timed);
+}
@@ -60,6 +60,10 @@ static cfgopts_t plugin_cfg_opts[] = {
  * Called once suring siproxd startup.
  */
 int  PLUGIN_INIT(plugin_def_t *plugin_def) {
+   char hname[64];
+   size_t len;
+   int i;
+
    /* API version number of siproxd that this plugin is built against.
     * This constant will change whenever changes to the API are made
     * that require adaptions in the plugin. */
@@ -72,6 +76,7 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
    /* Execution mask - during what stages of SIP processing shall
     * the plugin be called. */
    plugin_def->exe_mask=PLUGIN_PRE_PROXY;
+   plugin_def->mt_level=PLUGIN_MT_SAFE;
 
    /* read the config file */
    if (read_config(configuration.configfile,
@@ -81,6 +86,15 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
       return STS_FAILURE;
    }
 
+   /* headers to be removed must be parsed (lazy parsing) */
+   for (i=0; i<plugin_cfg.header_remove.used; i++) {
+      len=strcspn(plugin_cfg.header_remove.string[i], ":");
+      if (len >= sizeof(hname)) continue;
+      memcpy(hname, plugin_cfg.header_remove.string[i], len);
+      hname[len]='\0';
+      sip_want_header(hname);
+   }
+
    INFO("%s is initialized", name);
    return STS_SUCCESS;
 }
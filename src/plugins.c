@@ -20,9 +20,13 @@
 
 #include "config.h"
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <netinet/in.h>
@@ -41,11 +45,110 @@ extern struct siproxd_config configuration;
 /* Plugin "database" - queue header */
 plugin_def_t *siproxd_plugins=NULL;
 
+/*
+ * Per stage dispatch tables, built once after loading: for each
+ * PLUGIN_* stage bit a NULL terminated array of the plugins that
+ * want to be called in this stage, in the order of loading.
+ */
+#define PLUGIN_STAGES	9		/* bit positions of PLUGIN_* stages */
+static plugin_def_t **plugin_stage[PLUGIN_STAGES];
+
+/*
+ * Plugin profile, plugin_prof[stage][n] belongs to plugin_stage[stage][n].
+ * With plugin_profile=1 (PLUGIN_PROF_SAMPLED) all calls are counted but
+ * only every PLUGIN_PROF_SAMPLE-th call of a plugin is timed, so the
+ * clock is rarely read and it can be left enabled in production.
+ */
+#define PLUGIN_PROF_SAMPLE	64
+static plugin_profile_t *plugin_prof[PLUGIN_STAGES];
+
+/*
+ * Number of SIP workers that call the plugins (plugin_workers_init()).
+ * More than one only if all plugins are PLUGIN_MT_SAFE, others are
+ * called by the SIP thread (worker 0) only. The plugin profile and
+ * the suspended messages below are kept by the main loop (worker 0).
+ */
+static int plugin_workers=1;
+
+/*
+ * Suspended SIP messages (asynchronous plugins, see plugins.h)
+ *
+ * A job is created by plugin_suspend(), at the end of the pass
+ * the raw message is stored with it (PARKED). Once the plugin has
+ * called plugin_complete(), the main loop picks the message up
+ * again (RESUMED). A resumed message may be suspended again by
+ * another plugin, the new job then links the earlier ones (prev),
+ * so each plugin finds its own result in every later pass.
+ * If a resumed message gets parked by the DNS cache, its jobs keep
+ * a copy of it (DNSPARKED) and are attached again when the DNS cache
+ * hands the message back (plugin_async_dns_resumed()).
+ * The plugin gets a handle with the slot and a generation number,
+ * a late plugin_complete() of a dropped job does not touch a slot
+ * that has been reused in the meantime.
+ */
+#define PLUGIN_ASYNC_SIZE	64	/* max number of suspended messages */
+#define PLUGIN_ASYNC_MAXCOUNT	3	/* max times a message is suspended */
+#define PLUGIN_ASYNC_TIMEOUT	32	/* drop messages older than (sec) */
+#define PLUGIN_JOB_SLOTBITS	8	/* handle: generation << 8 | slot */
+
+#define PLUGIN_JOB_FREE		0
+#define PLUGIN_JOB_RUNNING	1	/* suspended in the current pass */
+#define PLUGIN_JOB_PARKED	2	/* waiting for plugin_complete() */
+#define PLUGIN_JOB_RESUMED	3	/* message is processed again */
+#define PLUGIN_JOB_DNSPARKED	4	/* resumed message waits for DNS */
+
+typedef struct plugin_async_s plugin_async_t;
+
+struct plugin_async_s {
+   int    state;		/* PLUGIN_JOB_* */
+   plugin_job_t handle;		/* handle given to the plugin */
+   int    completed;		/* plugin_complete() was called */
+   int    stage;		/* index into plugin_stage[] */
+   int    index;		/* position in plugin_stage[stage] */
+   int    count;		/* times this message has been suspended */
+   plugin_resume_t resume;	/* completion callback of the plugin */
+   void   *arg;
+   struct plugin_async_s *prev;	/* earlier job of the same message */
+   char   *raw_buffer;		/* copy of the raw message, NULL: drop */
+   size_t raw_buffer_len;
+   struct sockaddr_in from;
+   int    protocol;
+   time_t timestamp;		/* message first received */
+};
+
+static plugin_async_t plugin_job[PLUGIN_ASYNC_SIZE];
+static int plugin_job_parked=0;
+static int plugin_job_dnsparked=0;
+static unsigned int plugin_job_generation=0;
+/* protects plugin_job[].completed and .handle, used by the plugins
+ * threads in plugin_complete() */
+static pthread_mutex_t plugin_job_mutex=PTHREAD_MUTEX_INITIALIZER;
+static int plugin_notify_pipe[2]={-1, -1};
+
+/* state of the message that is currently processed by the SIP thread */
+static plugin_async_t *job_chain=NULL;	/* jobs of a resumed message */
+static plugin_async_t *job_new=NULL;	/* job created in this pass */
+static int job_stage=-1;		/* stage index of the called plugin */
+static int job_index=-1;		/* its position in the table */
+
 /* code */
 typedef int (*func_plugin_init_t)(plugin_def_t *plugin_def);
 typedef int (*func_plugin_process_t)(int stage, sip_ticket_t *ticket);
 typedef int (*func_plugin_end_t)(plugin_def_t *plugin_def);
 
+/* local prototypes */
+static int build_dispatch_tables(void);
+static int plugin_filter_match(int filter, sip_ticket_t *ticket);
+static int plugin_classify(osip_message_t *sipmsg);
+static int plugin_profile_call(plugin_profile_t *prof,
+                               func_plugin_process_t plugin_process,
+                               int stage, sip_ticket_t *ticket);
+static unsigned long long plugin_prof_clock(void);
+static plugin_async_t *plugin_job_find(int stage, int index);
+static void plugin_job_store(plugin_async_t *job, sip_ticket_t *ticket);
+static void plugin_job_release(plugin_async_t *job);
+static int plugin_mt_lock_init(plugin_def_t *plugin_def);
+
 
 /* 
  * Load the plugins in the order as specified in the config file.
@@ -64,6 +167,14 @@ int load_plugins (void) {
    func_plugin_process_t plugin_process = NULL;
    func_plugin_end_t plugin_end         = NULL;
 
+   /* wake up pipe for completed asynchronous plugin jobs */
+   if (pipe(plugin_notify_pipe) != 0) {
+      ERROR("failed to create plugin notification pipe");
+      return STS_FAILURE;
+   }
+   fcntl(plugin_notify_pipe[0], F_SETFL, O_NONBLOCK);
+   fcntl(plugin_notify_pipe[1], F_SETFL, O_NONBLOCK);
+
    /* initialize the libtool dynamic loader */
 //   LTDL_SET_PRELOADED_SYMBOLS();
    sts = lt_dlinit();
@@ -133,6 +244,15 @@ int load_plugins (void) {
             continue;
          }
 
+         /* lock for shared state and serialized calls */
+         if (plugin_mt_lock_init(cur) != STS_SUCCESS) {
+            ERROR("Plugin '%s' did fail to load.", cur->name);
+            sts=(*plugin_end)(cur);
+            free(cur);
+            lt_dlclose(handle);
+            continue;
+         }
+
          /* store the function pointers */
          cur->plugin_process = plugin_process;
          cur->plugin_end = plugin_end;
@@ -158,66 +278,189 @@ int load_plugins (void) {
          lt_dlclose(handle);
       }
    }
+   return build_dispatch_tables();
+}
+
+
+/*
+ * Create the worker contexts of the plugins for 'workers' SIP
+ * workers. Called once after load_plugins(). If a loaded plugin is
+ * not PLUGIN_MT_SAFE, only one worker (the SIP thread) is set up.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if a plugin failed to create a context
+ */
+int plugin_workers_init(int workers) {
+   plugin_def_t *cur;
+   plugin_worker_init_t worker_init;
+   void **ctx;
+   int w;
+
+   if (workers < 1) workers=1;
+   for (cur=siproxd_plugins; (cur != NULL) && (workers > 1); cur=cur->next) {
+      if (cur->mt_level != PLUGIN_MT_SAFE) {
+         WARN("plugin '%s' is not thread safe - using one SIP worker",
+              cur->name);
+         workers=1;
+      }
+   }
+   plugin_workers=workers;
+
+   for (cur=siproxd_plugins; cur != NULL; cur = cur->next) {
+      if (cur->worker_init == NULL) continue;
+      ctx=calloc(workers, sizeof(void*));
+      if (ctx == NULL) {
+         ERROR("out of memory");
+         return STS_FAILURE;
+      }
+      cur->worker_ctx=ctx;
+
+      worker_init=(plugin_worker_init_t)cur->worker_init;
+      for (w=0; w < workers; w++) {
+         ctx[w]=(*worker_init)(w);
+         if (ctx[w] == NULL) {
+            ERROR("Plugin '%s' failed to create the context of worker %i",
+                  cur->name, w);
+            return STS_FAILURE;
+         }
+      }
+   }
+   DEBUGC(DBCLASS_PLUGIN, "plugins set up for %i SIP workers", workers);
    return STS_SUCCESS;
 }
 
 
+/*
+ * Protect state of a plugin shared by the SIP workers (recursive)
+ */
+void plugin_lock(plugin_def_t *plugin_def) {
+   if (plugin_def && plugin_def->mt_lock) {
+      pthread_mutex_lock((pthread_mutex_t*)plugin_def->mt_lock);
+   }
+}
+
+
+void plugin_unlock(plugin_def_t *plugin_def) {
+   if (plugin_def && plugin_def->mt_lock) {
+      pthread_mutex_unlock((pthread_mutex_t*)plugin_def->mt_lock);
+   }
+}
+
+
 /*
  * Called at different stages of SIP processing.
  */
 int call_plugins(int stage, sip_ticket_t *ticket) {
    plugin_def_t *cur;
+   plugin_def_t **table;
+   plugin_profile_t *prof;
+   plugin_async_t *job;
    int sts;
+   int idx;
+   int n;
+   int main_worker;
    func_plugin_process_t plugin_process;
 
    /* sanity check, beware plugins from crappy stuff 
     * applies when SIP message has been parsed        */
    if ((stage > PLUGIN_PROCESS_RAW) && (!ticket || !ticket->sipmsg)) return STS_FAILURE;
 
-   /* for each plugin in plugins, do */
-   for (cur=siproxd_plugins; cur != NULL; cur = cur->next) {
-      /* check stage bitmask, if plugin wants to be called do so */
-      if (cur->exe_mask & stage) {
-         plugin_process=cur->plugin_process;
+   /* plugins that want to be called in this stage */
+   idx=ffs(stage)-1;
+   if ((idx < 0) || (idx >= PLUGIN_STAGES)) return STS_SUCCESS;
+   table=plugin_stage[idx];
+   if (table == NULL) return STS_SUCCESS;
+   main_worker=(ticket == NULL) || (ticket->worker == 0);
+
+   /* for each plugin in the dispatch table, do */
+   for (n=0; table[n] != NULL; n++) {
+      cur=table[n];
+      prof=&plugin_prof[idx][n];
+      /* check message filter, if plugin wants to be called do so */
+      if ((stage > PLUGIN_PROCESS_RAW) && cur->filter &&
+          (plugin_filter_match(cur->filter, ticket) != STS_TRUE)) {
+         if (configuration.plugin_profile && main_worker) prof->filtered++;
+         continue;
+      }
+
+      plugin_process=cur->plugin_process;
+      if (ticket) {
+         ticket->plugin_ctx=NULL;
+         if (cur->worker_ctx && (ticket->worker < plugin_workers)) {
+            ticket->plugin_ctx=((void**)cur->worker_ctx)[ticket->worker];
+         }
+      }
+      /* plugins that are not thread safe run on the SIP thread only
+       * (plugin_workers_init() does not set up more workers then) */
+      if (!main_worker && (cur->mt_level != PLUGIN_MT_SAFE)) continue;
+
+      job=(job_chain && main_worker) ? plugin_job_find(idx, n) : NULL;
+      if (job) {
+         /* suspended here in an earlier pass, the plugin continues
+          * in its completion callback */
+         sts=(*job->resume)(stage, ticket, job->arg);
+      } else if (main_worker) {
+         job_stage=idx;
+         job_index=n;
+         if (configuration.plugin_profile) {
+            sts=plugin_profile_call(prof, plugin_process, stage, ticket);
+         } else {
+            sts=(*plugin_process)(stage, ticket);
+         }
+         job_stage=-1;
+      } else {
          sts=(*plugin_process)(stage, ticket);
-         switch (stage) {
-            /* PLUGIN_PROCESS_RAW can be prematurely ended by plugin -
-               plugin determines that the UDP message is to be discarded */
-            case (PLUGIN_PROCESS_RAW):
-               /* return with the plugins status back to the caller */
-               if (sts == STS_FAILURE) {
-                  DEBUGC(DBCLASS_PLUGIN, "call_plugins: PLUGIN_PROCESS_RAW "
-                         "prematurely ending plugin processing in module "
-                         "%s sts=STS_FAILURE", cur->name);
-                  return sts;
-               }
-               break;
-            /* PLUGIN_VALIDATE can be prematurely ended by plugin -
-               plugin determines that the UDP message is to be discarded */
-            case (PLUGIN_VALIDATE):
-               /* return with the plugins status back to the caller */
-               if (sts == STS_FAILURE) {
-                  DEBUGC(DBCLASS_PLUGIN, "call_plugins: PLUGIN_VALIDATE "
-                         "prematurely ending plugin processing in module "
-                         "%s sts=STS_FAILURE", cur->name);
-                  return sts;
-               }
-               break;
-            /* PLUGIN_DETERMINE_TARGET can be prematurely ended by plugin - 
-               plugin processes and sends the final SIP message itself */
-            case (PLUGIN_DETERMINE_TARGET):
-               /* return with the plugins status back to the caller */
-               if (sts == STS_SIP_SENT) {
-                  DEBUGC(DBCLASS_PLUGIN, "call_plugins: PLUGIN_DETERMINE_TARGET "
-                         "prematurely ending plugin processing in module "
-                         "%s sts=STS_SIP_SENT", cur->name);
-                  return sts;
-               }
-               break;
-            default:
-               break;
-         } /* switch*/
-      } /* if */
+      }
+
+      /* message suspended, processing continues after plugin_complete() */
+      if (main_worker && job_new) {
+         DEBUGC(DBCLASS_PLUGIN, "call_plugins: SIP message suspended "
+                "by module %s", cur->name);
+         return STS_PLUGIN_PENDING;
+      }
+      if (sts == STS_PLUGIN_PENDING) {
+         ERROR("Plugin '%s' returned STS_PLUGIN_PENDING without calling "
+               "plugin_suspend()", cur->name);
+         sts=STS_SUCCESS;
+      }
+      switch (stage) {
+         /* PLUGIN_PROCESS_RAW can be prematurely ended by plugin -
+            plugin determines that the UDP message is to be discarded */
+         case (PLUGIN_PROCESS_RAW):
+            /* return with the plugins status back to the caller */
+            if (sts == STS_FAILURE) {
+               DEBUGC(DBCLASS_PLUGIN, "call_plugins: PLUGIN_PROCESS_RAW "
+                      "prematurely ending plugin processing in module "
+                      "%s sts=STS_FAILURE", cur->name);
+               return sts;
+            }
+            break;
+         /* PLUGIN_VALIDATE can be prematurely ended by plugin -
+            plugin determines that the UDP message is to be discarded */
+         case (PLUGIN_VALIDATE):
+            /* return with the plugins status back to the caller */
+            if (sts == STS_FAILURE) {
+               DEBUGC(DBCLASS_PLUGIN, "call_plugins: PLUGIN_VALIDATE "
+                      "prematurely ending plugin processing in module "
+                      "%s sts=STS_FAILURE", cur->name);
+               return sts;
+            }
+            break;
+         /* PLUGIN_DETERMINE_TARGET can be prematurely ended by plugin - 
+            plugin processes and sends the final SIP message itself */
+         case (PLUGIN_DETERMINE_TARGET):
+            /* return with the plugins status back to the caller */
+            if (sts == STS_SIP_SENT) {
+               DEBUGC(DBCLASS_PLUGIN, "call_plugins: PLUGIN_DETERMINE_TARGET "
+                      "prematurely ending plugin processing in module "
+                      "%s sts=STS_SIP_SENT", cur->name);
+               return sts;
+            }
+            break;
+         default:
+            break;
+      } /* switch*/
    } /* for */
 
    return STS_SUCCESS;
@@ -233,10 +476,21 @@ int call_plugins(int stage, sip_ticket_t *ticket) {
 int unload_plugins(void) {
    plugin_def_t *cur, *last;
    int sts;
+   int i;
    func_plugin_end_t plugin_end;
+   plugin_worker_end_t worker_end;
+   void **ctx;
 
    /* for each plugin in plugins do (start at the end of the plugin list) */
    DEBUGC(DBCLASS_PLUGIN, "unloading dynamic plugins");
+
+   /* no more dispatching */
+   for (i=0; i < PLUGIN_STAGES; i++) {
+      free(plugin_stage[i]);
+      plugin_stage[i]=NULL;
+      free(plugin_prof[i]);
+      plugin_prof[i]=NULL;
+   }
    
    /* call plugin_end function - the plugin may need to cleanup as well... */
    while (siproxd_plugins) {
@@ -244,6 +498,17 @@ int unload_plugins(void) {
       last=NULL;
       for (cur=siproxd_plugins; cur->next != NULL; cur = cur->next) {last=cur;}
 
+      /* worker contexts first */
+      ctx=cur->worker_ctx;
+      if (ctx) {
+         worker_end=(plugin_worker_end_t)cur->worker_end;
+         for (i=0; i < plugin_workers; i++) {
+            if (ctx[i] && worker_end) (*worker_end)(i, ctx[i]);
+         }
+         free(ctx);
+         cur->worker_ctx=NULL;
+      }
+
       plugin_end=cur->plugin_end;
       DEBUGC(DBCLASS_PLUGIN, "unload_plugins: '%s' unloading ptr=%p",
              cur->name, cur);
@@ -259,6 +524,10 @@ int unload_plugins(void) {
 
       /* deallocate plugins list item */
       if (last) last->next=NULL;
+      if (cur->mt_lock) {
+         pthread_mutex_destroy((pthread_mutex_t*)cur->mt_lock);
+         free(cur->mt_lock);
+      }
       free(cur);
 
       /* I don't like this */
@@ -273,3 +542,557 @@ int unload_plugins(void) {
 
    return STS_SUCCESS;
 }
+
+
+/*
+ * Create the (recursive) shared state lock of a plugin
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if out of memory
+ */
+static int plugin_mt_lock_init(plugin_def_t *plugin_def) {
+   pthread_mutex_t *lock;
+   pthread_mutexattr_t attr;
+
+   lock=malloc(sizeof(pthread_mutex_t));
+   if (lock == NULL) {
+      ERROR("out of memory");
+      return STS_FAILURE;
+   }
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init(lock, &attr);
+   pthread_mutexattr_destroy(&attr);
+   plugin_def->mt_lock=lock;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * Build the per stage dispatch tables from the exe_mask of
+ * all loaded plugins.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if out of memory
+ */
+static int build_dispatch_tables(void) {
+   plugin_def_t *cur;
+   int i, n;
+
+   for (i=0; i < PLUGIN_STAGES; i++) {
+      free(plugin_stage[i]);
+      plugin_stage[i]=NULL;
+      free(plugin_prof[i]);
+      plugin_prof[i]=NULL;
+
+      /* count the plugins for this stage */
+      n=0;
+      for (cur=siproxd_plugins; cur != NULL; cur = cur->next) {
+         if (cur->exe_mask & (1 << i)) n++;
+      }
+      if (n == 0) continue;
+
+      plugin_stage[i]=malloc((n+1)*sizeof(plugin_def_t*));
+      plugin_prof[i]=calloc(n, sizeof(plugin_profile_t));
+      if ((plugin_stage[i] == NULL) || (plugin_prof[i] == NULL)) {
+         ERROR("out of memory");
+         free(plugin_stage[i]);
+         plugin_stage[i]=NULL;
+         return STS_FAILURE;
+      }
+      n=0;
+      for (cur=siproxd_plugins; cur != NULL; cur = cur->next) {
+         if (cur->exe_mask & (1 << i)) {
+            plugin_prof[i][n].name=cur->name;
+            plugin_prof[i][n].stage=1 << i;
+            plugin_stage[i][n++]=cur;
+         }
+      }
+      plugin_stage[i][n]=NULL;
+      DEBUGC(DBCLASS_PLUGIN, "stage 0x%X: %i plugins", 1 << i, n);
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * Does the message of the ticket pass the message filter of a plugin?
+ * The request/response and method properties are evaluated once per
+ * ticket, the direction is determined once if still unknown.
+ *
+ * RETURNS
+ *	STS_TRUE if the plugin is to be called
+ *	STS_FALSE if not
+ */
+static int plugin_filter_match(int filter, sip_ticket_t *ticket) {
+   int msgflt;
+
+   if (ticket->plugin_flt == 0) {
+      ticket->plugin_flt=plugin_classify(ticket->sipmsg);
+   }
+   msgflt=ticket->plugin_flt;
+
+   if (filter & PLUGIN_FLT_DIRECTION) {
+      if (!ticket->direction_done) sip_find_direction(ticket, NULL);
+      switch (ticket->direction) {
+      case REQTYP_INCOMING:
+      case RESTYP_INCOMING:
+         msgflt |= PLUGIN_FLT_INCOMING;
+         break;
+      case REQTYP_OUTGOING:
+      case RESTYP_OUTGOING:
+         msgflt |= PLUGIN_FLT_OUTGOING;
+         break;
+      default:
+         msgflt |= PLUGIN_FLT_UNKNOWN;
+         break;
+      }
+   }
+
+   if ((filter & PLUGIN_FLT_TYPE) &&
+       !(filter & msgflt & PLUGIN_FLT_TYPE)) return STS_FALSE;
+   if ((filter & PLUGIN_FLT_METHOD) &&
+       !(filter & msgflt & PLUGIN_FLT_METHOD)) return STS_FALSE;
+   if ((filter & PLUGIN_FLT_DIRECTION) &&
+       !(filter & msgflt & PLUGIN_FLT_DIRECTION)) return STS_FALSE;
+   return STS_TRUE;
+}
+
+
+/*
+ * request/response and method of a SIP message as PLUGIN_FLT_* bits
+ *
+ * RETURNS
+ *	PLUGIN_FLT_* bits (never 0)
+ */
+static int plugin_classify(osip_message_t *sipmsg) {
+   int flt;
+   char *method;
+
+   if (MSG_IS_REQUEST(sipmsg)) {
+      flt=PLUGIN_FLT_REQUEST;
+      method=sipmsg->sip_method;
+   } else {
+      flt=PLUGIN_FLT_RESPONSE;
+      method=(sipmsg->cseq) ? sipmsg->cseq->method : NULL;
+   }
+
+   if (method == NULL)                      flt |= PLUGIN_FLT_OTHER;
+   else if (strcmp(method, "INVITE") == 0)   flt |= PLUGIN_FLT_INVITE;
+   else if (strcmp(method, "ACK") == 0)      flt |= PLUGIN_FLT_ACK;
+   else if (strcmp(method, "BYE") == 0)      flt |= PLUGIN_FLT_BYE;
+   else if (strcmp(method, "CANCEL") == 0)   flt |= PLUGIN_FLT_CANCEL;
+   else if (strcmp(method, "REGISTER") == 0) flt |= PLUGIN_FLT_REGISTER;
+   else if (strcmp(method, "OPTIONS") == 0)  flt |= PLUGIN_FLT_OPTIONS;
+   else                                      flt |= PLUGIN_FLT_OTHER;
+
+   return flt;
+}
+
+
+/*
+ * Runtime query of the plugin profile. The entries are numbered
+ * from 0, ordered by stage and within a stage by calling order.
+ *
+ * RETURNS
+ *	STS_SUCCESS and a copy of entry <index> in *prof
+ *	STS_FAILURE if there is no such entry
+ */
+int plugin_get_profile(int index, plugin_profile_t *prof) {
+   int i, n;
+
+   if (index < 0) return STS_FAILURE;
+   for (i=0; i < PLUGIN_STAGES; i++) {
+      if (plugin_stage[i] == NULL) continue;
+      for (n=0; plugin_stage[i][n] != NULL; n++) {
+         if (index-- == 0) {
+            memcpy(prof, &plugin_prof[i][n], sizeof(plugin_profile_t));
+            return STS_SUCCESS;
+         }
+      }
+   }
+   return STS_FAILURE;
+}
+
+
+/*
+ * clear all counters of the plugin profile
+ */
+void plugin_reset_profile(void) {
+   int i, n;
+
+   for (i=0; i < PLUGIN_STAGES; i++) {
+      if (plugin_stage[i] == NULL) continue;
+      for (n=0; plugin_stage[i][n] != NULL; n++) {
+         memset(&plugin_prof[i][n], 0, sizeof(plugin_profile_t));
+         plugin_prof[i][n].name=plugin_stage[i][n]->name;
+         plugin_prof[i][n].stage=1 << i;
+      }
+   }
+}
+
+
+/*
+ * Call a plugin and account the call in its profile entry.
+ *
+ * RETURNS
+ *	return status of the plugin
+ */
+static int plugin_profile_call(plugin_profile_t *prof,
+                               func_plugin_process_t plugin_process,
+                               int stage, sip_ticket_t *ticket) {
+   unsigned long long start, ns;
+   int sts;
+
+   /* time every call or only a sample of them */
+   if ((configuration.plugin_profile == PLUGIN_PROF_FULL) ||
+       ((prof->calls % PLUGIN_PROF_SAMPLE) == 0)) {
+      start=plugin_prof_clock();
+      sts=(*plugin_process)(stage, ticket);
+      ns=plugin_prof_clock() - start;
+      prof->timed++;
+      prof->total_ns += ns;
+      if (ns > prof->max_ns) prof->max_ns=ns;
+   } else {
+      sts=(*plugin_process)(stage, ticket);
+   }
+   prof->calls++;
+
+   switch (sts) {
+      case STS_SUCCESS:
+         prof->sts_success++;
+         break;
+      case STS_FAILURE:
+         prof->sts_failure++;
+         break;
+      case STS_SIP_SENT:
+         prof->sts_sip_sent++;
+         break;
+      default:
+         prof->sts_other++;
+         break;
+   }
+   return sts;
+}
+
+
+/*
+ * monotonic clock for the plugin profile, not subject to NTP
+ * slewing where available
+ *
+ * RETURNS
+ *	time in nanoseconds
+ */
+static unsigned long long plugin_prof_clock(void) {
+   struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_RAW
+   clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+   return (unsigned long long)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ * Suspend the processing of the current SIP message (plugin API).
+ * Must be called from within plugin_process().
+ *
+ * RETURNS
+ *	job handle to be passed to plugin_complete()
+ *	0 if the message cannot be suspended
+ */
+plugin_job_t plugin_suspend(sip_ticket_t *ticket,
+                            plugin_resume_t resume, void *arg) {
+   plugin_async_t *job;
+   int count;
+   int i;
+
+   if ((ticket == NULL) || (resume == NULL)) return 0;
+   /* suspended messages are kept by the main loop (worker 0) */
+   if (ticket->worker != 0) return 0;
+   /* only from plugin_process() of a stage that can be suspended */
+   if ((job_stage < 0) || (job_new != NULL)) return 0;
+   if (((1 << job_stage) & PLUGIN_ASYNC_STAGES) == 0) return 0;
+
+   count=(job_chain) ? job_chain->count : 0;
+   if (count >= PLUGIN_ASYNC_MAXCOUNT) return 0;
+
+   for (i=0; i < PLUGIN_ASYNC_SIZE; i++) {
+      if (plugin_job[i].state == PLUGIN_JOB_FREE) break;
+   }
+   if (i >= PLUGIN_ASYNC_SIZE) {
+      LIMIT_LOG_RATE(30) {
+         WARN("plugin job table full - processing SIP message synchronously");
+      }
+      return 0;
+   }
+
+   /* generation 0 is never used, so a handle is never 0 */
+   plugin_job_generation++;
+   if ((plugin_job_generation << PLUGIN_JOB_SLOTBITS) == 0) {
+      plugin_job_generation=1;
+   }
+
+   job=&plugin_job[i];
+   pthread_mutex_lock(&plugin_job_mutex);
+   memset(job, 0, sizeof(plugin_async_t));
+   job->handle=(plugin_job_generation << PLUGIN_JOB_SLOTBITS) | i;
+   pthread_mutex_unlock(&plugin_job_mutex);
+   job->state=PLUGIN_JOB_RUNNING;
+   job->stage=job_stage;
+   job->index=job_index;
+   job->count=count+1;
+   job->resume=resume;
+   job->arg=arg;
+   job->timestamp=(job_chain) ? job_chain->timestamp : ticket->timestamp;
+   job_new=job;
+   return job->handle;
+}
+
+
+/*
+ * The plugin has finished the work of a suspended message (plugin API).
+ * May be called from any thread. The completion of a job that has
+ * been dropped meanwhile (timeout) is ignored.
+ */
+void plugin_complete(plugin_job_t handle) {
+   plugin_async_t *job;
+   int valid=0;
+   int i;
+
+   i=handle & ((1 << PLUGIN_JOB_SLOTBITS) - 1);
+   if ((handle == 0) || (i >= PLUGIN_ASYNC_SIZE)) return;
+   job=&plugin_job[i];
+
+   pthread_mutex_lock(&plugin_job_mutex);
+   if (job->handle == handle) {
+      job->completed=1;
+      valid=1;
+   }
+   pthread_mutex_unlock(&plugin_job_mutex);
+   if (!valid) return;
+
+   /* wake up the SIP thread */
+   if (write(plugin_notify_pipe[1], "", 1) < 0) {
+      /* pipe full - SIP thread will wake up anyway */
+   }
+}
+
+
+/*
+ * returns the file descriptor the SIP thread has to wait on
+ * (readable = a plugin job has completed), -1 if none
+ */
+int plugin_async_notify_fd(void) {
+   return plugin_notify_pipe[0];
+}
+
+
+/*
+ * drain the notification pipe
+ */
+void plugin_async_notify_clear(void) {
+   char dummy[64];
+   if (plugin_notify_pipe[0] < 0) return;
+   while (read(plugin_notify_pipe[0], dummy, sizeof(dummy)) > 0) {};
+}
+
+
+/*
+ * fetch a suspended SIP message whose plugin job has completed
+ *
+ * RETURNS number of bytes (0 if no suspended message is ready)
+ *         buf, from and protocol are set like sipsock_waitfordata() does
+ */
+int plugin_async_resume(char *buf, size_t bufsize,
+                        struct sockaddr_in *from, int *protocol) {
+   plugin_async_t *job;
+   int completed;
+   int length;
+   int i;
+   time_t now;
+
+   if ((plugin_job_parked == 0) && (plugin_job_dnsparked == 0)) return 0;
+
+   time(&now);
+   for (i=0; i < PLUGIN_ASYNC_SIZE; i++) {
+      job=&plugin_job[i];
+
+      /* the DNS cache has dropped the message by now (same timeout) */
+      if ((job->state == PLUGIN_JOB_DNSPARKED) &&
+          ((job->timestamp + PLUGIN_ASYNC_TIMEOUT) < now)) {
+         DEBUGC(DBCLASS_PLUGIN, "jobs of DNS parked SIP message in slot %i "
+                "dropped", i);
+         plugin_job_dnsparked--;
+         plugin_job_release(job);
+         continue;
+      }
+      if (job->state != PLUGIN_JOB_PARKED) continue;
+
+      /* waited too long, the UA has given up - completed or not */
+      if ((job->timestamp + PLUGIN_ASYNC_TIMEOUT) < now) {
+         DEBUGC(DBCLASS_PLUGIN, "suspended SIP message in slot %i timed out",
+                i);
+         plugin_job_parked--;
+         plugin_job_release(job);
+         continue;
+      }
+
+      pthread_mutex_lock(&plugin_job_mutex);
+      completed=job->completed;
+      pthread_mutex_unlock(&plugin_job_mutex);
+      if (!completed) continue;
+      plugin_job_parked--;
+
+      /* no message to resume */
+      if (job->raw_buffer == NULL) {
+         DEBUGC(DBCLASS_PLUGIN, "suspended SIP message in slot %i dropped", i);
+         plugin_job_release(job);
+         continue;
+      }
+
+      /* hand it back to the SIP thread */
+      length=job->raw_buffer_len;
+      if (length > bufsize) length=bufsize;
+      memcpy(buf, job->raw_buffer, length);
+      memcpy(from, &job->from, sizeof(struct sockaddr_in));
+      *protocol=job->protocol;
+      free(job->raw_buffer);
+      job->raw_buffer=NULL;
+      job->state=PLUGIN_JOB_RESUMED;
+      job_chain=job;
+
+      DEBUGC(DBCLASS_PLUGIN, "resuming suspended SIP message from %s "
+             "(slot %i)", utils_inet_ntoa(from->sin_addr), i);
+      return length;
+   }
+   return 0;
+}
+
+
+/*
+ * End of processing of a SIP message (ticket=NULL: the message has
+ * been dropped early). If a plugin has suspended the message, a copy
+ * of the raw message is stored with the job. Jobs of a resumed
+ * message that are not needed any more are released.
+ * dns_parked: the message has been parked by the DNS cache, it will be
+ * resumed from there (jobs of a resumed message are kept until then).
+ */
+void plugin_async_park_end(sip_ticket_t *ticket, int dns_parked) {
+   plugin_async_t *job;
+
+   job=job_new;
+   job_new=NULL;
+   if (job) {
+      /* the earlier jobs stay with the message */
+      job->prev=job_chain;
+      job_chain=NULL;
+      if (ticket && !dns_parked) plugin_job_store(job, ticket);
+      job->state=PLUGIN_JOB_PARKED;
+      plugin_job_parked++;
+   }
+
+   /* resumed message waits for DNS: keep the results of its plugins */
+   if (job_chain && ticket && dns_parked) {
+      plugin_job_store(job_chain, ticket);
+      if (job_chain->raw_buffer) {
+         job_chain->state=PLUGIN_JOB_DNSPARKED;
+         plugin_job_dnsparked++;
+         job_chain=NULL;
+      }
+   }
+
+   if (job_chain) {
+      plugin_job_release(job_chain);
+      job_chain=NULL;
+   }
+}
+
+
+/*
+ * A message has been handed back by the DNS cache. If it had been
+ * resumed from a plugin job before it got parked, its jobs are
+ * attached again.
+ */
+void plugin_async_dns_resumed(char *buf, int length, struct sockaddr_in *from) {
+   plugin_async_t *job;
+   int i;
+
+   if ((plugin_job_dnsparked == 0) || (job_chain != NULL)) return;
+
+   for (i=0; i < PLUGIN_ASYNC_SIZE; i++) {
+      job=&plugin_job[i];
+      if (job->state != PLUGIN_JOB_DNSPARKED) continue;
+      if ((job->raw_buffer_len != length) ||
+          (memcmp(&job->from.sin_addr, &from->sin_addr,
+                  sizeof(struct in_addr)) != 0) ||
+          (job->from.sin_port != from->sin_port) ||
+          (memcmp(job->raw_buffer, buf, length) != 0)) continue;
+
+      free(job->raw_buffer);
+      job->raw_buffer=NULL;
+      job->state=PLUGIN_JOB_RESUMED;
+      plugin_job_dnsparked--;
+      job_chain=job;
+      DEBUGC(DBCLASS_PLUGIN, "DNS parked SIP message from %s continues "
+             "with its plugin jobs (slot %i)",
+             utils_inet_ntoa(from->sin_addr), i);
+      return;
+   }
+}
+
+
+/*
+ * find the job of the current (resumed) message that has been
+ * suspended by the plugin at plugin_stage[stage][index]
+ *
+ * RETURNS
+ *	job, NULL if none
+ */
+static plugin_async_t *plugin_job_find(int stage, int index) {
+   plugin_async_t *job;
+
+   for (job=job_chain; job != NULL; job=job->prev) {
+      if ((job->stage == stage) && (job->index == index)) return job;
+   }
+   return NULL;
+}
+
+
+/*
+ * store a copy of the raw message with a job
+ */
+static void plugin_job_store(plugin_async_t *job, sip_ticket_t *ticket) {
+   job->raw_buffer=malloc(ticket->raw_buffer_len);
+   if (job->raw_buffer == NULL) {
+      ERROR("plugin_job_store: out of memory");
+      return;
+   }
+   memcpy(job->raw_buffer, ticket->raw_buffer, ticket->raw_buffer_len);
+   job->raw_buffer_len=ticket->raw_buffer_len;
+   memcpy(&job->from, &ticket->from, sizeof(struct sockaddr_in));
+   job->protocol=ticket->protocol;
+}
+
+
+/*
+ * release a job and all earlier jobs of its message, the plugins
+ * get their completion callback with ticket=NULL
+ */
+static void plugin_job_release(plugin_async_t *job) {
+   plugin_async_t *prev;
+
+   for (; job != NULL; job=prev) {
+      prev=job->prev;
+      (*job->resume)(1 << job->stage, NULL, job->arg);
+      free(job->raw_buffer);
+      /* a late plugin_complete() must not see this slot any more */
+      pthread_mutex_lock(&plugin_job_mutex);
+      memset(job, 0, sizeof(plugin_async_t));
+      pthread_mutex_unlock(&plugin_job_mutex);
+   }
+}
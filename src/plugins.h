@@ -33,7 +33,8 @@
 #endif 
 
 
-/* Plugins must return STS_SUCCESS / SUCCESS_FAILURE */
+/* Plugins must return STS_SUCCESS / SUCCESS_FAILURE
+ * (or STS_PLUGIN_PENDING, see plugin_suspend() below) */
 
 
 /*
@@ -75,6 +76,37 @@
 #define PLUGIN_POST_PROXY	0x00000100	/* after MASQuerading */
 
 
+/*
+ * Message filter (optional)
+ * A plugin may declare which SIP messages it is interested in, siproxd
+ * then calls it only for matching messages (stages with a valid
+ * ticket->sipmsg only, PLUGIN_TIMER and PLUGIN_PROCESS_RAW always call).
+ * The bits are grouped, within a group any set bit matches. A group
+ * without any bit set does not filter. Example:
+ * PLUGIN_FLT_REQUEST|PLUGIN_FLT_INVITE|PLUGIN_FLT_ACK|PLUGIN_FLT_OUTGOING
+ * = outgoing INVITE or ACK requests.
+ */
+/* request / response */
+#define PLUGIN_FLT_REQUEST	0x00000001
+#define PLUGIN_FLT_RESPONSE	0x00000002
+#define PLUGIN_FLT_TYPE		0x00000003	/* group mask */
+/* method (of the request, or of the CSeq for responses) */
+#define PLUGIN_FLT_INVITE	0x00000010
+#define PLUGIN_FLT_ACK		0x00000020
+#define PLUGIN_FLT_BYE		0x00000040
+#define PLUGIN_FLT_CANCEL	0x00000080
+#define PLUGIN_FLT_REGISTER	0x00000100
+#define PLUGIN_FLT_OPTIONS	0x00000200
+#define PLUGIN_FLT_OTHER	0x00000400	/* any other method */
+#define PLUGIN_FLT_METHOD	0x000007F0	/* group mask */
+/* direction as found by sip_find_direction() - siproxd determines it
+ * (once per ticket) if the plugin filters on it */
+#define PLUGIN_FLT_INCOMING	0x00001000
+#define PLUGIN_FLT_OUTGOING	0x00002000
+#define PLUGIN_FLT_UNKNOWN	0x00004000	/* DIRTYP_UNKNOWN */
+#define PLUGIN_FLT_DIRECTION	0x00007000	/* group mask */
+
+
 /* Plugin "database" */
 typedef struct {
    void *next;		/* link to next plugin element, NULL if last */
@@ -87,9 +119,101 @@ typedef struct {
    lt_ptr plugin_process;/* Plugin processing entry point */
    lt_ptr plugin_end;	/* de-initialization function */
    lt_ptr dlhandle;	/* handle returned by dlopen() */
+   int  filter;		/* optional PLUGIN_FLT_* message filter, 0: none */
+   int  mt_level;	/* PLUGIN_MT_* thread safety of the plugin */
+   lt_ptr worker_init;	/* optional per worker context, plugin_worker_init_t */
+   lt_ptr worker_end;	/* releases it again, plugin_worker_end_t */
+   lt_ptr mt_lock;	/* shared state lock, see plugin_lock() */
+   lt_ptr worker_ctx;	/* worker contexts, indexed by ticket->worker */
 } plugin_def_t;
 
-#define SIPROXD_API_VERSION	0x0102
+#define SIPROXD_API_VERSION	0x0104
+
+
+/*
+ * Multiple SIP workers (API version 0x0104)
+ *
+ * A core may process several SIP messages at once, each in its own
+ * worker (0..n-1, ticket->worker). Worker 0 is the SIP thread, the
+ * only thread that runs core code which is not reentrant
+ * (get_ip_by_host() and the DNS park state, sip_gen_response(),
+ * sipsock_send(), the urlmap). A plugin declares in mt_level whether
+ * plugin_process() may be called by several workers at once:
+ *
+ * PLUGIN_MT_SERIAL (default): no. The plugin is only called by the
+ *   SIP thread, one call at a time, and may use all core functions.
+ *   As long as such a plugin is loaded, siproxd runs one worker only
+ *   (plugin_workers_init()).
+ * PLUGIN_MT_SAFE: yes. Per message scratch data lives on the stack or
+ *   in the worker context, state shared by the workers is protected
+ *   by plugin_lock()/plugin_unlock() (or a lock of the plugin's own).
+ *   Core code that is not reentrant (see above) must not be used.
+ *
+ * The worker context is optional. If the plugin sets worker_init, it
+ * is called once per worker after plugin_init and returns the context
+ * (NULL: failure), siproxd passes it in ticket->plugin_ctx with every
+ * call of that worker. worker_end releases it before plugin_end.
+ *
+ * PLUGIN_TIMER is always called by the main thread, one call at a
+ * time - but other workers may process messages meanwhile.
+ * plugin_lock() is recursive, so a PLUGIN_MT_SERIAL plugin may use it
+ * as well. Configuration read in plugin_init is read only afterwards
+ * and can be used without lock.
+ */
+#define PLUGIN_MT_SERIAL	0
+#define PLUGIN_MT_SAFE		1
+
+typedef void *(*plugin_worker_init_t)(int worker);
+typedef void (*plugin_worker_end_t)(int worker, void *ctx);
+
+void plugin_lock(plugin_def_t *plugin_def);
+void plugin_unlock(plugin_def_t *plugin_def);
+
+
+/*
+ * Asynchronous plugins (API version 0x0103)
+ *
+ * A plugin that has to wait for something slow (database, network)
+ * does not need to block siproxd. In plugin_process() it calls
+ *    job=plugin_suspend(ticket, my_resume, my_arg);
+ * starts its lookup (e.g. in a thread of its own) and returns
+ * STS_PLUGIN_PENDING. siproxd stops processing the SIP message and
+ * keeps a copy of it - the ticket itself must not be used any more
+ * once plugin_process() has returned. When the lookup is done, the
+ * plugin calls plugin_complete(job) (from any thread). The main loop
+ * then processes the message again from the start, like messages
+ * waiting for DNS answers. Instead of plugin_process(), this time the
+ * completion callback my_resume(stage, ticket, my_arg) is called on
+ * the main loop and returns the plugin status for this stage.
+ *
+ * - plugin_suspend() returns 0 if the message cannot be suspended
+ *   (stage not in PLUGIN_ASYNC_STAGES, too many suspended messages,
+ *   the message has been suspended too often, not called by the main
+ *   loop - worker 0), the plugin must then do its work synchronously.
+ * - If plugin_suspend() succeeded, plugin_process() must return
+ *   STS_PLUGIN_PENDING and plugin_complete() must be called exactly
+ *   once, eventually.
+ * - The callback may be called in more than one pass (if a later
+ *   plugin suspends the message as well). Finally it is called with
+ *   ticket=NULL, then my_arg can be released. This also happens if
+ *   the message is dropped (timeout, out of resources).
+ * - A message whose job is not completed within 32 seconds is
+ *   dropped. The callback (ticket=NULL) may then come
+ *   before plugin_complete(), which is ignored for such a job. Data
+ *   still used by the lookup must not be released in the callback
+ *   then (e.g. use a reference count).
+ * - Plugins called before the suspending plugin are called again for
+ *   the resumed message.
+ */
+#define PLUGIN_ASYNC_STAGES	(PLUGIN_VALIDATE|PLUGIN_DETERMINE_TARGET|\
+				 PLUGIN_PRE_PROXY)
+
+typedef unsigned int plugin_job_t;	/* job handle, 0 = none */
+typedef int (*plugin_resume_t)(int stage, sip_ticket_t *ticket, void *arg);
+
+plugin_job_t plugin_suspend(sip_ticket_t *ticket,
+                            plugin_resume_t resume, void *arg);
+void plugin_complete(plugin_job_t job);
 
 
 /* The plugin must provide the following entry points */
@@ -106,7 +230,17 @@ typedef struct {
    - name
    - desc
    - exe_mask
+   and may define
+   - filter		(PLUGIN_FLT_* bits, default 0: all messages)
+   - mt_level		(PLUGIN_MT_*, default PLUGIN_MT_SERIAL)
+   - worker_init, worker_end
+   exe_mask and filter are read once after plugin_init, the per stage
+   dispatch tables of siproxd are built from them.
    The rest will be initialized by siproxd and must not be fumbled with.
+   If the plugin accesses a header through its libosip2 structure (e.g.
+   osip_message_get_allow()), plugin_init must request it by calling
+   sip_want_header("Allow") - otherwise it may be left unparsed in
+   lazy parsing mode (sip_lazy_parse).
 */
 int  plugin_init(plugin_def_t *plugin_def);
 int  plugin_process(int stage, sip_ticket_t *ticket);
@@ -0,0 +1,261 @@
+/*
+    Copyright (C) 2002-2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/*
+ * Early reject prefilter
+ *
+ * Runs on the raw buffer before libosip2 gets to see a message and
+ * does not allocate any memory:
+ *
+ * - prefilter_rate_check(): per source IP token bucket, refilled with
+ *   prefilter_rate packets/sec up to prefilter_burst packets. Sources
+ *   are kept in a fixed size direct mapped table, a source that
+ *   collides with another one simply starts with a full bucket.
+ *
+ * - prefilter_check(): uses the index built by sip_scan_raw() to
+ *   verify the first line (request or status line), the presence of
+ *   the mandatory headers (Via, From, To, CSeq, Call-ID) and to match
+ *   the User-Agent against the configured scanner signatures
+ *   (prefilter_ua_block, case insensitive substrings).
+ *
+ * Only used by the SIP thread.
+ */
+#define PREFILTER_SOURCES	4096	/* rate limit table, power of 2 */
+
+typedef struct {
+   unsigned int addr;		/* source IP (network order), 0 = free */
+   unsigned int stamp;		/* last refill (msec) */
+   int tokens;			/* in 1/1000 packets */
+} prefilter_src_t;
+
+static prefilter_src_t prefilter_src[PREFILTER_SOURCES];
+static prefilter_stats_t prefilter_stats;
+
+/* local prototypes */
+static int prefilter_first_line(char *buff, sip_scan_t *scan);
+static int prefilter_ua_match(char *ua, size_t ualen, char *sig);
+
+
+/*
+ * initialize the prefilter
+ *
+ * RETURNS
+ *	STS_SUCCESS
+ */
+int prefilter_init(void) {
+   memset(prefilter_src, 0, sizeof(prefilter_src));
+   memset(&prefilter_stats, 0, sizeof(prefilter_stats));
+
+   if (configuration.prefilter_rate > 0) {
+      if (configuration.prefilter_burst < 1) {
+         configuration.prefilter_burst=1;
+      }
+      INFO("prefilter: rate limit %i packets/sec per source (burst %i)",
+           configuration.prefilter_rate, configuration.prefilter_burst);
+   }
+   if (configuration.prefilter && configuration.prefilter_ua_block.used) {
+      INFO("prefilter: %i User-Agent signatures blocked",
+           configuration.prefilter_ua_block.used);
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * per source rate limit (token bucket)
+ *
+ * RETURNS
+ *	STS_SUCCESS if the packet may pass
+ *	STS_FAILURE if the source exceeds its rate
+ */
+int prefilter_rate_check(struct sockaddr_in from) {
+   prefilter_src_t *src;
+   struct timespec ts;
+   unsigned int addr, now, elapsed;
+   long long refill;
+   int max;
+
+   if (configuration.prefilter_rate <= 0) return STS_SUCCESS;
+
+   addr=from.sin_addr.s_addr;
+   src=&prefilter_src[((ntohl(addr) * 2654435761U) >> 20) &
+                      (PREFILTER_SOURCES-1)];
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   now=(unsigned int)(ts.tv_sec*1000 + ts.tv_nsec/1000000);
+   max=configuration.prefilter_burst*1000;
+
+   if (src->addr != addr) {
+      /* new source (or collision): full bucket */
+      src->addr=addr;
+      src->stamp=now;
+      src->tokens=max;
+   } else {
+      /* refill, rate is packets/sec = tokens/msec */
+      elapsed=now - src->stamp;
+      src->stamp=now;
+      refill=(long long)elapsed * configuration.prefilter_rate;
+      if (src->tokens + refill > max) {
+         src->tokens=max;
+      } else {
+         src->tokens+=(int)refill;
+      }
+   }
+
+   if (src->tokens < 1000) {
+      prefilter_stats.rate_limited++;
+      DEBUGC(DBCLASS_SIP,"prefilter: rate limit exceeded by %s",
+             utils_inet_ntoa(from.sin_addr));
+      return STS_FAILURE;
+   }
+   src->tokens-=1000;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * check a received message using the index of the raw buffer
+ *
+ * RETURNS
+ *	STS_SUCCESS if the message may pass
+ *	STS_FAILURE if it is to be dropped
+ */
+int prefilter_check(char *buff, sip_scan_t *scan) {
+   int i;
+
+   if (!configuration.prefilter) return STS_SUCCESS;
+
+   if (prefilter_first_line(buff, scan) != STS_SUCCESS) {
+      prefilter_stats.malformed++;
+      DEBUGC(DBCLASS_SIP,"prefilter: invalid first line");
+      return STS_FAILURE;
+   }
+
+   if ((scan->hdr_mask & SIP_SCAN_MANDATORY) != SIP_SCAN_MANDATORY) {
+      prefilter_stats.malformed++;
+      DEBUGC(DBCLASS_SIP,"prefilter: mandatory header missing (0x%x)",
+             scan->hdr_mask);
+      return STS_FAILURE;
+   }
+
+   if (scan->user_agent.len) {
+      for (i=0; i<configuration.prefilter_ua_block.used; i++) {
+         if (prefilter_ua_match(&buff[scan->user_agent.off],
+                                scan->user_agent.len,
+                                configuration.prefilter_ua_block.string[i])) {
+            prefilter_stats.ua_blocked++;
+            DEBUGC(DBCLASS_SIP,"prefilter: User-Agent blocked (%s)",
+                   configuration.prefilter_ua_block.string[i]);
+            return STS_FAILURE;
+         }
+      }
+   }
+
+   return STS_SUCCESS;
+}
+
+
+/*
+ * get a copy of the prefilter counters
+ */
+void prefilter_get_stats(prefilter_stats_t *stats) {
+   memcpy(stats, &prefilter_stats, sizeof(prefilter_stats_t));
+}
+
+
+/*
+ * verify the first line:
+ *   Request:  <method> SP <Request-URI> SP SIP/2.0
+ *   Response: SIP/2.0 SP <3 digits> SP <reason phrase>
+ *
+ * RETURNS
+ *	STS_SUCCESS if valid
+ *	STS_FAILURE if not
+ */
+static int prefilter_first_line(char *buff, sip_scan_t *scan) {
+   char *p=&buff[scan->first_line.off];
+   size_t i;
+
+   if ((scan->tokens < 3) || (scan->tok1_len == 0) ||
+       (scan->tok2.len == 0)) return STS_FAILURE;
+
+   /* response */
+   if ((scan->tok1_len == 7) && (strncasecmp(p, "SIP/2.0", 7) == 0)) {
+      if (scan->tok2.len != 3) return STS_FAILURE;
+      for (i=0; i<3; i++) {
+         if (!isdigit((unsigned char)buff[scan->tok2.off+i])) {
+            return STS_FAILURE;
+         }
+      }
+      return STS_SUCCESS;
+   }
+
+   /* request: method is a token (RFC3261 25.1) */
+   for (i=0; i<scan->tok1_len; i++) {
+      if (!isalnum((unsigned char)p[i]) &&
+          (strchr("-.!%*_+`'~", p[i]) == NULL)) {
+         return STS_FAILURE;
+      }
+   }
+   if ((scan->tok3.len != 7) ||
+       (strncasecmp(&buff[scan->tok3.off], "SIP/2.0", 7) != 0)) {
+      return STS_FAILURE;
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * case insensitive substring match on a (not \0 terminated) value
+ *
+ * RETURNS
+ *	1 if sig is contained in ua, 0 if not
+ */
+static int prefilter_ua_match(char *ua, size_t ualen, char *sig) {
+   size_t siglen=strlen(sig);
+   size_t i;
+
+   if ((siglen == 0) || (siglen > ualen)) return 0;
+   for (i=0; i <= ualen-siglen; i++) {
+      if ((tolower((unsigned char)ua[i]) == tolower((unsigned char)sig[0])) &&
+          (strncasecmp(&ua[i], sig, siglen) == 0)) return 1;
+   }
+   return 0;
+}
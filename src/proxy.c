@@ -43,6 +43,23 @@ extern struct siproxd_config configuration;	/* defined in siproxd.c */
 extern struct urlmap_s urlmap[];		/* URL mapping table     */
 extern struct lcl_if_s local_addresses;
 
+/* SDP body can't be handled by the streaming rewriter */
+#define SDP_FAST_FALLBACK	(-1)
+
+/* local prototypes */
+static int proxy_rewrite_sdp_fast(sip_ticket_t *ticket, int direction);
+static int proxy_rtp_directions(sip_ticket_t *ticket, int direction,
+                                struct in_addr *map_addr,
+                                struct in_addr *inside_addr,
+                                int *rtp_direction, int *call_direction);
+static int proxy_rtp_start_stream(sip_ticket_t *ticket, int direction,
+                                  int rtp_direction, int call_direction,
+                                  int media_stream_no, char *protocol,
+                                  struct in_addr addr_media, int msg_port,
+                                  struct in_addr *map_addr,
+                                  struct in_addr inside_addr,
+                                  int *map_port);
+
 
 /*
  * PROXY_REQUEST
@@ -50,6 +67,7 @@ extern struct lcl_if_s local_addresses;
  * RETURNS
  *	STS_SUCCESS on success
  *	STS_FAILURE on error
+ *	STS_PLUGIN_PENDING if a plugin has suspended the request
  *
  * RFC3261
  *    Section 16.3: Proxy Behavior - Request Validation
@@ -112,9 +130,12 @@ int proxy_request (sip_ticket_t *ticket) {
     * by doing a lookup in the registration table.
     */
    sip_find_direction(ticket, &i);
+   if (dnscache_is_parked() == STS_TRUE) return STS_FAILURE;
 
    /* Call Plugins for stage: PLUGIN_PRE_PROXY */
    sts = call_plugins(PLUGIN_PRE_PROXY, ticket);
+   if (sts == STS_PLUGIN_PENDING) return sts;
+   if (dnscache_is_parked() == STS_TRUE) return STS_FAILURE;
 
    type = ticket->direction;
    /*
@@ -379,33 +400,23 @@ sts=sip_obscure_callid(ticket);
     * destination from SIP URI
     */
    } else {
-      /* get the destination from the SIP URI */
-
-      /* 1) try SRV record */
-/*&&&& Here, the SRV record lookup magic must go.
-In a first implementation we may just try to get the lowest priority,
-max weighted '_sip._udp.domain' entry and port number.
-No load balancing and no failover are supported with this.
-&&&*/
+      /* outbound proxy lookup parked, don't fall back to the URI */
+      if (dnscache_is_parked() == STS_TRUE) return STS_FAILURE;
 
-      /* 2) if no SRV record found, resolve A record */
-      sts = get_ip_by_host(request->req_uri->host, &ticket->next_hop.sin_addr);
+      /* get the destination from the SIP URI (RFC3263: NAPTR, SRV, A) */
+      sts = resolve_sip_target(request->req_uri->host, request->req_uri->port,
+                               ticket->protocol, &ticket->next_hop.sin_addr,
+                               &ticket->next_hop.sin_port);
       if (sts == STS_FAILURE) {
          DEBUGC(DBCLASS_PROXY, "proxy_request: cannot resolve URI [%s]",
                 request->req_uri->host);
          return STS_FAILURE;
       }
 
-      ticket->next_hop.sin_port=SIP_PORT;
-      if (request->req_uri->port) {
-         ticket->next_hop.sin_port=atoi(request->req_uri->port);
-         if (ticket->next_hop.sin_port == 0) {
-            ticket->next_hop.sin_port=SIP_PORT;
-         }
-      }
       DEBUGC(DBCLASS_PROXY, "proxy_request: have SIP URI to %s:%i",
              utils_inet_ntoa(ticket->next_hop.sin_addr), ticket->next_hop.sin_port);
    }
+   if (dnscache_is_parked() == STS_TRUE) return STS_FAILURE;
 
    /*
     * RFC 3261, Section 16.6 step 8
@@ -437,16 +448,27 @@ No load balancing and no failover are supported with this.
    * RFC 3261, Section 16.6 step 10
    * Proxy Behavior - Forward the new request
    */
+   /* regenerate the SDP body if the core or a plugin modified it */
+   sip_sdp_finalize(ticket);
+
    sts = sip_message_to_str(request, &buffer, &buflen);
    if (sts != 0) {
       ERROR("proxy_request: sip_message_to_str failed");
       return STS_FAILURE;
    }
 
-   sipsock_send(ticket->next_hop.sin_addr, ticket->next_hop.sin_port, 
-                ticket->protocol, buffer, buflen);
+   sts = sipsock_send(ticket->next_hop.sin_addr, ticket->next_hop.sin_port, 
+                      ticket->protocol, buffer, buflen);
    osip_free (buffer);
 
+   /* next hop unreachable: avoid this target for a while (only if it
+    * came out of a server set). The UA's retransmission will then be
+    * sent to another server of the set */
+   if (sts == STS_FAILURE) {
+      resolve_target_failed(ticket->next_hop.sin_addr,
+                            ticket->next_hop.sin_port, 0);
+   }
+
   /*
    * RFC 3261, Section 16.6 step 11
    * Proxy Behavior - Set timer C
@@ -463,6 +485,7 @@ No load balancing and no failover are supported with this.
  * RETURNS
  *	STS_SUCCESS on success
  *	STS_FAILURE on error
+ *	STS_PLUGIN_PENDING if a plugin has suspended the response
  * RFC3261
  *    Section 16.7: Proxy Behavior - Response Processing
  *    1.  Find the appropriate response context
@@ -501,9 +524,12 @@ int proxy_response (sip_ticket_t *ticket) {
     * world to one of our registered clients
     */
    sip_find_direction(ticket, NULL);
+   if (dnscache_is_parked() == STS_TRUE) return STS_FAILURE;
 
    /* Call Plugins for stage: PLUGIN_PRE_PROXY */
    sts = call_plugins(PLUGIN_PRE_PROXY, ticket);
+   if (sts == STS_PLUGIN_PENDING) return sts;
+   if (dnscache_is_parked() == STS_TRUE) return STS_FAILURE;
 
    type = ticket->direction;
    /*
@@ -517,6 +543,23 @@ int proxy_response (sip_ticket_t *ticket) {
       return STS_FAILURE;
    }
 
+   /*
+    * RFC 3263, Section 4.3: a 503 means the server is overloaded,
+    * do not use it for the time given in Retry-After (ignored by
+    * resolve_target_failed() unless it came out of a server set)
+    */
+   if (response->status_code == 503) {
+      osip_header_t *retry_after=NULL;
+      int holddown=0;
+      if (osip_message_header_get_byname(response, "retry-after", 0,
+                                         &retry_after) >= 0 &&
+          retry_after && retry_after->hvalue) {
+         holddown=atoi(retry_after->hvalue);
+      }
+      resolve_target_failed(ticket->from.sin_addr,
+                            ntohs(ticket->from.sin_port), holddown);
+   }
+
 /*
  * ok, we got a response that we are allowed to process.
  */
@@ -733,6 +776,9 @@ sts=sip_obscure_callid(ticket);
       DEBUGC(DBCLASS_PROXY, "proxy_response: have outbound proxy %s:%i",
              utils_inet_ntoa(ticket->next_hop.sin_addr), ticket->next_hop.sin_port);
    } else {
+      /* outbound proxy lookup parked, don't fall back to the Via */
+      if (dnscache_is_parked() == STS_TRUE) return STS_FAILURE;
+
       /* get target address and port from VIA header */
       via = (osip_via_t *) osip_list_get (&(response->vias), 0);
       if (via == NULL) {
@@ -755,6 +801,7 @@ sts=sip_obscure_callid(ticket);
          }
       }
    }
+   if (dnscache_is_parked() == STS_TRUE) return STS_FAILURE;
 
    /* Call Plugins for stage: PLUGIN_POST_PROXY */
    sts = call_plugins(PLUGIN_POST_PROXY, ticket);
@@ -762,6 +809,9 @@ sts=sip_obscure_callid(ticket);
   /*
    * Proxy Behavior - Forward the response
    */
+   /* regenerate the SDP body if the core or a plugin modified it */
+   sip_sdp_finalize(ticket);
+
    sts = sip_message_to_str(response, &buffer, &buflen);
    if (sts != 0) {
       ERROR("proxy_response: sip_message_to_str failed");
@@ -784,14 +834,9 @@ sts=sip_obscure_callid(ticket);
  *	STS_FAILURE on error
  */
 int proxy_rewrite_invitation_body(sip_ticket_t *ticket, int direction){
-   osip_message_t *mymsg=ticket->sipmsg;
-   osip_body_t *body;
    sdp_message_t  *sdp;
-   struct in_addr map_addr, addr_sess, addr_media, outside_addr, inside_addr;
+   struct in_addr map_addr, addr_sess, addr_media, inside_addr;
    int sts;
-   char *buff;
-   size_t buflen;
-   char clen[8]; /* content length: probably never more than 7 digits !*/
    int map_port, msg_port;
    int media_stream_no;
    sdp_connection_t *sdp_conn;
@@ -799,55 +844,42 @@ int proxy_rewrite_invitation_body(sip_ticket_t *ticket, int direction){
    int rtp_direction=0;
    int call_direction=0;
    int have_c_media=0;
-   int isrtp = 0 ;
-   int cseq = 0;
 
    if (configuration.rtp_proxy_enable == 0) return STS_SUCCESS;
 
    /*
-    * get SDP structure
+    * As long as nobody did parse the SDP body, rewrite the body text
+    * directly. Bodies that are not in canonical form are left to the
+    * parser below.
     */
-   sts = osip_message_get_body(mymsg, 0, &body);
-   if (sts != 0) {
-      DEBUGC(DBCLASS_PROXY, "rewrite_invitation_body: "
-                            "no body found in message");
-      return STS_SUCCESS;
+   if (configuration.sdp_fast_rewrite &&
+       (ticket->sdp_state == SDP_UNPARSED)) {
+      sts = proxy_rewrite_sdp_fast(ticket, direction);
+      if (sts != SDP_FAST_FALLBACK) return sts;
    }
 
-   sts = sip_body_to_str(body, &buff, &buflen);
-   if (sts != 0) {
-      ERROR("rewrite_invitation_body: unable to sip_body_to_str");
+   /*
+    * get SDP structure (shared with plugins, owned by the ticket)
+    */
+   sts = sip_get_sdp(ticket, &sdp);
+   if (sts != STS_SUCCESS) {
+      ERROR("rewrite_invitation_body: unable to parse SDP body");
       return STS_FAILURE;
    }
-
-   DEBUGC(DBCLASS_PROXY, "rewrite_invitation_body: payload %ld bytes", 
-          (long)buflen);
-   DUMP_BUFFER(DBCLASS_PROXY, buff, buflen);
-
-   sts = sdp_message_init(&sdp);
-   sts = sdp_message_parse (sdp, buff);
-   if (sts != 0) {
-      ERROR("rewrite_invitation_body: unable to sdp_message_parse body");
-      DUMP_BUFFER(-1, buff, buflen);
-      osip_free(buff);
-      sdp_message_free(sdp);
-      return STS_FAILURE;
+   if (sdp == NULL) {
+      DEBUGC(DBCLASS_PROXY, "rewrite_invitation_body: "
+                            "no SDP body found in message");
+      return STS_SUCCESS;
    }
-   osip_free(buff);
 
 
 if (configuration.debuglevel)
-{ /* just dump the buffer */
-   char *tmp, *tmp2;
-   size_t tmplen;
-   sts = osip_message_get_body(mymsg, 0, &body);
-   sts = sip_body_to_str(body, &tmp, &tmplen);
-   if (sts == 0) {
-      osip_content_length_to_str(mymsg->content_length, &tmp2);
-      DEBUG("Body before rewrite (may be truncated) - (clen=%s, strlen=%ld):\n%s\n----",
-            tmp2, (long)tmplen, tmp);
+{ /* just dump the SDP */
+   char *tmp;
+   if ((sdp_message_to_str(sdp, &tmp) == 0) && tmp) {
+      DEBUG("Body before rewrite (may be truncated) - (strlen=%ld):\n%s\n----",
+            (long)strlen(tmp), tmp);
       osip_free(tmp);
-      osip_free(tmp2);
    } else {
       DEBUG("Body before rewrite: failed to decode!");
    }
@@ -857,47 +889,9 @@ if (configuration.debuglevel)
     * RTP proxy: get ready and start forwarding
     * start forwarding for each media stream ('m=' item in SIP message)
     */
-
-   /* get outbound address */
-   if (get_interface_ip(IF_OUTBOUND, &outside_addr) != STS_SUCCESS) {
-      sdp_message_free(sdp);
-      return STS_FAILURE;
-   }
-
-   /* get inbound address */
-   if (get_interface_ip(IF_INBOUND, &inside_addr) != STS_SUCCESS) {
-      sdp_message_free(sdp);
-      return STS_FAILURE;
-   }
-
-   /* figure out what address to use for RTP masquerading */
-   if (MSG_IS_REQUEST(mymsg)) {
-      if (direction == DIR_INCOMING) {
-         memcpy(&map_addr, &inside_addr, sizeof (map_addr));
-         rtp_direction  = DIR_OUTGOING;
-         call_direction = DIR_INCOMING;
-      } else {
-         memcpy(&map_addr, &outside_addr, sizeof (map_addr));
-         rtp_direction  = DIR_INCOMING;
-         call_direction = DIR_OUTGOING;
-      }
-   } else /* MSG_IS_REPONSE(mymsg) */ {
-      if (direction == DIR_INCOMING) {
-         memcpy(&map_addr, &inside_addr, sizeof (map_addr));
-         rtp_direction  = DIR_OUTGOING;
-         call_direction = DIR_OUTGOING;
-      } else {
-         memcpy(&map_addr, &outside_addr, sizeof (map_addr));
-         rtp_direction  = DIR_INCOMING;
-         call_direction = DIR_INCOMING;
-      }
-   }
-
-   DEBUGC(DBCLASS_PROXY, "proxy_rewrite_invitation_body: SIP[%s %s] RTP[%s %s]",
-          MSG_IS_REQUEST(mymsg)? "RQ" : "RS",
-          (direction==DIR_INCOMING)? "IN" : "OUT",
-          (rtp_direction==DIR_INCOMING)? "IN" : "OUT",
-          utils_inet_ntoa(map_addr));
+   sts = proxy_rtp_directions(ticket, direction, &map_addr, &inside_addr,
+                              &rtp_direction, &call_direction);
+   if (sts != STS_SUCCESS) return STS_FAILURE;
 
 
    /*
@@ -916,7 +910,6 @@ if (configuration.debuglevel)
          if (sdp_message_c_addr_get(sdp, media_stream_no, 0) == NULL) {
             ERROR("SDP: have no 'c=' on session level and neither "
                   "on media level (media=%i)",media_stream_no);
-            sdp_message_free(sdp);
             return STS_FAILURE;
          }
          media_stream_no++;
@@ -936,7 +929,6 @@ if (configuration.debuglevel)
       if (sts == STS_FAILURE) {
          ERROR("SDP: cannot resolve session 'c=' host [%s]",
                sdp->c_connection->c_addr);
-         sdp_message_free(sdp);
          return STS_FAILURE;
       }
       /*
@@ -961,7 +953,6 @@ if (configuration.debuglevel)
    if (sdp->o_addrtype && sdp->o_addr) {
       if (strcmp(sdp->o_addrtype, "IP4") != 0) {
          ERROR("got IP6 in SDP originator - not yet suported by siproxd");
-         sdp_message_free(sdp);
          return STS_FAILURE;
       }
 
@@ -989,6 +980,7 @@ if (configuration.debuglevel)
       if (sdp_conn && sdp_conn->c_addr) {
          if (strcmp(sdp_conn->c_addr, "0.0.0.0") != 0) {
             sts = get_ip_by_host(sdp_conn->c_addr, &addr_media);
+            if (dnscache_is_parked() == STS_TRUE) return STS_FAILURE;
             have_c_media=1;
             /* have a valid address */
             osip_free(sdp_conn->c_addr);
@@ -1005,111 +997,6 @@ if (configuration.debuglevel)
       if (sdp_message_m_port_get(sdp, media_stream_no)) {
          msg_port=atoi(sdp_message_m_port_get(sdp, media_stream_no));
          if ((msg_port > 0) && (msg_port <= 65535)) {
-            client_id_t client_id;
-            osip_contact_t *contact = NULL;
-            char *protocol=NULL;
-
-            /* try to get some additional UA specific unique ID.
-             * This Client-ID should be guaranteed persistent
-             * and not depend on if a UA/Server does include a
-             * particular Header (Contact) or not.
-             */
-            /* we will use - if present the from/to fields.
-              * Outgoing call (RQ out, RS in  => use the "from" field to identify local client
-              * Incoming call (RQ in,  RS out => use the "to" field to identify local client
-              *
-              * According to RFC3261, the From and To headers MUST NOT change
-              * withing an ongoing dialog:
-              *
-              * 8.2.6.2 Headers and Tags
-              *
-              *    The From field of the response MUST equal the From header field of
-              *    the request.  The Call-ID header field of the response MUST equal the
-              *    Call-ID header field of the request.  The CSeq header field of the
-              *    response MUST equal the CSeq field of the request.  The Via header
-              *    field values in the response MUST equal the Via header field values
-              *    in the request and MUST maintain the same ordering.
-              *
-              *    If a request contained a To tag in the request, the To header field
-              *    in the response MUST equal that of the request.  However, if the To
-              *    header field in the request did not contain a tag, the URI in the To
-              *    header field in the response MUST equal the URI in the To header
-              *    field; additionally, the UAS MUST add a tag to the To header field in
-              *    the response (with the exception of the 100 (Trying) response, in
-              *    [...]
-              */
-
-             /* If no proper TO/FROM headers are present, fall back to use Contact header... */
-
-            memset(&client_id, 0, sizeof(client_id));
-
-             /* Outgoing call (RQ out, RS in  => use the "from" field to identify local client */
-            if ((MSG_IS_REQUEST(mymsg) && direction == DIR_OUTGOING) ||
-                (!MSG_IS_REQUEST(mymsg) && direction == DIR_INCOMING)) {
-
-                /* I have a full FROM SIP URI 'user@host' */
-                if (mymsg->from && mymsg->from->url && 
-                    mymsg->from->url->username && mymsg->from->url->host) {
-                   snprintf(client_id.idstring, CLIENT_ID_SIZE, "%s@%s", 
-                            mymsg->from->url->username, mymsg->from->url->host);
-                } else {
-                   char *tmp=NULL;
-                   /* get the Contact Header if present */
-                   osip_message_get_contact(mymsg, 0, &contact);
-                   if (contact) osip_contact_to_str(contact, &tmp);
-                   if (tmp) {
-                      strncpy(client_id.idstring, tmp, CLIENT_ID_SIZE);
-                      client_id.idstring[CLIENT_ID_SIZE-1]='\0';
-                   }
-                } /* if from header */
-
-            /* Incoming call (RQ in,  RS out => use the "to" field to identify local client */
-            } else { /*(MSG_IS_REQUEST(mymsg) && direction == DIR_INCOMING) ||
-                       (!MSG_IS_REQUEST(mymsg) && direction == DIR_OUTGOING)) */
-
-                /* I have a full TO SIP URI 'user@host' */
-                if (mymsg->to && mymsg->to->url && 
-                    mymsg->to->url->username && mymsg->to->url->host) {
-                   snprintf(client_id.idstring, CLIENT_ID_SIZE, "%s@%s", 
-                            mymsg->to->url->username, mymsg->to->url->host);
-                } else {
-                   char *tmp=NULL;
-                   /* get the Contact Header if present */
-                   osip_message_get_contact(mymsg, 0, &contact);
-                   if (contact) osip_contact_to_str(contact, &tmp);
-                   if (tmp) {
-                      strncpy(client_id.idstring, tmp, CLIENT_ID_SIZE);
-                      client_id.idstring[CLIENT_ID_SIZE-1]='\0';
-                   }
-                } /* if to header */
-            }
-
-            /* store the IP address of the sender */
-            memcpy(&client_id.from_ip, &ticket->from.sin_addr,
-                   sizeof(client_id.from_ip));
-
-
-            /*
-             * is this an RTP stream ? If yes, set 'isrtp=1'
-             */
-            protocol = sdp_message_m_proto_get (sdp, media_stream_no);
-            if (protocol == NULL) {
-               DEBUGC(DBCLASS_PROXY, "no protocol definition found!");
-            } else {
-               char *check;
-               char *cmp;
-               isrtp = 1;
-               check = protocol ;
-               cmp = "RTP/" ;
-               while (*cmp && (isrtp = isrtp && *check) && 
-                      (isrtp = isrtp && (*cmp++ == toupper(*check++))) ) {} ;
-               if (isrtp) {
-                  DEBUGC(DBCLASS_PROXY, "found RTP protocol [%s]!", protocol);
-               } else {
-                  DEBUGC(DBCLASS_PROXY, "found non RTP protocol [%s]!", protocol);
-               }
-            }
-
             /*
              * do we have a 'c=' item on media level?
              * if not, use the same as on session level
@@ -1118,37 +1005,12 @@ if (configuration.debuglevel)
                memcpy(&addr_media, &addr_sess, sizeof(addr_sess));
             }
 
-            /*
-             * Am I running in front of the routing device? Then I cannot
-             * use the external IP to bind a listen socket to, but should
-             * use my real IP on the outbound interface (which may legally
-             * be the same as the inbound interface if only one interface
-             * is used).
-             */
-            if ((rtp_direction == DIR_INCOMING) &&
-                (configuration.outbound_host) &&
-                (strcmp(configuration.outbound_host, "")!=0)) {
-               DEBUGC(DBCLASS_PROXY, "proxy_rewrite_invitation_body: "
-                      "in-front-of-NAT-Router, use real outboud IP");
-               if (get_interface_real_ip(IF_OUTBOUND, &map_addr)
-                   != STS_SUCCESS) {
-                  ERROR("cannot get my real outbound interface address");
-                  /* as we do not know better, take the internal address */
-                  memcpy(&map_addr, &inside_addr, sizeof (map_addr));
-               }
-            }
-
-            /*
-             * Start the RTP stream
-             */
-            cseq = atoi(osip_cseq_get_number(mymsg->cseq));
-            sts = rtp_start_fwd(osip_message_get_call_id(mymsg),
-                                client_id,
-                                rtp_direction, call_direction,
-                                media_stream_no,
-                                map_addr, &map_port,
-                                addr_media, msg_port,
-                                isrtp, cseq);
+            sts = proxy_rtp_start_stream(ticket, direction,
+                                  rtp_direction, call_direction,
+                                  media_stream_no,
+                                  sdp_message_m_proto_get(sdp, media_stream_no),
+                                  addr_media, msg_port,
+                                  &map_addr, inside_addr, &map_port);
 
             if (sts == STS_SUCCESS) {
                /* and rewrite the port */
@@ -1172,44 +1034,16 @@ if (configuration.debuglevel)
       }
    } /* for media_stream_no */
 
-   /* remove old body */
-   sts = osip_list_remove(&(mymsg->bodies), 0);
-   osip_body_free(body);
-
-   /* dump new body */
-   sdp_message_to_str(sdp, &buff);
-   buflen=strlen(buff);
-
-   /* free sdp structure */
-   sdp_message_free(sdp);
-
-   /* include new body */
-   sip_message_set_body(mymsg, buff, buflen);
-   if (sts != 0) {
-      ERROR("rewrite_invitation_body: unable to sip_message_set_body body");
-   }
-
-   /* free content length resource and include new one*/
-   osip_content_length_free(mymsg->content_length);
-   mymsg->content_length=NULL;
-   sprintf(clen,"%ld",(long)buflen);
-   sts = osip_message_set_content_length(mymsg, clen);
-
-   /* free new body string*/
-   osip_free(buff);
+   /* body is regenerated once, right before the message is sent */
+   sip_sdp_modified(ticket);
 
 if (configuration.debuglevel)
-{ /* just dump the buffer */
-   char *tmp, *tmp2;
-   size_t tmplen;
-   sts = osip_message_get_body(mymsg, 0, &body);
-   sts = sip_body_to_str(body, &tmp, &tmplen);
-   if (sts == 0) {
-      osip_content_length_to_str(mymsg->content_length, &tmp2);
-      DEBUG("Body after rewrite (may be truncated) - (clen=%s, strlen=%ld):\n%s\n----",
-            tmp2, (long)tmplen, tmp);
+{ /* just dump the SDP */
+   char *tmp;
+   if ((sdp_message_to_str(sdp, &tmp) == 0) && tmp) {
+      DEBUG("Body after rewrite (may be truncated) - (strlen=%ld):\n%s\n----",
+            (long)strlen(tmp), tmp);
       osip_free(tmp);
-      osip_free(tmp2);
    } else {
       DEBUG("Body after rewrite: failed to decode!");
    }
@@ -1281,3 +1115,387 @@ int proxy_rewrite_useragent(sip_ticket_t *ticket){
    }
    return STS_SUCCESS;
 }
+
+
+/*
+ * rewrite the SDP body as text (streaming SDP rewriter) - does the
+ * same as the parser path of proxy_rewrite_invitation_body(), but
+ * only replaces the o= / c= addresses and m= ports in the body.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ *	SDP_FAST_FALLBACK if the body must be handled by the parser
+ *	                  (nothing has been changed or started yet)
+ */
+static int proxy_rewrite_sdp_fast(sip_ticket_t *ticket, int direction) {
+   const char *body;
+   size_t len;
+   sdp_scan_t scan;
+   char newbody[BUFFER_SIZE];
+   size_t newlen;
+   char host[HOSTNAME_SIZE];
+   char protocol[HOSTNAME_SIZE];
+   char port[8];
+   char sess_addr[IPSTRING_SIZE];
+   char media_addr[SDP_SCAN_MEDIA][IPSTRING_SIZE];
+   char map_ports[SDP_SCAN_MEDIA][8];
+   struct in_addr map_addr, addr_sess, addr_media, inside_addr;
+   int rtp_direction=0;
+   int call_direction=0;
+   int have_c_media;
+   int map_port, msg_port;
+   int media_stream_no;
+   int sts;
+
+   sip_get_sdp_body(ticket, &body, &len);
+   if (body == NULL) {
+      DEBUGC(DBCLASS_PROXY, "rewrite_invitation_body: "
+                            "no SDP body found in message");
+      return STS_SUCCESS;
+   }
+
+   if (sdp_scan(body, len, &scan) != STS_SUCCESS) {
+      DEBUGC(DBCLASS_PROXY, "rewrite_invitation_body: "
+                            "SDP not in canonical form, using parser");
+      return SDP_FAST_FALLBACK;
+   }
+
+   /*
+    * Everything that may let us fall back must be checked before
+    * the first RTP stream is started: the result must fit (each
+    * replaced value grows to at most an IP address), all values must
+    * be copyable and all required 'c=' items must be present.
+    */
+   if (len + (2+2*scan.media_count)*IPSTRING_SIZE >= sizeof(newbody)) {
+      return SDP_FAST_FALLBACK;
+   }
+   if ((scan.c_addr.len >= sizeof(host)) || (scan.o_addr.len == 0)) {
+      return SDP_FAST_FALLBACK;
+   }
+   for (media_stream_no=0; media_stream_no < scan.media_count;
+        media_stream_no++) {
+      if ((scan.media[media_stream_no].c_addr.len >= sizeof(host)) ||
+          (scan.media[media_stream_no].proto.len >= sizeof(protocol)) ||
+          ((scan.c_addr.len == 0) &&
+           (scan.media[media_stream_no].c_addr.len == 0))) {
+         return SDP_FAST_FALLBACK;
+      }
+   }
+
+   if (configuration.debuglevel) {
+      DEBUG("Body before rewrite (may be truncated) - (strlen=%ld):\n%.*s\n----",
+            (long)len, (int)len, body);
+   }
+
+   sts = proxy_rtp_directions(ticket, direction, &map_addr, &inside_addr,
+                              &rtp_direction, &call_direction);
+   if (sts != STS_SUCCESS) return STS_FAILURE;
+
+   /*
+    * rewrite 'c=' item on session level if present.
+    * remember the original address in addr_sess
+    */
+   memset(&addr_sess, 0, sizeof(addr_sess));
+   snprintf(sess_addr, sizeof(sess_addr), "%s", utils_inet_ntoa(map_addr));
+   if (scan.c_addr.len) {
+      sdp_span_copy(body, &scan.c_addr, host, sizeof(host));
+      sts = get_ip_by_host(host, &addr_sess);
+      if (sts == STS_FAILURE) {
+         ERROR("SDP: cannot resolve session 'c=' host [%s]", host);
+         return STS_FAILURE;
+      }
+      /* an IP address of 0.0.0.0 means *MUTE*, don't rewrite such */
+      if (strcmp(host, "0.0.0.0") != 0) {
+         scan.c_addr.repl=sess_addr;
+      } else {
+         DEBUGC(DBCLASS_PROXY, "proxy_rewrite_invitation_body: "
+                "got a MUTE c= record (on session level - legal?)");
+      }
+   }
+
+   /* rewrite 'o=' item (originator), sdp_scan() accepts IP4 only */
+   scan.o_addr.repl=sess_addr;
+
+   /*
+    * loop through all media descritions,
+    * start RTP proxy and rewrite them
+    */
+   for (media_stream_no=0; media_stream_no < scan.media_count;
+        media_stream_no++) {
+      memset(&addr_media, 0, sizeof(addr_media));
+      have_c_media=0;
+      if (scan.media[media_stream_no].c_addr.len) {
+         sdp_span_copy(body, &scan.media[media_stream_no].c_addr,
+                       host, sizeof(host));
+         if (strcmp(host, "0.0.0.0") != 0) {
+            sts = get_ip_by_host(host, &addr_media);
+            if (dnscache_is_parked() == STS_TRUE) return STS_FAILURE;
+            have_c_media=1;
+            snprintf(media_addr[media_stream_no], IPSTRING_SIZE, "%s",
+                     utils_inet_ntoa(map_addr));
+            scan.media[media_stream_no].c_addr.repl=
+               media_addr[media_stream_no];
+         } else {
+            DEBUGC(DBCLASS_PROXY, "proxy_rewrite_invitation_body: got a "
+                   "MUTE c= record (media level)");
+         }
+      }
+
+      sdp_span_copy(body, &scan.media[media_stream_no].port,
+                    port, sizeof(port));
+      msg_port=atoi(port);
+      if ((msg_port <= 0) || (msg_port > 65535)) continue;
+
+      /* no 'c=' item on media level, use the one on session level */
+      if (have_c_media == 0) {
+         memcpy(&addr_media, &addr_sess, sizeof(addr_sess));
+      }
+
+      sdp_span_copy(body, &scan.media[media_stream_no].proto,
+                    protocol, sizeof(protocol));
+      sts = proxy_rtp_start_stream(ticket, direction,
+                                   rtp_direction, call_direction,
+                                   media_stream_no, protocol,
+                                   addr_media, msg_port,
+                                   &map_addr, inside_addr, &map_port);
+      if (sts == STS_SUCCESS) {
+         snprintf(map_ports[media_stream_no], sizeof(map_ports[0]), "%i",
+                  map_port);
+         scan.media[media_stream_no].port.repl=map_ports[media_stream_no];
+         DEBUGC(DBCLASS_PROXY, "proxy_rewrite_invitation_body: "
+                "m= rewrote port to [%i]",map_port);
+      }
+   } /* for media_stream_no */
+
+   sts = sdp_emit(body, len, &scan, newbody, sizeof(newbody), &newlen);
+   if (sts != STS_SUCCESS) {
+      ERROR("rewrite_invitation_body: SDP body too large");
+      return STS_FAILURE;
+   }
+
+   if (configuration.debuglevel) {
+      DEBUG("Body after rewrite (may be truncated) - (strlen=%ld):\n%s\n----",
+            (long)newlen, newbody);
+   }
+
+   return sip_set_sdp_body(ticket, newbody, newlen);
+}
+
+
+/*
+ * get the RTP masquerading address and the RTP/call directions
+ * for rewriting the SDP body of a message
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if the interface addresses are not available
+ */
+static int proxy_rtp_directions(sip_ticket_t *ticket, int direction,
+                                struct in_addr *map_addr,
+                                struct in_addr *inside_addr,
+                                int *rtp_direction, int *call_direction) {
+   osip_message_t *mymsg=ticket->sipmsg;
+   struct in_addr outside_addr;
+
+   /* get outbound address */
+   if (get_interface_ip(IF_OUTBOUND, &outside_addr) != STS_SUCCESS) {
+      return STS_FAILURE;
+   }
+
+   /* get inbound address */
+   if (get_interface_ip(IF_INBOUND, inside_addr) != STS_SUCCESS) {
+      return STS_FAILURE;
+   }
+
+   /* figure out what address to use for RTP masquerading */
+   if (MSG_IS_REQUEST(mymsg)) {
+      if (direction == DIR_INCOMING) {
+         memcpy(map_addr, inside_addr, sizeof (*map_addr));
+         *rtp_direction  = DIR_OUTGOING;
+         *call_direction = DIR_INCOMING;
+      } else {
+         memcpy(map_addr, &outside_addr, sizeof (*map_addr));
+         *rtp_direction  = DIR_INCOMING;
+         *call_direction = DIR_OUTGOING;
+      }
+   } else /* MSG_IS_REPONSE(mymsg) */ {
+      if (direction == DIR_INCOMING) {
+         memcpy(map_addr, inside_addr, sizeof (*map_addr));
+         *rtp_direction  = DIR_OUTGOING;
+         *call_direction = DIR_OUTGOING;
+      } else {
+         memcpy(map_addr, &outside_addr, sizeof (*map_addr));
+         *rtp_direction  = DIR_INCOMING;
+         *call_direction = DIR_INCOMING;
+      }
+   }
+
+   DEBUGC(DBCLASS_PROXY, "proxy_rewrite_invitation_body: SIP[%s %s] RTP[%s %s]",
+          MSG_IS_REQUEST(mymsg)? "RQ" : "RS",
+          (direction==DIR_INCOMING)? "IN" : "OUT",
+          (*rtp_direction==DIR_INCOMING)? "IN" : "OUT",
+          utils_inet_ntoa(*map_addr));
+
+   return STS_SUCCESS;
+}
+
+
+/*
+ * start RTP proxying for one media stream of an SDP body
+ *
+ * map_addr may be updated (in front of a NAT router the real
+ * outbound address is used) and is passed on to later streams.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success, *map_port is the port to put into m=
+ *	STS_FAILURE on error
+ */
+static int proxy_rtp_start_stream(sip_ticket_t *ticket, int direction,
+                                  int rtp_direction, int call_direction,
+                                  int media_stream_no, char *protocol,
+                                  struct in_addr addr_media, int msg_port,
+                                  struct in_addr *map_addr,
+                                  struct in_addr inside_addr,
+                                  int *map_port) {
+   osip_message_t *mymsg=ticket->sipmsg;
+   client_id_t client_id;
+   osip_contact_t *contact = NULL;
+   int isrtp=0;
+   int cseq;
+   int sts;
+
+   /* try to get some additional UA specific unique ID.
+    * This Client-ID should be guaranteed persistent
+    * and not depend on if a UA/Server does include a
+    * particular Header (Contact) or not.
+    */
+   /* we will use - if present the from/to fields.
+     * Outgoing call (RQ out, RS in  => use the "from" field to identify local client
+     * Incoming call (RQ in,  RS out => use the "to" field to identify local client
+     *
+     * According to RFC3261, the From and To headers MUST NOT change
+     * withing an ongoing dialog:
+     *
+     * 8.2.6.2 Headers and Tags
+     *
+     *    The From field of the response MUST equal the From header field of
+     *    the request.  The Call-ID header field of the response MUST equal the
+     *    Call-ID header field of the request.  The CSeq header field of the
+     *    response MUST equal the CSeq field of the request.  The Via header
+     *    field values in the response MUST equal the Via header field values
+     *    in the request and MUST maintain the same ordering.
+     *
+     *    If a request contained a To tag in the request, the To header field
+     *    in the response MUST equal that of the request.  However, if the To
+     *    header field in the request did not contain a tag, the URI in the To
+     *    header field in the response MUST equal the URI in the To header
+     *    field; additionally, the UAS MUST add a tag to the To header field in
+     *    the response (with the exception of the 100 (Trying) response, in
+     *    [...]
+     */
+
+    /* If no proper TO/FROM headers are present, fall back to use Contact header... */
+
+   memset(&client_id, 0, sizeof(client_id));
+
+    /* Outgoing call (RQ out, RS in  => use the "from" field to identify local client */
+   if ((MSG_IS_REQUEST(mymsg) && direction == DIR_OUTGOING) ||
+       (!MSG_IS_REQUEST(mymsg) && direction == DIR_INCOMING)) {
+
+       /* I have a full FROM SIP URI 'user@host' */
+       if (mymsg->from && mymsg->from->url && 
+           mymsg->from->url->username && mymsg->from->url->host) {
+          snprintf(client_id.idstring, CLIENT_ID_SIZE, "%s@%s", 
+                   mymsg->from->url->username, mymsg->from->url->host);
+       } else {
+          char *tmp=NULL;
+          /* get the Contact Header if present */
+          osip_message_get_contact(mymsg, 0, &contact);
+          if (contact) osip_contact_to_str(contact, &tmp);
+          if (tmp) {
+             strncpy(client_id.idstring, tmp, CLIENT_ID_SIZE);
+             client_id.idstring[CLIENT_ID_SIZE-1]='\0';
+          }
+       } /* if from header */
+
+   /* Incoming call (RQ in,  RS out => use the "to" field to identify local client */
+   } else { /*(MSG_IS_REQUEST(mymsg) && direction == DIR_INCOMING) ||
+              (!MSG_IS_REQUEST(mymsg) && direction == DIR_OUTGOING)) */
+
+       /* I have a full TO SIP URI 'user@host' */
+       if (mymsg->to && mymsg->to->url && 
+           mymsg->to->url->username && mymsg->to->url->host) {
+          snprintf(client_id.idstring, CLIENT_ID_SIZE, "%s@%s", 
+                   mymsg->to->url->username, mymsg->to->url->host);
+       } else {
+          char *tmp=NULL;
+          /* get the Contact Header if present */
+          osip_message_get_contact(mymsg, 0, &contact);
+          if (contact) osip_contact_to_str(contact, &tmp);
+          if (tmp) {
+             strncpy(client_id.idstring, tmp, CLIENT_ID_SIZE);
+             client_id.idstring[CLIENT_ID_SIZE-1]='\0';
+          }
+       } /* if to header */
+   }
+
+   /* store the IP address of the sender */
+   memcpy(&client_id.from_ip, &ticket->from.sin_addr,
+          sizeof(client_id.from_ip));
+
+
+   /*
+    * is this an RTP stream ? If yes, set 'isrtp=1'
+    */
+   if (protocol == NULL) {
+      DEBUGC(DBCLASS_PROXY, "no protocol definition found!");
+   } else {
+      char *check;
+      char *cmp;
+      isrtp = 1;
+      check = protocol ;
+      cmp = "RTP/" ;
+      while (*cmp && (isrtp = isrtp && *check) && 
+             (isrtp = isrtp && (*cmp++ == toupper(*check++))) ) {} ;
+      if (isrtp) {
+         DEBUGC(DBCLASS_PROXY, "found RTP protocol [%s]!", protocol);
+      } else {
+         DEBUGC(DBCLASS_PROXY, "found non RTP protocol [%s]!", protocol);
+      }
+   }
+
+   /*
+    * Am I running in front of the routing device? Then I cannot
+    * use the external IP to bind a listen socket to, but should
+    * use my real IP on the outbound interface (which may legally
+    * be the same as the inbound interface if only one interface
+    * is used).
+    */
+   if ((rtp_direction == DIR_INCOMING) &&
+       (configuration.outbound_host) &&
+       (strcmp(configuration.outbound_host, "")!=0)) {
+      DEBUGC(DBCLASS_PROXY, "proxy_rewrite_invitation_body: "
+             "in-front-of-NAT-Router, use real outboud IP");
+      if (get_interface_real_ip(IF_OUTBOUND, map_addr)
+          != STS_SUCCESS) {
+         ERROR("cannot get my real outbound interface address");
+         /* as we do not know better, take the internal address */
+         memcpy(map_addr, &inside_addr, sizeof (*map_addr));
+      }
+   }
+
+   /*
+    * Start the RTP stream
+    */
+   cseq = atoi(osip_cseq_get_number(mymsg->cseq));
+   sts = rtp_start_fwd(osip_message_get_call_id(mymsg),
+                       client_id,
+                       rtp_direction, call_direction,
+                       media_stream_no,
+                       *map_addr, map_port,
+                       addr_media, msg_port,
+                       isrtp, cseq);
+
+   return sts;
+}
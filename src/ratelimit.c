@@ -0,0 +1,464 @@
+/*
+    Copyright (C) 2002-2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/*
+ * Per source / per AOR rate limits
+ *
+ * Rules are configured per request method:
+ *   ratelimit_source = <method> <rate> <burst>   (per source IP)
+ *   ratelimit_aor    = <method> <rate> <burst>   (per From AOR)
+ * <rate> is requests/sec (may be fractional), <burst> the number of
+ * requests allowed in excess of that. Method "*" matches all requests
+ * except ACK and CANCEL. Responses are never limited.
+ *
+ * Each (rule, source IP or AOR) pair gets a token bucket. Buckets are
+ * kept in a fixed size table (ratelimit_table_size entries), hashed
+ * and linked into an LRU list, a new pair takes over the least
+ * recently used bucket. The table is allocated once at startup.
+ *
+ * Requests exceeding a limit are either answered with 503 and
+ * a Retry-After header or silently dropped (ratelimit_action).
+ * The checks work on the raw buffer index (sip_scan_raw()), a 503
+ * is sent once the message has been parsed.
+ *
+ * Only used by the SIP thread.
+ */
+#define RATELIMIT_RULES		16	/* max rules per type */
+#define RATELIMIT_AORLEN	64	/* max significant length of an AOR */
+#define RATELIMIT_METHODLEN	16
+#define RL_SCALE		1000000	/* tokens per request */
+
+typedef struct {
+   int  aor;				/* 0: per source IP, 1: per AOR */
+   char method[RATELIMIT_METHODLEN];	/* "*" = any */
+   long long rate;			/* tokens per msec */
+   long long burst;			/* bucket size (tokens) */
+} rl_rule_t;
+
+typedef struct {
+   int hnext;				/* hash chain, -1 = end */
+   int lprev, lnext;			/* LRU list, -1 = end */
+   int rule;				/* -1 = unused */
+   int limited;				/* currently exceeding */
+   unsigned int hash;
+   struct in_addr addr;
+   char aor[RATELIMIT_AORLEN];
+   unsigned int stamp;			/* last refill (msec) */
+   long long tokens;
+} rl_entry_t;
+
+static rl_rule_t rl_rule[2*RATELIMIT_RULES];
+static int rl_rules=0;
+
+static rl_entry_t *rl_entry=NULL;
+static int rl_size=0;
+static int *rl_hash=NULL;
+static unsigned int rl_hash_mask=0;
+static int rl_lru_head=-1;		/* most recently used */
+static int rl_lru_tail=-1;		/* least recently used */
+
+static ratelimit_stats_t rl_stats;
+
+/* local prototypes */
+static int ratelimit_add_rules(stringa_t *cfg, int aor);
+static int ratelimit_bucket(int rule, struct in_addr *addr, char *aor,
+                            unsigned int now);
+static int ratelimit_aor(char *buff, sip_span_t *from, char *aor);
+static void ratelimit_lru_unlink(int i);
+static void ratelimit_lru_push(int i);
+
+
+/*
+ * parse the configured rules and allocate the bucket table
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error in the configuration
+ */
+int ratelimit_init(void) {
+   unsigned int buckets;
+   int i;
+
+   rl_rules=0;
+   memset(&rl_stats, 0, sizeof(rl_stats));
+
+   if ((ratelimit_add_rules(&configuration.ratelimit_source, 0)
+        != STS_SUCCESS) ||
+       (ratelimit_add_rules(&configuration.ratelimit_aor, 1)
+        != STS_SUCCESS)) {
+      return STS_FAILURE;
+   }
+   if (rl_rules == 0) return STS_SUCCESS;
+
+   rl_size=configuration.ratelimit_table_size;
+   if (rl_size < 64) rl_size=64;
+   for (buckets=64; buckets < (unsigned int)rl_size; buckets <<= 1);
+
+   rl_entry=calloc(rl_size, sizeof(rl_entry_t));
+   rl_hash=malloc(buckets*sizeof(int));
+   if ((rl_entry == NULL) || (rl_hash == NULL)) {
+      ERROR("ratelimit_init: out of memory");
+      free(rl_entry);
+      free(rl_hash);
+      rl_entry=NULL;
+      rl_hash=NULL;
+      rl_rules=0;
+      return STS_FAILURE;
+   }
+   rl_hash_mask=buckets-1;
+   for (i=0; i<buckets; i++) rl_hash[i]=-1;
+
+   /* all entries unused, in the LRU list */
+   rl_lru_head=rl_lru_tail=-1;
+   for (i=0; i<rl_size; i++) {
+      rl_entry[i].rule=-1;
+      rl_entry[i].hnext=-1;
+      ratelimit_lru_push(i);
+   }
+
+   INFO("rate limits: %i rules, %i buckets", rl_rules, rl_size);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * check the rate limits for a received message
+ *
+ * RETURNS
+ *	STS_SUCCESS if the message may pass
+ *	STS_FAILURE if it is to be dropped
+ *	RATELIMIT_REJECT if it is to be answered with 503
+ */
+int ratelimit_check(sip_ticket_t *ticket) {
+   sip_scan_t *scan=&ticket->raw_scan;
+   char *method;
+   char aor[RATELIMIT_AORLEN];
+   int have_aor=-1;
+   struct timespec ts;
+   unsigned int now;
+   int i, len;
+   int sts=STS_SUCCESS;
+
+   if (rl_rules == 0) return STS_SUCCESS;
+
+   /* requests only */
+   method=&ticket->raw_buffer[scan->first_line.off];
+   len=scan->tok1_len;
+   if ((len == 0) || ((len == 7) && (strncmp(method, "SIP/2.0", 7) == 0))) {
+      return STS_SUCCESS;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   now=(unsigned int)(ts.tv_sec*1000 + ts.tv_nsec/1000000);
+
+   for (i=0; i<rl_rules; i++) {
+      if (strcmp(rl_rule[i].method, "*") == 0) {
+         if (((len == 3) && (strncmp(method, "ACK", 3) == 0)) ||
+             ((len == 6) && (strncmp(method, "CANCEL", 6) == 0))) continue;
+      } else if ((strlen(rl_rule[i].method) != len) ||
+                 (strncmp(rl_rule[i].method, method, len) != 0)) {
+         continue;
+      }
+
+      if (rl_rule[i].aor) {
+         if (have_aor < 0) {
+            have_aor=(ratelimit_aor(ticket->raw_buffer, &scan->from, aor)
+                      == STS_SUCCESS);
+         }
+         if (!have_aor) continue;
+         if (ratelimit_bucket(i, NULL, aor, now) != STS_SUCCESS) {
+            rl_stats.limited_aor++;
+            sts=STS_FAILURE;
+            break;
+         }
+      } else {
+         if (ratelimit_bucket(i, &ticket->from.sin_addr, NULL, now)
+             != STS_SUCCESS) {
+            rl_stats.limited_source++;
+            sts=STS_FAILURE;
+            break;
+         }
+      }
+   }
+
+   if (sts == STS_SUCCESS) return STS_SUCCESS;
+
+   /* an ACK can not be answered */
+   if (configuration.ratelimit_action &&
+       !((len == 3) && (strncmp(method, "ACK", 3) == 0))) {
+      return RATELIMIT_REJECT;
+   }
+   rl_stats.dropped++;
+   return STS_FAILURE;
+}
+
+
+/*
+ * answer a rate limited request with 503 Service Unavailable and
+ * a Retry-After header. The response is sent directly back to
+ * the source of the request (no DNS lookup).
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int ratelimit_reply(sip_ticket_t *ticket) {
+   osip_message_t *response;
+   char *buffer;
+   size_t buflen;
+   char tmp[16];
+
+   if (MSG_IS_ACK(ticket->sipmsg)) return STS_SUCCESS;
+
+   response=msg_make_template_reply(ticket, 503);
+   if (response == NULL) {
+      ERROR("ratelimit_reply: error in msg_make_template_reply");
+      return STS_FAILURE;
+   }
+   snprintf(tmp, sizeof(tmp), "%i", configuration.ratelimit_retry_after);
+   osip_message_set_header(response, "Retry-After", tmp);
+
+   if (sip_message_to_str(response, &buffer, &buflen) != 0) {
+      ERROR("ratelimit_reply: msg_2char failed");
+      osip_message_free(response);
+      return STS_FAILURE;
+   }
+
+   sipsock_send(ticket->from.sin_addr, ntohs(ticket->from.sin_port),
+                ticket->protocol, buffer, buflen);
+   rl_stats.replied++;
+
+   osip_message_free(response);
+   osip_free(buffer);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * get a copy of the rate limit counters
+ */
+void ratelimit_get_stats(ratelimit_stats_t *stats) {
+   memcpy(stats, &rl_stats, sizeof(ratelimit_stats_t));
+}
+
+
+/*
+ * parse rules "<method> <rate> <burst>"
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on syntax error
+ */
+static int ratelimit_add_rules(stringa_t *cfg, int aor) {
+   char method[RATELIMIT_METHODLEN];
+   double rate;
+   int burst;
+   int i;
+
+   for (i=0; i<cfg->used; i++) {
+      if ((sscanf(cfg->string[i], "%15s %lf %i", method, &rate, &burst) != 3)
+          || (rate <= 0) || (burst < 1)) {
+         ERROR("invalid rate limit [%s], expected <method> <rate> <burst>",
+               cfg->string[i]);
+         return STS_FAILURE;
+      }
+      if (rl_rules >= 2*RATELIMIT_RULES) {
+         ERROR("too many rate limits, ignoring [%s]", cfg->string[i]);
+         continue;
+      }
+      rl_rule[rl_rules].aor=aor;
+      strcpy(rl_rule[rl_rules].method, method);
+      /* requests/sec -> tokens/msec */
+      rl_rule[rl_rules].rate=(long long)(rate * (RL_SCALE/1000));
+      if (rl_rule[rl_rules].rate < 1) rl_rule[rl_rules].rate=1;
+      rl_rule[rl_rules].burst=(long long)burst * RL_SCALE;
+      DEBUGC(DBCLASS_CONFIG, "rate limit per %s: %s %.3f/sec burst %i",
+             (aor)? "AOR" : "source", method, rate, burst);
+      rl_rules++;
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * find (or create) the bucket of a rule and a source / AOR,
+ * refill it and take one request out of it
+ *
+ * RETURNS
+ *	STS_SUCCESS if within the limit
+ *	STS_FAILURE if exceeded
+ */
+static int ratelimit_bucket(int rule, struct in_addr *addr, char *aor,
+                            unsigned int now) {
+   rl_entry_t *e;
+   unsigned int h;
+   unsigned char *p;
+   int i, *link;
+
+   /* FNV-1a over rule and key */
+   h=2166136261U ^ (unsigned int)rule;
+   h*=16777619U;
+   if (addr) {
+      for (p=(unsigned char *)addr, i=0; i<sizeof(struct in_addr); i++) {
+         h ^= p[i];
+         h *= 16777619U;
+      }
+   } else {
+      for (p=(unsigned char *)aor; *p; p++) {
+         h ^= *p;
+         h *= 16777619U;
+      }
+   }
+
+   for (i=rl_hash[h & rl_hash_mask]; i >= 0; i=rl_entry[i].hnext) {
+      e=&rl_entry[i];
+      if ((e->hash == h) && (e->rule == rule) &&
+          ((addr && (e->addr.s_addr == addr->s_addr)) ||
+           (aor && (strcmp(e->aor, aor) == 0)))) break;
+   }
+
+   if (i < 0) {
+      /* take over the least recently used bucket */
+      i=rl_lru_tail;
+      e=&rl_entry[i];
+      if (e->rule >= 0) {
+         rl_stats.evictions++;
+         for (link=&rl_hash[e->hash & rl_hash_mask]; *link != i;
+              link=&rl_entry[*link].hnext);
+         *link=e->hnext;
+      }
+      e->rule=rule;
+      e->hash=h;
+      e->limited=0;
+      if (addr) {
+         e->addr=*addr;
+         e->aor[0]='\0';
+      } else {
+         e->addr.s_addr=0;
+         strcpy(e->aor, aor);
+      }
+      e->stamp=now;
+      e->tokens=rl_rule[rule].burst;
+      e->hnext=rl_hash[h & rl_hash_mask];
+      rl_hash[h & rl_hash_mask]=i;
+   } else {
+      /* refill */
+      e->tokens+=(long long)(now - e->stamp) * rl_rule[rule].rate;
+      if (e->tokens > rl_rule[rule].burst) e->tokens=rl_rule[rule].burst;
+      e->stamp=now;
+   }
+
+   /* most recently used */
+   if (rl_lru_head != i) {
+      ratelimit_lru_unlink(i);
+      ratelimit_lru_push(i);
+   }
+
+   if (e->tokens < RL_SCALE) {
+      if (!e->limited) {
+         e->limited=1;
+         INFO("rate limit for %s exceeded by %s",
+              rl_rule[rule].method,
+              (addr)? utils_inet_ntoa(*addr) : aor);
+      }
+      return STS_FAILURE;
+   }
+   e->tokens-=RL_SCALE;
+   e->limited=0;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * extract the AOR (user@host[:port]) from the From header value
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if no SIP URI found
+ */
+static int ratelimit_aor(char *buff, sip_span_t *from, char *aor) {
+   char *p, *end;
+   int n=0;
+
+   if (from->len == 0) return STS_FAILURE;
+   p=&buff[from->off];
+   end=p+from->len;
+
+   /* name-addr: the URI is enclosed in <> */
+   for (; (p < end) && (*p != '<'); p++);
+   if (p < end) p++;
+   else p=&buff[from->off];
+
+   if ((end-p > 4) && (strncasecmp(p, "sip:", 4) == 0)) p+=4;
+   else if ((end-p > 5) && (strncasecmp(p, "sips:", 5) == 0)) p+=5;
+   else return STS_FAILURE;
+
+   for (; (p < end) && (n < RATELIMIT_AORLEN-1); p++) {
+      if ((*p == '>') || (*p == ';') || (*p == '?') || (*p == ' ')) break;
+      aor[n++]=tolower((unsigned char)*p);
+   }
+   aor[n]='\0';
+   return (n > 0)? STS_SUCCESS : STS_FAILURE;
+}
+
+
+/*
+ * remove an entry from the LRU list
+ */
+static void ratelimit_lru_unlink(int i) {
+   rl_entry_t *e=&rl_entry[i];
+
+   if (e->lprev >= 0) rl_entry[e->lprev].lnext=e->lnext;
+   else rl_lru_head=e->lnext;
+   if (e->lnext >= 0) rl_entry[e->lnext].lprev=e->lprev;
+   else rl_lru_tail=e->lprev;
+}
+
+
+/*
+ * insert an entry at the head of the LRU list
+ */
+static void ratelimit_lru_push(int i) {
+   rl_entry[i].lprev=-1;
+   rl_entry[i].lnext=rl_lru_head;
+   if (rl_lru_head >= 0) rl_entry[rl_lru_head].lprev=i;
+   rl_lru_head=i;
+   if (rl_lru_tail < 0) rl_lru_tail=i;
+}
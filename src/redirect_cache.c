@@ -23,7 +23,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <netinet/in.h>
@@ -55,95 +57,252 @@
  * to the plugins.
  *
  * This is the "redirected_cache". Each plugin needs its own private
- * cache. A static Queue header for the cache must be created and
- * passed to the cache handling functions.
+ * cache. A static cache handle must be created and passed to the
+ * cache handling functions.
  *
  * static redirected_cache_element_t redirected_cache;
  * [...]
  * add_to_redirected_cache(&redirected_cache, ticket);
  *
+ * The Call-Ids of all plugins are kept in one hash table, hashed by
+ * Call-Id only. A lookup matches the Call-Id and the plugin's handle,
+ * so a plugin only sees its own entries. As all entries live CACHE_TIMEOUT seconds,
+ * the order of insertion is the order of expiry: a FIFO time queue is
+ * enough and expiring only looks at its head. Entries are taken from
+ * a pool and returned to it, not freed.
+ *
+ * The functions may be called from several SIP workers at once, the
+ * shared table is guarded by redirect_mutex.
  */
+#define REDIRECT_HASH_SIZE	1024	/* buckets, power of 2 */
+#define REDIRECT_POOL_CHUNK	64	/* entries allocated at once */
+
+typedef struct redirect_entry_s {
+   struct redirect_entry_s *hnext;	/* hash chain */
+   struct redirect_entry_s *tprev;	/* time queue, oldest first */
+   struct redirect_entry_s *tnext;	/* time queue / pool free list */
+   redirected_cache_element_t *owner;	/* cache handle of the plugin */
+   osip_call_id_t *call_id;
+   unsigned int hash;
+   time_t ts;
+} redirect_entry_t;
+
+static redirect_entry_t *redirect_hash[REDIRECT_HASH_SIZE];
+static redirect_entry_t *redirect_queue_head;	/* oldest */
+static redirect_entry_t *redirect_queue_tail;	/* newest */
+static redirect_entry_t *redirect_pool;	/* free entries */
+static pthread_mutex_t redirect_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+/* local prototypes */
+static redirect_entry_t *redirect_find(redirected_cache_element_t *owner,
+                                       osip_call_id_t *call_id,
+                                       unsigned int hash);
+static void redirect_remove(redirect_entry_t *e);
+static redirect_entry_t *redirect_alloc(void);
+static unsigned int redirect_callid_hash(osip_call_id_t *call_id);
+
 
 int add_to_redirected_cache(redirected_cache_element_t *redirected_cache, sip_ticket_t *ticket) {
-   redirected_cache_element_t *e;
+   redirect_entry_t *e;
+   osip_call_id_t *call_id;
+   unsigned int idx;
    DEBUGC(DBCLASS_PLUGIN, "entered add_to_redirected_cache()");
-   
+
+   if (ticket->sipmsg->call_id == NULL) return STS_FAILURE;
+
+   if (osip_call_id_clone(ticket->sipmsg->call_id, &call_id) != 0) {
+      ERROR("out of memory");
+      return STS_FAILURE;
+   }
+
+   pthread_mutex_lock(&redirect_mutex);
    /* allocate */
-   e=malloc(sizeof(redirected_cache_element_t));
+   e=redirect_alloc();
    if (e == NULL) {
+       pthread_mutex_unlock(&redirect_mutex);
+       osip_call_id_free(call_id);
        ERROR("out of memory");
        return  STS_FAILURE;
    }
 
    /* populate element */
-   e->next = NULL;
-   e->ts   = time(NULL);
-   osip_call_id_clone(ticket->sipmsg->call_id, &(e->call_id));
+   e->call_id = call_id;
+   e->owner = redirected_cache;
+   e->ts    = time(NULL);
+   e->hash  = redirect_callid_hash(e->call_id);
 
-   /* add to head of queue */
-   e->next = redirected_cache->next;
-   redirected_cache->next = e;
+   /* add to hash table */
+   idx = e->hash & (REDIRECT_HASH_SIZE-1);
+   e->hnext = redirect_hash[idx];
+   redirect_hash[idx] = e;
 
+   /* add to tail of time queue (newest) */
+   e->tnext = NULL;
+   e->tprev = redirect_queue_tail;
+   if (redirect_queue_tail) redirect_queue_tail->tnext = e;
+   else redirect_queue_head = e;
+   redirect_queue_tail = e;
+
+   redirected_cache->entries++;
+   pthread_mutex_unlock(&redirect_mutex);
    DEBUGC(DBCLASS_PLUGIN, "left add_to_redirected_cache()");
    return STS_SUCCESS;
 }
 
 int is_in_redirected_cache(redirected_cache_element_t *redirected_cache, sip_ticket_t *ticket) {
-   redirected_cache_element_t *p, *p_prev;
+   redirect_entry_t *e;
+   unsigned int hash;
 
    DEBUGC(DBCLASS_BABBLE, "entered is_in_redirected_cache");
-   /* iterate through queue */
-   p_prev=NULL;
-   for (p=redirected_cache; p; p=p->next) {
-      DEBUGC(DBCLASS_BABBLE, "l: p=%p, p->next=%p", p, p->next);
-      if ( (p != redirected_cache) && (p_prev != NULL) ) {
-         if (compare_callid(ticket->sipmsg->call_id, p->call_id) == STS_SUCCESS) {
-            DEBUGC(DBCLASS_BABBLE, "remove p=%p", p);
-            /* remove from queue */
-            p_prev->next = p->next;
-            osip_call_id_free (p->call_id);
-            free(p);
-            DEBUGC(DBCLASS_BABBLE, "left is_in_redirected_cache - FOUND");
-            return STS_TRUE;
-         } /* if compare_callid */
-      }
-      p_prev = p;
-   } /* for */
+   if (ticket->sipmsg->call_id == NULL) {
+      DEBUGC(DBCLASS_BABBLE, "left is_in_redirected_cache - NOT FOUND");
+      return STS_FALSE;
+   }
+   hash = redirect_callid_hash(ticket->sipmsg->call_id);
+
+   pthread_mutex_lock(&redirect_mutex);
+   e = NULL;
+   if (redirected_cache->entries > 0) {
+      e = redirect_find(redirected_cache, ticket->sipmsg->call_id, hash);
+   }
+   if (e) {
+      DEBUGC(DBCLASS_BABBLE, "remove e=%p", e);
+      redirect_remove(e);
+      pthread_mutex_unlock(&redirect_mutex);
+      DEBUGC(DBCLASS_BABBLE, "left is_in_redirected_cache - FOUND");
+      return STS_TRUE;
+   }
+   pthread_mutex_unlock(&redirect_mutex);
    DEBUGC(DBCLASS_BABBLE, "left is_in_redirected_cache - NOT FOUND");
    return STS_FALSE;
 }
 
 /*
- * Run through the whole Call-Id cache and remove
- * expired elements.
+ * Remove expired elements from the head of the time queue.
+ * The queue is shared, expired Call-Ids of other plugins are
+ * removed as well.
  */
 int expire_redirected_cache(redirected_cache_element_t *redirected_cache) {
-   redirected_cache_element_t *p, *p_prev;
    time_t now;
 
    DEBUGC(DBCLASS_BABBLE, "entered expire_redirected_cache");
    now = time(NULL);
 
-   /* iterate through queue */
-   p_prev=NULL;
-   for (p=redirected_cache; p; p=p->next) {
-      DEBUGC(DBCLASS_BABBLE, "1: p=%p, p->next=%p", p, p->next);
-      if ( (p != redirected_cache) && (p_prev != NULL) ) {
-         DEBUGC(DBCLASS_BABBLE,"ts:%i, now:%i", (int)p->ts, (int)now);
-         if ((p->ts + CACHE_TIMEOUT) < now) {
-            DEBUGC(DBCLASS_BABBLE, "remove p=%p", p);
-            /* remove from queue */
-            p_prev->next = p->next;
-            osip_call_id_free (p->call_id);
-            free(p);
-            /* the current element is being removed and invalidated,
-             * set the iteration pointer to a valid element. */
-            p = p_prev;
-         } /* if timeout */
-         DEBUGC(DBCLASS_BABBLE, "2: p=%p, p->next=%p", p, p->next);
-      }
-      p_prev = p;
-   } /* for */
+   pthread_mutex_lock(&redirect_mutex);
+   while (redirect_queue_head &&
+          ((redirect_queue_head->ts + CACHE_TIMEOUT) < now)) {
+      DEBUGC(DBCLASS_BABBLE,"remove e=%p ts:%i, now:%i", redirect_queue_head,
+             (int)redirect_queue_head->ts, (int)now);
+      redirect_remove(redirect_queue_head);
+   }
+   pthread_mutex_unlock(&redirect_mutex);
    DEBUGC(DBCLASS_BABBLE, "left expire_redirected_cache");
    return STS_FALSE;
 }
+
+
+/*
+ * Find the entry of a plugin for a Call-Id
+ *
+ * RETURNS
+ *	pointer to the entry, NULL if not found
+ */
+static redirect_entry_t *redirect_find(redirected_cache_element_t *owner,
+                                       osip_call_id_t *call_id,
+                                       unsigned int hash) {
+   redirect_entry_t *e;
+
+   for (e=redirect_hash[hash & (REDIRECT_HASH_SIZE-1)]; e; e=e->hnext) {
+      if ((e->hash == hash) && (e->owner == owner) &&
+          (compare_callid(call_id, e->call_id) == STS_SUCCESS)) {
+         return e;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ * Unlink an entry from hash table and time queue and return it
+ * to the pool
+ */
+static void redirect_remove(redirect_entry_t *e) {
+   redirect_entry_t **pp;
+
+   for (pp=&redirect_hash[e->hash & (REDIRECT_HASH_SIZE-1)]; *pp;
+        pp=&(*pp)->hnext) {
+      if (*pp == e) {
+         *pp = e->hnext;
+         break;
+      }
+   }
+
+   if (e->tprev) e->tprev->tnext = e->tnext;
+   else redirect_queue_head = e->tnext;
+   if (e->tnext) e->tnext->tprev = e->tprev;
+   else redirect_queue_tail = e->tprev;
+
+   e->owner->entries--;
+   osip_call_id_free (e->call_id);
+   e->call_id = NULL;
+   e->owner = NULL;
+   e->tprev = NULL;
+   e->tnext = redirect_pool;
+   redirect_pool = e;
+}
+
+
+/*
+ * Get an entry from the pool, grow the pool by REDIRECT_POOL_CHUNK
+ * entries if it is empty
+ *
+ * RETURNS
+ *	pointer to the entry, NULL if out of memory
+ */
+static redirect_entry_t *redirect_alloc(void) {
+   redirect_entry_t *e;
+   int i;
+
+   if (redirect_pool == NULL) {
+      e=calloc(REDIRECT_POOL_CHUNK, sizeof(redirect_entry_t));
+      if (e == NULL) return NULL;
+      for (i=0; i < REDIRECT_POOL_CHUNK; i++) {
+         e[i].tnext = redirect_pool;
+         redirect_pool = &e[i];
+      }
+   }
+   e = redirect_pool;
+   redirect_pool = e->tnext;
+   e->tnext = NULL;
+   return e;
+}
+
+
+/*
+ * Hash of a Call-Id, consistent with compare_callid(): the number
+ * part is case sensitive, the host part is not, a missing part
+ * equals an empty one.
+ */
+static unsigned int redirect_callid_hash(osip_call_id_t *call_id) {
+   siphash_ctx_t ctx;
+   unsigned char hash[16];
+   char buf[64];
+   const char *p;
+   unsigned int h;
+   int i;
+
+   siphash_begin(&ctx);
+   if (call_id->number) {
+      siphash_update(&ctx, call_id->number, strlen(call_id->number));
+   }
+   siphash_update(&ctx, "@", 1);
+   for (p=call_id->host; p && *p; ) {
+      for (i=0; *p && (i < sizeof(buf)); i++, p++) {
+         buf[i]=tolower((unsigned char)*p);
+      }
+      siphash_update(&ctx, buf, i);
+   }
+   siphash_final(&ctx, hash);
+   memcpy(&h, hash, sizeof(h));
+   return h;
+}
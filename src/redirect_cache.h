@@ -20,10 +20,12 @@
 
 /* $Id: siproxd.h 482 2011-06-12 18:45:17Z hb9xar $ */
 
+/*
+ * Per plugin handle of the redirected cache. The Call-Ids are kept
+ * in a hash table shared by all plugins (see redirect_cache.c).
+ */
 typedef struct {
-    void            *next;
-    osip_call_id_t  *call_id;
-    time_t          ts;
+    int             entries;	/* Call-Ids cached for this plugin */
 } redirected_cache_element_t;
 
 /* return STS_ codes */
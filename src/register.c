@@ -177,6 +177,7 @@ void register_save(void) {
  *    STS_SUCCESS : successfully registered
  *    STS_FAILURE : registration failed
  *    STS_NEED_AUTH : authentication needed
+ *    STS_AUTH_STALE: authentication needed, nonce stale
  */
 int register_client(sip_ticket_t *ticket, int force_lcl_masq) {
    int i, j, n, sts;
@@ -205,12 +206,12 @@ int register_client(sip_ticket_t *ticket, int force_lcl_masq) {
               ticket->sipmsg->to->url->username : "*NULL*",
               ticket->sipmsg->to->url->host);
          return STS_FAILURE;
-      } else if (sts == STS_NEED_AUTH) {
+      } else if ((sts == STS_NEED_AUTH) || (sts == STS_AUTH_STALE)) {
          /* needed */
          DEBUGC(DBCLASS_REG,"proxy authentication needed for %s@%s",
                 ticket->sipmsg->to->url->username,
                 ticket->sipmsg->to->url->host);
-         return STS_NEED_AUTH;
+         return sts;
       }
    }
 
@@ -548,6 +549,7 @@ void register_agemap(void) {
  *  flag = STS_SUCCESS    -> positive answer (200)
  *  flag = STS_FAILURE    -> negative answer (503)
  *  flag = STS_NEED_AUTH  -> proxy authentication needed (407)
+ *  flag = STS_AUTH_STALE -> proxy authentication needed, stale nonce (407)
  *
  * RETURNS
  *      STS_SUCCESS on success
@@ -573,6 +575,7 @@ int register_response(sip_ticket_t *ticket, int flag) {
       code = 503;       /* failed */
       break;
    case STS_NEED_AUTH:
+   case STS_AUTH_STALE:
       code = 407;       /* proxy authentication needed */
       break;
    default:
@@ -595,7 +598,7 @@ int register_response(sip_ticket_t *ticket, int flag) {
    /* if we send back an proxy authentication needed, 
       include the Proxy-Authenticate field */
    if (code == 407) {
-      auth_include_authrq(response);
+      auth_include_authrq(response, (flag == STS_AUTH_STALE));
    }
 
    /* get the IP address from existing VIA header */
@@ -29,225 +29,543 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
 #include <resolv.h>
 #include <string.h>
 #include <sys/types.h>
 
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
 #include "log.h"
 
-#define USE_NAPTR	0
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/*
+ * RFC3263 - Locating SIP Servers
+ *
+ * The DNS queries (NAPTR, SRV) are done by the resolver threads of
+ * the DNS cache (see dnscache.c), the resulting server sets are
+ * cached there. Here we do the selection of the next hop out of a
+ * cached server set: lowest priority first, weighted random selection
+ * within one priority (RFC2782). Targets that did fail recently are
+ * skipped (see resolve_target_failed()).
+ */
+
+/*
+ * health state of SRV targets
+ */
+#define SRV_HEALTH_SIZE		64	/* number of remembered failed targets */
+
+static struct {
+   struct in_addr addr;
+   int    port;
+   time_t down_until;		/* 0 = unused */
+} srv_health[SRV_HEALTH_SIZE];
+
+/*
+ * targets that have been selected out of a server set - only these
+ * are put on hold by resolve_target_failed(), a plain IP or an
+ * explicit port is always used as given
+ */
+#define SRV_KNOWN_SIZE		256	/* number of remembered SRV targets */
+
+static struct {
+   struct in_addr addr;
+   int    port;
+   time_t last_used;		/* 0 = unused */
+} srv_known[SRV_KNOWN_SIZE];
 
 /* local functions */
-static int _resolve(char *name, int class, int type,
-                    char *dname, int dnamelen, int *port);
+static int _resolve(char *name, int type, unsigned char *answer, int anslen,
+                    ns_msg *msg);
+static int resolve_NAPTR(char *name, int proto, char *dname, int dnamelen,
+                         unsigned int *ttl);
+static int srv_is_down(struct in_addr addr, int port, time_t now);
+static void srv_remember(struct in_addr addr, int port, time_t now);
+static int srv_is_known(struct in_addr addr, int port);
+static int srv_select(dns_srvset_t *srvset, int *excluded, time_t now);
+
 
 /*
- * perform a SRV record lookup
+ * perform a NAPTR (if available) and SRV record lookup
+ * (RFC3263, 4.1 and 4.2) - blocking, called by the resolver threads.
  *
- * name		name of service
- * proto    IPPROTO_TCP / IPPROTO_UDP
- * dname	returned value
- * dnamelen	length of return buffer
- * port		port number of service
+ * name		domain name
+ * proto	PROTO_UDP / PROTO_TCP
+ * srvset	returned server set, sorted by priority.
+ *		srvset->count=0: no SRV records, use A record
+ * ttl		returned TTL of the server set
+ *
+ * RETURNS
+ *	STS_SUCCESS on success (also if no SRV record exists)
+ *	STS_FAILURE on DNS failure
  */
-int resolve_SRV(char *name, int proto, char *dname, int dnamelen, int *port) {
-   char nname[256];
-   if (proto == IPPROTO_TCP) {
-      snprintf(nname, sizeof(nname), "_sip._tcp.%s", name);
-   } else {
-      snprintf(nname, sizeof(nname), "_sip._udp.%s", name);
-   }
-   return _resolve(nname, C_IN, T_SRV, dname, dnamelen, port);
+int resolve_SRV(char *name, int proto, dns_srvset_t *srvset, int *ttl) {
+   char nname[HOSTNAME_SIZE+16];
+   unsigned char answer[4*NS_PACKETSZ];
+   unsigned int minttl=UINT_MAX;
+   int i, j, count;
+   ns_msg msg;
+   ns_rr rr;
+   const unsigned char *rdata;
+   char target[NS_MAXDNAME];
+
+   memset(srvset, 0, sizeof(dns_srvset_t));
+   *ttl = DNS_BAD_AGE;
+
+   /* 1) NAPTR: which SRV name to use for my transport? */
+   nname[0]='\0';
+   if (resolve_NAPTR(name, proto, nname, sizeof(nname), &minttl) !=
+       STS_SUCCESS) {
+      return STS_FAILURE;
+   }
+
+   /* 2) no usable NAPTR: construct the SRV name */
+   if (nname[0] == '\0') {
+      snprintf(nname, sizeof(nname), "_sip._%s.%s",
+               (proto == PROTO_TCP) ? "tcp" : "udp", name);
+   }
+
+   /* 3) SRV lookup */
+   switch (_resolve(nname, ns_t_srv, answer, sizeof(answer), &msg)) {
+   case ns_r_noerror:
+      break;
+   case ns_r_nxdomain:
+      /* no SRV - caller will use A record */
+      DEBUGC(DBCLASS_DNS, "resolve_SRV: no SRV for [%s]", nname);
+      return STS_SUCCESS;
+   default:
+      return STS_FAILURE;
+   }
+
+   count = ns_msg_count(msg, ns_s_an);
+   for (i=0; i<count; i++) {
+      if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) break;
+      if (ns_rr_ttl(rr) < minttl) minttl = ns_rr_ttl(rr);
+      if ((ns_rr_type(rr) != ns_t_srv) || (ns_rr_rdlen(rr) < 7)) continue;
+
+      rdata = ns_rr_rdata(rr);
+      if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), rdata+6,
+                    target, sizeof(target)) < 0) {
+         ERROR("resolve_SRV: dn_expand error");
+         break;
+      }
+
+      /* "." as target: service decidedly not available */
+      if ((target[0] == '\0') || (strcmp(target, ".") == 0)) continue;
+
+      /* a truncated name would be a different host */
+      if (strlen(target) > DNS_SRV_TARGETSIZE) {
+         DEBUGC(DBCLASS_DNS, "resolve_SRV: target name too long for [%s], "
+                "ignoring [%s]", nname, target);
+         continue;
+      }
+
+      if (srvset->count >= DNS_SRV_MAX) {
+         DEBUGC(DBCLASS_DNS, "resolve_SRV: too many SRV records for [%s], "
+                "ignoring [%s]", nname, target);
+         continue;
+      }
+
+      /* insert sorted by priority */
+      for (j=srvset->count; j>0; j--) {
+         if (srvset->entry[j-1].priority <= ns_get16(rdata)) break;
+         srvset->entry[j] = srvset->entry[j-1];
+      }
+      srvset->entry[j].priority = ns_get16(rdata);
+      srvset->entry[j].weight   = ns_get16(rdata+2);
+      srvset->entry[j].port     = ns_get16(rdata+4);
+      strcpy(srvset->entry[j].target, target);
+      srvset->count++;
+
+      DEBUGC(DBCLASS_DNS, "resolve_SRV: [%s] prio=%i, weight=%i, "
+             "port=%i name=[%s]", nname, ns_get16(rdata), ns_get16(rdata+2),
+             ns_get16(rdata+4), target);
+   }
+
+   if (minttl != UINT_MAX) {
+      *ttl = (minttl > INT_MAX) ? INT_MAX : (int)minttl;
+   }
+   return STS_SUCCESS;
 }
 
-#if USE_NAPTR
+
 /*
- * perform a NAPTR lookup
+ * perform a NAPTR lookup (RFC3263, 4.1)
  *
- * name		name of service
- * dname	return
+ * name		domain name
+ * proto	PROTO_UDP / PROTO_TCP
+ * dname	returned SRV name to query ('\0' if no usable NAPTR)
  * dnamelen	length of return buffer
+ * ttl		lowered to the TTL of the NAPTR records
+ *
+ * RETURNS
+ *	STS_SUCCESS on success (also if no NAPTR record exists)
+ *	STS_FAILURE on DNS failure
  */
-int resolve_NAPTR(char *name, char *dname, int dnamelen) {
-   int port=0;
-   return _resolve(name, C_ANY, T_NAPTR, dname, dnamelen, &port);
+static int resolve_NAPTR(char *name, int proto, char *dname, int dnamelen,
+                         unsigned int *ttl) {
+   unsigned char answer[4*NS_PACKETSZ];
+   int i, count, len;
+   int order, pref;
+   int best_order=INT_MAX, best_pref=INT_MAX;
+   ns_msg msg;
+   ns_rr rr;
+   const unsigned char *p, *end;
+   const char *service;
+   char replacement[NS_MAXDNAME];
+
+   service = (proto == PROTO_TCP) ? "SIP+D2T" : "SIP+D2U";
+   dname[0]='\0';
+
+   switch (_resolve(name, ns_t_naptr, answer, sizeof(answer), &msg)) {
+   case ns_r_noerror:
+      break;
+   case ns_r_nxdomain:
+      return STS_SUCCESS;
+   default:
+      return STS_FAILURE;
+   }
+
+   count = ns_msg_count(msg, ns_s_an);
+   for (i=0; i<count; i++) {
+      if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) break;
+      if ((ns_rr_type(rr) != ns_t_naptr) || (ns_rr_rdlen(rr) < 7)) continue;
+      if (ns_rr_ttl(rr) < *ttl) *ttl = ns_rr_ttl(rr);
+
+      p = ns_rr_rdata(rr);
+      end = p + ns_rr_rdlen(rr);
+      order = ns_get16(p);
+      pref  = ns_get16(p+2);
+      p += 4;
+
+      /* FLAGS: must be "s" (next lookup is SRV) */
+      len = *p++;
+      if ((p+len > end) || (len != 1) || ((*p != 's') && (*p != 'S'))) {
+         continue;
+      }
+      p += len;
+
+      /* SERVICES: must match my transport */
+      len = *p++;
+      if ((p+len > end) || (len != strlen(service)) ||
+          (strncasecmp((const char*)p, service, len) != 0)) {
+         continue;
+      }
+      p += len;
+
+      /* REGEXP: not used for SIP (RFC3263, 4.1) */
+      len = *p++;
+      if (p+len > end) continue;
+      p += len;
+
+      /* REPLACEMENT */
+      if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), p,
+                    replacement, sizeof(replacement)) < 0) {
+         ERROR("resolve_NAPTR: dn_expand error");
+         break;
+      }
+
+      DEBUGC(DBCLASS_DNS, "resolve_NAPTR: [%s] order=%i, pref=%i, "
+             "service=%s, replacement=[%s]", name, order, pref, service,
+             replacement);
+
+      /* a truncated name would be a different domain */
+      if (strlen(replacement) >= dnamelen) {
+         DEBUGC(DBCLASS_DNS, "resolve_NAPTR: replacement too long for [%s], "
+                "ignoring [%s]", name, replacement);
+         continue;
+      }
+
+      if ((order < best_order) ||
+          ((order == best_order) && (pref < best_pref))) {
+         best_order = order;
+         best_pref  = pref;
+         strcpy(dname, replacement);
+      }
+   }
+
+   return STS_SUCCESS;
 }
-#endif
+
 
 /*
  * query the DNS for a specific record type
+ *
+ * RETURNS the RCODE of the answer (ns_r_noerror, ns_r_nxdomain, ...)
+ *         or -1 on failure. msg is initialized for parsing on success.
+ */
+static int _resolve(char *name, int type, unsigned char *answer, int anslen,
+                    ns_msg *msg) {
+   unsigned char query[NS_PACKETSZ];
+   int qlen, alen;
+   int rcode;
+
+   qlen = res_mkquery(ns_o_query, name, ns_c_in, type, NULL, 0,
+                      NULL, query, sizeof(query));
+   if (qlen < 0) {
+      ERROR("res_mkquery failed for [%s]", name);
+      return -1;
+   }
+
+   alen = res_send(query, qlen, answer, anslen);
+   if (alen < 0) {
+      DEBUGC(DBCLASS_DNS, "_resolve: res_send failed for [%s]", name);
+      return -1;
+   }
+
+   if (ns_initparse(answer, alen, msg) < 0) {
+      ERROR("_resolve: unparseable DNS answer for [%s]", name);
+      return -1;
+   }
+
+   rcode = ns_msg_getflag(*msg, ns_f_rcode);
+   DEBUGC(DBCLASS_DNS, "_resolve: name=[%s], type=%i, rcode=%i, ancount=%i",
+          name, type, rcode, ns_msg_count(*msg, ns_s_an));
+   return rcode;
+}
+
+
+/*
+ * RFC3263 next hop determination for a SIP URI host part
+ *
+ * host		host part of the URI
+ * port		port part of the URI (may be NULL)
+ * proto	PROTO_UDP / PROTO_TCP
+ * addr, retport  resulting next hop
+ *
+ * If the host is a numeric IP or a port is given, only an A lookup
+ * is done. Otherwise the cached server set (NAPTR/SRV) is used. If
+ * there is no server set or its lookup failed, the A record is used
+ * (port 5060).
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on failure (or if the message got parked)
  */
-static int _resolve(char *name, int class, int type,
-                    char *dname, int dnamelen, int *port) {
-   int sts;
+int resolve_sip_target(char *host, char *port, int proto,
+                       struct in_addr *addr, in_port_t *retport) {
+   dns_srvset_t srvset;
+   int excluded[DNS_SRV_MAX];
+   int i, sts;
+   time_t now;
 
+   if (host == NULL) return STS_FAILURE;
 
-   // message buffer
-   unsigned char msg[PACKETSZ];
-   int msglen=PACKETSZ;
+   *retport = SIP_PORT;
+   if (port) {
+      i = atoi(port);
+      if ((i <= 0) || (i > 65535)) i = SIP_PORT;
+      *retport = i;
+   }
 
-   // response header
-   HEADER *res_header;
+   /* numeric IP or explicit port: A record only (RFC3263, 4.2) */
+   if ((port != NULL) || (utils_inet_aton(host, addr) > 0) ||
+       (configuration.dns_use_srv == 0)) {
+      return get_ip_by_host(host, addr);
+   }
 
-   // expanded name
-   char exp_dn[MAXDNAME];
-   int exp_dnlen=MAXDNAME;
+   sts = dnscache_lookup_srv(host, proto, &srvset);
+   if (sts != STS_SUCCESS) {
+      /* waiting for DNS, try again later */
+      if (dnscache_is_parked() == STS_TRUE) return STS_FAILURE;
+      /* NAPTR/SRV lookup failed (SERVFAIL, timeout): A record */
+      DEBUGC(DBCLASS_DNS, "resolve_sip_target: no server set for %s, "
+             "using A record", host);
+      return get_ip_by_host(host, addr);
+   }
 
-   int i, j, co;
-   unsigned char *mptr, *xptr;
-   unsigned short *usp,ty;
-   unsigned int *uip;
+   /* no server set: plain A record */
+   if (srvset.count == 0) {
+      return get_ip_by_host(host, addr);
+   }
 
-   u_short priority = 0;
-   u_short weight = 0;
+   /* select a target, skip targets that can't be resolved */
+   time(&now);
+   memset(excluded, 0, sizeof(excluded));
+   for (;;) {
+      i = srv_select(&srvset, excluded, now);
+      if (i < 0) break;
 
-   char tmpname[PACKETSZ];
+      sts = get_ip_by_host(srvset.entry[i].target, addr);
+      if (sts == STS_SUCCESS) {
+         *retport = srvset.entry[i].port;
+         srv_remember(*addr, *retport, now);
+         DEBUGC(DBCLASS_DNS, "resolve_sip_target: %s -> %s (%s:%i)", host,
+                srvset.entry[i].target, utils_inet_ntoa(*addr), *retport);
+         return STS_SUCCESS;
+      }
 
-   dname[0]='\0';
-   *port=0;
+      /* waiting for DNS, try again later */
+      if (dnscache_is_parked() == STS_TRUE) return STS_FAILURE;
 
-   // issue request
-   sts=res_query(name, class, type, msg, msglen);
-   if (sts<0) {
-      ERROR("res_query failed sts=%i\n", sts);
-      return 0;
+      excluded[i] = 1;
    }
 
-   res_header = (HEADER *)msg;
-   DEBUGC(DBCLASS_DNS, "_resolve: name=[%s], type=%i, qdcount=%i, ancount=%i",
-         name, type, ntohs(res_header->qdcount), ntohs(res_header->ancount));
+   DEBUGC(DBCLASS_DNS, "resolve_sip_target: no usable target for %s", host);
+   return STS_FAILURE;
+}
 
-   mptr=msg+sizeof(HEADER);
 
-   // loop through query part
-   co=ntohs(res_header->qdcount);
-   for (i=0; i<co; i++) {
-      j=dn_expand(msg,msg+PACKETSZ,mptr,exp_dn,exp_dnlen);
-      DEBUGC(DBCLASS_DNS, "_resolve: Q - len=%i, name=[%s]", j, exp_dn);
-      if( j < 0 ) {
+/*
+ * mark a target as failed, it will not be selected out of a server
+ * set for the next 'holddown' seconds (0 = default) - unless there
+ * is no other choice. Targets that were not handed out of a server
+ * set by resolve_sip_target() are ignored.
+ */
+void resolve_target_failed(struct in_addr addr, int port, int holddown) {
+   int i, idx=-1;
+   time_t now;
+
+   time(&now);
+   if (holddown <= 0) holddown = configuration.dns_srv_holddown;
+   if (holddown <= 0) return;
+
+   /* only targets out of a server set have alternatives */
+   if (srv_is_known(addr, port) != STS_TRUE) return;
+
+   for (i=0; i<SRV_HEALTH_SIZE; i++) {
+      if ((srv_health[i].down_until != 0) &&
+          (memcmp(&srv_health[i].addr, &addr, sizeof(addr)) == 0) &&
+          (srv_health[i].port == port)) {
+         idx = i;
          break;
-      } else {
-         mptr += j;
-         usp = (unsigned short *)mptr;
-         mptr += sizeof( short );
-         usp = (unsigned short *)mptr;
-         mptr += sizeof( short );
+      }
+      /* remember a free (or the oldest) slot */
+      if ((idx < 0) || (srv_health[i].down_until < srv_health[idx].down_until)) {
+         idx = i;
       }
    }
 
-   // loop through answer part
-   co=ntohs(res_header->ancount);
-   for (i=0; i<co; i++) {
-      j=dn_expand(msg,msg+PACKETSZ,mptr,exp_dn,exp_dnlen);
-      if( j < 0 ) {
-         ERROR("_resolve: dn_expand error");
+   INFO("SIP target %s:%i failed, not using it for %i seconds",
+        utils_inet_ntoa(addr), port, holddown);
+   memcpy(&srv_health[idx].addr, &addr, sizeof(addr));
+   srv_health[idx].port = port;
+   srv_health[idx].down_until = now + holddown;
+}
+
+
+/*
+ * remember a target selected out of a server set, replaces the
+ * least recently used one if the table is full
+ */
+static void srv_remember(struct in_addr addr, int port, time_t now) {
+   int i, idx=0;
+
+   for (i=0; i<SRV_KNOWN_SIZE; i++) {
+      if ((srv_known[i].last_used != 0) &&
+          (memcmp(&srv_known[i].addr, &addr, sizeof(addr)) == 0) &&
+          (srv_known[i].port == port)) {
+         idx = i;
          break;
-      } else {
-         mptr += j;
-         usp = (unsigned short *)mptr;
-         ty = ntohs( *usp );
-         mptr += sizeof( short );
-         usp = (unsigned short *)mptr;
-         mptr += sizeof(short);
-         uip = (unsigned int *)mptr;
-         mptr += sizeof(int);
-         uip = (unsigned int *)mptr;
-         j = ntohs( *uip );
-         mptr += sizeof(short);
-         xptr = mptr;
-         mptr += j;
-         if( ty == T_SRV ) {
-            u_short pr;
-            u_short we;
-            u_short po;
-            usp = (unsigned short *)xptr;
-            pr = ntohs( *usp );
-            xptr += sizeof( short );
-            usp = (unsigned short *)xptr;
-            we = ntohs( *usp );
-            xptr += sizeof( short );
-            usp = (unsigned short *)xptr;
-            po = ntohs( *usp );
-            xptr += sizeof( short );
-            j = dn_expand( msg, msg + PACKETSZ, xptr, tmpname, MAXDNAME );
-            if( j < 0 ) {
-               break;
-            } else {
-                DEBUGC(DBCLASS_DNS, "_resolve: A[%i] - type SRV prio=%i, weight=%i, "
-                       "port=%i name=[%s]", i, pr, we, po, tmpname);
-               if( !priority || pr < priority ||
-                   (pr == priority && we > weight) ) {
-                  priority = pr;
-                  weight = we;
-                  *port = po;
-                  strncpy(dname, tmpname, dnamelen);
-/*&&& here the magic with the priorities should go.
-which one do we use? RFC3263 talks a bit on how a stateless
-SIP proxy should handle it - BY GOING STATEFUL if the lowest priority
-is unavailable. Why do I have a stateless proxy? Exactly, because I
-do NOT want to do the whole stateful crap.
-Rethinking needed.
-Currently just the first (lowest prio, highest weight) entry is returned.
-*/
-                  xptr+=j;
-               }
-            }
-#if USE_NAPTR
-         } else if( ty == T_NAPTR ) {
-            DEBUGC(DBCLASS_DNS, "_resolve: A - type NAPTR");
-            usp = (unsigned short *)xptr;
-            xptr += sizeof(short);
-            usp = (unsigned short *)xptr;
-            xptr += sizeof(short);
-            j = (int)(*xptr);
-            xptr += 1;
-            while( j > 0 ) {
-               xptr+=1;
-               j--;
-            }
-            j = (int)(*xptr);
-            xptr += 1;
-            while( j > 0 ) {
-               xptr += 1;
-               j--;
-            }
-            j=(int)(*xptr);
-            xptr+=1;
-            while( j > 0 ) {
-               xptr += 1;
-               j--;
-            }
-            j = dn_expand( msg, msg + PACKETSZ, xptr, tmpname, MAXDNAME );
-            if( j < 0 ) {
-               break;
-            } else {
+      }
+      if (srv_known[i].last_used < srv_known[idx].last_used) idx = i;
+   }
+   memcpy(&srv_known[idx].addr, &addr, sizeof(addr));
+   srv_known[idx].port = port;
+   srv_known[idx].last_used = now;
+}
+
+
 /*
- * there should be some REGEX magic, no?
- * Not yet used nor implemented. Just complain in
- * case somebody feels lucky enough trying to use it.
+ * has a target been selected out of a server set?
+ *
+ * RETURNS
+ *	STS_TRUE if yes
+ *	STS_FALSE if not
  */
-ERROR("_resolve: NAPTR lookup not yet supported.");
-               if( proto == PROTO_UDP ) {
-                  if( strstr(tmpname, "_udp" ) ) {
-                     strncpy(dname, tmpname, dnamelen);
-                  }
-               } else {
-                  if( strstr(tmpname, "_tcp" ) ) {
-                     strncpy(dname, tmpname, dnamelen);
-                  }
-               }
-               DEBUGC(DBCLASS_DNS, "_resolve: A[%i] - type NAPTR: %s",
-                      i, tmpname);
-               xptr+=j;
-            }
-#endif
-         } else {
-            ERROR("_resolve: unknown type in DNS answer [type=%i]\n", ty);
-         } // if ty
-      } // if dn_expand
-   } // for i
-
-   dname[dnamelen-1]='\0';
-   return 0;
+static int srv_is_known(struct in_addr addr, int port) {
+   int i;
+
+   for (i=0; i<SRV_KNOWN_SIZE; i++) {
+      if ((srv_known[i].last_used != 0) &&
+          (memcmp(&srv_known[i].addr, &addr, sizeof(addr)) == 0) &&
+          (srv_known[i].port == port)) {
+         return STS_TRUE;
+      }
+   }
+   return STS_FALSE;
 }
 
+
+/*
+ * is a target currently marked down?
+ *
+ * RETURNS
+ *	STS_TRUE if down
+ *	STS_FALSE if not
+ */
+static int srv_is_down(struct in_addr addr, int port, time_t now) {
+   int i;
+
+   for (i=0; i<SRV_HEALTH_SIZE; i++) {
+      if (srv_health[i].down_until == 0) continue;
+      if (srv_health[i].down_until < now) {
+         srv_health[i].down_until = 0;
+         continue;
+      }
+      if ((memcmp(&srv_health[i].addr, &addr, sizeof(addr)) == 0) &&
+          (srv_health[i].port == port)) {
+         return STS_TRUE;
+      }
+   }
+   return STS_FALSE;
+}
+
+
+/*
+ * select a target out of a server set (RFC2782): lowest priority
+ * first, weighted random within the same priority. Targets marked
+ * down are used only if all others are down, too.
+ *
+ * RETURNS index of the selected entry, -1 if none is left
+ */
+static int srv_select(dns_srvset_t *srvset, int *excluded, time_t now) {
+   int i, pass;
+   int prio, sum, r;
+   int down[DNS_SRV_MAX];
+   struct in_addr addr;
+
+   /* health of each target (uses cached A records only) */
+   for (i=0; i<srvset->count; i++) {
+      down[i] = 0;
+      if (excluded[i]) continue;
+      if (dnscache_peek(srvset->entry[i].target, &addr) == STS_SUCCESS) {
+         down[i] = (srv_is_down(addr, srvset->entry[i].port, now) == STS_TRUE);
+      }
+   }
+
+   /* pass 0: healthy targets only, pass 1: all */
+   for (pass=0; pass<2; pass++) {
+      for (i=0; i<srvset->count; ) {
+         prio = srvset->entry[i].priority;
+
+         /* sum up weights of this priority group */
+         sum = 0;
+         for (r=i; (r<srvset->count) && (srvset->entry[r].priority == prio);
+              r++) {
+            if (excluded[r] || (pass == 0 && down[r])) continue;
+            /* weight 0 entries get a small chance as well */
+            sum += srvset->entry[r].weight + 1;
+         }
+
+         if (sum > 0) {
+            r = rand() % sum;
+            for (; i<srvset->count; i++) {
+               if (excluded[i] || (pass == 0 && down[i])) continue;
+               r -= srvset->entry[i].weight + 1;
+               if (r < 0) return i;
+            }
+         }
+
+         /* next priority group */
+         while ((i<srvset->count) && (srvset->entry[i].priority == prio)) i++;
+      }
+   }
+
+   return -1;
+}
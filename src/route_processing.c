@@ -385,19 +385,14 @@ int route_determine_nexthop(sip_ticket_t *ticket,
          return STS_FAILURE;
       }
 
-      sts = get_ip_by_host(route->url->host, dest);
+      /* RFC3263: NAPTR, SRV, A */
+      sts = resolve_sip_target(route->url->host, route->url->port,
+                               ticket->protocol, dest, port);
       if (sts == STS_FAILURE) {
          DEBUGC(DBCLASS_PROXY, "route_determine_nexthop: cannot resolve "
                 "Route URI [%s]", route->url->host);
          return STS_FAILURE;
       }
-
-      if (route->url->port) {
-         *port=atoi(route->url->port);
-         if ((*port<=0) || (*port>65535)) *port=SIP_PORT;
-      } else {
-         *port=SIP_PORT;
-      }
    }
 
    return STS_SUCCESS;
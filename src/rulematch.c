@@ -0,0 +1,597 @@
+/*
+    Copyright (C) 2002-2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "rulematch.h"
+#include "log.h"
+
+/*
+ * Ordered rule sets of regular expressions (plugin_regex,
+ * plugin_siptrunk), the first matching rule wins.
+ *
+ * Trying every rule with regexec() costs linear in the number of
+ * rules. Most rules of a dial plan are anchored and start with a
+ * literal, like "^sip:0041..." - these literal prefixes are put into
+ * a trie at compile time. A lookup walks the trie once along the
+ * input and only hands the rules whose prefix matched (plus the rules
+ * without usable prefix) to regexec(), in configuration order.
+ * The result is the same as trying all rules in a row.
+ *
+ * Optionally a rule set carries a bounded LRU cache of the outcome per
+ * input string (matching rule and rewritten string, or no match) - the
+ * same destinations are dialed over and over. The cache belongs to the
+ * compiled rules, so compiling them again starts with an empty cache.
+ *
+ * A compiled rule set is only read by a lookup, rulematch_exec() may
+ * run in several threads at once. The result caches and the counters
+ * are guarded by rulematch_mutex.
+ */
+#define RULEMATCH_MAXPREFIX	64	/* longest prefix put into the trie */
+#define RULEMATCH_STACKCAND	128	/* candidates kept on the stack */
+
+/* cache counters, summed over all rule sets */
+static rulematch_stats_t rulematch_stats;
+static pthread_mutex_t rulematch_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+/* local prototypes */
+static int rulematch_prefix(const char *pattern, int cflags, char *prefix);
+static int rulematch_toplevel_alt(const char *pattern);
+static int rulematch_insert(rulematch_t *rules, const char *prefix, int idx);
+static void rulematch_free_node(rulematch_node_t *node);
+static rulematch_centry_t *rulematch_cache_find(rulematch_cache_t *cache,
+                                    const char *key, unsigned int hash);
+static void rulematch_cache_unlink(rulematch_cache_t *cache,
+                                   rulematch_centry_t *entry);
+static void rulematch_cache_use(rulematch_cache_t *cache,
+                                rulematch_centry_t *entry);
+static unsigned int rulematch_hash(const char *key);
+
+
+/*
+ * compile a set of 'count' regular expressions
+ *
+ * Rules that fail to compile are reported and never match.
+ *
+ * RETURNS
+ *	STS_SUCCESS if all rules did compile
+ *	STS_FAILURE otherwise ('*rules' may still be used)
+ */
+int rulematch_compile(rulematch_t **rules, int count, char **patterns,
+                      int cflags) {
+   rulematch_t *rm;
+   char prefix[RULEMATCH_MAXPREFIX+1];
+   char errbuf[256];
+   int i, sts;
+   int retsts=STS_SUCCESS;
+
+   *rules=NULL;
+   rm=calloc(1, sizeof(rulematch_t));
+   if (rm == NULL) {
+      ERROR("rulematch_compile: out of memory");
+      return STS_FAILURE;
+   }
+   rm->count=count;
+   rm->icase=(cflags & REG_ICASE) ? 1 : 0;
+   rm->re=calloc(count+1, sizeof(regex_t));
+   rm->valid=calloc(count+1, 1);
+   rm->disabled=calloc(count+1, 1);
+   rm->always=calloc(count+1, sizeof(int));
+   rm->root=calloc(1, sizeof(rulematch_node_t));
+   if (!rm->re || !rm->valid || !rm->disabled || !rm->always || !rm->root) {
+      ERROR("rulematch_compile: out of memory");
+      rulematch_free(rm);
+      return STS_FAILURE;
+   }
+
+   for (i=0; i < count; i++) {
+      sts = regcomp (&rm->re[i], patterns[i], cflags);
+      if (sts != 0) {
+         regerror(sts, &rm->re[i], errbuf, sizeof(errbuf));
+         ERROR("Regular expression [%s] failed to compile: %s",
+               patterns[i], errbuf);
+         retsts = STS_FAILURE;
+         continue;
+      }
+      rm->valid[i]=1;
+
+      if ((rulematch_prefix(patterns[i], cflags, prefix) > 0) &&
+          (rulematch_insert(rm, prefix, i) == STS_SUCCESS)) {
+         rm->prefixed++;
+      } else {
+         rm->always[rm->always_count++]=i;
+      }
+   }
+
+   DEBUGC(DBCLASS_PLUGIN, "rulematch: %i rules, %i indexed by literal prefix",
+          count, rm->prefixed);
+   *rules=rm;
+   return retsts;
+}
+
+
+/*
+ * find the first rule (in configuration order) matching 'buf'
+ *
+ * pmatch[] receives the match of that rule, as from regexec().
+ *
+ * RETURNS
+ *	index of the matching rule
+ *	-1 if no rule matches
+ */
+int rulematch_exec(rulematch_t *rules, const char *buf,
+                   size_t nmatch, regmatch_t pmatch[]) {
+   rulematch_node_t *node;
+   const unsigned char *p;
+   unsigned char c;
+   int stack_cand[RULEMATCH_STACKCAND];
+   int *cand=stack_cand;
+   int n, i, j, idx;
+
+   if (rules == NULL) return -1;
+
+   /* workspace per call, on the stack unless the rule set is huge */
+   if (rules->count > RULEMATCH_STACKCAND) {
+      cand=malloc(rules->count*sizeof(int));
+      if (cand == NULL) {
+         ERROR("rulematch_exec: out of memory");
+         return -1;
+      }
+   }
+
+   /* candidates: rules without prefix and all prefixes found in buf */
+   n=rules->always_count;
+   memcpy(cand, rules->always, n*sizeof(int));
+   node=rules->root;
+   for (p=(const unsigned char *)buf; *p; p++) {
+      c=rules->icase ? tolower(*p) : *p;
+      for (node=node->child; node && (node->c != c); node=node->sibling);
+      if (node == NULL) break;
+      for (i=0; i < node->rule_count; i++) {
+         /* insertion sort, the lists are short */
+         idx=node->rules[i];
+         for (j=n; (j > 0) && (cand[j-1] > idx); j--) {
+            cand[j]=cand[j-1];
+         }
+         cand[j]=idx;
+         n++;
+      }
+   }
+
+   /* verify the candidates, first match wins */
+   for (i=0; i < n; i++) {
+      idx=cand[i];
+      if (rules->disabled[idx]) continue;
+      if (regexec (&rules->re[idx], buf, nmatch, pmatch, 0) == 0) break;
+   }
+   if (cand != stack_cand) free(cand);
+   return (i < n) ? idx : -1;
+}
+
+
+/*
+ * exclude a rule from matching, lookups continue with the next
+ * matching rule (e.g. a rule whose action is not usable). Must be
+ * called before the rule set is used.
+ */
+void rulematch_disable(rulematch_t *rules, int idx) {
+   if ((rules == NULL) || (idx < 0) || (idx >= rules->count)) return;
+   rules->disabled[idx]=1;
+}
+
+
+void rulematch_free(rulematch_t *rules) {
+   int i;
+
+   if (rules == NULL) return;
+   if (rules->re && rules->valid) {
+      for (i=0; i < rules->count; i++) {
+         if (rules->valid[i]) regfree(&rules->re[i]);
+      }
+   }
+   if (rules->cache) {
+      free(rules->cache->bucket);
+      free(rules->cache->entry);
+      free(rules->cache);
+   }
+   rulematch_free_node(rules->root);
+   free(rules->re);
+   free(rules->valid);
+   free(rules->disabled);
+   free(rules->always);
+   free(rules);
+}
+
+
+/*
+ * enable the result cache of a rule set with room for 'entries'
+ * input strings (0 disables it)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if out of memory (the rule set works without cache)
+ */
+int rulematch_cache_init(rulematch_t *rules, int entries) {
+   rulematch_cache_t *cache;
+   unsigned int buckets;
+
+   if ((rules == NULL) || (entries <= 0)) return STS_SUCCESS;
+
+   for (buckets=16; buckets < entries; buckets <<= 1);
+   cache=calloc(1, sizeof(rulematch_cache_t));
+   if (cache) {
+      cache->bucket=calloc(buckets, sizeof(rulematch_centry_t*));
+      cache->entry=calloc(entries, sizeof(rulematch_centry_t));
+   }
+   if (!cache || !cache->bucket || !cache->entry) {
+      ERROR("rulematch_cache_init: out of memory");
+      if (cache) {
+         free(cache->bucket);
+         free(cache->entry);
+         free(cache);
+      }
+      return STS_FAILURE;
+   }
+   cache->size=entries;
+   cache->mask=buckets-1;
+   rules->cache=cache;
+   DEBUGC(DBCLASS_PLUGIN, "rulematch: result cache with %i entries", entries);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * look up the cached outcome for 'key'
+ *
+ * *rule receives the matching rule (-1 for no match). If 'result' is
+ * not NULL, the cached result string is copied to it ("" if none has
+ * been stored).
+ *
+ * RETURNS
+ *	STS_SUCCESS if found in the cache
+ *	STS_FAILURE if not cached
+ */
+int rulematch_cache_get(rulematch_t *rules, const char *key,
+                        int *rule, char *result, size_t size) {
+   rulematch_cache_t *cache;
+   rulematch_centry_t *entry;
+   unsigned int hash=0;
+   int cacheable;
+
+   if ((rules == NULL) || (rules->cache == NULL)) return STS_FAILURE;
+   cache=rules->cache;
+
+   cacheable=(strlen(key) <= RULEMATCH_CACHE_KEYLEN);
+   if (cacheable) hash=rulematch_hash(key);
+
+   pthread_mutex_lock(&rulematch_mutex);
+   entry=NULL;
+   if (cacheable) entry=rulematch_cache_find(cache, key, hash);
+   if (entry == NULL) {
+      cache->stats.misses++;
+      rulematch_stats.misses++;
+      pthread_mutex_unlock(&rulematch_mutex);
+      return STS_FAILURE;
+   }
+
+   rulematch_cache_use(cache, entry);
+   *rule=entry->rule;
+   if (result && (size > 0)) {
+      result[0]='\0';
+      if (entry->has_result) {
+         strncpy(result, entry->result, size-1);
+         result[size-1]='\0';
+      }
+   }
+   cache->stats.hits++;
+   rulematch_stats.hits++;
+   pthread_mutex_unlock(&rulematch_mutex);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * store the outcome for 'key' (result may be NULL), replacing the
+ * least recently used entry if the cache is full
+ */
+void rulematch_cache_put(rulematch_t *rules, const char *key,
+                         int rule, const char *result) {
+   rulematch_cache_t *cache;
+   rulematch_centry_t *entry;
+   rulematch_centry_t **pp;
+   unsigned int hash;
+
+   if ((rules == NULL) || (rules->cache == NULL)) return;
+   cache=rules->cache;
+
+   if (strlen(key) > RULEMATCH_CACHE_KEYLEN) return;
+   if (result && (strlen(result) > RULEMATCH_CACHE_KEYLEN)) return;
+
+   hash=rulematch_hash(key);
+   pthread_mutex_lock(&rulematch_mutex);
+   entry=rulematch_cache_find(cache, key, hash);
+   if (entry == NULL) {
+      if (cache->used < cache->size) {
+         entry=&cache->entry[cache->used++];
+      } else {
+         /* take over the least recently used entry */
+         entry=cache->tail;
+         for (pp=&cache->bucket[entry->hash & cache->mask]; *pp != entry;
+              pp=&(*pp)->hnext);
+         *pp=entry->hnext;
+         rulematch_cache_unlink(cache, entry);
+         cache->stats.evictions++;
+         rulematch_stats.evictions++;
+      }
+      entry->hash=hash;
+      strcpy(entry->key, key);
+      entry->hnext=cache->bucket[hash & cache->mask];
+      cache->bucket[hash & cache->mask]=entry;
+      cache->stats.inserts++;
+      rulematch_stats.inserts++;
+   } else {
+      rulematch_cache_unlink(cache, entry);
+   }
+
+   entry->rule=rule;
+   entry->has_result=0;
+   if (result) {
+      strcpy(entry->result, result);
+      entry->has_result=1;
+   }
+   /* insert as most recently used */
+   entry->prev=NULL;
+   entry->next=cache->head;
+   if (cache->head) cache->head->prev=entry;
+   cache->head=entry;
+   if (cache->tail == NULL) cache->tail=entry;
+   pthread_mutex_unlock(&rulematch_mutex);
+}
+
+
+/*
+ * forget all cached outcomes (e.g. the rules have changed)
+ */
+void rulematch_cache_flush(rulematch_t *rules) {
+   rulematch_cache_t *cache;
+
+   if ((rules == NULL) || (rules->cache == NULL)) return;
+   cache=rules->cache;
+
+   pthread_mutex_lock(&rulematch_mutex);
+   memset(cache->bucket, 0, (cache->mask+1)*sizeof(rulematch_centry_t*));
+   cache->used=0;
+   cache->head=NULL;
+   cache->tail=NULL;
+   pthread_mutex_unlock(&rulematch_mutex);
+}
+
+
+/*
+ * cache counters of all rule sets
+ */
+void rulematch_get_stats(rulematch_stats_t *stats) {
+   pthread_mutex_lock(&rulematch_mutex);
+   memcpy(stats, &rulematch_stats, sizeof(rulematch_stats_t));
+   pthread_mutex_unlock(&rulematch_mutex);
+}
+
+
+/*
+ * extract the literal prefix every match of an anchored extended
+ * regular expression must start with. Conservative: anything not
+ * understood ends the prefix.
+ *
+ * RETURNS
+ *	length of the prefix (0 if none)
+ */
+static int rulematch_prefix(const char *pattern, int cflags, char *prefix) {
+   const char *p;
+   char c;
+   int len=0;
+
+   /* unanchored, or the anchor may match after a newline */
+   if ((pattern[0] != '^') || (cflags & REG_NEWLINE)) return 0;
+   /* top level alternatives may start anywhere */
+   if (rulematch_toplevel_alt(pattern)) return 0;
+
+   for (p=pattern+1; *p && (len < RULEMATCH_MAXPREFIX); ) {
+      if (*p == '\\') {
+         /* escaped special character is a literal */
+         if ((p[1] == '\0') || !strchr(".[]()*+?{}|\\^$", p[1])) break;
+         c=p[1];
+         p+=2;
+      } else if (strchr(".[]()*+?{}|^$", *p)) {
+         break;
+      } else {
+         c=*p;
+         p++;
+      }
+
+      /* a quantifier makes the preceding literal optional */
+      if ((*p == '*') || (*p == '?') || (*p == '{')) break;
+
+      prefix[len++]=(cflags & REG_ICASE) ? tolower((unsigned char)c) : c;
+
+      /* one or more: the first one is required, the rest unknown */
+      if (*p == '+') break;
+   }
+   prefix[len]='\0';
+   return len;
+}
+
+
+/*
+ * does the pattern contain a '|' outside of any parentheses?
+ * (a '|' inside a group does not affect what precedes the group)
+ *
+ * RETURNS
+ *	1 if yes (or if in doubt), 0 if not
+ */
+static int rulematch_toplevel_alt(const char *pattern) {
+   const char *p;
+   int depth=0;
+
+   for (p=pattern; *p; p++) {
+      if (*p == '\\') {
+         if (p[1] == '\0') return 1;
+         p++;
+      } else if (*p == '[') {
+         /* bracket expression, a leading ']' is a literal */
+         p++;
+         if (*p == '^') p++;
+         if (*p == ']') p++;
+         while (*p && (*p != ']')) {
+            /* [:class:], [.coll.] and [=equiv=] may contain a ']' */
+            if ((*p == '[') && p[1] && strchr(":.=", p[1])) {
+               char *end, close[3]={p[1], ']', '\0'};
+               end=strstr(p+2, close);
+               if (end == NULL) return 1;
+               p=end+1;
+            }
+            p++;
+         }
+         if (*p == '\0') return 1;
+      } else if (*p == '(') {
+         depth++;
+      } else if (*p == ')') {
+         if (depth > 0) depth--;
+      } else if ((*p == '|') && (depth == 0)) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+
+/*
+ * add rule 'idx' to the trie node of 'prefix'
+ * (rules are added in ascending order, the lists stay sorted)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if out of memory
+ */
+static int rulematch_insert(rulematch_t *rules, const char *prefix, int idx) {
+   rulematch_node_t *node=rules->root;
+   rulematch_node_t *next;
+   const unsigned char *p;
+   int *list;
+
+   for (p=(const unsigned char *)prefix; *p; p++) {
+      for (next=node->child; next && (next->c != *p); next=next->sibling);
+      if (next == NULL) {
+         next=calloc(1, sizeof(rulematch_node_t));
+         if (next == NULL) return STS_FAILURE;
+         next->c=*p;
+         next->sibling=node->child;
+         node->child=next;
+      }
+      node=next;
+   }
+
+   list=realloc(node->rules, (node->rule_count+1)*sizeof(int));
+   if (list == NULL) return STS_FAILURE;
+   node->rules=list;
+   node->rules[node->rule_count++]=idx;
+   return STS_SUCCESS;
+}
+
+
+static void rulematch_free_node(rulematch_node_t *node) {
+   rulematch_node_t *next;
+
+   while (node) {
+      rulematch_free_node(node->child);
+      next=node->sibling;
+      free(node->rules);
+      free(node);
+      node=next;
+   }
+}
+
+
+static rulematch_centry_t *rulematch_cache_find(rulematch_cache_t *cache,
+                                    const char *key, unsigned int hash) {
+   rulematch_centry_t *entry;
+
+   for (entry=cache->bucket[hash & cache->mask]; entry; entry=entry->hnext) {
+      if ((entry->hash == hash) && (strcmp(entry->key, key) == 0)) {
+         return entry;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ * remove an entry from the LRU list
+ */
+static void rulematch_cache_unlink(rulematch_cache_t *cache,
+                                   rulematch_centry_t *entry) {
+   if (entry->prev) entry->prev->next=entry->next;
+   else cache->head=entry->next;
+   if (entry->next) entry->next->prev=entry->prev;
+   else cache->tail=entry->prev;
+   entry->prev=NULL;
+   entry->next=NULL;
+}
+
+
+/*
+ * move an entry to the head of the LRU list
+ */
+static void rulematch_cache_use(rulematch_cache_t *cache,
+                                rulematch_centry_t *entry) {
+   if (cache->head == entry) return;
+   rulematch_cache_unlink(cache, entry);
+   entry->next=cache->head;
+   if (cache->head) cache->head->prev=entry;
+   cache->head=entry;
+   if (cache->tail == NULL) cache->tail=entry;
+}
+
+
+/*
+ * keyed hash of the input string - the strings come from the
+ * network, a plain hash would allow to flood a single bucket
+ */
+static unsigned int rulematch_hash(const char *key) {
+   siphash_ctx_t ctx;
+   unsigned char hash[16];
+   unsigned int h;
+
+   siphash_begin(&ctx);
+   siphash_update(&ctx, key, strlen(key));
+   siphash_final(&ctx, hash);
+   memcpy(&h, hash, sizeof(h));
+   return h;
+}
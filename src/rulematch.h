@@ -0,0 +1,83 @@
+/*
+    Copyright (C) 2002-2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <regex.h>
+
+/* node of the literal prefix trie */
+typedef struct rulematch_node_s {
+   struct rulematch_node_s *child;	/* first child */
+   struct rulematch_node_s *sibling;	/* next node on the same level */
+   unsigned char c;
+   int  rule_count;
+   int  *rules;			/* rules with the prefix ending here */
+} rulematch_node_t;
+
+/* rewrite result cache: input string -> matching rule + result */
+#define RULEMATCH_CACHE_KEYLEN	128	/* longer strings are not cached */
+typedef struct rulematch_centry_s {
+   struct rulematch_centry_s *hnext;	/* hash chain */
+   struct rulematch_centry_s *prev;	/* LRU list, head is most recent */
+   struct rulematch_centry_s *next;
+   unsigned int hash;
+   int  rule;				/* -1: no rule matches */
+   int  has_result;
+   char key[RULEMATCH_CACHE_KEYLEN+1];
+   char result[RULEMATCH_CACHE_KEYLEN+1];
+} rulematch_centry_t;
+
+typedef struct {
+   int  size;			/* number of entries */
+   int  used;
+   unsigned int mask;		/* number of buckets - 1 */
+   rulematch_centry_t **bucket;
+   rulematch_centry_t *entry;	/* preallocated entries */
+   rulematch_centry_t *head;	/* most recently used */
+   rulematch_centry_t *tail;	/* least recently used */
+   rulematch_stats_t stats;
+} rulematch_cache_t;
+
+/* an ordered set of regular expressions, first match wins */
+typedef struct {
+   int  count;			/* number of rules */
+   int  icase;			/* compiled with REG_ICASE */
+   regex_t *re;			/* compiled rules, configuration order */
+   char *valid;			/* regcomp() did succeed for rule i */
+   char *disabled;		/* rule i never matches (rulematch_disable) */
+   rulematch_node_t *root;	/* literal prefixes of anchored rules */
+   int  always_count;
+   int  *always;		/* rules without literal prefix */
+   int  prefixed;		/* number of rules in the trie */
+   rulematch_cache_t *cache;	/* optional, see rulematch_cache_init() */
+} rulematch_t;
+
+/* return STS_ codes */
+int  rulematch_compile(rulematch_t **rules, int count, char **patterns,
+                       int cflags);
+/* returns the index of the first matching rule or -1 */
+int  rulematch_exec(rulematch_t *rules, const char *buf,
+                    size_t nmatch, regmatch_t pmatch[]);
+void rulematch_disable(rulematch_t *rules, int idx);
+void rulematch_free(rulematch_t *rules);
+int  rulematch_cache_init(rulematch_t *rules, int entries);
+int  rulematch_cache_get(rulematch_t *rules, const char *key,
+                         int *rule, char *result, size_t size);
+void rulematch_cache_put(rulematch_t *rules, const char *key,
+                         int rule, const char *result);
+void rulematch_cache_flush(rulematch_t *rules);
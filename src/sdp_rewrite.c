@@ -0,0 +1,331 @@
+/*
+    Copyright (C) 2002-2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+
+/*
+ * Streaming SDP rewriter
+ *
+ * Rewriting an SDP body for the RTP proxy only touches a few values:
+ * the address of the o= and c= lines and the port of the m= lines.
+ * Instead of building a complete sdp_message_t and rendering the
+ * whole body again, sdp_scan() locates these values in one pass over
+ * the body and sdp_emit() copies the body with the values replaced.
+ *
+ * The result must be identical to what the libosip2 parser path
+ * (parse, modify, sdp_message_to_str) produces. libosip2 renders the
+ * lines in a fixed order and normalizes whitespace, so the scanner
+ * only accepts bodies that are already in that canonical form:
+ *   - all lines terminated by CRLF
+ *   - session lines in the order v o s i u e p c b t r z k a,
+ *     media lines in the order m i c b k a
+ *   - single spaces between tokens, no leading or trailing blanks
+ *   - IPv4 addresses only, at most one c= per level, no TTL/count
+ *     suffixes on c= addresses and m= ports
+ * Anything else fails the scan and the caller falls back to the
+ * full parser. a= lines (including a=rtcp) are passed unchanged,
+ * just like the parser path does.
+ */
+
+/* session level line types in libosip2 rendering order */
+static const char sdp_session_order[] = "vosiuepcbtrzka";
+/* media level line types in libosip2 rendering order (after m=) */
+static const char sdp_media_order[]   = "micbka";
+
+/* local prototypes */
+static int sdp_line_rank(char type, int media);
+static int sdp_line_repeatable(char type, int media);
+static int sdp_tokens(const char *body, size_t off, size_t len,
+                      sdp_span_t *tok, int maxtok);
+static int sdp_token_is(const char *body, sdp_span_t *tok, const char *str);
+
+
+/*
+ * scan an SDP body and locate the values that the RTP proxy rewrites
+ *
+ * RETURNS
+ *	STS_SUCCESS if the body is in canonical form, *scan is filled
+ *	STS_FAILURE if the body must be handled by the full parser
+ */
+int sdp_scan(const char *body, size_t len, sdp_scan_t *scan) {
+   size_t pos, eol, i;
+   const char *line;
+   sdp_span_t tok[6];
+   int ntok;
+   int rank, last_rank=-1;
+   int media=-1;
+   int have_c=0;
+   unsigned int seen=0;
+   char type, last_type='\0';
+
+   memset(scan, 0, sizeof(sdp_scan_t));
+   if ((body == NULL) || (len == 0)) return STS_FAILURE;
+
+   for (pos=0; pos < len; pos=eol+2) {
+      line=&body[pos];
+
+      /* find the end of line, must be CRLF */
+      for (eol=pos; eol < len; eol++) {
+         if ((body[eol] == '\r') || (body[eol] == '\n')) break;
+      }
+      if ((eol+1 >= len) || (body[eol] != '\r') || (body[eol+1] != '\n')) {
+         return STS_FAILURE;
+      }
+
+      /* "x=" and at least one character of value */
+      if ((eol-pos < 3) || (line[1] != '=')) return STS_FAILURE;
+
+      /* whitespace that libosip2 would normalize */
+      if ((line[2] == ' ') || (body[eol-1] == ' ')) return STS_FAILURE;
+      for (i=pos+2; i < eol; i++) {
+         if (((unsigned char)body[i] < 0x20) || (body[i] == 0x7f)) {
+            return STS_FAILURE;
+         }
+         if ((body[i] == ' ') && (body[i+1] == ' ')) return STS_FAILURE;
+      }
+
+      /* line order and repetition */
+      type=line[0];
+      if (type == 'm') {
+         media++;
+         if (media >= SDP_SCAN_MEDIA) return STS_FAILURE;
+         last_rank=-1;
+         have_c=0;
+      }
+      rank=sdp_line_rank(type, (media >= 0));
+      if (rank < 0) return STS_FAILURE;
+      if ((rank < last_rank) ||
+          ((rank == last_rank) && !sdp_line_repeatable(type, (media >= 0)))) {
+         return STS_FAILURE;
+      }
+      /* r= only directly after t= or r= */
+      if ((type == 'r') && (last_type != 't') && (last_type != 'r')) {
+         return STS_FAILURE;
+      }
+      last_rank=rank;
+      last_type=type;
+      if (media < 0) seen |= 1 << rank;
+
+      switch (type) {
+      case 'o':
+         /* o=<username> <sess-id> <sess-version> IN IP4 <address> */
+         ntok=sdp_tokens(body, pos+2, eol-pos-2, tok, 6);
+         if ((ntok != 6) || !sdp_token_is(body, &tok[3], "IN") ||
+             !sdp_token_is(body, &tok[4], "IP4")) return STS_FAILURE;
+         scan->o_addr.off=tok[5].off;
+         scan->o_addr.len=tok[5].len;
+         break;
+
+      case 'c':
+         /* c=IN IP4 <address>, one per level */
+         if (have_c) return STS_FAILURE;
+         have_c=1;
+         ntok=sdp_tokens(body, pos+2, eol-pos-2, tok, 3);
+         if ((ntok != 3) || !sdp_token_is(body, &tok[0], "IN") ||
+             !sdp_token_is(body, &tok[1], "IP4")) return STS_FAILURE;
+         if (memchr(&body[tok[2].off], '/', tok[2].len)) return STS_FAILURE;
+         if (media < 0) {
+            scan->c_addr.off=tok[2].off;
+            scan->c_addr.len=tok[2].len;
+         } else {
+            scan->media[media].c_addr.off=tok[2].off;
+            scan->media[media].c_addr.len=tok[2].len;
+         }
+         break;
+
+      case 't':
+         /* t=<start> <stop> */
+         ntok=sdp_tokens(body, pos+2, eol-pos-2, tok, 3);
+         if (ntok != 2) return STS_FAILURE;
+         break;
+
+      case 'm':
+         /* m=<media> <port> <proto> <fmt> ... */
+         ntok=sdp_tokens(body, pos+2, eol-pos-2, tok, 4);
+         if (ntok < 4) return STS_FAILURE;
+         if ((tok[1].len == 0) || (tok[1].len > 5)) return STS_FAILURE;
+         for (i=tok[1].off; i < tok[1].off+tok[1].len; i++) {
+            if ((body[i] < '0') || (body[i] > '9')) return STS_FAILURE;
+         }
+         scan->media[media].port.off=tok[1].off;
+         scan->media[media].port.len=tok[1].len;
+         scan->media[media].proto.off=tok[2].off;
+         scan->media[media].proto.len=tok[2].len;
+         break;
+
+      default:
+         break;
+      }
+   }
+
+   /* libosip2 insists on v=, o=, s= and t= */
+   if ((seen & 0x7) != 0x7) return STS_FAILURE;
+   if ((seen & (1 << sdp_line_rank('t', 0))) == 0) return STS_FAILURE;
+
+   scan->media_count=media+1;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * copy the body to out, replacing all spans of *scan that have
+ * a replacement (repl != NULL) set
+ *
+ * RETURNS
+ *	STS_SUCCESS on success, *outlen is the new length
+ *	STS_FAILURE if the result does not fit into out
+ */
+int sdp_emit(const char *body, size_t len, sdp_scan_t *scan,
+             char *out, size_t outsize, size_t *outlen) {
+   sdp_span_t *edit[2+2*SDP_SCAN_MEDIA];
+   size_t pos, o, n;
+   int nedit=0;
+   int i;
+
+   /* collected in body order: o=, c=, then m= and c= of each media */
+   if (scan->o_addr.repl) edit[nedit++]=&scan->o_addr;
+   if (scan->c_addr.repl) edit[nedit++]=&scan->c_addr;
+   for (i=0; i < scan->media_count; i++) {
+      if (scan->media[i].port.repl)   edit[nedit++]=&scan->media[i].port;
+      if (scan->media[i].c_addr.repl) edit[nedit++]=&scan->media[i].c_addr;
+   }
+
+   pos=0;
+   o=0;
+   for (i=0; i < nedit; i++) {
+      if ((edit[i]->len == 0) || (edit[i]->off < pos)) return STS_FAILURE;
+      /* unchanged part */
+      n=edit[i]->off - pos;
+      if (o+n >= outsize) return STS_FAILURE;
+      memcpy(&out[o], &body[pos], n);
+      o+=n;
+      /* replacement */
+      n=strlen(edit[i]->repl);
+      if (o+n >= outsize) return STS_FAILURE;
+      memcpy(&out[o], edit[i]->repl, n);
+      o+=n;
+      pos=edit[i]->off + edit[i]->len;
+   }
+   n=len - pos;
+   if (o+n >= outsize) return STS_FAILURE;
+   memcpy(&out[o], &body[pos], n);
+   o+=n;
+   out[o]='\0';
+
+   *outlen=o;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * copy the value of a span into a '\0' terminated string
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if not present or too long
+ */
+int sdp_span_copy(const char *body, sdp_span_t *span,
+                  char *dst, size_t dstsize) {
+   if ((span->len == 0) || (span->len >= dstsize)) return STS_FAILURE;
+   memcpy(dst, &body[span->off], span->len);
+   dst[span->len]='\0';
+   return STS_SUCCESS;
+}
+
+
+/*
+ * position of a line type in the rendering order
+ *
+ * RETURNS
+ *	rank (>=0), -1 if the line type is not valid here
+ */
+static int sdp_line_rank(char type, int media) {
+   const char *order = (media)? sdp_media_order : sdp_session_order;
+   const char *p;
+
+   if (type == '\0') return -1;
+   /* r= belongs to the preceeding t= */
+   if (!media && (type == 'r')) type='t';
+
+   p=strchr(order, type);
+   if (p == NULL) return -1;
+   return (int)(p - order);
+}
+
+
+/*
+ * may this line type appear several times in a row?
+ *
+ * RETURNS
+ *	1 if repeatable, 0 if not
+ */
+static int sdp_line_repeatable(char type, int media) {
+   if (media) return (strchr("ba", type) != NULL);
+   return (strchr("epbtra", type) != NULL);
+}
+
+
+/*
+ * split a value into space separated tokens, the first maxtok
+ * tokens are stored in tok[]
+ *
+ * RETURNS
+ *	total number of tokens
+ */
+static int sdp_tokens(const char *body, size_t off, size_t len,
+                      sdp_span_t *tok, int maxtok) {
+   size_t end=off+len;
+   size_t start;
+   int n=0;
+
+   while (off < end) {
+      start=off;
+      while ((off < end) && (body[off] != ' ')) off++;
+      if (n < maxtok) {
+         tok[n].off=start;
+         tok[n].len=off-start;
+         tok[n].repl=NULL;
+      }
+      n++;
+      off++;	/* skip the (single) space */
+   }
+   return n;
+}
+
+
+/*
+ * compare a token with a string
+ *
+ * RETURNS
+ *	1 if equal, 0 if not
+ */
+static int sdp_token_is(const char *body, sdp_span_t *tok, const char *str) {
+   return ((strlen(str) == tok->len) &&
+           (memcmp(&body[tok->off], str, tok->len) == 0));
+}
@@ -37,11 +37,14 @@
  * do security and integrity checks on the received packet
  * (raw buffer, \0 terminated)
  *
+ * The buffer is scanned once (sip_scan_raw()), the index is
+ * returned in *scan for use by the fixups and later stages.
+ *
  * RETURNS
  *	STS_SUCCESS if ok 
  * 	STS_FAILURE if the packed did not pass the checks
  */
-int security_check_raw(char *sip_buffer, size_t size) {
+int security_check_raw(char *sip_buffer, size_t size, sip_scan_t *scan) {
    char *p1=NULL, *p2=NULL;
 
    DEBUGC(DBCLASS_BABBLE,"security_check_raw: size=%ld", (long)size);
@@ -61,14 +64,10 @@ int security_check_raw(char *sip_buffer, size_t size) {
     * !! Contact records may all come in one single line, getting QUITE long...
     *    especially on TCP.
     */
-   for (p1=sip_buffer; (p1+SEC_MAXLINELEN) < (sip_buffer+size); p1=p2+1) {
-      p2=strchr(p1, 10);
-      if ((p2 == 0) ||                  /* no CRLF found */
-          (p2-p1) > SEC_MAXLINELEN) {   /* longer than allowed */
-         DEBUGC(DBCLASS_SIP,"security_check_raw: line too long or no "
-                            "CRLF found");
-         return STS_FAILURE;
-      }
+   if (sip_scan_raw(sip_buffer, size, scan) != STS_SUCCESS) {
+      DEBUGC(DBCLASS_SIP,"security_check_raw: line too long or no "
+                         "CRLF found");
+      return STS_FAILURE;
    }
 
 
@@ -86,17 +85,20 @@ int security_check_raw(char *sip_buffer, size_t size) {
       calculation (VERY BIG NUMBER), which in turn then dies inside 
       osip_malloc.
       So, we need at least 2 spaces to survive that code part of libosip2.
+      (usually both are found on the first line by the scanner)
     */
-   p1 = strchr(sip_buffer, ' ');
-   if (p1 && ((p1+1) < (sip_buffer+size))) {
-      p2 = strchr(p1+1, ' ');
-   } else {
-         DEBUGC(DBCLASS_SIP,"security_check_raw: found no space");
-         return STS_FAILURE;
-   }
-   if (p2==NULL) {
-         DEBUGC(DBCLASS_SIP,"security_check_raw: found only one space");
-         return STS_FAILURE;
+   if (scan->tokens < 3) {
+      p1 = strchr(sip_buffer, ' ');
+      if (p1 && ((p1+1) < (sip_buffer+size))) {
+         p2 = strchr(p1+1, ' ');
+      } else {
+            DEBUGC(DBCLASS_SIP,"security_check_raw: found no space");
+            return STS_FAILURE;
+      }
+      if (p2==NULL) {
+            DEBUGC(DBCLASS_SIP,"security_check_raw: found only one space");
+            return STS_FAILURE;
+      }
    }
 
    /* libosip2 can be put into an endless loop by trying to parse:
@@ -104,16 +106,13 @@ int security_check_raw(char *sip_buffer, size_t size) {
         49 4e 56 49 54 45 20 20 53 49 50 2f 32 2e 30 0d INVITE  SIP/2.0.
         0a 56 69 61 3a 20 53 49 50 2f 32 2e 30 2f 55 44 .Via: SIP/2.0/UD
    Note, this is an INVITE with no valid SIP URI (INVITE  SIP/2.0)
+   Any method followed by an empty Request-URI is refused.
    */
-   /* clumsy... */
-   if (size >20) {
-   if      (strncmp(sip_buffer, "INVITE  SIP/2.0",  15)==0) return STS_FAILURE;
-   else if (strncmp(sip_buffer, "ACK  SIP/2.0",     12)==0) return STS_FAILURE;
-   else if (strncmp(sip_buffer, "BYE  SIP/2.0",     12)==0) return STS_FAILURE;
-   else if (strncmp(sip_buffer, "CANCEL  SIP/2.0",  15)==0) return STS_FAILURE;
-   else if (strncmp(sip_buffer, "REGISTER  SIP/2.0",17)==0) return STS_FAILURE;
-   else if (strncmp(sip_buffer, "OPTIONS  SIP/2.0", 16)==0) return STS_FAILURE;
-   else if (strncmp(sip_buffer, "INFO  SIP/2.0",    13)==0) return STS_FAILURE;
+   if ((scan->tokens == 3) && (scan->tok1_len > 0) &&
+       (scan->tok2.len == 0) && (scan->tok3.len >= 7) &&
+       (strncmp(&sip_buffer[scan->tok3.off], "SIP/2.0", 7) == 0)) {
+      DEBUGC(DBCLASS_SIP,"security_check_raw: empty Request-URI");
+      return STS_FAILURE;
    }
 
    /* TODO: still way to go here ... */
@@ -18,8 +18,21 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA 
 */
 
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
 #include <osipparser2/osip_parser.h>
-#include <log.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
 
 /*
  * This file contains wrapper functions to call the osip2_ library.
@@ -28,10 +41,199 @@
  * argument for a number of functions used by siproxd.
  */
 
+/*
+ * Lazy header parsing (sip_lazy_parse)
+ *
+ * libosip2 parses a number of headers into their own structures even
+ * though siproxd never looks at them. In lazy mode these headers are
+ * cut out of the buffer before it is handed to libosip2 and are added
+ * to the message afterwards as generic headers (name/value strings,
+ * no further parsing). They are sent out unchanged.
+ *
+ * A header that is accessed through its libosip2 structure (e.g.
+ * osip_message_get_allow()) must be requested with sip_want_header(),
+ * plugins do so in their plugin_init(). Headers libosip2 does not
+ * know anyway (Max-Forwards, User-Agent, ...) are always generic.
+ */
+#define SIP_LAZY_MAX	32	/* max lazy headers per message */
+
+static struct {
+   const char *name;
+   char compact;		/* compact form, '\0' if none */
+   int  wanted;			/* needs to be parsed */
+} sip_lazy_hdr[] = {
+   { "Accept",			'\0', 0 },
+   { "Accept-Encoding",		'\0', 0 },
+   { "Accept-Language",		'\0', 0 },
+   { "Alert-Info",		'\0', 0 },
+   { "Allow",			'\0', 0 },
+   { "Authentication-Info",	'\0', 0 },
+   { "Authorization",		'\0', 0 },
+   { "Call-Info",		'\0', 0 },
+   { "Content-Encoding",	'e',  0 },
+   { "Error-Info",		'\0', 0 },
+   { "Mime-Version",		'\0', 0 },
+   { "Proxy-Authenticate",	'\0', 0 },
+   { "Proxy-Authentication-Info",'\0', 0 },
+   { "WWW-Authenticate",		'\0', 0 },
+   { NULL,			'\0', 0 }
+};
+
+/* local prototypes */
+static int sip_message_parse_lazy(osip_message_t * sip, const char *buf,
+                                  size_t len);
+static int sip_lazy_lookup(const char *name, size_t len);
+
+
+/*
+ * declare interest in a header: it will always be parsed by libosip2
+ * (to be called during initialization, e.g. from plugin_init)
+ */
+void sip_want_header(const char *name) {
+   int i;
+
+   i=sip_lazy_lookup(name, strlen(name));
+   if (i >= 0) {
+      DEBUGC(DBCLASS_CONFIG, "header %s will be parsed", name);
+      sip_lazy_hdr[i].wanted=1;
+   }
+}
+
+
 int sip_message_parse(osip_message_t * sip, const char *buf, size_t len) {
+   if (configuration.sip_lazy_parse) {
+      return sip_message_parse_lazy(sip, buf, len);
+   }
    return osip_message_parse(sip, buf, len);
 }
 
+
+/*
+ * parse a message, leaving out the headers nobody is interested in
+ * (SIP thread only)
+ *
+ * RETURNS
+ *	0 on success, libosip2 error code otherwise
+ */
+static int sip_message_parse_lazy(osip_message_t * sip, const char *buf,
+                                  size_t len) {
+   static char reduced[BUFFER_SIZE+1];
+   struct {
+      const char *name;
+      size_t namelen;
+      const char *value;
+      size_t valuelen;
+   } lazy[SIP_LAZY_MAX];
+   int nlazy=0;
+   size_t pos, eol, end, o=0;
+   size_t n, v;
+   osip_header_t *h;
+   int i, sts;
+
+   if (len > BUFFER_SIZE) return osip_message_parse(sip, buf, len);
+
+   /* first line */
+   for (pos=0; (pos < len) && (buf[pos] != '\n'); pos++);
+   if (pos >= len) return osip_message_parse(sip, buf, len);
+   pos++;
+   memcpy(reduced, buf, pos);
+   o=pos;
+
+   while (pos < len) {
+      /* empty line: the body follows */
+      if ((buf[pos] == '\n') ||
+          ((buf[pos] == '\r') && (pos+1 < len) && (buf[pos+1] == '\n'))) {
+         break;
+      }
+
+      /* header line, including continuation lines */
+      for (eol=pos; (eol < len) && (buf[eol] != '\n'); eol++);
+      while ((eol+1 < len) && ((buf[eol+1] == ' ') || (buf[eol+1] == '\t'))) {
+         for (eol++; (eol < len) && (buf[eol] != '\n'); eol++);
+      }
+      end=(eol < len)? eol+1 : len;
+
+      /* name */
+      for (n=0; (pos+n < eol) && (buf[pos+n] != ':') &&
+                (buf[pos+n] != ' ') && (buf[pos+n] != '\t'); n++);
+      i=(nlazy < SIP_LAZY_MAX)? sip_lazy_lookup(&buf[pos], n) : -1;
+
+      if ((i >= 0) && !sip_lazy_hdr[i].wanted) {
+         /* value: after ':' and whitespace, without CRLF */
+         for (v=pos+n; (v < eol) && (buf[v] != ':'); v++);
+         for (v++; (v < eol) && ((buf[v] == ' ') || (buf[v] == '\t')); v++);
+         lazy[nlazy].name=&buf[pos];
+         lazy[nlazy].namelen=n;
+         lazy[nlazy].value=&buf[v];
+         lazy[nlazy].valuelen=(eol > v)? eol-v : 0;
+         if ((lazy[nlazy].valuelen > 0) &&
+             (lazy[nlazy].value[lazy[nlazy].valuelen-1] == '\r')) {
+            lazy[nlazy].valuelen--;
+         }
+         nlazy++;
+      } else {
+         memcpy(&reduced[o], &buf[pos], end-pos);
+         o+=end-pos;
+      }
+      pos=end;
+   }
+
+   /* nothing left out */
+   if (nlazy == 0) return osip_message_parse(sip, buf, len);
+
+   /* separator and body */
+   memcpy(&reduced[o], &buf[pos], len-pos);
+   o+=len-pos;
+   reduced[o]='\0';
+
+   sts=osip_message_parse(sip, reduced, o);
+   if (sts != 0) return sts;
+
+   /* the left out headers as generic headers */
+   for (i=0; i<nlazy; i++) {
+      if (osip_header_init(&h) != 0) continue;
+      h->hname=osip_malloc(lazy[i].namelen+1);
+      h->hvalue=osip_malloc(lazy[i].valuelen+1);
+      if ((h->hname == NULL) || (h->hvalue == NULL)) {
+         osip_header_free(h);
+         continue;
+      }
+      memcpy(h->hname, lazy[i].name, lazy[i].namelen);
+      h->hname[lazy[i].namelen]='\0';
+      memcpy(h->hvalue, lazy[i].value, lazy[i].valuelen);
+      h->hvalue[lazy[i].valuelen]='\0';
+      osip_list_add(&sip->headers, h, -1);
+   }
+   DEBUGC(DBCLASS_BABBLE, "lazy parse: %i headers not parsed", nlazy);
+
+   /* the message text stored by libosip2 lacks these headers */
+   osip_message_force_update(sip);
+
+   return 0;
+}
+
+
+/*
+ * find a header name in the table of lazily parsed headers
+ *
+ * RETURNS
+ *	index into sip_lazy_hdr, -1 if not a lazy header
+ */
+static int sip_lazy_lookup(const char *name, size_t len) {
+   int i;
+
+   for (i=0; sip_lazy_hdr[i].name; i++) {
+      if (len == 1) {
+         if (sip_lazy_hdr[i].compact &&
+             ((name[0] | 0x20) == sip_lazy_hdr[i].compact)) return i;
+      } else if ((strlen(sip_lazy_hdr[i].name) == len) &&
+                 (strncasecmp(sip_lazy_hdr[i].name, name, len) == 0)) {
+         return i;
+      }
+   }
+   return -1;
+}
+
 int sip_message_to_str(osip_message_t * sip, char **dest, size_t *len) {
    int sts;
    /* check params */
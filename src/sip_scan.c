@@ -0,0 +1,325 @@
+/*
+    Copyright (C) 2002-2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define SCAN_BLOCK	32
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+# define SCAN_BLOCK	16
+#endif
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/*
+ * Pre-parse scanner for received SIP messages
+ *
+ * sip_scan_raw() walks the raw buffer once, line by line, and builds
+ * an index (sip_scan_t) of the things the raw security checks and
+ * the fixups need: length of the longest line, the first line and
+ * its tokens, the header/body separator, Content-Length, the
+ * presence of the mandatory headers and the position of some header
+ * lines. The line ends are located 16 (SSE2)
+ * or 32 (AVX2) bytes at a time, without SIMD support the scan falls
+ * back to memchr().
+ *
+ * Only the header lines are indexed, the body is checked for its
+ * line lengths only.
+ */
+
+/* local prototypes */
+static int sip_scan_line(char *buff, size_t start, size_t eol,
+                         sip_scan_t *scan);
+static int sip_scan_hdr(char *line, size_t len, const char *name,
+                        const char *compact, size_t *valoff);
+
+
+/*
+ * scan a received SIP message (\0 terminated) and build the index
+ *
+ * The line length limit is applied as security_check_raw() always
+ * did: a line must end (LF) within SEC_MAXLINELEN characters, unless
+ * the rest of the buffer is shorter than that. A \0 ends the scan.
+ *
+ * RETURNS
+ *	STS_SUCCESS if the line lengths are acceptable, *scan is filled
+ *	STS_FAILURE if a line is too long or a LF is missing
+ */
+int sip_scan_raw(char *buff, size_t size, sip_scan_t *scan) {
+   size_t pos=0;
+   size_t start=0;		/* start of the current line */
+   size_t i;
+   int done=0;
+#ifdef SCAN_BLOCK
+   unsigned int mask;
+#endif
+
+   memset(scan, 0, sizeof(sip_scan_t));
+   scan->content_length=-1;
+
+   while ((pos < size) && !done) {
+#ifdef SCAN_BLOCK
+      if (pos+SCAN_BLOCK <= size) {
+         /* bitmask of all LF and \0 in this block */
+# if defined(__AVX2__)
+         __m256i v=_mm256_loadu_si256((const __m256i *)&buff[pos]);
+         mask=(unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+# else
+         __m128i v=_mm_loadu_si128((const __m128i *)&buff[pos]);
+         mask=(unsigned int)_mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+# endif
+         for (; mask && !done; mask &= mask-1) {
+            i=pos+__builtin_ctz(mask);
+            if (buff[i] == '\0') {
+               done=1;
+               break;
+            }
+            if (sip_scan_line(buff, start, i, scan) != STS_SUCCESS) {
+               return STS_FAILURE;
+            }
+            start=i+1;
+         }
+         if (!done) pos+=SCAN_BLOCK;
+         continue;
+      }
+#endif
+      /* scalar: tail of the buffer (or no SIMD available) */
+      for (i=pos; i < size; i++) {
+         if ((buff[i] == '\n') || (buff[i] == '\0')) break;
+      }
+      if ((i >= size) || (buff[i] == '\0')) {
+         done=1;
+         break;
+      }
+      if (sip_scan_line(buff, start, i, scan) != STS_SUCCESS) {
+         return STS_FAILURE;
+      }
+      start=pos=i+1;
+   }
+
+   /* last line without LF (or up to a \0) */
+   if (start+SEC_MAXLINELEN < size) {
+      DEBUGC(DBCLASS_SIP,"sip_scan_raw: line too long or no LF found");
+      return STS_FAILURE;
+   }
+   if (scan->lines == 0) {
+      /* the one and only line is the first line */
+      for (i=start; (i < size) && buff[i]; i++);
+      sip_scan_line(buff, start, i, scan);
+   }
+
+   return STS_SUCCESS;
+}
+
+
+/*
+ * a part of the buffer has been removed (by a fixup), move the
+ * indexed positions behind it
+ */
+void sip_scan_cut(sip_scan_t *scan, size_t off, size_t len) {
+   sip_span_t *span[5];
+   int i;
+
+   span[0]=&scan->content_length_hdr;
+   span[1]=&scan->call_id;
+   span[2]=&scan->user_agent;
+   span[3]=&scan->alert_info;
+   span[4]=&scan->from;
+   for (i=0; i<5; i++) {
+      if (span[i]->len == 0) continue;
+      if (span[i]->off >= off+len) {
+         span[i]->off-=len;
+      } else if (span[i]->off+span[i]->len > off) {
+         /* (partially) removed */
+         span[i]->off=0;
+         span[i]->len=0;
+      }
+   }
+   if (scan->body_off >= off+len) scan->body_off-=len;
+}
+
+
+/*
+ * process one line of the message
+ * (start: first character, eol: position of the LF)
+ *
+ * RETURNS
+ *	STS_SUCCESS if ok
+ *	STS_FAILURE if the line is too long
+ */
+static int sip_scan_line(char *buff, size_t start, size_t eol,
+                         sip_scan_t *scan) {
+   char *line=&buff[start];
+   size_t len=eol-start;
+   size_t valoff;
+   char *sp1, *sp2;
+
+   if (len > SEC_MAXLINELEN) {
+      DEBUGC(DBCLASS_SIP,"sip_scan_raw: line too long (%ld)", (long)len);
+      return STS_FAILURE;
+   }
+   if (len > scan->max_linelen) scan->max_linelen=len;
+   scan->lines++;
+
+   /* body: only the line length matters */
+   if (scan->body_off) return STS_SUCCESS;
+
+   /* without the CR */
+   if ((len > 0) && (line[len-1] == '\r')) len--;
+
+   /* first line: <method> SP <uri> SP SIP/2.0 or SIP/2.0 SP <code> SP .. */
+   if (scan->lines == 1) {
+      scan->first_line.off=start;
+      scan->first_line.len=len;
+      scan->tokens=1;
+      sp1=memchr(line, ' ', len);
+      if (sp1) {
+         scan->tokens=2;
+         scan->tok1_len=sp1-line;
+         sp2=memchr(sp1+1, ' ', len-(sp1+1-line));
+         if (sp2) {
+            scan->tokens=3;
+            scan->tok2.off=start+(sp1+1-line);
+            scan->tok2.len=sp2-(sp1+1);
+            scan->tok3.off=start+(sp2+1-line);
+            scan->tok3.len=len-(sp2+1-line);
+         }
+      }
+      return STS_SUCCESS;
+   }
+
+   /* empty line: the body follows */
+   if (len == 0) {
+      scan->body_off=eol+1;
+      return STS_SUCCESS;
+   }
+
+   /* header lines of interest (first occurrence) */
+   switch (line[0]) {
+   case 'V': case 'v':
+      if (sip_scan_hdr(line, len, "Via", "v", &valoff)) {
+         scan->hdr_mask |= SIP_SCAN_VIA;
+      }
+      break;
+   case 'F': case 'f':
+      if (((scan->hdr_mask & SIP_SCAN_FROM) == 0) &&
+          sip_scan_hdr(line, len, "From", "f", &valoff)) {
+         scan->hdr_mask |= SIP_SCAN_FROM;
+         scan->from.off=start+valoff;
+         scan->from.len=len-valoff;
+      }
+      break;
+   case 'T': case 't':
+      if (sip_scan_hdr(line, len, "To", "t", &valoff)) {
+         scan->hdr_mask |= SIP_SCAN_TO;
+      }
+      break;
+   case 'C': case 'c': case 'L': case 'l':
+   case 'I': case 'i':
+      if (((line[0] == 'C') || (line[0] == 'c')) &&
+          sip_scan_hdr(line, len, "CSeq", NULL, &valoff)) {
+         scan->hdr_mask |= SIP_SCAN_CSEQ;
+      } else if ((scan->content_length_hdr.len == 0) &&
+          sip_scan_hdr(line, len, "Content-Length", "l", &valoff)) {
+         scan->content_length_hdr.off=start;
+         scan->content_length_hdr.len=eol+1-start;
+         scan->content_length=0;
+         for (; (valoff < len) && (line[valoff] >= '0') &&
+                (line[valoff] <= '9') &&
+                (scan->content_length < 100000000); valoff++) {
+            scan->content_length=scan->content_length*10+(line[valoff]-'0');
+         }
+      } else if ((scan->call_id.len == 0) &&
+                 sip_scan_hdr(line, len, "Call-ID", "i", &valoff)) {
+         scan->hdr_mask |= SIP_SCAN_CALLID;
+         scan->call_id.off=start+valoff;
+         scan->call_id.len=len-valoff;
+      }
+      break;
+   case 'U': case 'u':
+      if ((scan->user_agent.len == 0) &&
+          sip_scan_hdr(line, len, "User-Agent", NULL, &valoff)) {
+         scan->user_agent.off=start+valoff;
+         scan->user_agent.len=len-valoff;
+      }
+      break;
+   case 'A': case 'a':
+      if ((scan->alert_info.len == 0) &&
+          sip_scan_hdr(line, len, "Alert-Info", NULL, &valoff)) {
+         /* the whole line including CRLF */
+         scan->alert_info.off=start;
+         scan->alert_info.len=eol+1-start;
+      }
+      break;
+   default:
+      break;
+   }
+
+   return STS_SUCCESS;
+}
+
+
+/*
+ * does a header line have the given name (case insensitive, long or
+ * compact form)?
+ *
+ * RETURNS
+ *	1 if it matches, *valoff is the offset of the value in the line
+ *	0 if not
+ */
+static int sip_scan_hdr(char *line, size_t len, const char *name,
+                        const char *compact, size_t *valoff) {
+   size_t n;
+   size_t i;
+
+   n=strlen(name);
+   if ((len > n) && (strncasecmp(line, name, n) == 0)) {
+      i=n;
+   } else if (compact && (len > 1) && (tolower(line[0]) == compact[0])) {
+      i=1;
+   } else {
+      return 0;
+   }
+
+   while ((i < len) && ((line[i] == ' ') || (line[i] == '\t'))) i++;
+   if ((i >= len) || (line[i] != ':')) return 0;
+   i++;
+   while ((i < len) && ((line[i] == ' ') || (line[i] == '\t'))) i++;
+
+   *valoff=i;
+   return 1;
+}
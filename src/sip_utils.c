@@ -37,6 +37,7 @@
 
 #include <osipparser2/osip_parser.h>
 #include <osipparser2/osip_md5.h>
+#include <osipparser2/sdp_message.h>
 
 #include "siproxd.h"
 #include "digcalc.h"
@@ -762,6 +763,46 @@ int sip_rewrite_contact (sip_ticket_t *ticket, int direction) {
 }
 
 
+/*
+ * hash used for the branch parameter: MD5 or, if sip_fast_hash is
+ * enabled, the keyed SipHash (siphash.c). Both give 16 bytes, so the
+ * branch parameter looks the same in either case.
+ */
+typedef struct {
+   int fast;
+   osip_MD5_CTX md5;
+   siphash_ctx_t sip;
+} branch_hash_t;
+
+static void branch_hash_init(branch_hash_t *ctx) {
+   ctx->fast=configuration.sip_fast_hash;
+   if (ctx->fast) {
+      siphash_begin(&ctx->sip);
+   } else {
+      osip_MD5Init(&ctx->md5);
+   }
+}
+
+static void branch_hash_update(branch_hash_t *ctx, char *data) {
+   if (ctx->fast) {
+      siphash_update(&ctx->sip, data, strlen(data));
+   } else {
+      osip_MD5Update(&ctx->md5, (unsigned char*)data, strlen(data));
+   }
+}
+
+static void branch_hash_final(branch_hash_t *ctx, HASHHEX hashstring) {
+   HASH HA1;
+
+   if (ctx->fast) {
+      siphash_final(&ctx->sip, HA1);
+   } else {
+      osip_MD5Final(HA1, &ctx->md5);
+   }
+   CvtHex(HA1, hashstring);
+}
+
+
 /*
  * SIP_CALCULATE_BRANCH
  *
@@ -822,15 +863,12 @@ int  sip_calculate_branch_id (sip_ticket_t *ticket, char *id) {
       DEBUGC(DBCLASS_BABBLE, "looking for magic cookie [%s]",param->gvalue);
       if (strncmp(param->gvalue, magic_cookie,
                   strlen(magic_cookie))==0) {
-         /* calculate MD5 hash */
-         osip_MD5_CTX Md5Ctx;
-         HASH HA1;
+         /* calculate hash */
+         branch_hash_t ctx;
 
-         osip_MD5Init(&Md5Ctx);
-         osip_MD5Update(&Md5Ctx, (unsigned char*)param->gvalue,
-                        strlen(param->gvalue)); 
-         osip_MD5Final(HA1, &Md5Ctx);
-         CvtHex(HA1, hashstring);
+         branch_hash_init(&ctx);
+         branch_hash_update(&ctx, param->gvalue);
+         branch_hash_final(&ctx, hashstring);
 
          DEBUGC(DBCLASS_BABBLE, "existing branch -> branch hash [%s]",
                 hashstring);
@@ -848,57 +886,53 @@ int  sip_calculate_branch_id (sip_ticket_t *ticket, char *id) {
     *   - the Request-URI from the received request
     */
    if (hashstring[0] == '\0') {
-      /* calculate MD5 hash */
-      osip_MD5_CTX Md5Ctx;
-      HASH HA1;
+      /* calculate hash */
+      branch_hash_t ctx;
       char *tmp;
 
-      osip_MD5Init(&Md5Ctx);
+      branch_hash_init(&ctx);
 
       /* topmost via */
       osip_via_to_str(via, &tmp);
       if (tmp) {
-         osip_MD5Update(&Md5Ctx, (unsigned char*)tmp, strlen(tmp));
+         branch_hash_update(&ctx, tmp);
          osip_free(tmp);
       }
      
       /* Tag in To header */
       osip_to_get_tag(sip_msg->to, &param);
       if (param && param->gvalue) {
-         osip_MD5Update(&Md5Ctx, (unsigned char*)param->gvalue,
-	                strlen(param->gvalue));
+         branch_hash_update(&ctx, param->gvalue);
       }
 
       /* Tag in From header */
       osip_from_get_tag(sip_msg->from, &param);
       if (param && param->gvalue) {
-         osip_MD5Update(&Md5Ctx, (unsigned char*)param->gvalue,
-	                strlen(param->gvalue));
+         branch_hash_update(&ctx, param->gvalue);
       }
 
       /* Call-ID */
       call_id = osip_message_get_call_id(sip_msg);
       osip_call_id_to_str(call_id, &tmp);
       if (tmp) {
-         osip_MD5Update(&Md5Ctx, (unsigned char*)tmp, strlen(tmp));
+         branch_hash_update(&ctx, tmp);
          osip_free(tmp);
       }
 
       /* CSeq number (but not method) */
       tmp = osip_cseq_get_number(sip_msg->cseq);
       if (tmp) {
-         osip_MD5Update(&Md5Ctx, (unsigned char*)tmp, strlen(tmp));
+         branch_hash_update(&ctx, tmp);
       }
  
       /* Request URI */
       osip_uri_to_str(sip_msg->req_uri, &tmp);
       if (tmp) {
-         osip_MD5Update(&Md5Ctx, (unsigned char*)tmp, strlen(tmp));
+         branch_hash_update(&ctx, tmp);
          osip_free(tmp);
       }
 
-      osip_MD5Final(HA1, &Md5Ctx);
-      CvtHex(HA1, hashstring);
+      branch_hash_final(&ctx, hashstring);
 
       DEBUGC(DBCLASS_BABBLE, "non-existing branch -> branch hash [%s]",
              hashstring);
@@ -918,7 +952,8 @@ int  sip_calculate_branch_id (sip_ticket_t *ticket, char *id) {
  *
  * RETURNS
  *	STS_SUCCESS on successful lookup
- *	STS_FAILURE if no outbound proxy to be used
+ *	STS_FAILURE if no outbound proxy to be used or the lookup is
+ *	            parked (check dnscache_is_parked())
  */
 int  sip_find_outbound_proxy(sip_ticket_t *ticket, struct in_addr *addr,
                              in_port_t *port) {
@@ -960,16 +995,22 @@ int  sip_find_outbound_proxy(sip_ticket_t *ticket, struct in_addr *addr,
       for (i=0; i<configuration.outbound_proxy_domain_name.used; i++) {
          if (strcasecmp(configuration.outbound_proxy_domain_name.string[i],
              domain)==0) {
-            sts = get_ip_by_host(configuration.outbound_proxy_domain_host.string[i],
-                                 addr);
+            /* port 0: locate the proxy via SRV records (RFC3263) */
+            *port=atoi(configuration.outbound_proxy_domain_port.string[i]);
+            sts = resolve_sip_target(
+                     configuration.outbound_proxy_domain_host.string[i],
+                     (*port > 0) ?
+                        configuration.outbound_proxy_domain_port.string[i] :
+                        NULL,
+                     ticket->protocol, addr, port);
             if (sts == STS_FAILURE) {
+               /* lookup pending - not a config problem */
+               if (dnscache_is_parked() == STS_TRUE) return STS_FAILURE;
                ERROR("sip_find_outbound_proxy: cannot resolve "
                      "outbound proxy host [%s], check config", 
                      configuration.outbound_proxy_domain_host.string[i]);
                return STS_FAILURE;
             }
-            *port=atoi(configuration.outbound_proxy_domain_port.string[i]);
-//            if ((*port<=0) || (*port>65535)) *port=SIP_PORT;
 
             return STS_SUCCESS;
 
@@ -982,18 +1023,19 @@ int  sip_find_outbound_proxy(sip_ticket_t *ticket, struct in_addr *addr,
     */
    if (configuration.outbound_proxy_host) {
       /* I have a global outbound proxy configured */
-      sts = get_ip_by_host(configuration.outbound_proxy_host, addr);
+      if (configuration.outbound_proxy_port) {
+         sts = get_ip_by_host(configuration.outbound_proxy_host, addr);
+         *port=configuration.outbound_proxy_port;
+      } else {
+         /* no port configured: locate the proxy via SRV (RFC3263) */
+         sts = resolve_sip_target(configuration.outbound_proxy_host, NULL,
+                                  ticket->protocol, addr, port);
+      }
       if (sts == STS_FAILURE) {
          DEBUGC(DBCLASS_PROXY, "proxy_request: cannot resolve outbound "
                 " proxy host [%s]", configuration.outbound_proxy_host);
          return STS_FAILURE;
       }
-
-      if (configuration.outbound_proxy_port) {
-         *port=configuration.outbound_proxy_port;
-      } else {
-         *port = SIP_PORT;
-      }
       DEBUGC(DBCLASS_PROXY, "proxy_request: have outbound proxy %s:%i",
              configuration.outbound_proxy_host, *port);
 
@@ -1028,6 +1070,7 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
    type = DIRTYP_UNKNOWN;
 
    ticket->direction = DIRTYP_UNKNOWN;
+   ticket->direction_done = 1;
 
    DEBUGC(DBCLASS_SIP, "sip_find_direction: beginning search");
 
@@ -1304,41 +1347,38 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
  * that cause parsing to fail (libosip2).
  * This function does try to guess if we have such a broken SIP
  * message and does simply remove the offending Alert-Info header.
+ * (the header lines are located by the scanner, see sip_scan_raw())
  *
  * RETURNS
  *	STS_SUCCESS on success
  */
-int  sip_fixup_asterisk(char *buff, size_t *buflen) {
-   char *alert_info_ptr=NULL;
+int  sip_fixup_asterisk(char *buff, size_t *buflen, sip_scan_t *scan) {
+   static const char asterisk[]="Asterisk PBX";
+   size_t off, len;
    /*
     * Check for Asterisk UA string
     * User-Agent: Asterisk PBX
     */
-   if (strstr(buff, "\r\nUser-Agent: Asterisk PBX\r\n")==NULL)
+   if ((scan->user_agent.len != sizeof(asterisk)-1) ||
+       (memcmp(&buff[scan->user_agent.off], asterisk, sizeof(asterisk)-1)))
       return STS_SUCCESS;
 
    DEBUGC(DBCLASS_SIP, "sip_fixup_alert_info: SIP message is from Asterisk");
    /*
     * Look form Alert-Info: header
     */
-   alert_info_ptr=strstr(buff, "\r\nAlert-Info: ");
-   if (alert_info_ptr) {
-      char *eol_ptr=NULL;
+   if (scan->alert_info.len) {
       DEBUGC(DBCLASS_SIP, "sip_fixup_alert_info: Asterisk message "
              "with Alert-Info found");
-      eol_ptr=strstr((alert_info_ptr+2), "\r\n");
-      if (eol_ptr) {
-         int i;
-         // cut the Alert-Info header from the message
-         // (actually move the rest of the message up)
-         DEBUGC(DBCLASS_SIP, "sip_fixup_alert_info: removed malformed "
-                "Alert-Info header");
-         for (i=0; i<(*buflen - (eol_ptr - buff)); i++) {
-            alert_info_ptr[i]=eol_ptr[i];
-         } /* for */
-
-         *buflen=strlen(buff);
-      } /* if */
+      // cut the Alert-Info header from the message
+      // (actually move the rest of the message up)
+      DEBUGC(DBCLASS_SIP, "sip_fixup_alert_info: removed malformed "
+             "Alert-Info header");
+      off=scan->alert_info.off;
+      len=scan->alert_info.len;
+      memmove(&buff[off], &buff[off+len], *buflen - (off+len) + 1);
+      *buflen -= len;
+      sip_scan_cut(scan, off, len);
    }
    return STS_SUCCESS;
 }
@@ -1578,3 +1618,225 @@ int  sip_get_received_param(sip_ticket_t *ticket,
    /* not found */
    return STS_FAILURE;
 }
+
+
+/*
+ * the body of the ticket's SIP message, if it is SDP
+ *
+ * RETURNS
+ *	pointer to the body, NULL if there is no SDP body
+ */
+static osip_body_t *sip_sdp_body(sip_ticket_t *ticket) {
+   osip_body_t *body;
+   osip_content_type_t *content_type;
+
+   if (osip_message_get_body(ticket->sipmsg, 0, &body) != 0) {
+      DEBUGC(DBCLASS_PROXY, "sip_sdp_body: no body found in message");
+      return NULL;
+   }
+
+   /* a body that explicitly is something else than SDP is left alone */
+   content_type=osip_message_get_content_type(ticket->sipmsg);
+   if (content_type && content_type->type && content_type->subtype &&
+       ((osip_strcasecmp(content_type->type, "application") != 0) ||
+        (osip_strcasecmp(content_type->subtype, "sdp") != 0))) {
+      DEBUGC(DBCLASS_PROXY, "sip_sdp_body: content-type %s/%s is not SDP",
+             content_type->type, content_type->subtype);
+      return NULL;
+   }
+
+   return body;
+}
+
+
+/*
+ * SIP_GET_SDP
+ *
+ * Get the parsed SDP body of the ticket's SIP message. The body is
+ * parsed on first use only, afterwards the core and all plugins work
+ * on the same sdp_message_t. The handle is owned by the ticket and
+ * must not be freed by the caller. Whoever modifies it must call
+ * sip_sdp_modified() so the body gets rebuilt before sending.
+ *
+ * RETURNS
+ *	STS_SUCCESS, *sdp is NULL if the message has no SDP body
+ *	STS_FAILURE if the body could not be parsed
+ */
+int  sip_get_sdp(sip_ticket_t *ticket, sdp_message_t **sdp) {
+   osip_body_t *body;
+   char *buff;
+   size_t buflen;
+   int sts;
+
+   *sdp=NULL;
+
+   switch (ticket->sdp_state) {
+   case SDP_PARSED:
+   case SDP_MODIFIED:
+      *sdp=ticket->sdp;
+      return STS_SUCCESS;
+   case SDP_INVALID:
+      return STS_FAILURE;
+   default:
+      break;
+   }
+
+   body=sip_sdp_body(ticket);
+   if (body == NULL) return STS_SUCCESS;
+
+   sts = sip_body_to_str(body, &buff, &buflen);
+   if (sts != 0) {
+      ERROR("sip_get_sdp: unable to sip_body_to_str");
+      ticket->sdp_state=SDP_INVALID;
+      return STS_FAILURE;
+   }
+
+   DEBUGC(DBCLASS_PROXY, "sip_get_sdp: payload %ld bytes", (long)buflen);
+   DUMP_BUFFER(DBCLASS_PROXY, buff, buflen);
+
+   sts = sdp_message_init(&ticket->sdp);
+   if (sts == 0) sts = sdp_message_parse(ticket->sdp, buff);
+   if (sts != 0) {
+      ERROR("sip_get_sdp: unable to sdp_message_parse body");
+      DUMP_BUFFER(-1, buff, buflen);
+      osip_free(buff);
+      if (ticket->sdp) sdp_message_free(ticket->sdp);
+      ticket->sdp=NULL;
+      ticket->sdp_state=SDP_INVALID;
+      return STS_FAILURE;
+   }
+   osip_free(buff);
+
+   ticket->sdp_state=SDP_PARSED;
+   *sdp=ticket->sdp;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * SIP_SDP_MODIFIED
+ *
+ * Mark the shared SDP handle as modified, the SIP body will be
+ * regenerated by sip_sdp_finalize().
+ *
+ * RETURNS
+ *	nothing
+ */
+void sip_sdp_modified(sip_ticket_t *ticket) {
+   if (ticket->sdp_state == SDP_PARSED) ticket->sdp_state=SDP_MODIFIED;
+}
+
+
+/*
+ * SIP_SDP_FINALIZE
+ *
+ * If the shared SDP handle has been modified, serialize it (once)
+ * and replace the body and Content-Length of the SIP message.
+ * Must be called before the SIP message is converted into a string.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if the body could not be replaced
+ */
+int  sip_sdp_finalize(sip_ticket_t *ticket) {
+   char *buff=NULL;
+   int sts;
+
+   if (ticket->sdp_state != SDP_MODIFIED) return STS_SUCCESS;
+   ticket->sdp_state=SDP_PARSED;
+
+   sts = sdp_message_to_str(ticket->sdp, &buff);
+   if ((sts != 0) || (buff == NULL)) {
+      ERROR("sip_sdp_finalize: unable to sdp_message_to_str");
+      return STS_FAILURE;
+   }
+
+   sts = sip_set_sdp_body(ticket, buff, strlen(buff));
+   osip_free(buff);
+   return sts;
+}
+
+
+/*
+ * SIP_GET_SDP_BODY
+ *
+ * Get the unparsed SDP body of the ticket's SIP message (no copy).
+ * Only valid until the body is replaced.
+ *
+ * RETURNS
+ *	STS_SUCCESS, *body is NULL if the message has no SDP body
+ */
+int  sip_get_sdp_body(sip_ticket_t *ticket, const char **body, size_t *len) {
+   osip_body_t *sipbody;
+
+   *body=NULL;
+   *len=0;
+
+   sipbody=sip_sdp_body(ticket);
+   if ((sipbody == NULL) || (sipbody->body == NULL)) return STS_SUCCESS;
+
+   *body=sipbody->body;
+   *len=sipbody->length;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * SIP_SET_SDP_BODY
+ *
+ * Replace the body and Content-Length of the ticket's SIP message
+ * with a new SDP body. The shared SDP handle is not touched, only
+ * use this if there is none or if the body was rendered from it.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if the body could not be replaced
+ */
+int  sip_set_sdp_body(sip_ticket_t *ticket, const char *buff, size_t buflen) {
+   osip_message_t *mymsg=ticket->sipmsg;
+   osip_body_t *body;
+   char clen[8]; /* content length: probably never more than 7 digits !*/
+   int sts;
+
+   /* remove old body */
+   if (osip_message_get_body(mymsg, 0, &body) == 0) {
+      osip_list_remove(&(mymsg->bodies), 0);
+      osip_body_free(body);
+   }
+
+   /* include new body */
+   sts = sip_message_set_body(mymsg, buff, buflen);
+   if (sts != 0) {
+      ERROR("sip_set_sdp_body: unable to sip_message_set_body body");
+      DUMP_BUFFER(-1, (char *)buff, buflen);
+      buflen=0;
+   }
+
+   /* free content length resource and include new one*/
+   osip_content_length_free(mymsg->content_length);
+   mymsg->content_length=NULL;
+   sprintf(clen,"%ld",(long)buflen);
+   osip_message_set_content_length(mymsg, clen);
+
+   DEBUGC(DBCLASS_PROXY, "sip_set_sdp_body: new body, %ld bytes",
+          (long)buflen);
+   DUMP_BUFFER(DBCLASS_PROXY, (char *)buff, buflen);
+
+   return (sts == 0)? STS_SUCCESS : STS_FAILURE;
+}
+
+
+/*
+ * SIP_SDP_FREE
+ *
+ * Release the shared SDP handle of a ticket (end of processing).
+ * Unfinalized modifications are discarded.
+ *
+ * RETURNS
+ *	nothing
+ */
+void sip_sdp_free(sip_ticket_t *ticket) {
+   if (ticket->sdp) sdp_message_free(ticket->sdp);
+   ticket->sdp=NULL;
+   ticket->sdp_state=SDP_UNPARSED;
+}
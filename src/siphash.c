@@ -0,0 +1,200 @@
+/*
+    Copyright (C) 2002-2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/*
+ * Keyed hashing with SipHash-2-4 (128 bit output variant)
+ *
+ * Used instead of MD5 where siproxd needs a hash that is unique and
+ * not predictable from outside, but not a cryptographic digest
+ * (branch parameter, see sip_calculate_branch_id()).
+ *
+ * The key is taken from /dev/urandom once at startup, so the hashes
+ * differ between two runs of siproxd.
+ */
+static unsigned char siphash_key[16];
+
+#define ROTL(x,b)	(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0,v1,v2,v3) do {				\
+   v0 += v1; v1 = ROTL(v1,13); v1 ^= v0; v0 = ROTL(v0,32);	\
+   v2 += v3; v3 = ROTL(v3,16); v3 ^= v2;			\
+   v0 += v3; v3 = ROTL(v3,21); v3 ^= v0;			\
+   v2 += v1; v1 = ROTL(v1,17); v1 ^= v2; v2 = ROTL(v2,32);	\
+} while (0)
+
+/* local prototypes */
+static unsigned long long siphash_load(const unsigned char *p);
+static void siphash_store(unsigned char *p, unsigned long long v);
+static void siphash_block(siphash_ctx_t *ctx, unsigned long long m);
+
+
+/*
+ * initialize the per process key
+ *
+ * RETURNS
+ *	STS_SUCCESS
+ */
+int siphash_init(void) {
+   struct timeval tv;
+   int fd, i;
+   int got=0;
+
+   fd=open("/dev/urandom", O_RDONLY);
+   if (fd >= 0) {
+      got=(read(fd, siphash_key, sizeof(siphash_key)) ==
+           sizeof(siphash_key));
+      close(fd);
+   }
+   if (!got) {
+      WARN("siphash_init: /dev/urandom not available, weak hash key");
+      gettimeofday(&tv, NULL);
+      srand(tv.tv_sec ^ tv.tv_usec ^ getpid());
+      for (i=0; i<sizeof(siphash_key); i++) siphash_key[i]=rand();
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * start a new hash, using the per process key
+ */
+void siphash_begin(siphash_ctx_t *ctx) {
+   unsigned long long k0=siphash_load(&siphash_key[0]);
+   unsigned long long k1=siphash_load(&siphash_key[8]);
+
+   ctx->v0=k0 ^ 0x736f6d6570736575ULL;
+   ctx->v1=k1 ^ 0x646f72616e646f6dULL ^ 0xee;
+   ctx->v2=k0 ^ 0x6c7967656e657261ULL;
+   ctx->v3=k1 ^ 0x7465646279746573ULL;
+   ctx->len=0;
+}
+
+
+/*
+ * add data to the hash
+ */
+void siphash_update(siphash_ctx_t *ctx, const void *data, size_t len) {
+   const unsigned char *p=data;
+   size_t fill=ctx->len & 7;
+
+   ctx->len+=len;
+
+   /* complete a partial block from a previous call */
+   if (fill) {
+      while ((fill < 8) && len) {
+         ctx->buf[fill++]=*p++;
+         len--;
+      }
+      if (fill < 8) return;
+      siphash_block(ctx, siphash_load(ctx->buf));
+   }
+
+   for (; len >= 8; p+=8, len-=8) {
+      siphash_block(ctx, siphash_load(p));
+   }
+   memcpy(ctx->buf, p, len);
+}
+
+
+/*
+ * finish the hash and write the 16 byte result to 'out'
+ * (same size as the MD5 HASH, can be converted with CvtHex())
+ */
+void siphash_final(siphash_ctx_t *ctx, unsigned char *out) {
+   unsigned long long b=((unsigned long long)(ctx->len & 0xff)) << 56;
+   unsigned long long v0=ctx->v0, v1=ctx->v1, v2=ctx->v2, v3=ctx->v3;
+   int i;
+
+   for (i=(ctx->len & 7)-1; i >= 0; i--) {
+      b |= ((unsigned long long)ctx->buf[i]) << (8*i);
+   }
+
+   v3 ^= b;
+   SIPROUND(v0,v1,v2,v3);
+   SIPROUND(v0,v1,v2,v3);
+   v0 ^= b;
+
+   v2 ^= 0xee;
+   SIPROUND(v0,v1,v2,v3);
+   SIPROUND(v0,v1,v2,v3);
+   SIPROUND(v0,v1,v2,v3);
+   SIPROUND(v0,v1,v2,v3);
+   siphash_store(&out[0], v0 ^ v1 ^ v2 ^ v3);
+
+   v1 ^= 0xdd;
+   SIPROUND(v0,v1,v2,v3);
+   SIPROUND(v0,v1,v2,v3);
+   SIPROUND(v0,v1,v2,v3);
+   SIPROUND(v0,v1,v2,v3);
+   siphash_store(&out[8], v0 ^ v1 ^ v2 ^ v3);
+}
+
+
+/*
+ * compress one 8 byte block
+ */
+static void siphash_block(siphash_ctx_t *ctx, unsigned long long m) {
+   unsigned long long v0=ctx->v0, v1=ctx->v1, v2=ctx->v2, v3=ctx->v3;
+
+   v3 ^= m;
+   SIPROUND(v0,v1,v2,v3);
+   SIPROUND(v0,v1,v2,v3);
+   v0 ^= m;
+
+   ctx->v0=v0; ctx->v1=v1; ctx->v2=v2; ctx->v3=v3;
+}
+
+
+/*
+ * little endian load / store, independent of the host byte order
+ */
+static unsigned long long siphash_load(const unsigned char *p) {
+   return ((unsigned long long)p[0])       |
+          ((unsigned long long)p[1] << 8)  |
+          ((unsigned long long)p[2] << 16) |
+          ((unsigned long long)p[3] << 24) |
+          ((unsigned long long)p[4] << 32) |
+          ((unsigned long long)p[5] << 40) |
+          ((unsigned long long)p[6] << 48) |
+          ((unsigned long long)p[7] << 56);
+}
+
+static void siphash_store(unsigned char *p, unsigned long long v) {
+   int i;
+   for (i=0; i<8; i++) {
+      p[i]=(unsigned char)(v >> (8*i));
+   }
+}
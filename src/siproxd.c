@@ -68,6 +68,8 @@ static cfgopts_t main_cfg_opts[] = {
    { "proxy_auth_realm",    TYP_STRING, &configuration.proxy_auth_realm,	{0, NULL} },
    { "proxy_auth_passwd",   TYP_STRING, &configuration.proxy_auth_passwd,	{0, NULL} },
    { "proxy_auth_pwfile",   TYP_STRING, &configuration.proxy_auth_pwfile,	{0, NULL} },
+   { "proxy_auth_nonce_lifetime", TYP_INT4, &configuration.proxy_auth_nonce_lifetime, {AUTH_NONCE_LIFETIME, NULL} },
+   { "proxy_auth_cache_ttl", TYP_INT4, &configuration.proxy_auth_cache_ttl, {AUTH_CACHE_TTL, NULL} },
    { "mask_host",           TYP_STRINGA,&configuration.mask_host,		{0, NULL} },
    { "masked_host",         TYP_STRINGA,&configuration.masked_host,		{0, NULL} },
    { "outbound_proxy_host", TYP_STRING, &configuration.outbound_proxy_host,	{0, NULL} },
@@ -89,6 +91,27 @@ static cfgopts_t main_cfg_opts[] = {
    { "tcp_connect_timeout", TYP_INT4,   &configuration.tcp_connect_timeout,	{TCP_CONNECT_TO, NULL} },
    { "tcp_keepalive",       TYP_INT4,   &configuration.tcp_keepalive,		{0, NULL} },
    { "thread_stack_size",   TYP_INT4,   &configuration.thread_stack_size,	{0, NULL} },
+   { "dns_cache_size",      TYP_INT4,   &configuration.dns_cache_size,		{DNS_CACHE_SIZE, NULL} },
+   { "dns_resolver_threads",TYP_INT4,   &configuration.dns_resolver_threads,	{DNS_THREADS, NULL} },
+   { "dns_max_ttl",         TYP_INT4,   &configuration.dns_max_ttl,		{DNS_MAX_TTL, NULL} },
+   { "dns_max_negative_ttl",TYP_INT4,   &configuration.dns_max_negative_ttl,	{DNS_BAD_AGE, NULL} },
+   { "dns_use_srv",         TYP_INT4,   &configuration.dns_use_srv,		{1, NULL} },
+   { "dns_srv_holddown",    TYP_INT4,   &configuration.dns_srv_holddown,	{DNS_SRV_HOLDDOWN, NULL} },
+   { "dns_prefetch",        TYP_INT4,   &configuration.dns_prefetch,		{1, NULL} },
+   { "dns_serve_stale",     TYP_INT4,   &configuration.dns_serve_stale,	{DNS_SERVE_STALE, NULL} },
+   { "sdp_fast_rewrite",    TYP_INT4,   &configuration.sdp_fast_rewrite,	{0, NULL} },
+   { "prefilter",           TYP_INT4,   &configuration.prefilter,		{1, NULL} },
+   { "prefilter_ua_block",  TYP_STRINGA,&configuration.prefilter_ua_block,	{0, NULL} },
+   { "prefilter_rate",      TYP_INT4,   &configuration.prefilter_rate,	{0, NULL} },
+   { "prefilter_burst",     TYP_INT4,   &configuration.prefilter_burst,	{PREFILTER_BURST, NULL} },
+   { "ratelimit_source",    TYP_STRINGA,&configuration.ratelimit_source,	{0, NULL} },
+   { "ratelimit_aor",       TYP_STRINGA,&configuration.ratelimit_aor,	{0, NULL} },
+   { "ratelimit_action",    TYP_INT4,   &configuration.ratelimit_action,	{1, NULL} },
+   { "ratelimit_retry_after", TYP_INT4, &configuration.ratelimit_retry_after, {RATELIMIT_RETRY_AFTER, NULL} },
+   { "ratelimit_table_size", TYP_INT4,  &configuration.ratelimit_table_size, {RATELIMIT_SIZE, NULL} },
+   { "sip_lazy_parse",      TYP_INT4,   &configuration.sip_lazy_parse,	{0, NULL} },
+   { "sip_fast_hash",       TYP_INT4,   &configuration.sip_fast_hash,	{0, NULL} },
+   { "plugin_profile",      TYP_INT4,   &configuration.plugin_profile,	{PLUGIN_PROF_SAMPLED, NULL} },
    {0, 0, 0}
 };
 
@@ -136,6 +159,8 @@ int main (int argc, char *argv[])
    int i;
    size_t buflen;
    int access;
+   int resumed;
+   int overload;
    char buff[BUFFER_SIZE];
    sip_ticket_t ticket;
 
@@ -301,6 +326,40 @@ int main (int argc, char *argv[])
       INFO("daemonized, pid=%i", getpid());
    }
 
+   /* start the DNS resolver threads (after daemonizing - fork() does
+    * not carry threads along - and before chroot()ing) */
+   sts=dnscache_init();
+   if (sts != STS_SUCCESS) {
+      ERROR("unable to initialize DNS cache - aborting");
+      exit(1);
+   }
+
+   /* watch interface address changes (falls back to polling) */
+   ifaddr_init();
+
+   /* compile the access lists */
+   sts=accesslist_init();
+   if (sts != STS_SUCCESS) {
+      ERROR("error in access lists (hosts_allow_*, hosts_deny_sip) - aborting");
+      exit(1);
+   }
+
+   /* load the password file (reloaded when changed) */
+   auth_init();
+
+   /* per process key for the branch parameter hashes */
+   siphash_init();
+
+   /* early reject prefilter (rate limits, scanner signatures) */
+   prefilter_init();
+
+   /* per source / per AOR rate limits */
+   sts=ratelimit_init();
+   if (sts != STS_SUCCESS) {
+      ERROR("error in rate limits (ratelimit_*) - aborting");
+      exit(1);
+   }
+
    /* load and initialize the plugins */
    sts=load_plugins();
    /* if error, abort siproxd */
@@ -308,6 +367,12 @@ int main (int argc, char *argv[])
       ERROR("Error while loading and initializing plug-ins - aborting");
       exit(1);
    }
+   /* one SIP worker: the main loop below */
+   sts=plugin_workers_init(1);
+   if (sts != STS_SUCCESS) {
+      ERROR("Error while initializing plug-in worker contexts - aborting");
+      exit(1);
+   }
 
    /* prepare for creating PID file */
    if (pidfilename == NULL) pidfilename = configuration.pid_file;
@@ -355,8 +420,23 @@ int main (int argc, char *argv[])
    while (!exit_program) {
 
       memset(&ticket, 0, sizeof(sip_ticket_t));
-      while ((sts = sipsock_waitfordata(buff, sizeof(buff)-1,
-                                    &ticket.from, &ticket.protocol)) <=0 ) {
+      /* release what a message that has been dropped early left behind */
+      plugin_async_park_end(NULL, 0);
+
+      /* messages that have been parked waiting for a DNS lookup or
+       * have been suspended by a plugin and are ready now take
+       * precedence over new input */
+      resumed=1;
+      while (((sts = dnscache_resume(buff, sizeof(buff)-1,
+                                     &ticket.from, &ticket.protocol)) <= 0) &&
+             ((sts = plugin_async_resume(buff, sizeof(buff)-1,
+                                         &ticket.from, &ticket.protocol)) <= 0)) {
+         sts = sipsock_waitfordata(buff, sizeof(buff)-1,
+                                   &ticket.from, &ticket.protocol);
+         if (sts > 0) {
+            resumed=0;
+            break;
+         }
 
          /* allow exit, even if there is no activity... */
          if (exit_program) goto exit_prg;
@@ -387,20 +467,35 @@ int main (int argc, char *argv[])
 
       } /* while sts */
 
+      /* a message handed back by the DNS cache continues with the
+       * results of the plugins that had suspended it before */
+      if (resumed) plugin_async_dns_resumed(buff, sts, &ticket.from);
+
       /*
        * got input, process
        */
       buflen = (size_t)sts;
       DEBUGC(DBCLASS_BABBLE,"received %zd bytes of data", buflen);
       ticket.direction=0;
+      ticket.direction_done=0;
+      ticket.plugin_flt=0;
       ticket.timestamp=time(NULL);
       memset(&ticket.next_hop, 0, sizeof(ticket.next_hop));
+      ticket.sdp=NULL;
+      ticket.sdp_state=SDP_UNPARSED;
       buff[buflen]='\0';
 
       /* pointers in ticket to raw message */
       ticket.raw_buffer=buff;
       ticket.raw_buffer_len=buflen;
 
+      /*
+       * per source rate limit (resumed messages have already passed)
+       */
+      if (!resumed && (prefilter_rate_check(ticket.from) != STS_SUCCESS)) {
+         continue; /* there are no resources to free */
+      }
+
       /* Call Plugins for stage: PLUGIN_PROCESS_RAW */
       sts = call_plugins(PLUGIN_PROCESS_RAW, &ticket);
       if (sts == STS_FALSE) continue;
@@ -417,16 +512,41 @@ int main (int argc, char *argv[])
       /*
        * integrity checks
        */
-      sts=security_check_raw(ticket.raw_buffer, ticket.raw_buffer_len);
+      sts=security_check_raw(ticket.raw_buffer, ticket.raw_buffer_len,
+                             &ticket.raw_scan);
       if (sts != STS_SUCCESS) {
          DEBUGC(DBCLASS_SIP,"security check (raw) failed");
          continue; /* there are no resources to free */
       }
 
+      /*
+       * early reject of junk (first line, mandatory headers, scanners)
+       * before any libosip2 allocation
+       */
+      sts=prefilter_check(ticket.raw_buffer, &ticket.raw_scan);
+      if (sts != STS_SUCCESS) {
+         DEBUGC(DBCLASS_SIP,"prefilter rejected message");
+         continue; /* there are no resources to free */
+      }
+
+      /*
+       * per source / per AOR rate limits (drop or answer with 503)
+       */
+      overload=0;
+      if (!resumed) {
+         sts=ratelimit_check(&ticket);
+         if (sts == STS_FAILURE) {
+            DEBUGC(DBCLASS_SIP,"rate limit exceeded, message dropped");
+            continue; /* there are no resources to free */
+         }
+         if (sts == RATELIMIT_REJECT) overload=1;
+      }
+
       /*
        * Hacks to fix-up some broken headers
        */
-      sts=sip_fixup_asterisk(ticket.raw_buffer, &ticket.raw_buffer_len);
+      sts=sip_fixup_asterisk(ticket.raw_buffer, &ticket.raw_buffer_len,
+                             &ticket.raw_scan);
 
       /*
        * init sip_msg
@@ -438,6 +558,9 @@ int main (int argc, char *argv[])
          continue; /* skip, there are no resources to free */
       }
 
+      /* from here on, DNS cache misses park the message */
+      dnscache_park_begin();
+
       /*
        * RFC 3261, Section 16.3 step 1
        * Proxy Behavior - Request Validation - Reasonable Syntax
@@ -460,6 +583,13 @@ int main (int argc, char *argv[])
          goto end_loop; /* skip and free resources */
       }
 
+      /* rate limit exceeded: 503 Service Unavailable */
+      if (overload) {
+         DEBUGC(DBCLASS_SIP,"rate limit exceeded, answering with 503");
+         ratelimit_reply(&ticket);
+         goto end_loop; /* skip and free resources */
+      }
+
       /*
        * RFC 3261, Section 16.3 step 2
        * Proxy Behavior - Request Validation - URI scheme
@@ -470,6 +600,10 @@ int main (int argc, char *argv[])
       /* Call Plugins for stage: PLUGIN_VALIDATE */
       sts = call_plugins(PLUGIN_VALIDATE, &ticket);
       if (sts == STS_FALSE) goto end_loop;
+      if (sts == STS_PLUGIN_PENDING) goto end_loop;
+      /* a DNS cache miss parks the message, it is processed again
+       * from scratch later - stop here before anything else is done */
+      if (dnscache_is_parked() == STS_TRUE) goto end_loop;
 
       /*
        * RFC 3261, Section 16.3 step 3
@@ -510,7 +644,9 @@ int main (int argc, char *argv[])
        * Proxy Behavior - Request Validation - Loop Detection check
        * (check for loop and return 482 if a loop is detected)
        */
-      if (check_vialoop(&ticket) == STS_TRUE) {
+      sts=check_vialoop(&ticket);
+      if (dnscache_is_parked() == STS_TRUE) goto end_loop;
+      if (sts == STS_TRUE) {
          /* make sure we don't end up in endless loop when detecting
           * an loop in an "loop detected" message - brrr */
          if (MSG_IS_RESPONSE(ticket.sipmsg) && 
@@ -552,10 +688,13 @@ int main (int argc, char *argv[])
        * Feed to the plugins. If a plugin decides
        * to end processing and terminate the ongoing
        * dialog (STS_SIP_SENT), then just free
-       * the allocated resources.
+       * the allocated resources. A plugin may
+       * also suspend the message (STS_PLUGIN_PENDING).
        *********************************/
       sts = call_plugins(PLUGIN_DETERMINE_TARGET, &ticket);
       if (sts == STS_SIP_SENT) goto end_loop;
+      if (sts == STS_PLUGIN_PENDING) goto end_loop;
+      if (dnscache_is_parked() == STS_TRUE) goto end_loop;
 
 
       /*********************************
@@ -583,7 +722,10 @@ int main (int argc, char *argv[])
             dest_port= (url->port)?atoi(url->port):SIP_PORT;
             if ((dest_port <=0) || (dest_port >65535)) dest_port=SIP_PORT;
 
-            if ( (get_ip_by_host(url->host, &addr1) == STS_SUCCESS) &&
+            sts = get_ip_by_host(url->host, &addr1);
+            if (dnscache_is_parked() == STS_TRUE) goto end_loop;
+
+            if ( (sts == STS_SUCCESS) &&
                  (get_interface_ip(IF_INBOUND,&addr2) == STS_SUCCESS) &&
                  (get_interface_ip(IF_OUTBOUND,&addr3) == STS_SUCCESS)) {
 
@@ -665,6 +807,12 @@ int main (int argc, char *argv[])
  * free the SIP message buffers
  */
       end_loop:
+      /* if the message got parked, it will be processed again
+       * once all its DNS lookups have completed */
+      sts=dnscache_park_end(&ticket);
+      /* same if it got suspended by a plugin (once the plugin is done) */
+      plugin_async_park_end(&ticket, (sts == STS_TRUE));
+      sip_sdp_free(&ticket);
       osip_message_free(ticket.sipmsg);
 
    } /* while TRUE */
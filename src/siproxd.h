@@ -83,6 +83,8 @@ struct siproxd_config {
    char *proxy_auth_realm;
    char *proxy_auth_passwd;
    char *proxy_auth_pwfile;
+   int  proxy_auth_nonce_lifetime;
+   int  proxy_auth_cache_ttl;
    stringa_t mask_host;
    stringa_t masked_host;
    char *outbound_proxy_host;
@@ -104,6 +106,27 @@ struct siproxd_config {
    int   tcp_connect_timeout;
    int   tcp_keepalive;
    int   thread_stack_size;
+   int   dns_cache_size;
+   int   dns_resolver_threads;
+   int   dns_max_ttl;
+   int   dns_max_negative_ttl;
+   int   dns_use_srv;
+   int   dns_srv_holddown;
+   int   dns_prefetch;
+   int   dns_serve_stale;
+   int   sdp_fast_rewrite;
+   int   prefilter;
+   stringa_t prefilter_ua_block;
+   int   prefilter_rate;
+   int   prefilter_burst;
+   stringa_t ratelimit_source;
+   stringa_t ratelimit_aor;
+   int   ratelimit_action;
+   int   ratelimit_retry_after;
+   int   ratelimit_table_size;
+   int   sip_lazy_parse;
+   int   sip_fast_hash;
+   int   plugin_profile;
 };
 
 /*
@@ -120,6 +143,38 @@ typedef struct {
    defval_t defval;
 } cfgopts_t;
 
+/*
+ * index of a received SIP message (sip_scan.c), offsets are
+ * relative to the raw buffer, len 0 = not present
+ */
+typedef struct {
+   size_t off;
+   size_t len;
+} sip_span_t;
+typedef struct {
+   int lines;			/* number of lines (LF terminated) */
+   size_t max_linelen;		/* longest line */
+   sip_span_t first_line;	/* first line without CRLF */
+   int tokens;			/* tokens found on the first line (max 3) */
+   size_t tok1_len;		/* length of method / SIP version */
+   sip_span_t tok2;		/* Request-URI / status code */
+   sip_span_t tok3;		/* SIP version / reason phrase */
+   size_t body_off;		/* start of the body, 0 if no empty line */
+   long content_length;		/* Content-Length value, -1 if none */
+   sip_span_t content_length_hdr; /* Content-Length line incl. CRLF */
+   sip_span_t call_id;		/* Call-ID value */
+   sip_span_t from;		/* From value */
+   sip_span_t user_agent;	/* User-Agent value */
+   sip_span_t alert_info;	/* Alert-Info line incl. CRLF */
+#define SIP_SCAN_VIA		0x01
+#define SIP_SCAN_FROM		0x02
+#define SIP_SCAN_TO		0x04
+#define SIP_SCAN_CSEQ		0x08
+#define SIP_SCAN_CALLID		0x10
+#define SIP_SCAN_MANDATORY	0x1f
+   unsigned int hdr_mask;	/* SIP_SCAN_* headers present */
+} sip_scan_t;
+
 /*
  * SIP ticket
  */
@@ -139,7 +194,18 @@ typedef struct {
 #define RESTYP_INCOMING		3
 #define RESTYP_OUTGOING		4
    int direction;		/* direction as determined by proxy */
+   int direction_done;		/* sip_find_direction() has been run */
+   int plugin_flt;		/* PLUGIN_FLT_* bits of the message, 0: unset */
    struct sockaddr_in next_hop;	/* next hop as determined by plugin or proxy */
+#define SDP_UNPARSED		0
+#define SDP_PARSED		1
+#define SDP_MODIFIED		2
+#define SDP_INVALID		3
+   int sdp_state;		/* state of the shared SDP handle */
+   struct sdp_message *sdp;	/* parsed SDP body, see sip_get_sdp() */
+   sip_scan_t raw_scan;		/* index of raw_buffer, see sip_scan_raw() */
+   int worker;			/* SIP worker processing the ticket, 0..n-1 */
+   void *plugin_ctx;		/* worker context of the called plugin */
 } sip_ticket_t;
 
 
@@ -156,6 +222,140 @@ typedef struct {
 } client_id_t;
 
 
+/*
+ * SIP server set of a domain (RFC3263 NAPTR/SRV lookup),
+ * entries are sorted by priority
+ */
+#define DNS_SRV_MAX	8	/* max targets remembered per domain */
+#define DNS_SRV_TARGETSIZE 128	/* max string length of a target hostname */
+typedef struct {
+   int     count;
+   struct {
+      char target[DNS_SRV_TARGETSIZE+1];
+      int  port;
+      int  priority;
+      int  weight;
+   } entry[DNS_SRV_MAX];
+} dns_srvset_t;
+
+/*
+ * compiled access list (accessctl.c)
+ */
+typedef struct acl_s acl_t;
+
+/*
+ * streaming SDP rewriter (sdp_rewrite.c)
+ */
+#define SDP_SCAN_MEDIA	16	/* max media descriptions handled */
+typedef struct {
+   size_t off;			/* offset of the value in the body */
+   size_t len;			/* length of the value, 0 if not present */
+   const char *repl;		/* replacement, NULL keeps the value */
+} sdp_span_t;
+typedef struct {
+   sdp_span_t o_addr;		/* o= address */
+   sdp_span_t c_addr;		/* c= address on session level */
+   int media_count;
+   struct {
+      sdp_span_t port;		/* m= port */
+      sdp_span_t proto;		/* m= protocol */
+      sdp_span_t c_addr;	/* c= address on media level */
+   } media[SDP_SCAN_MEDIA];
+} sdp_scan_t;
+
+/*
+ * DNS cache statistics
+ */
+typedef struct {
+   unsigned long hits;		/* answered from the cache */
+   unsigned long misses;	/* had to wait for a DNS query */
+   unsigned long refreshes;	/* background refreshes started */
+   unsigned long stale;		/* expired entries served */
+   unsigned long refresh_failures;
+} dnscache_stats_t;
+
+/*
+ * early reject prefilter statistics
+ */
+typedef struct {
+   unsigned long rate_limited;	/* dropped by the per source rate limit */
+   unsigned long malformed;	/* bad first line / missing headers */
+   unsigned long ua_blocked;	/* User-Agent matches a signature */
+} prefilter_stats_t;
+
+/*
+ * rate limit statistics
+ */
+#define RATELIMIT_REJECT	2	/* ratelimit_check(): answer with 503 */
+typedef struct {
+   unsigned long limited_source;	/* exceeded a per source limit */
+   unsigned long limited_aor;		/* exceeded a per AOR limit */
+   unsigned long replied;		/* answered with 503 */
+   unsigned long dropped;		/* silently dropped */
+   unsigned long evictions;		/* buckets taken over (LRU) */
+} ratelimit_stats_t;
+
+/*
+ * Authentication result cache statistics
+ */
+typedef struct {
+   unsigned long hits;		/* verified from the cache */
+   unsigned long misses;	/* digest had to be calculated */
+   unsigned long inserts;	/* verified tuples added */
+   unsigned long evictions;	/* live entries replaced */
+} auth_stats_t;
+
+/*
+ * rewrite result cache statistics (rulematch.c)
+ */
+typedef struct {
+   unsigned long hits;		/* answered from the cache */
+   unsigned long misses;	/* rules had to be evaluated */
+   unsigned long inserts;	/* results added */
+   unsigned long evictions;	/* least recently used entries replaced */
+} rulematch_stats_t;
+
+/*
+ * plugin profile, one per plugin and stage (plugins.c)
+ */
+#define PLUGIN_PROF_OFF		0	/* no accounting */
+#define PLUGIN_PROF_SAMPLED	1	/* count all, time every Nth call */
+#define PLUGIN_PROF_FULL	2	/* count and time all calls */
+typedef struct {
+   const char *name;		/* plugin name */
+   int  stage;			/* PLUGIN_* stage */
+   unsigned long calls;		/* invocations */
+   unsigned long filtered;	/* skipped, message filter did not match */
+   unsigned long timed;		/* invocations that have been timed */
+   unsigned long long total_ns;	/* time spent in the timed invocations */
+   unsigned long max_ns;	/* slowest timed invocation */
+   unsigned long sts_success;	/* returned STS_SUCCESS */
+   unsigned long sts_failure;	/* returned STS_FAILURE */
+   unsigned long sts_sip_sent;	/* returned STS_SIP_SENT */
+   unsigned long sts_other;	/* returned anything else */
+} plugin_profile_t;
+
+/*
+ * SipHash state (siphash.c)
+ */
+typedef struct {
+   unsigned long long v0, v1, v2, v3;
+   unsigned char buf[8];	/* partial block */
+   size_t len;			/* total bytes hashed */
+} siphash_ctx_t;
+
+/*
+ * Counting Bloom filter (bloom.c)
+ */
+typedef struct {
+   unsigned char *counter;
+   unsigned int size;		/* number of counters, power of 2 */
+   unsigned int capacity;	/* elements it was sized for */
+   unsigned int entries;	/* elements added */
+   int saturated;		/* a counter did overflow */
+} bloom_t;
+
+
 /*
  * Function prototypes
  */
@@ -207,6 +407,30 @@ int  createpidfile(char *pidfilename);					/*X*/
 int  compare_client_id(client_id_t cid1, client_id_t cid2);		/*X*/
 int  is_empty_sockaddr(struct sockaddr_in *sockaddr);			/*X*/
 
+/* dnscache.c */
+int  dnscache_init(void);						/*X*/
+int  dnscache_lookup(char *hostname, struct in_addr *addr);		/*X*/
+int  dnscache_lookup_srv(char *domain, int proto, dns_srvset_t *srvset);/*X*/
+int  dnscache_peek(char *hostname, struct in_addr *addr);		/*X*/
+void dnscache_get_stats(dnscache_stats_t *stats);
+int  dnscache_notify_fd(void);
+void dnscache_notify_clear(void);
+void dnscache_park_begin(void);
+int  dnscache_is_parked(void);						/*X*/
+int  dnscache_park_end(sip_ticket_t *ticket);				/*X*/
+int  dnscache_resume(char *buf, size_t bufsize,
+                     struct sockaddr_in *from, int *protocol);
+
+/* resolve.c */
+int  resolve_SRV(char *name, int proto, dns_srvset_t *srvset, int *ttl);/*X*/
+int  resolve_sip_target(char *host, char *port, int proto,
+                        struct in_addr *addr, in_port_t *retport);	/*X*/
+void resolve_target_failed(struct in_addr addr, int port, int holddown);
+
+/* ifaddr.c */
+int  ifaddr_init(void);							/*X*/
+int  ifaddr_lookup(char *ifname, struct in_addr *retaddr);
+
 /* sip_utils.c */
 osip_message_t * msg_make_template_reply (sip_ticket_t *ticket, int code);
 int  check_vialoop (sip_ticket_t *ticket);				/*X*/
@@ -222,11 +446,19 @@ int  sip_calculate_branch_id (sip_ticket_t *ticket, char *id);		/*X*/
 int  sip_find_outbound_proxy(sip_ticket_t *ticket, struct in_addr *addr,
                              in_port_t *port);				/*X*/
 int  sip_find_direction(sip_ticket_t *ticket, int *urlidx);		/*X*/
-int  sip_fixup_asterisk(char *buff, size_t *buflen);			/*X*/
+int  sip_fixup_asterisk(char *buff, size_t *buflen, sip_scan_t *scan);	/*X*/
 int  sip_obscure_callid(sip_ticket_t *ticket);				/*X*/
 int  sip_add_received_param(sip_ticket_t *ticket);			/*X*/
 int  sip_get_received_param(sip_ticket_t *ticket,
                             struct in_addr *dest, in_port_t *port);	/*X*/
+int  sip_get_sdp(sip_ticket_t *ticket, struct sdp_message **sdp);	/*X*/
+void sip_sdp_modified(sip_ticket_t *ticket);
+int  sip_sdp_finalize(sip_ticket_t *ticket);				/*X*/
+int  sip_get_sdp_body(sip_ticket_t *ticket, const char **body,		/*X*/
+                      size_t *len);
+int  sip_set_sdp_body(sip_ticket_t *ticket, const char *buff,		/*X*/
+                      size_t buflen);
+void sip_sdp_free(sip_ticket_t *ticket);
 
 /* readconf.c */
 int  read_config(char *name, int search, cfgopts_t cfgopts[], char *filter); /*X*/
@@ -241,16 +473,64 @@ int  rtp_start_fwd (osip_call_id_t *callid, client_id_t client_id,	/*X*/
 int  rtp_stop_fwd (osip_call_id_t *callid, int direction, int cseq);	/*X*/
 
 /* accessctl.c */
+int  accesslist_init(void);						/*X*/
 int  accesslist_check(struct sockaddr_in from);
-int  process_aclist (char *aclist, struct sockaddr_in from);
+int  process_aclist (char *aclist, struct sockaddr_in from);		/*X*/
+acl_t *acl_compile(char *aclist);
+int  acl_match(acl_t *acl, struct in_addr from);			/*X*/
+void acl_free(acl_t *acl);
+
+/* sdp_rewrite.c */
+int  sdp_scan(const char *body, size_t len, sdp_scan_t *scan);		/*X*/
+int  sdp_emit(const char *body, size_t len, sdp_scan_t *scan,		/*X*/
+              char *out, size_t outsize, size_t *outlen);
+int  sdp_span_copy(const char *body, sdp_span_t *span,			/*X*/
+                   char *dst, size_t dstsize);
+
+/* sip_scan.c */
+int  sip_scan_raw(char *buff, size_t size, sip_scan_t *scan);		/*X*/
+void sip_scan_cut(sip_scan_t *scan, size_t off, size_t len);
+
+/* prefilter.c */
+int  prefilter_init(void);						/*X*/
+int  prefilter_rate_check(struct sockaddr_in from);			/*X*/
+int  prefilter_check(char *buff, sip_scan_t *scan);			/*X*/
+void prefilter_get_stats(prefilter_stats_t *stats);
+
+/* ratelimit.c */
+int  ratelimit_init(void);						/*X*/
+int  ratelimit_check(sip_ticket_t *ticket);				/*X*/
+int  ratelimit_reply(sip_ticket_t *ticket);				/*X*/
+void ratelimit_get_stats(ratelimit_stats_t *stats);
+
+/* siphash.c */
+int  siphash_init(void);						/*X*/
+void siphash_begin(siphash_ctx_t *ctx);
+void siphash_update(siphash_ctx_t *ctx, const void *data, size_t len);
+void siphash_final(siphash_ctx_t *ctx, unsigned char *out);
+
+/* rulematch.c (the rule set API is in rulematch.h) */
+void rulematch_get_stats(rulematch_stats_t *stats);
+
+/* bloom.c */
+bloom_t *bloom_new(unsigned int entries);
+void bloom_free(bloom_t *bloom);
+void bloom_clear(bloom_t *bloom);
+void bloom_add(bloom_t *bloom, const unsigned char *hash);
+void bloom_del(bloom_t *bloom, const unsigned char *hash);
+int  bloom_check(bloom_t *bloom, const unsigned char *hash);		/*X*/
+int  bloom_saturated(bloom_t *bloom);					/*X*/
 
 /* security.c */
-int  security_check_raw(char *sip_buffer, size_t size);			/*X*/
+int  security_check_raw(char *sip_buffer, size_t size,			/*X*/
+                        sip_scan_t *scan);
 int  security_check_sip(sip_ticket_t *ticket);				/*X*/
 
 /* auth.c */
+int  auth_init(void);							/*X*/
 int  authenticate_proxy(osip_message_t *sipmsg);			/*X*/
-int  auth_include_authrq(osip_message_t *sipmsg);			/*X*/
+int  auth_include_authrq(osip_message_t *sipmsg, int stale);		/*X*/
+void auth_get_stats(auth_stats_t *stats);
 void CvtHex(unsigned char *hash, unsigned char *hashstring);
 
 /* fwapi.c */
@@ -266,11 +546,21 @@ int sip_message_parse(osip_message_t * sip,    const char *buf, size_t len);
 int sip_message_to_str(osip_message_t * sip,   char **dest,     size_t *len);
 int sip_body_to_str(const osip_body_t * body,  char **dest,     size_t *len);
 int sip_message_set_body(osip_message_t * sip, const char *buf, size_t len);
+void sip_want_header(const char *name);
 
 /* plugins.c */
 int load_plugins (void);
+int plugin_workers_init(int workers);					/*X*/
 int call_plugins(int stage, sip_ticket_t *ticket);
 int unload_plugins(void);
+int plugin_get_profile(int index, plugin_profile_t *prof);		/*X*/
+void plugin_reset_profile(void);
+int  plugin_async_notify_fd(void);
+void plugin_async_notify_clear(void);
+int  plugin_async_resume(char *buf, size_t bufsize,
+                         struct sockaddr_in *from, int *protocol);
+void plugin_async_park_end(sip_ticket_t *ticket, int dns_parked);
+void plugin_async_dns_resumed(char *buf, int length, struct sockaddr_in *from);
 
 /*
  * some constant definitions
@@ -298,11 +588,24 @@ int unload_plugins(void);
 #define PATH_STRING_SIZE 256	/* max size of an file path		*/
 #define URL_STRING_SIZE	128	/* max size of an URL/URI string	*/
 #define STATUSCODE_SIZE	5	/* size of string representation of status */
-#define DNS_CACHE_SIZE	256	/* number of entries in internal DNS cache */
+#define DNS_CACHE_SIZE	256	/* default number of entries in DNS cache */
+#define DNS_THREADS	2	/* default number of DNS resolver threads */
 #define DNS_ATTEMPTS	3	/* number of attempts to resolve a name
 				   before it is marked as bad */
-#define DNS_GOOD_AGE	60	/* maximum age of a good cache entry (sec) */
+#define DNS_GOOD_AGE	60	/* age of a good cache entry if no TTL is
+				   known (e.g. /etc/hosts) (sec) */
 #define DNS_BAD_AGE	600	/* maximum age of a bad cache entry (sec) */
+#define DNS_MAX_TTL	3600	/* default max. age of a good entry (sec) */
+#define DNS_MIN_TTL	5	/* minimum age of any cache entry (sec) */
+#define DNS_SERVE_STALE	300	/* default time an expired entry is served
+				   while being refreshed (sec) */
+#define DNS_SRV_HOLDDOWN 30	/* default time a failed SRV target is
+				   not used (sec) */
+#define AUTH_NONCE_LIFETIME 3600 /* default lifetime of an auth nonce (sec) */
+#define AUTH_CACHE_TTL	60	/* default TTL of cached auth results (sec) */
+#define PREFILTER_BURST	50	/* default burst of the per source rate limit */
+#define RATELIMIT_SIZE	4096	/* default number of rate limit buckets */
+#define RATELIMIT_RETRY_AFTER 5 /* default Retry-After of 503 (sec) */
 #define IFADR_CACHE_SIZE 32	/* number of entries in internal IFADR cache */
 #define IFADR_MAX_AGE	5	/* max. age of the IF address cache (sec) */
 #define IFNAME_SIZE	16	/* max string length of a interface name */
@@ -337,7 +640,9 @@ int unload_plugins(void);
 #define STS_FAILURE	1	/* FAILURE				*/
 #define STS_FALSE	1	/* FALSE				*/
 #define STS_NEED_AUTH	1001	/* need authentication			*/
+#define STS_AUTH_STALE	1002	/* need authentication, nonce stale	*/
 #define STS_SIP_SENT	2001	/* SIP packet is already sent, end of dialog */
+#define STS_PLUGIN_PENDING 3001	/* plugin has suspended the SIP message */
 
 /* symbolic direction of data */
 #define DIR_INCOMING	1
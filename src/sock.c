@@ -158,6 +158,8 @@ int sipsock_waitfordata(char *buf, size_t bufsize,
    int i, fd;
    fd_set fdset;
    int highest_fd, num_fd_active;
+   int dns_fd;
+   int plugin_fd;
    static struct timeval timeout={0,0};
    int length;
    socklen_t fromlen;
@@ -189,6 +191,20 @@ int sipsock_waitfordata(char *buf, size_t bufsize,
       highest_fd = sip_tcp_socket;
    }
 
+   /* prepare FD set: DNS resolver notification */
+   dns_fd=dnscache_notify_fd();
+   if (dns_fd >= 0) {
+      FD_SET(dns_fd, &fdset);
+      if (dns_fd > highest_fd) highest_fd = dns_fd;
+   }
+
+   /* prepare FD set: asynchronous plugin notification */
+   plugin_fd=plugin_async_notify_fd();
+   if (plugin_fd >= 0) {
+      FD_SET(plugin_fd, &fdset);
+      if (plugin_fd > highest_fd) highest_fd = plugin_fd;
+   }
+
    /* prepare FD set: TCP connections */
    for (i=0; i<(sizeof(sip_tcp_cache)/sizeof(sip_tcp_cache[0])); i++) {
       /* active TCP conenction? */
@@ -245,6 +261,26 @@ for (i=0; i< highest_fd; i++) {
     */
 
 
+   /*
+    * Check DNS resolver notification - a parked message may be
+    * ready to be processed (picked up by the main loop)
+    */
+   if ((dns_fd >= 0) && FD_ISSET(dns_fd, &fdset)) {
+      dnscache_notify_clear();
+      num_fd_active--;
+      if (num_fd_active <=0) return 0;
+   }
+
+   /*
+    * Check plugin notification - a suspended message may be
+    * ready to be processed (picked up by the main loop)
+    */
+   if ((plugin_fd >= 0) && FD_ISSET(plugin_fd, &fdset)) {
+      plugin_async_notify_clear();
+      num_fd_active--;
+      if (num_fd_active <=0) return 0;
+   }
+
    /*
     * Check TCP listen socket
     */
@@ -432,6 +468,14 @@ int sipsock_send(struct in_addr addr, int port, int protocol,
       return STS_FAILURE;
    }
 
+   /* the message being processed is parked waiting for DNS and will
+    * be processed again later - don't send anything now */
+   if (dnscache_is_parked() == STS_TRUE) {
+      DEBUGC(DBCLASS_DNS, "message is parked, not sending to %s:%i",
+             utils_inet_ntoa(addr), port);
+      return STS_SUCCESS;
+   }
+
    if (protocol == PROTO_UDP) {
       /*
        * UDP target
@@ -27,6 +27,7 @@
 #include <time.h>
 #include <signal.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -53,34 +54,24 @@
 /* configuration storage */
 extern struct siproxd_config configuration;
 
-extern int h_errno;
+#if defined(HAVE_INET_NTOP)
+/* result buffer of utils_inet_ntoa(), one per thread */
+static pthread_key_t ntoa_key;
+static pthread_once_t ntoa_once=PTHREAD_ONCE_INIT;
+static void ntoa_key_create(void);
+#endif
 
 
 /*
  * resolve a hostname and return in_addr
- * handles its own little DNS cache.
+ * uses the DNS cache (dnscache.c), lookups are done asynchronously
+ * if the hostname is not cached.
  *
  * RETURNS
  *	STS_SUCCESS on success
  *	STS_FAILURE on failure
  */
 int get_ip_by_host(char *hostname, struct in_addr *addr) {
-   int i, j, k, idx;
-   time_t t1, t2;
-   struct hostent *hostentry;
-#if defined(HAVE_GETHOSTBYNAME_R)
-   struct hostent result_buffer;
-   char tmp[GETHOSTBYNAME_BUFLEN];
-#endif
-   int error;
-   static struct {
-      time_t expires_timestamp;	/* time of expiration */
-      struct in_addr addr;	/* IP address or 0.0.0.0 if a bad entry */
-      char   error_count;	/* counts failed resolution attempts */
-      char   bad_entry;		/* != 0 if resolving failed */
-      char hostname[HOSTNAME_SIZE+1];
-   } dns_cache[DNS_CACHE_SIZE];
-   static int cache_initialized=0;
 
    if (hostname == NULL) {
       ERROR("get_ip_by_host: NULL hostname requested");
@@ -100,184 +91,9 @@ int get_ip_by_host(char *hostname, struct in_addr *addr) {
       return STS_SUCCESS;
    }
 
-   /* first time: initialize DNS cache */
-   if (cache_initialized == 0) {
-      DEBUGC(DBCLASS_DNS, "initializing DNS cache (%i entries)", DNS_CACHE_SIZE);
-      memset(dns_cache, 0, sizeof(dns_cache));
-      cache_initialized=1;
-   }
-
-   time(&t1);
-   /* clean expired entries */
-   for (i=0; i<DNS_CACHE_SIZE; i++) {
-      if (dns_cache[i].hostname[0]=='\0') continue;
-      if ( (dns_cache[i].expires_timestamp) < t1 ) {
-         DEBUGC(DBCLASS_DNS, "cleaning DNS cache (entry %i)", i);
-         memset (&dns_cache[i], 0, sizeof(dns_cache[0]));
-      }
-   }
-
-   /*
-    * search requested entry in cache
-    */
-   idx=0;
-   for (i=0; i<DNS_CACHE_SIZE; i++) {
-      if (dns_cache[i].hostname[0]=='\0') continue; /* empty */
-      if (strcasecmp(hostname, dns_cache[i].hostname) == 0) { /* match */
-         memcpy(addr, &dns_cache[i].addr, sizeof(struct in_addr));
-         if (dns_cache[i].bad_entry) {
-            DEBUGC(DBCLASS_DNS, "DNS lookup - blacklisted from cache: %s",
-                   hostname);
-            return STS_FAILURE;
-         }
-         if (dns_cache[i].error_count > 0) {
-            DEBUGC(DBCLASS_DNS, "DNS lookup - previous resolution failed: %s"
-                   ", attempt %i", hostname, dns_cache[i].error_count);
-            idx=i;
-            break;
-         }
-// avoid: causes tremendous logging during URL lookups through
-//        the urlmap...
-//         DEBUGC(DBCLASS_BABBLE, "DNS lookup - from cache: %s -> %s",
-//                hostname, utils_inet_ntoa(*addr));
-         return STS_SUCCESS;
-      }
-   }
-   
-   /* I did not find it in cache, so I have to resolve it */
-   error = 0;
-
-   /* need to deal with reentrant versions of gethostbyname_r()
-    * as we may use threads... */
-#if defined(HAVE_GETHOSTBYNAME_R)
-
-   /* gethostbyname_r() with 3 arguments (e.g. osf/1) */
-   #if defined(HAVE_FUNC_GETHOSTBYNAME_R_3)
-   gethostbyname_r(hostname,		/* the FQDN */
-		   &result_buffer,	/* the result buffer */ 
-		   &hostentry
-		   );
-   if (hostentry == NULL) error = h_errno;
-
-   /* gethostbyname_r() with 5 arguments (e.g. solaris, linux libc5) */
-   #elif defined(HAVE_FUNC_GETHOSTBYNAME_R_5)
-   hostentry = gethostbyname_r(hostname,        /* the FQDN */
-			       &result_buffer,  /* the result buffer */
-			       tmp,
-			       GETHOSTBYNAME_BUFLEN,
-			       &error);
-
-   /* gethostbyname_r() with 6 arguments (e.g. linux glibc) */
-   #elif defined(HAVE_FUNC_GETHOSTBYNAME_R_6)
-   gethostbyname_r(hostname,        /* the FQDN */
-		   &result_buffer,  /* the result buffer */
-		   tmp,
-		   GETHOSTBYNAME_BUFLEN,
-		   &hostentry,
-		   &error);
-   #else
-      #error "gethostbyname_r() with 3, 5 or 6 arguments supported only"
-   #endif   
-#elif defined(HAVE_GETHOSTBYNAME)
-   hostentry=gethostbyname(hostname);
-   if (hostentry == NULL) error = h_errno;
-#else
-   #error "need gethostbyname() or gethostbyname_r()"
-#endif
-   /* Here I have 'hostentry' and 'error' */
-
-
-   if (hostentry==NULL) {
-      /*
-       * Some errors just tell us that there was no IP resolvable.
-       * From the manpage:
-       *   HOST_NOT_FOUND
-       *      The specified host is unknown.
-       *   NO_ADDRESS or NO_DATA
-       *      The requested name is valid but does not have an IP
-       *      address.
-       */
-      if ((error == HOST_NOT_FOUND) ||
-          (error == NO_ADDRESS) ||
-          (error == NO_DATA)) {
-#ifdef HAVE_HSTRERROR
-         DEBUGC(DBCLASS_DNS, "gethostbyname(%s) failed: h_errno=%i [%s]",
-                hostname, h_errno, hstrerror(error));
-#else
-         DEBUGC(DBCLASS_DNS, "gethostbyname(%s) failed: h_errno=%i",
-                hostname, error);
-#endif
-      } else {
-#ifdef HAVE_HSTRERROR
-         ERROR("gethostbyname(%s) failed: h_errno=%i [%s]",
-               hostname, h_errno, hstrerror(h_errno));
-#else
-         ERROR("gethostbyname(%s) failed: h_errno=%i",hostname, h_errno);
-#endif
-      }
-   }
-
-   if (hostentry) {
-      memcpy(addr, hostentry->h_addr, sizeof(struct in_addr));
-      DEBUGC(DBCLASS_DNS, "DNS lookup - resolved: %s -> %s",
-             hostname, utils_inet_ntoa(*addr));
-   }
-
-   /* if we already have the entry, skip finding a new empty one */
-   if (idx == 0) {
-      /*
-       * find an empty slot in the cache
-       */
-      j=0;
-      k=0;
-      t1=INT_MAX;
-      t2=INT_MAX;
-      for (i=0; i<DNS_CACHE_SIZE; i++) {
-         if (dns_cache[i].hostname[0]=='\0') break;
-         if ((dns_cache[i].expires_timestamp < t1) &&
-             (dns_cache[i].bad_entry == 0)) {
-            /* remember oldest good entry */
-            t1=dns_cache[i].expires_timestamp;
-            j=i;
-         } else 
-         if (dns_cache[i].expires_timestamp < t2) {
-            /* remember oldest bad entry */
-            t2=dns_cache[i].expires_timestamp;
-            k=i;
-         }
-      }
-      /* if no empty slot found, victimize oldest one.
-       * Give preference to the oldest "bad" entry if 
-       * one exists */
-      if (i >= DNS_CACHE_SIZE) {
-         if (k > 0) i=k;
-         else       i=j;
-      }
-      idx=i;
-      memset(&dns_cache[idx], 0, sizeof(dns_cache[0]));
-   }
-
-   /*
-    * store the result in the cache
-    */
-   DEBUGC(DBCLASS_DNS, "DNS lookup - store into cache, entry %i)", idx);
-   strncpy(dns_cache[idx].hostname, hostname, HOSTNAME_SIZE);
-   dns_cache[idx].expires_timestamp = time(NULL) + DNS_GOOD_AGE;
-   if (hostentry) {
-      memcpy(&dns_cache[idx].addr, addr, sizeof(struct in_addr));
-      dns_cache[idx].error_count = 0;
-      dns_cache[idx].bad_entry = 0;
-   } else {
-      dns_cache[idx].error_count++;
-      DEBUGC(DBCLASS_DNS, "DNS lookup - errcnt=%i", dns_cache[idx].error_count);
-      if (dns_cache[idx].error_count >= DNS_ATTEMPTS) {
-         DEBUGC(DBCLASS_DNS, "DNS lookup - blacklisting entry");
-         dns_cache[idx].expires_timestamp = time(NULL) + DNS_BAD_AGE;
-         dns_cache[idx].bad_entry = 1;
-      }
-      return STS_FAILURE;
-   }
-   return STS_SUCCESS;
+// avoid logging here: causes tremendous logging during URL lookups
+// through the urlmap...
+   return dnscache_lookup(hostname, addr);
 }
 
 
@@ -414,7 +230,7 @@ int  get_interface_real_ip(int interface, struct in_addr *retaddr) {
  */
 int get_ip_by_ifname(char *ifname, struct in_addr *retaddr) {
    struct in_addr ifaddr; /* resulting IP */
-   int i, j;
+   int i, j, sts;
    int ifflags=0, isup=0;
    time_t t;
    static struct {
@@ -439,6 +255,15 @@ int get_ip_by_ifname(char *ifname, struct in_addr *retaddr) {
       return STS_FAILURE;
    }
 
+   /* table maintained via netlink available? (ifaddr.c) */
+   sts = ifaddr_lookup(ifname, retaddr);
+   if (sts != -1) {
+      if ((sts != STS_SUCCESS) && retaddr) {
+         memset(retaddr, 0, sizeof(struct in_addr));
+      }
+      return sts;
+   }
+
    /* first time: initialize ifaddr cache */
    if (cache_initialized == 0) {
       DEBUGC(DBCLASS_DNS, "initializing ifaddr cache (%i entries)", 
@@ -586,7 +411,7 @@ int get_ip_by_ifname(char *ifname, struct in_addr *retaddr) {
  * utils_inet_ntoa:
  * implements an inet_ntoa()
  *
- * Returns pointer to a STATIC character string.
+ * Returns pointer to a STATIC character string (one per thread).
  * NOte: BE AWARE OF THE STATIC NATURE of the string! Never pass it as
  * calling argument to a function and use it immediately or str(n)cpy()
  * it into a buffer.
@@ -597,7 +422,18 @@ int get_ip_by_ifname(char *ifname, struct in_addr *retaddr) {
  */
 char *utils_inet_ntoa(struct in_addr in) {
 #if defined(HAVE_INET_NTOP)
-   static char string[INET_ADDRSTRLEN];
+   static char fallback[INET_ADDRSTRLEN];
+   char *string;
+
+   pthread_once(&ntoa_once, ntoa_key_create);
+   string=pthread_getspecific(ntoa_key);
+   if (string == NULL) {
+      string=malloc(INET_ADDRSTRLEN);
+      if ((string == NULL) || (pthread_setspecific(ntoa_key, string) != 0)) {
+         free(string);
+         string=fallback;
+      }
+   }
    if ((inet_ntop(AF_INET, &in, string, INET_ADDRSTRLEN)) == NULL) {
       ERROR("inet_ntop() failed: %s",strerror(errno));
       string[0]='\0';
@@ -610,6 +446,12 @@ char *utils_inet_ntoa(struct in_addr in) {
 #endif
 }
 
+#if defined(HAVE_INET_NTOP)
+static void ntoa_key_create(void) {
+   pthread_key_create(&ntoa_key, free);
+}
+#endif
+
 
 /*
  * utils_inet_aton:
@@ -0,0 +1,205 @@
+/*
+    Copyright (C) 2002-2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * bloom_bench - negative lookups in a large blacklist
+ *
+ * Fills a blacklist with n (ip, sipuri) records, once as SQLite table
+ * (the way plugin_blacklist did query it for every request) and once
+ * as Bloom filters (bloom.c) over the IPs and the pairs. Then requests
+ * from sources that are not blacklisted are looked up with both.
+ * Reports the time per lookup, the false positive rate of the
+ * filters and checks that every blacklisted record is found.
+ *
+ * usage: bloom_bench [-n entries] [-l lookups]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sqlite3.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+
+#define SQL_CREATE \
+	"CREATE TABLE blacklist (type INTEGER DEFAULT 0, ip VARCHAR(16), "\
+	"sipuri VARCHAR(128), failcount INTEGER DEFAULT 0, "\
+	"lastfail INTEGER DEFAULT 0, lastseen INTEGER DEFAULT 0, "\
+	"CONSTRAINT unique_src UNIQUE (ip, sipuri));"
+#define SQL_INSERT \
+	"INSERT INTO blacklist (ip, sipuri, failcount) VALUES (?001, ?002, 20);"
+#define SQL_CHECK \
+	"SELECT count(*) from blacklist WHERE ip=?001 and sipuri=?002 "\
+	"AND (type=1 or failcount>?003);"
+
+/* siphash.c logs a warning if /dev/urandom is missing */
+void log_warn(char *file, int line, const char *format, ...) {
+   va_list ap;
+   va_start(ap, format);
+   vfprintf(stderr, format, ap);
+   va_end(ap);
+   fprintf(stderr, "\n");
+}
+
+
+/* blacklisted sources are 10.x.x.x, clean ones 172.16.x.x */
+static struct in_addr src_ip(int i, int listed) {
+   struct in_addr addr;
+   addr.s_addr=htonl((listed ? 0x0a000000 : 0xac100000) + i);
+   return addr;
+}
+
+
+static void src_uri(int i, char *uri, size_t size) {
+   snprintf(uri, size, "sip:%i@sip.example.net", 1000+i);
+}
+
+
+static void hash_key(struct in_addr ip, char *uri, unsigned char *hash) {
+   siphash_ctx_t ctx;
+
+   siphash_begin(&ctx);
+   siphash_update(&ctx, &ip, sizeof(ip));
+   if (uri) siphash_update(&ctx, uri, strlen(uri));
+   siphash_final(&ctx, hash);
+}
+
+
+static double elapsed(struct timespec *a, struct timespec *b) {
+   return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+
+int main(int argc, char *argv[]) {
+   int entries=100000;
+   int lookups=1000000;
+   sqlite3 *db;
+   sqlite3_stmt *ins, *chk;
+   bloom_t *bloom_ip, *bloom_pair;
+   unsigned char hash[16];
+   char uri[64];
+   char *from;
+   struct in_addr ip;
+   struct timespec t0, t1;
+   double t_sql, t_bloom;
+   int i, found=0, fp_ip=0, fp_pair=0, missed=0;
+
+   for (i=1; i+1 < argc; i+=2) {
+      if (strcmp(argv[i], "-n") == 0) entries=atoi(argv[i+1]);
+      if (strcmp(argv[i], "-l") == 0) lookups=atoi(argv[i+1]);
+   }
+
+   siphash_init();
+   bloom_ip=bloom_new(entries*2);
+   bloom_pair=bloom_new(entries*2);
+   if ((bloom_ip == NULL) || (bloom_pair == NULL)) return 1;
+
+   if ((sqlite3_open(":memory:", &db) != SQLITE_OK) ||
+       (sqlite3_exec(db, SQL_CREATE, NULL, NULL, NULL) != SQLITE_OK) ||
+       (sqlite3_prepare(db, SQL_INSERT, -1, &ins, NULL) != SQLITE_OK) ||
+       (sqlite3_prepare(db, SQL_CHECK, -1, &chk, NULL) != SQLITE_OK)) {
+      fprintf(stderr, "sqlite: %s\n", sqlite3_errmsg(db));
+      return 1;
+   }
+
+   /* fill the blacklist */
+   sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+   for (i=0; i < entries; i++) {
+      ip=src_ip(i, 1);
+      src_uri(i, uri, sizeof(uri));
+      sqlite3_bind_text(ins, 1, inet_ntoa(ip), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_text(ins, 2, uri, -1, SQLITE_TRANSIENT);
+      sqlite3_step(ins);
+      sqlite3_reset(ins);
+      hash_key(ip, NULL, hash);
+      bloom_add(bloom_ip, hash);
+      hash_key(ip, uri, hash);
+      bloom_add(bloom_pair, hash);
+   }
+   sqlite3_exec(db, "END TRANSACTION", NULL, NULL, NULL);
+
+   /* no false negatives */
+   for (i=0; i < entries; i++) {
+      ip=src_ip(i, 1);
+      src_uri(i, uri, sizeof(uri));
+      hash_key(ip, uri, hash);
+      if (bloom_check(bloom_pair, hash) != STS_TRUE) missed++;
+   }
+
+   /* clean traffic, SQLite: URI string + SELECT (as before) */
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (i=0; i < lookups; i++) {
+      ip=src_ip(i % 1000000, 0);
+      from=malloc(64);
+      src_uri(i, from, 64);
+      sqlite3_bind_text(chk, 1, inet_ntoa(ip), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_text(chk, 2, from, -1, SQLITE_TRANSIENT);
+      sqlite3_bind_int(chk, 3, 10);
+      if (sqlite3_step(chk) == SQLITE_ROW) found+=sqlite3_column_int(chk, 0);
+      sqlite3_reset(chk);
+      free(from);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   t_sql=elapsed(&t0, &t1);
+
+   /* clean traffic, Bloom filter on the IP */
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (i=0; i < lookups; i++) {
+      ip=src_ip(i % 1000000, 0);
+      hash_key(ip, NULL, hash);
+      if (bloom_check(bloom_ip, hash) == STS_TRUE) fp_ip++;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   t_bloom=elapsed(&t0, &t1);
+
+   /* false positives of the pair filter (known IP, other user) */
+   for (i=0; i < lookups; i++) {
+      ip=src_ip(i % entries, 1);
+      src_uri(entries+i, uri, sizeof(uri));
+      hash_key(ip, uri, hash);
+      if (bloom_check(bloom_pair, hash) == STS_TRUE) fp_pair++;
+   }
+
+   printf("%i records, %i lookups of clean sources\n", entries, lookups);
+   printf("SQLite SELECT      %8.0f ns/lookup\n", t_sql*1e9/lookups);
+   printf("Bloom filter (IP)  %8.0f ns/lookup  x%.0f\n",
+          t_bloom*1e9/lookups, t_sql/t_bloom);
+   printf("false positives: IP filter %.3f%%, pair filter %.3f%%\n",
+          100.0*fp_ip/lookups, 100.0*fp_pair/lookups);
+   printf("filter size: %u + %u bytes\n", bloom_ip->size, bloom_pair->size);
+   printf("blacklisted records missed: %i (SQLite: %i)\n", missed, found);
+
+   sqlite3_finalize(ins);
+   sqlite3_finalize(chk);
+   sqlite3_close(db);
+   bloom_free(bloom_ip);
+   bloom_free(bloom_pair);
+
+   return ((missed == 0) && (found == 0)) ? 0 : 1;
+}
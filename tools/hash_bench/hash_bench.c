@@ -0,0 +1,198 @@
+/*
+    Copyright (C) 2002-2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * hash_bench - compare the MD5 and the SipHash (siphash.c) variant
+ * of the branch parameter calculation (sip_calculate_branch_id).
+ *
+ * Both cases of RFC3261 section 16.11 are timed: hashing the received
+ * branch and hashing topmost Via, tags, Call-ID, CSeq number and
+ * Request-URI. The hex conversion is included, the libosip2 parsing
+ * and rendering of the header fields is not (same for both variants).
+ * A number of different Call-IDs is hashed to check that the
+ * branch parameters do not collide.
+ *
+ * usage: hash_bench [-n loops]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+#include <osipparser2/osip_md5.h>
+
+#include "siproxd.h"
+
+#define COLLISION_IDS	100000
+
+static char *magic_cookie="z9hG4bK";
+
+/* fields of a typical INVITE */
+static char *fields[] = {
+   "SIP/2.0/UDP 192.168.1.10:5060;rport;branch=z9hG4bK1598271435",
+   "",
+   "1845279813",
+   "1240557618@192.168.1.10",
+   "20",
+   "sip:4930123456@sip.example.net",
+   NULL
+};
+
+static char *rcv_branch="z9hG4bK1598271435";
+
+/* siphash.c logs a warning if /dev/urandom is missing */
+void log_warn(char *file, int line, const char *format, ...) {
+   va_list ap;
+   va_start(ap, format);
+   vfprintf(stderr, format, ap);
+   va_end(ap);
+   fprintf(stderr, "\n");
+}
+
+
+static void hex(unsigned char *hash, char *id) {
+   static const char digits[]="0123456789abcdef";
+   int i;
+
+   strcpy(id, magic_cookie);
+   id+=strlen(magic_cookie);
+   for (i=0; i<16; i++) {
+      *id++=digits[hash[i] >> 4];
+      *id++=digits[hash[i] & 0xf];
+   }
+   *id='\0';
+}
+
+
+static void branch_md5(char **data, char *id) {
+   osip_MD5_CTX ctx;
+   unsigned char hash[16];
+
+   osip_MD5Init(&ctx);
+   for (; *data; data++) {
+      osip_MD5Update(&ctx, (unsigned char*)*data, strlen(*data));
+   }
+   osip_MD5Final(hash, &ctx);
+   hex(hash, id);
+}
+
+
+static void branch_siphash(char **data, char *id) {
+   siphash_ctx_t ctx;
+   unsigned char hash[16];
+
+   siphash_begin(&ctx);
+   for (; *data; data++) {
+      siphash_update(&ctx, *data, strlen(*data));
+   }
+   siphash_final(&ctx, hash);
+   hex(hash, id);
+}
+
+
+static double elapsed(struct timespec *a, struct timespec *b) {
+   return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+
+static void bench(const char *name, char **data, long loops) {
+   char id[VIA_BRANCH_SIZE];
+   struct timespec t0, t1;
+   double t_md5, t_sip;
+   long i;
+
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (i=0; i < loops; i++) {
+      branch_md5(data, id);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   t_md5=elapsed(&t0, &t1);
+
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (i=0; i < loops; i++) {
+      branch_siphash(data, id);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   t_sip=elapsed(&t0, &t1);
+
+   printf("%-26s MD5 %8.0f ns  SipHash %8.0f ns  x%.1f  (%s)\n",
+          name, t_md5*1e9/loops, t_sip*1e9/loops, t_md5/t_sip, id);
+}
+
+
+static int cmp_id(const void *a, const void *b) {
+   return memcmp(a, b, VIA_BRANCH_SIZE);
+}
+
+
+/* hash COLLISION_IDS different Call-IDs, count duplicate branches */
+static int collisions(void) {
+   char (*ids)[VIA_BRANCH_SIZE];
+   char callid[64];
+   char *data[7];
+   int i, dup=0;
+
+   ids=calloc(COLLISION_IDS, VIA_BRANCH_SIZE);
+   if (ids == NULL) return 0;
+
+   memcpy(data, fields, sizeof(data));
+   data[3]=callid;
+   for (i=0; i < COLLISION_IDS; i++) {
+      snprintf(callid, sizeof(callid), "%i@192.168.1.10", i);
+      branch_siphash(data, ids[i]);
+   }
+   qsort(ids, COLLISION_IDS, VIA_BRANCH_SIZE, cmp_id);
+   for (i=1; i < COLLISION_IDS; i++) {
+      if (memcmp(ids[i-1], ids[i], VIA_BRANCH_SIZE) == 0) dup++;
+   }
+   free(ids);
+   return dup;
+}
+
+
+int main(int argc, char *argv[]) {
+   long loops=1000000;
+   char *branch[2];
+   int dup;
+
+   if ((argc > 2) && (strcmp(argv[1], "-n") == 0)) {
+      loops=atol(argv[2]);
+   }
+
+   siphash_init();
+
+   branch[0]=rcv_branch;
+   branch[1]=NULL;
+   bench("received branch", branch, loops);
+   bench("Via/tags/Call-ID/CSeq/URI", fields, loops);
+
+   dup=collisions();
+   printf("%i different Call-IDs: %i duplicate branches\n",
+          COLLISION_IDS, dup);
+
+   return (dup == 0) ? 0 : 1;
+}
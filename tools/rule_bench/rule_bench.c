@@ -0,0 +1,243 @@
+/*
+    Copyright (C) 2002-2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * rule_bench - first matching rule of a large plugin_regex rule set
+ *
+ * Generates a dial plan of n number rewriting rules, most of them
+ * anchored with a literal number prefix, some only with "sip:" and
+ * some not anchored at all. Then To URIs are matched against it, once by
+ * trying every rule with regexec() in a row (the way plugin_regex
+ * did) and once with the compiled rule set (rulematch.c).
+ * A third run repeats the lookups through the rewrite result cache
+ * of the rule set. Reports the time per lookup and checks that all
+ * find the same rule for every URI.
+ *
+ * usage: rule_bench [-n rules] [-l lookups]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "rulematch.h"
+
+#define URIS		1000	/* different URIs looked up */
+#define NMATCHES	10
+
+/* rulematch.c and siphash.c log through log.c */
+void log_error(char *file, int line, const char *format, ...) {
+   va_list ap;
+   va_start(ap, format);
+   vfprintf(stderr, format, ap);
+   va_end(ap);
+   fprintf(stderr, "\n");
+}
+
+void log_warn(char *file, int line, const char *format, ...) {
+   va_list ap;
+   va_start(ap, format);
+   vfprintf(stderr, format, ap);
+   va_end(ap);
+   fprintf(stderr, "\n");
+}
+
+void log_debug(unsigned int class, char *file, int line,
+               const char *format, ...) {
+}
+
+
+static double elapsed(struct timespec *a, struct timespec *b) {
+   return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+
+static void digits(char *buf, int n) {
+   int i;
+   for (i=0; i < n; i++) buf[i]='0' + rand() % 10;
+   buf[n]='\0';
+}
+
+
+/*
+ * 8 of 10 rules have a literal number prefix, one only "sip:" and
+ * one is not anchored (not indexed, tried for every URI)
+ */
+static char *make_rule(int i, char *prefix) {
+   char buf[128];
+
+   digits(prefix, 3 + rand() % 5);
+   switch (i % 10) {
+   case 9:
+      snprintf(buf, sizeof(buf), "sips?:%s([0-9]*)@", prefix);
+      break;
+   case 8:
+      snprintf(buf, sizeof(buf), "^sip:(\\+|00)%s([0-9]*)@", prefix);
+      break;
+   default:
+      snprintf(buf, sizeof(buf), "^sip:00%s([0-9]*)@(.*)$", prefix);
+      break;
+   }
+   return strdup(buf);
+}
+
+
+/* lookup through the result cache, as plugin_siptrunk does */
+static int cached(rulematch_t *rules, char *uri) {
+   regmatch_t pm[NMATCHES];
+   int i;
+
+   if (rulematch_cache_get(rules, uri, &i, NULL, 0) == STS_SUCCESS) {
+      return i;
+   }
+   i=rulematch_exec(rules, uri, NMATCHES, pm);
+   rulematch_cache_put(rules, uri, i, NULL);
+   return i;
+}
+
+
+/* the reference: try every rule in a row, first match hits */
+static int linear(regex_t *re, int count, char *uri) {
+   regmatch_t pm[NMATCHES];
+   int i;
+
+   for (i=0; i < count; i++) {
+      if (regexec(&re[i], uri, NMATCHES, pm, 0) == 0) return i;
+   }
+   return -1;
+}
+
+
+int main(int argc, char *argv[]) {
+   int count=500;
+   long loops=100000;
+   char **patterns, **prefixes;
+   char *uris[URIS];
+   char tail[16], buf[128];
+   regex_t *re;
+   regmatch_t pm[NMATCHES];
+   rulematch_t *rules;
+   struct timespec t0, t1;
+   double t_lin, t_rm, t_cache;
+   rulematch_stats_t st;
+   int i, r, hits=0, diff=0;
+   long l;
+
+   for (i=1; i+1 < argc; i+=2) {
+      if (strcmp(argv[i], "-n") == 0) count=atoi(argv[i+1]);
+      if (strcmp(argv[i], "-l") == 0) loops=atol(argv[i+1]);
+   }
+   if (count < 1) count=1;
+   srand(1);
+   siphash_init();
+
+   patterns=calloc(count, sizeof(char*));
+   prefixes=calloc(count, sizeof(char*));
+   re=calloc(count, sizeof(regex_t));
+   for (i=0; i < count; i++) {
+      prefixes[i]=malloc(16);
+      patterns[i]=make_rule(i, prefixes[i]);
+      if (regcomp(&re[i], patterns[i], REG_ICASE|REG_EXTENDED) != 0) {
+         fprintf(stderr, "regcomp failed: %s\n", patterns[i]);
+         return 2;
+      }
+   }
+   if (rulematch_compile(&rules, count, patterns,
+                         REG_ICASE|REG_EXTENDED) != STS_SUCCESS) {
+      return 2;
+   }
+   rulematch_cache_init(rules, URIS);
+
+   /* half of the URIs dial a configured prefix, the rest is random */
+   for (i=0; i < URIS; i++) {
+      digits(tail, 6);
+      if (i & 1) {
+         r=rand() % count;
+         snprintf(buf, sizeof(buf), "sip:00%s%s@sip.example.net",
+                  prefixes[r], tail);
+      } else {
+         digits(buf+100, 4);
+         snprintf(buf, sizeof(buf), "sip:%s%s@sip.example.net",
+                  buf+100, tail);
+      }
+      uris[i]=strdup(buf);
+   }
+
+   /* both must find the same rule */
+   for (i=0; i < URIS; i++) {
+      r=linear(re, count, uris[i]);
+      if (r != rulematch_exec(rules, uris[i], NMATCHES, pm)) diff++;
+      if (r != cached(rules, uris[i])) diff++;
+      if (r != cached(rules, uris[i])) diff++;
+      if (r >= 0) hits++;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (l=0; l < loops; l++) {
+      linear(re, count, uris[l % URIS]);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   t_lin=elapsed(&t0, &t1);
+
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (l=0; l < loops; l++) {
+      rulematch_exec(rules, uris[l % URIS], NMATCHES, pm);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   t_rm=elapsed(&t0, &t1);
+
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (l=0; l < loops; l++) {
+      cached(rules, uris[l % URIS]);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   t_cache=elapsed(&t0, &t1);
+   rulematch_get_stats(&st);
+
+   printf("%i rules (%i indexed by prefix), %i of %i URIs match\n",
+          count, rules->prefixed, hits, URIS);
+   printf("regexec loop %10.0f ns  rule set %8.0f ns  x%.1f\n",
+          t_lin*1e9/loops, t_rm*1e9/loops, t_lin/t_rm);
+   printf("result cache %10.0f ns  (%lu hits, %lu misses)\n",
+          t_cache*1e9/loops, st.hits, st.misses);
+   printf("%i URIs with different result\n", diff);
+
+   rulematch_free(rules);
+   for (i=0; i < count; i++) {
+      regfree(&re[i]);
+      free(patterns[i]);
+      free(prefixes[i]);
+   }
+   for (i=0; i < URIS; i++) free(uris[i]);
+   free(re);
+   free(patterns);
+   free(prefixes);
+
+   return (diff == 0) ? 0 : 1;
+}
@@ -0,0 +1,265 @@
+/*
+    Copyright (C) 2002-2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * sdp_bench - compare the streaming SDP rewriter (sdp_rewrite.c)
+ * with the libosip2 parse / modify / render path.
+ *
+ * For every SDP body (built-in samples and files given on the command
+ * line) the o=, c= addresses and m= ports are rewritten by both paths.
+ * The results must be byte identical if the streaming scanner accepts
+ * the body. Then both paths are timed.
+ *
+ * usage: sdp_bench [-n loops] [file.sdp ...]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+#include <osipparser2/sdp_message.h>
+
+#include "siproxd.h"
+
+#define NEW_ADDR	"203.0.113.7"
+#define NEW_PORT	"7078"
+
+static const char *samples[] = {
+   /* typical desk phone */
+   "v=0\r\n"
+   "o=user1 53655765 2353687637 IN IP4 192.168.1.10\r\n"
+   "s=-\r\n"
+   "c=IN IP4 192.168.1.10\r\n"
+   "t=0 0\r\n"
+   "m=audio 6000 RTP/AVP 0 8 18 101\r\n"
+   "a=rtpmap:0 PCMU/8000\r\n"
+   "a=rtpmap:8 PCMA/8000\r\n"
+   "a=rtpmap:18 G729/8000\r\n"
+   "a=rtpmap:101 telephone-event/8000\r\n"
+   "a=fmtp:101 0-15\r\n"
+   "a=ptime:20\r\n"
+   "a=sendrecv\r\n",
+   /* audio + video, c= on media level */
+   "v=0\r\n"
+   "o=- 3724394400 3724394405 IN IP4 10.0.0.5\r\n"
+   "s=Softphone\r\n"
+   "t=0 0\r\n"
+   "m=audio 4000 RTP/AVP 9 0 101\r\n"
+   "c=IN IP4 10.0.0.5\r\n"
+   "a=rtpmap:9 G722/8000\r\n"
+   "a=rtpmap:101 telephone-event/8000\r\n"
+   "a=rtcp:4001\r\n"
+   "m=video 4002 RTP/AVP 96\r\n"
+   "c=IN IP4 10.0.0.5\r\n"
+   "b=AS:512\r\n"
+   "a=rtpmap:96 H264/90000\r\n"
+   "a=fmtp:96 profile-level-id=42801F\r\n",
+   /* on hold */
+   "v=0\r\n"
+   "o=root 1821 1822 IN IP4 172.16.0.2\r\n"
+   "s=session\r\n"
+   "c=IN IP4 0.0.0.0\r\n"
+   "t=0 0\r\n"
+   "m=audio 10010 RTP/AVP 0\r\n"
+   "a=rtpmap:0 PCMU/8000\r\n"
+   "a=sendonly\r\n",
+   NULL
+};
+
+
+/* libosip2 path, as proxy_rewrite_invitation_body() does it */
+static char *rewrite_osip(const char *body) {
+   sdp_message_t *sdp;
+   sdp_connection_t *conn;
+   sdp_media_t *med;
+   char *out=NULL;
+   int i;
+
+   if (sdp_message_init(&sdp) != 0) return NULL;
+   if (sdp_message_parse(sdp, body) != 0) {
+      sdp_message_free(sdp);
+      return NULL;
+   }
+   if (sdp->c_connection && sdp->c_connection->c_addr &&
+       strcmp(sdp->c_connection->c_addr, "0.0.0.0")) {
+      osip_free(sdp->c_connection->c_addr);
+      sdp->c_connection->c_addr=osip_strdup(NEW_ADDR);
+   }
+   if (sdp->o_addr) {
+      osip_free(sdp->o_addr);
+      sdp->o_addr=osip_strdup(NEW_ADDR);
+   }
+   for (i=0; (med=osip_list_get(&sdp->m_medias, i)) != NULL; i++) {
+      conn=sdp_message_connection_get(sdp, i, 0);
+      if (conn && conn->c_addr && strcmp(conn->c_addr, "0.0.0.0")) {
+         osip_free(conn->c_addr);
+         conn->c_addr=osip_strdup(NEW_ADDR);
+      }
+      if (med->m_port && atoi(med->m_port) > 0) {
+         osip_free(med->m_port);
+         med->m_port=osip_strdup(NEW_PORT);
+      }
+   }
+   sdp_message_to_str(sdp, &out);
+   sdp_message_free(sdp);
+   return out;
+}
+
+
+/* streaming path, as proxy_rewrite_sdp_fast() does it */
+static int rewrite_stream(const char *body, size_t len,
+                          char *out, size_t outsize) {
+   sdp_scan_t scan;
+   size_t outlen;
+   int i;
+
+   if (sdp_scan(body, len, &scan) != STS_SUCCESS) return -1;
+   if (scan.c_addr.len &&
+       !((scan.c_addr.len == 7) &&
+         (memcmp(&body[scan.c_addr.off], "0.0.0.0", 7) == 0))) {
+      scan.c_addr.repl=NEW_ADDR;
+   }
+   scan.o_addr.repl=NEW_ADDR;
+   for (i=0; i < scan.media_count; i++) {
+      if (scan.media[i].c_addr.len &&
+          !((scan.media[i].c_addr.len == 7) &&
+            (memcmp(&body[scan.media[i].c_addr.off], "0.0.0.0", 7) == 0))) {
+         scan.media[i].c_addr.repl=NEW_ADDR;
+      }
+      if (atoi(&body[scan.media[i].port.off]) > 0) {
+         scan.media[i].port.repl=NEW_PORT;
+      }
+   }
+   if (sdp_emit(body, len, &scan, out, outsize, &outlen) != STS_SUCCESS) {
+      return -1;
+   }
+   return (int)outlen;
+}
+
+
+static double elapsed(struct timespec *a, struct timespec *b) {
+   return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+
+static int bench(const char *name, const char *body, long loops) {
+   char out[BUFFER_SIZE];
+   char *ref;
+   struct timespec t0, t1;
+   double t_osip, t_stream;
+   size_t len=strlen(body);
+   int outlen;
+   long i;
+
+   ref=rewrite_osip(body);
+   outlen=rewrite_stream(body, len, out, sizeof(out));
+   if (outlen < 0) {
+      printf("%-24s not canonical, parser fallback\n", name);
+      if (ref) osip_free(ref);
+      return 0;
+   }
+   if ((ref == NULL) || (strlen(ref) != (size_t)outlen) ||
+       (memcmp(ref, out, outlen) != 0)) {
+      printf("%-24s MISMATCH\n--- libosip2:\n%s--- streaming:\n%s---\n",
+             name, ref ? ref : "(parse failed)\n", out);
+      if (ref) osip_free(ref);
+      return 1;
+   }
+   osip_free(ref);
+
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (i=0; i < loops; i++) {
+      ref=rewrite_osip(body);
+      osip_free(ref);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   t_osip=elapsed(&t0, &t1);
+
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (i=0; i < loops; i++) {
+      rewrite_stream(body, len, out, sizeof(out));
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   t_stream=elapsed(&t0, &t1);
+
+   printf("%-24s identical  libosip2 %8.0f ns  streaming %8.0f ns  "
+          "x%.1f\n", name, t_osip*1e9/loops, t_stream*1e9/loops,
+          t_osip/t_stream);
+   return 0;
+}
+
+
+static char *read_file(const char *name) {
+   FILE *f;
+   char *buf;
+   size_t n;
+
+   f=fopen(name, "rb");
+   if (f == NULL) {
+      perror(name);
+      return NULL;
+   }
+   buf=malloc(BUFFER_SIZE);
+   if (buf == NULL) {
+      fclose(f);
+      return NULL;
+   }
+   n=fread(buf, 1, BUFFER_SIZE-1, f);
+   buf[n]='\0';
+   fclose(f);
+   return buf;
+}
+
+
+int main(int argc, char *argv[]) {
+   long loops=100000;
+   char name[32];
+   char *body;
+   int errors=0;
+   int i;
+
+   parser_init();
+
+   i=1;
+   if ((argc > 2) && (strcmp(argv[1], "-n") == 0)) {
+      loops=atol(argv[2]);
+      i=3;
+   }
+
+   for (; i < argc; i++) {
+      body=read_file(argv[i]);
+      if (body == NULL) continue;
+      errors+=bench(argv[i], body, loops);
+      free(body);
+   }
+
+   for (i=0; samples[i]; i++) {
+      snprintf(name, sizeof(name), "sample %i", i);
+      errors+=bench(name, samples[i], loops);
+   }
+
+   return (errors)? 1 : 0;
+}